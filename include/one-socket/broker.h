@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2021 Ilya Maximets <i.maximets@ovn.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __ONE_SOCKET_PUBLIC_BROKER_H
+#define __ONE_SOCKET_PUBLIC_BROKER_H
+
+#include <stdbool.h>
+
+/* SocketPair Broker that runs inside the application's own event loop
+ * instead of a separate one-socket daemon.  No threads are created, the
+ * broker does its work only inside one_socket_broker_process().  Typical
+ * integration, e.g. into the main loop of a switch:
+ *
+ *     broker = one_socket_broker_create(listen_fd, &config);
+ *     for (;;) {
+ *         ... wait for POLLIN on one_socket_broker_fd(broker) with the
+ *             timeout of one_socket_broker_timeout(broker) along with the
+ *             application's own descriptors ...
+ *         one_socket_broker_process(broker);
+ *     }
+ *
+ * All clients are served through the single descriptor, so the set of
+ * descriptors to wait for doesn't change while clients come and go.
+ * Functions of one broker must not be called concurrently. */
+struct one_socket_broker;
+
+/* Importance of a log message of the broker. */
+enum one_socket_log_level {
+    ONE_SOCKET_LOG_ERROR,       /* Failures. */
+    ONE_SOCKET_LOG_INFO,        /* Clients, pairings and statistics. */
+};
+
+struct one_socket_broker_config {
+    int pair_pool_size;         /* Number of pre-created socket pairs. */
+
+    /* Default buffer sizes of created sockets and the limit for sizes
+     * requested by clients.  Zero - system default or no limit. */
+    int sndbuf;
+    int rcvbuf;
+    int max_buf;
+
+    /* Choosing between clients with the same key: "fifo", "round-robin",
+     * "least-recent" or "weighted".  NULL - "round-robin". */
+    const char *balance;
+
+    bool profile;               /* Measure time spent in phases of the loop. */
+
+    /* Receives log messages of the broker one line at a time, without the
+     * trailing new line, instead of printing errors to stderr and the rest
+     * to stdout.  Called only from functions of this broker.  NULL - print
+     * them. */
+    void (*log)(enum one_socket_log_level, const char *msg, void *aux);
+    void *log_aux;              /* Passed to 'log'. */
+
+    /* Less important messages are dropped.  ONE_SOCKET_LOG_INFO by
+     * default. */
+    enum one_socket_log_level log_level;
+};
+
+/* Initializes 'config' with defaults of the one-socket daemon. */
+void one_socket_broker_config_init(struct one_socket_broker_config *config);
+
+/* Creates a broker that accepts clients on 'listen_fd', a listening Unix
+ * socket, and switches it to non-blocking mode.  The socket stays owned by
+ * the caller and must outlive the broker.  'config' could be NULL for
+ * defaults.  Returns NULL and sets errno on failure. */
+struct one_socket_broker *
+one_socket_broker_create(int listen_fd,
+                         const struct one_socket_broker_config *config);
+
+/* Disconnects all the clients and frees the broker. */
+void one_socket_broker_destroy(struct one_socket_broker *);
+
+/* Returns the descriptor to wait for POLLIN on.  The descriptor could change
+ * after one_socket_broker_process() returned 1. */
+int one_socket_broker_fd(const struct one_socket_broker *);
+
+/* Returns the longest time in milliseconds to wait for the descriptor
+ * before calling one_socket_broker_process() anyway, e.g. while the pool
+ * of socket pairs could be refilled.  Negative - no timeout. */
+int one_socket_broker_timeout(const struct one_socket_broker *);
+
+/* Serves all the clients that are ready without blocking.  Returns 0 on
+ * success.  Returns 1 if the broker had to restart after a failure, so all
+ * clients were disconnected and the descriptor returned by
+ * one_socket_broker_fd() changed.  Returns -1 and sets errno if the restart
+ * failed, the call could be repeated later. */
+int one_socket_broker_process(struct one_socket_broker *);
+
+/* Logs statistics of the broker with ONE_SOCKET_LOG_INFO level. */
+void one_socket_broker_dump_stats(struct one_socket_broker *);
+
+#endif
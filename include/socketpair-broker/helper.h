@@ -19,8 +19,95 @@
 
 #include <stdbool.h>
 
-struct sp_broker_msg;
-enum sp_broker_request;
+#include <socketpair-broker/proto.h>
+
+/* Parameters of a pairing request. */
+struct sp_broker_pair_params {
+    enum sp_broker_get_pair_mode mode;  /* NONE, CLIENT or SERVER. */
+    enum sp_broker_pair_type type;      /* Type of the resulted socket. */
+    bool prefix;                        /* Key is a prefix of the pair's. */
+
+    /* Options of the resulted socket.  Zero means broker's default.
+     * Requires broker that supports version 2 of the protocol. */
+    uint32_t sndbuf;                    /* SO_SNDBUF. */
+    uint32_t rcvbuf;                    /* SO_RCVBUF. */
+    uint32_t sock_flags;                /* SP_BROKER_SOCK_F_* flags. */
+    uint32_t ring_size;                 /* For SP_BROKER_PAIR_TYPE_SHM_RING. */
+
+    /* Share of pairings of this process among processes that registered
+     * servers with the same key, if the broker balances by weights.  Zero
+     * keeps the share requested by other clients of the process, 1 if none
+     * did.  Requires broker that supports version 2 of the protocol. */
+    uint32_t weight;
+
+    /* Class of the request.  Classes above SP_BROKER_PRIORITY_NORMAL
+     * require broker that supports version 2 of the protocol. */
+    enum sp_broker_priority priority;
+
+    /* Data for the peer, e.g. supported features, up to
+     * SP_BROKER_MAX_HELLO_SIZE bytes.  Delivered with the pair if the peer
+     * sent a hello too, so peers that sent each other their hellos do not
+     * need an extra round-trip over the new channel.  Not NULL, even with
+     * zero 'hello_len', means that the peer's hello is expected.  Requires
+     * broker that supports version 2 of the protocol. */
+    const void *hello;
+    int hello_len;
+
+    /* Descriptors for the peer, e.g. memfds and eventfds of shared memory
+     * regions, up to SP_BROKER_MAX_PEER_FDS.  Peer receives duplicates of
+     * them with the pair if it sets 'accept_fds'.  Caller keeps the
+     * ownership.  Both require broker that supports version 2 of the
+     * protocol. */
+    const int *fds;
+    int n_fds;
+    bool accept_fds;                    /* Receive descriptors of the peer. */
+
+    /* Receive credentials of the peer's process, captured by the broker
+     * when the peer connected.  Credentials of the received socket itself
+     * are the broker's.  Requires broker that supports version 2 of the
+     * protocol. */
+    bool peer_cred;
+};
+
+/* Policy of retries for sp_broker_request_pair_retry().  Delay before the
+ * retry number N is a random value in range [0, min(max_delay_ms,
+ * initial_delay_ms * 2^N)], so clients that failed at the same time, e.g.
+ * because of the broker restart, are not coming back all at once. */
+struct sp_broker_retry_policy {
+    uint32_t initial_delay_ms;          /* Upper bound of the first delay. */
+    uint32_t max_delay_ms;              /* Upper bound of any delay. */
+    uint32_t timeout_ms;                /* Overall deadline.  0 - none. */
+    uint32_t max_attempts;              /* Number of attempts.  0 - any. */
+};
+
+/* Result of a pairing. */
+struct sp_broker_pair {
+    uint64_t id;                        /* Same for both clients.  0 - none. */
+    enum sp_broker_pair_type type;
+    bool producer;                      /* Producer side of a SHM ring. */
+    int n_fds;                          /* 1 for sockets, 3 for a SHM ring. */
+    int fds[SP_BROKER_PROTOCOL_MAX_FDS];
+    int n_peer_fds;                     /* Descriptors sent by the peer. */
+    int peer_fds[SP_BROKER_MAX_PEER_FDS];
+    int hello_len;                      /* -1 if the peer sent no hello. */
+    uint8_t hello[SP_BROKER_MAX_HELLO_SIZE];
+    bool has_peer_cred;                 /* 'peer_cred' is set. */
+    struct sp_broker_peer_cred peer_cred;
+    char peer_cgroup[SP_BROKER_MAX_CGROUP_SIZE + 1];  /* Empty if unknown. */
+};
+
+/* Client waiting for a pair, see sp_broker_list_pending(). */
+struct sp_broker_pending_info {
+    uint64_t wait_ms;                   /* Time since the request. */
+    enum sp_broker_get_pair_mode mode;
+    enum sp_broker_pair_type type;
+    int key_len;
+    uint8_t key[SP_BROKER_MAX_KEY_LENGTH];
+};
+
+/* Initializes 'params' with default values, i.e. nondirectional pairing
+ * with a SOCK_STREAM socket as a result. */
+void sp_broker_pair_params_init(struct sp_broker_pair_params *params);
 
 /* Validates the message 'msg' to follow the SocketPair Broker Protocol.
  * If 'expected' array provided, also checks if the message is one of the
@@ -34,6 +121,45 @@ int sp_broker_message_validate(const struct sp_broker_msg *msg,
                                const enum sp_broker_request *expected,
                                int n_expected, char **err);
 
+/* Maximum length of an error message from sp_broker_message_validate_buf()
+ * including the terminating null byte. */
+#define SP_BROKER_MAX_ERROR_LEN 256
+
+/* Same as sp_broker_message_validate(), but doesn't allocate memory.  If
+ * 'err' is not NULL, it should point to a buffer of SP_BROKER_MAX_ERROR_LEN
+ * bytes.  Error message is stored there on failure, possibly truncated. */
+int sp_broker_message_validate_buf(const struct sp_broker_msg *msg,
+                                   const enum sp_broker_request *expected,
+                                   int n_expected, char *err);
+
+/* Returns the number of bytes that message 'msg' occupies on the wire
+ * (without file descriptors) according to its header.  Returns -1 if the
+ * protocol version or the payload size in the header is not valid. */
+int sp_broker_message_length(const struct sp_broker_msg *msg);
+
+/* Iteration over attributes of a version 2 message.  Message should be
+ * validated with sp_broker_message_validate() beforehand.  Returns NULL
+ * if there are no more attributes. */
+const struct sp_broker_attr *
+sp_broker_attr_first(const struct sp_broker_msg *msg);
+const struct sp_broker_attr *
+sp_broker_attr_next(const struct sp_broker_msg *msg,
+                    const struct sp_broker_attr *attr);
+
+#define SP_BROKER_ATTR_FOR_EACH(ATTR, MSG)           \
+    for ((ATTR) = sp_broker_attr_first(MSG); (ATTR); \
+         (ATTR) = sp_broker_attr_next(MSG, ATTR))
+
+uint32_t sp_broker_attr_get_u32(const struct sp_broker_attr *attr);
+
+/* Appends attribute of type 'type' with 'len' bytes of 'value' to the end
+ * of the version 2 message 'msg' and updates its size.  Returns 0 on success.
+ * On failure returns -1 and sets errno. */
+int sp_broker_attr_put(struct sp_broker_msg *msg, uint16_t type,
+                       const void *value, uint16_t len);
+int sp_broker_attr_put_u32(struct sp_broker_msg *msg, uint16_t type,
+                           uint32_t value);
+
 /* Connects to the SocketPair Broker on socket 'sock_path' and requests
  * a pair for a key 'key'. If 'server' is 'true', defines that user will
  * operate as a server, otherwise as a client.  User will be paired with the
@@ -55,6 +181,44 @@ int sp_broker_get_pair(const char *sock_path, const char *key,
 int sp_broker_get_pair_nondirectional(const char *sock_path, const char *key,
                                       char **err);
 
+/* Same as 'sp_broker_get_pair', but operation mode, type of the resulted
+ * socket and other parameters of a pairing are taken from 'params'.
+ * User will be paired only with other user that requested the same type
+ * of a socket.  E.g. with SP_BROKER_PAIR_TYPE_SEQPACKET resulted socket
+ * preserves message boundaries. */
+int sp_broker_get_pair_params(const char *sock_path, const char *key,
+                              const struct sp_broker_pair_params *params,
+                              char **err);
+
+/* Same as 'sp_broker_get_pair_params', but supports all types of pairs and
+ * stores the result in 'pair'.  E.g. with SP_BROKER_PAIR_TYPE_SHM_RING the
+ * result should be passed to sp_broker_ring_open().
+ *
+ * Returns 0 on success.  On failure returns -1 and sets errno. */
+int sp_broker_request_pair(const char *sock_path, const char *key,
+                           const struct sp_broker_pair_params *params,
+                           struct sp_broker_pair *pair, char **err);
+
+/* Initializes 'policy' with default values: delays from 10 ms up to 1 s,
+ * unlimited number of attempts without a deadline. */
+void sp_broker_retry_policy_init(struct sp_broker_retry_policy *policy);
+
+/* Same as 'sp_broker_request_pair', but on failure reconnects and requests
+ * the pair again according to the 'policy', e.g. if the broker is not
+ * running or restarted while the client was waiting for a pair.  Backoff
+ * starts over once the request is successfully sent to the broker.
+ * Invalid parameters are not retried.
+ *
+ * Returns 0 on success.  On failure returns -1 and sets errno to the error
+ * of the last attempt or to ETIMEDOUT if the deadline reached. */
+int sp_broker_request_pair_retry(const char *sock_path, const char *key,
+                                 const struct sp_broker_pair_params *params,
+                                 const struct sp_broker_retry_policy *policy,
+                                 struct sp_broker_pair *pair, char **err);
+
+/* Closes all file descriptors of the 'pair', including the peer's ones. */
+void sp_broker_pair_close(struct sp_broker_pair *pair);
+
 /* Connects to the SocketPair Broker on socket 'sock_path'.  If 'nonblock'
  * set to 'true', connects in nonblocking mode, otherwise waits for connection
  * establishment.
@@ -84,6 +248,12 @@ int sp_broker_send_get_pair(int broker_fd, const char *key,
 int sp_broker_send_get_pair_nondirectional(int broker_fd, const char *key,
                                            char **err);
 
+/* Same as 'sp_broker_send_get_pair', but parameters of a pairing are taken
+ * from 'params'. */
+int sp_broker_send_get_pair_params(int broker_fd, const char *key,
+                                   const struct sp_broker_pair_params *params,
+                                   char **err);
+
 
 /* Attempts to receive SP_BROKER_SET_PAIR request from the  SocketPair Broker
  * on socket 'broker_fd'.
@@ -94,4 +264,39 @@ int sp_broker_send_get_pair_nondirectional(int broker_fd, const char *key,
  * release it by calling free(). */
 int sp_broker_receive_set_pair(int broker_fd, char **err);
 
+/* Same as 'sp_broker_receive_set_pair', but supports all types of pairs and
+ * stores the result in 'pair'.  Returns 0 on success.  On failure returns -1
+ * and sets errno. */
+int sp_broker_receive_pair(int broker_fd, struct sp_broker_pair *pair,
+                           char **err);
+
+/* Asks the SocketPair Broker on socket 'broker_fd' whether a client that
+ * would be paired with the pairing request for 'key' with 'params' is
+ * waiting, without requesting a pair.  If there is no such client and
+ * 'timeout_ms' is not zero, waits for it to appear up to 'timeout_ms'
+ * milliseconds (negative - infinitely).  Connection could be used for the
+ * next queries.  Requires broker that supports version 2 of the protocol.
+ *
+ * Returns 1 if the client is present and 0 if it is absent.  On failure
+ * returns -1 and sets errno.  If the wait timed out, errno is ETIMEDOUT and
+ * the connection should be closed, since the broker still sends its reply
+ * once the client appears. */
+int sp_broker_query_peer(int broker_fd, const char *key,
+                         const struct sp_broker_pair_params *params,
+                         int timeout_ms, char **err);
+
+/* Requests one page of the list of clients that are waiting for a pair from
+ * the SocketPair Broker on socket 'broker_fd' and stores up to 'max_entries'
+ * of them in 'entries'.  '*cursor' should be zero for the first page.  It is
+ * updated to the position of the next page and becomes zero once the last
+ * page is received.  The same connection should be used for all pages.
+ * If 'n_pending' is not NULL, stores the total number of waiting clients
+ * there.  Requires broker that supports version 2 of the protocol.
+ *
+ * Returns the number of stored entries.  On failure returns -1 and sets
+ * errno. */
+int sp_broker_list_pending(int broker_fd, uint64_t *cursor,
+                           struct sp_broker_pending_info *entries,
+                           int max_entries, uint32_t *n_pending, char **err);
+
 #endif
@@ -25,7 +25,11 @@ enum sp_broker_request {
     SP_BROKER_NONE = 0,
     SP_BROKER_GET_PAIR = 1,
     SP_BROKER_SET_PAIR = 2,
-    SP_BROKER_MAX = 3
+    SP_BROKER_LIST_PENDING = 3,   /* Version 2 only. */
+    SP_BROKER_PENDING_LIST = 4,   /* Version 2 only. */
+    SP_BROKER_QUERY_PEER = 5,     /* Version 2 only. */
+    SP_BROKER_PEER_STATUS = 6,    /* Version 2 only. */
+    SP_BROKER_MAX = 7
 };
 
 #define SP_BROKER_MAX_KEY_LENGTH 1024
@@ -37,30 +41,175 @@ enum sp_broker_get_pair_mode {
     SP_BROKER_PAIR_MODE_MAX = 3
 };
 
+/* Type of a channel between paired clients.  Stored in 'flags' of
+ * SP_BROKER_GET_PAIR and SP_BROKER_SET_PAIR requests. */
+enum sp_broker_pair_type {
+    SP_BROKER_PAIR_TYPE_STREAM = 0,     /* SOCK_STREAM */
+    SP_BROKER_PAIR_TYPE_SEQPACKET = 1,  /* SOCK_SEQPACKET */
+    SP_BROKER_PAIR_TYPE_DGRAM = 2,      /* SOCK_DGRAM */
+    SP_BROKER_PAIR_TYPE_SHM_RING = 3,   /* Shared memory ring, see ring.h. */
+    SP_BROKER_PAIR_TYPE_MAX = 4
+};
+
 struct sp_broker_get_pair_request {
     uint16_t mode;     /* enum sp_broker_get_pair_mode */
     uint16_t key_len;
     uint8_t key[SP_BROKER_MAX_KEY_LENGTH];
 } __attribute__((__packed__));
 
+/* SP_BROKER_LIST_PENDING: asks for clients that are waiting for a pair
+ * starting after the 'cursor' returned in the previous reply (zero for the
+ * first request). */
+struct sp_broker_list_pending_request {
+    uint64_t cursor;
+    uint32_t max_entries;  /* Maximum number of entries.  0 - no limit. */
+} __attribute__((__packed__));
+
+/* SP_BROKER_PENDING_LIST: reply to SP_BROKER_LIST_PENDING.  The header is
+ * followed by 'n_entries' of 'struct sp_broker_pending_entry' placed one
+ * after another without padding. */
+struct sp_broker_pending_list {
+    uint64_t cursor;       /* For the next request.  0 - no more entries. */
+    uint32_t n_entries;    /* Number of entries in this message. */
+    uint32_t n_pending;    /* Total number of waiting clients. */
+} __attribute__((__packed__));
+
+struct sp_broker_pending_entry {
+    uint64_t wait_ms;      /* Time since SP_BROKER_GET_PAIR. */
+    uint16_t mode;         /* enum sp_broker_get_pair_mode */
+    uint16_t type;         /* enum sp_broker_pair_type */
+    uint16_t key_len;
+    uint8_t key[];         /* 'key_len' bytes. */
+} __attribute__((__packed__));
+
+/* SP_BROKER_QUERY_PEER has the same payload as SP_BROKER_GET_PAIR, but
+ * only asks if a pair for such a request is waiting.  SP_BROKER_PEER_STATUS
+ * reply carries one of the values below in 'u64'. */
+#define SP_BROKER_PEER_ABSENT   0
+#define SP_BROKER_PEER_PRESENT  1
+
+/* Optional attributes of a version 2 message. */
+enum sp_broker_attr_type {
+    SP_BROKER_ATTR_NONE = 0,
+    SP_BROKER_ATTR_SNDBUF = 1,      /* u32: SO_SNDBUF of the socket. */
+    SP_BROKER_ATTR_RCVBUF = 2,      /* u32: SO_RCVBUF of the socket. */
+    SP_BROKER_ATTR_SOCK_FLAGS = 3,  /* u32: SP_BROKER_SOCK_F_* flags. */
+    SP_BROKER_ATTR_RING_SIZE = 4,   /* u32: Size of a shared memory ring. */
+    SP_BROKER_ATTR_WEIGHT = 5,      /* u32: Share among same-key servers. */
+    SP_BROKER_ATTR_PRIORITY = 6,    /* u32: enum sp_broker_priority. */
+    SP_BROKER_ATTR_HELLO = 7,       /* Opaque data for the peer. */
+    SP_BROKER_ATTR_PEER_CRED = 8,   /* struct sp_broker_peer_cred. */
+    SP_BROKER_ATTR_PEER_CGROUP = 9, /* cgroup path of the peer. */
+    SP_BROKER_ATTR_MAX = 10
+};
+
+/* Maximum size of SP_BROKER_ATTR_HELLO.  Data sent in SP_BROKER_GET_PAIR is
+ * delivered in SP_BROKER_SET_PAIR of the peer, but only if the peer sent
+ * SP_BROKER_ATTR_HELLO too, even an empty one. */
+#define SP_BROKER_MAX_HELLO_SIZE 512
+
+/* Value of SP_BROKER_ATTR_PEER_CRED: credentials of the peer's process as
+ * seen by the broker when the peer connected. */
+struct sp_broker_peer_cred {
+    uint32_t pid;
+    uint32_t uid;
+    uint32_t gid;
+} __attribute__((__packed__));
+
+/* Maximum size of SP_BROKER_ATTR_PEER_CGROUP.  Value is a path in the
+ * unified cgroup hierarchy without the terminating null byte. */
+#define SP_BROKER_MAX_CGROUP_SIZE 1024
+
+/* Values for SP_BROKER_ATTR_SOCK_FLAGS. */
+#define SP_BROKER_SOCK_F_PASSCRED   (1 << 0)  /* Set SO_PASSCRED. */
+#define SP_BROKER_SOCK_F_PASSSEC    (1 << 1)  /* Set SO_PASSSEC. */
+#define SP_BROKER_SOCK_F_MASK       0x3
+
+/* Values for SP_BROKER_ATTR_PRIORITY.  Clients of higher classes are
+ * served first and are the last to be disconnected if the broker is full. */
+enum sp_broker_priority {
+    SP_BROKER_PRIORITY_NORMAL = 0,      /* Default. */
+    SP_BROKER_PRIORITY_HIGH = 1,
+    SP_BROKER_PRIORITY_CRITICAL = 2,
+    SP_BROKER_PRIORITY_MAX = 3
+};
+
+/* Attributes are placed one after another right after the fixed part of
+ * a payload, i.e. after the 'key_len' bytes of a 'key' in
+ * SP_BROKER_GET_PAIR or after the 'u64' in SP_BROKER_SET_PAIR.  All values
+ * are in host byte order. */
+struct sp_broker_attr {
+    uint16_t type;     /* enum sp_broker_attr_type */
+    uint16_t len;      /* Size of the 'value' below. */
+    uint8_t value[];
+} __attribute__((__packed__));
+
+/* Maximum size of a version 2 payload. */
+#define SP_BROKER_MAX_PAYLOAD_SIZE 4096
+
+/* Payload of a version 1 message. */
+union sp_broker_payload_v1 {
+    uint64_t u64;
+    struct sp_broker_get_pair_request get_pair;
+};
+
 struct sp_broker_msg {
     uint32_t request;  /* enum sp_broker_request */
 #define SP_BROKER_PROTOCOL_VERSION_MASK   0xf
+#define SP_BROKER_PAIR_TYPE_SHIFT         4
+#define SP_BROKER_PAIR_TYPE_MASK          (0xf << SP_BROKER_PAIR_TYPE_SHIFT)
+/* SP_BROKER_SET_PAIR: receiver is a producer of a SP_BROKER_PAIR_TYPE_SHM_RING
+ * pair. */
+#define SP_BROKER_SET_PAIR_F_PRODUCER     (1 << 8)
+/* SP_BROKER_QUERY_PEER: if the pair is absent, reply once it appears. */
+#define SP_BROKER_QUERY_PEER_F_WAIT       (1 << 8)
+/* SP_BROKER_GET_PAIR and SP_BROKER_QUERY_PEER: 'key' is a prefix, pair with
+ * a client whose key starts with it. */
+#define SP_BROKER_GET_PAIR_F_PREFIX       (1 << 9)
+/* SP_BROKER_GET_PAIR: client accepts descriptors of the peer in
+ * SP_BROKER_SET_PAIR.  Version 2 only. */
+#define SP_BROKER_GET_PAIR_F_ACCEPT_FDS   (1 << 10)
+/* SP_BROKER_GET_PAIR: client wants to know credentials of the peer.
+ * Version 2 only. */
+#define SP_BROKER_GET_PAIR_F_PEER_CRED    (1 << 11)
     uint32_t flags;
     uint32_t size;     /* Size of the 'payload' below. */
     union {
         uint64_t u64;
         struct sp_broker_get_pair_request get_pair;
+        struct sp_broker_list_pending_request list_pending;
+        struct sp_broker_pending_list pending_list;
+        uint8_t data[SP_BROKER_MAX_PAYLOAD_SIZE];
     } payload;
 #define SP_BROKER_PROTOCOL_MAX_FDS        64
+/* Maximum number of descriptors in SP_BROKER_GET_PAIR.  They are forwarded
+ * to the peer after descriptors of the channel, so some room is left. */
+#define SP_BROKER_MAX_PEER_FDS            (SP_BROKER_PROTOCOL_MAX_FDS - 4)
     int fds[SP_BROKER_PROTOCOL_MAX_FDS];
     int n_fds;
 } __attribute__((__packed__));
 
-/* Message size without space for file dscriptors. */
-#define SP_BROKER_MESSAGE_SIZE  offsetof(struct sp_broker_msg, fds[0])
+/* Size of a message header, i.e. 'request', 'flags' and 'size'. */
+#define SP_BROKER_HEADER_SIZE   offsetof(struct sp_broker_msg, payload)
 
-/* The supported version of a protocol. */
+/* Version 1 message size without space for file dscriptors. */
+#define SP_BROKER_MESSAGE_SIZE  (SP_BROKER_HEADER_SIZE \
+                                 + sizeof (union sp_broker_payload_v1))
+
+#define SP_BROKER_PAIR_TYPE_GET(FLAGS) \
+    (((FLAGS) & SP_BROKER_PAIR_TYPE_MASK) >> SP_BROKER_PAIR_TYPE_SHIFT)
+#define SP_BROKER_PAIR_TYPE_SET(TYPE) \
+    (((uint32_t) (TYPE) << SP_BROKER_PAIR_TYPE_SHIFT) \
+     & SP_BROKER_PAIR_TYPE_MASK)
+
+/* The base version of a protocol.  All messages have the same size of
+ * SP_BROKER_MESSAGE_SIZE bytes. */
 #define SP_BROKER_PROTOCOL_VERSION 0x1
 
+/* Version 2 of a protocol.  Message consists of a header and exactly 'size'
+ * bytes of a payload.  Payload has the same fields as in version 1, but the
+ * 'key' occupies only 'key_len' bytes, and could be followed by attributes.
+ * See 'struct sp_broker_attr'. */
+#define SP_BROKER_PROTOCOL_VERSION_2 0x2
+
 #endif
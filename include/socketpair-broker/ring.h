@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) 2021 Ilya Maximets <i.maximets@ovn.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __SOCKET_PAIR_BROKER_RING_H
+#define __SOCKET_PAIR_BROKER_RING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Shared memory single-producer single-consumer message ring.
+ *
+ * Broker creates a ring for clients that requested the
+ * SP_BROKER_PAIR_TYPE_SHM_RING pair type and sends the same 3 file
+ * descriptors to both of them: memfd with the ring and 2 eventfds for
+ * wakeups.  SP_BROKER_SET_PAIR_F_PRODUCER flag of SP_BROKER_SET_PAIR tells
+ * which side is a producer.  Messages are written and read in place, so no
+ * syscalls or copies are needed on a fast path.  Eventfds are only used if
+ * the other side is waiting. */
+
+#define SP_BROKER_RING_MAGIC        0x52425053  /* "SPBR" */
+#define SP_BROKER_RING_VERSION      1
+
+#define SP_BROKER_RING_MIN_SIZE     4096
+#define SP_BROKER_RING_DEFAULT_SIZE (256 * 1024)
+#define SP_BROKER_RING_MAX_SIZE     (64 * 1024 * 1024)
+
+/* Order of file descriptors in SP_BROKER_SET_PAIR. */
+enum sp_broker_ring_fd {
+    SP_BROKER_RING_FD_MEM = 0,     /* memfd with the ring. */
+    SP_BROKER_RING_FD_DATA = 1,    /* eventfd: producer -> consumer. */
+    SP_BROKER_RING_FD_SPACE = 2,   /* eventfd: consumer -> producer. */
+    SP_BROKER_RING_N_FDS = 3
+};
+
+/* Layout of the beginning of the shared memory.  Data area starts at
+ * 'data_offset' and has 'size' bytes.  'head' and 'tail' are free running
+ * byte counters, each written only by one side. */
+struct sp_broker_ring_shared {
+    uint32_t magic;                 /* SP_BROKER_RING_MAGIC */
+    uint32_t version;               /* SP_BROKER_RING_VERSION */
+    uint64_t size;                  /* Size of the data area, power of 2. */
+    uint64_t data_offset;           /* Offset of the data area. */
+    uint8_t pad0[40];
+
+    uint64_t head;                  /* Written by the producer. */
+    uint32_t producer_waiting;      /* Producer waits for space. */
+    uint8_t pad1[52];
+
+    uint64_t tail;                  /* Written by the consumer. */
+    uint32_t consumer_waiting;      /* Consumer waits for data. */
+    uint8_t pad2[52];
+} __attribute__((__packed__));
+
+/* Every message in the data area is prefixed with this header and padded
+ * to 8 bytes.  Messages never wrap around the end of the data area, the
+ * rest of the area is filled with a padding record instead. */
+struct sp_broker_ring_record {
+    uint32_t len;                   /* Size of the message. */
+#define SP_BROKER_RING_RECORD_PAD   0x1
+    uint32_t flags;
+} __attribute__((__packed__));
+
+struct sp_broker_ring;
+struct sp_broker_pair;
+
+/* Creates a new shared memory ring with the data area of at least 'size'
+ * bytes and stores its file descriptors in 'fds'.  Used by the broker.
+ * Returns 0 on success.  On failure returns -1 and sets errno. */
+int sp_broker_ring_create(uint32_t size, int fds[SP_BROKER_RING_N_FDS]);
+
+/* Maps the ring received from the broker in 'pair'.  On success takes the
+ * ownership of file descriptors in 'pair'.  On failure returns NULL and sets
+ * errno, 'pair' is not modified in this case. */
+struct sp_broker_ring *sp_broker_ring_open(struct sp_broker_pair *pair);
+void sp_broker_ring_close(struct sp_broker_ring *);
+
+bool sp_broker_ring_is_producer(const struct sp_broker_ring *);
+
+/* Maximum size of one message in the ring. */
+uint32_t sp_broker_ring_max_msg_size(const struct sp_broker_ring *);
+
+/* Producer API.  sp_broker_ring_reserve() returns a pointer to 'len' bytes
+ * in the ring that could be filled in place and made visible to consumer
+ * with sp_broker_ring_commit().  Returns NULL and sets errno to EAGAIN if
+ * there is not enough space in the ring or to EMSGSIZE if 'len' is larger
+ * than sp_broker_ring_max_msg_size().  sp_broker_ring_send() is the same,
+ * but copies 'len' bytes of 'data'. */
+void *sp_broker_ring_reserve(struct sp_broker_ring *, uint32_t len);
+void sp_broker_ring_commit(struct sp_broker_ring *);
+int sp_broker_ring_send(struct sp_broker_ring *, const void *data,
+                        uint32_t len);
+
+/* Consumer API.  sp_broker_ring_peek() returns a pointer to the next message
+ * in the ring and stores its size in 'len'.  Message stays in the ring until
+ * sp_broker_ring_release().  Returns NULL and sets errno to EAGAIN if the
+ * ring is empty or to EPROTO if the ring is corrupted.
+ * sp_broker_ring_recv() copies the next message to 'buf' and releases it.
+ * Returns the size of the message or -1 with errno set (EMSGSIZE if the
+ * message doesn't fit in 'buflen' bytes). */
+const void *sp_broker_ring_peek(struct sp_broker_ring *, uint32_t *len);
+void sp_broker_ring_release(struct sp_broker_ring *);
+int sp_broker_ring_recv(struct sp_broker_ring *, void *buf, uint32_t buflen);
+
+/* Waiting.  Consumer waits for new messages, producer waits for the consumer
+ * to release some space.  sp_broker_ring_wait() blocks for up to
+ * 'timeout_ms' milliseconds (negative - infinitely).  Returns 0 if ring is
+ * ready, -1 with errno set to ETIMEDOUT or other error otherwise.
+ *
+ * For external event loops: sp_broker_ring_fd() returns file descriptor to
+ * poll for POLLIN.  sp_broker_ring_arm() should be called before going to
+ * sleep, it returns 'true' if the ring is already ready and sleep should be
+ * skipped.  sp_broker_ring_ack() should be called after the wakeup. */
+int sp_broker_ring_wait(struct sp_broker_ring *, int timeout_ms);
+int sp_broker_ring_fd(const struct sp_broker_ring *);
+bool sp_broker_ring_arm(struct sp_broker_ring *);
+void sp_broker_ring_ack(struct sp_broker_ring *);
+
+#endif
@@ -0,0 +1,160 @@
+/*
+ * Copyright (c) 2021 Ilya Maximets <i.maximets@ovn.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+
+#include <config.h>
+
+#include "affinity.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+
+#define NUMA_NODE_CPULIST "/sys/devices/system/node/node%d/cpulist"
+
+int
+affinity_parse_list(const char *list, bool *map, int size)
+{
+    const char *p = list;
+    long first, last;
+    char *end;
+
+    memset(map, 0, size * sizeof *map);
+
+    while (*p && *p != '\n') {
+        if (!isdigit((unsigned char) *p)) {
+            goto err;
+        }
+        first = last = strtol(p, &end, 10);
+        p = end;
+        if (*p == '-') {
+            p++;
+            if (!isdigit((unsigned char) *p)) {
+                goto err;
+            }
+            last = strtol(p, &end, 10);
+            p = end;
+        }
+        if (first > last || last >= size) {
+            goto err;
+        }
+        for (; first <= last; first++) {
+            map[first] = true;
+        }
+
+        if (*p == ',') {
+            p++;
+            if (!*p) {
+                goto err;
+            }
+        } else if (*p && *p != '\n') {
+            goto err;
+        }
+    }
+    return 0;
+
+err:
+    errno = EINVAL;
+    return -1;
+}
+
+/* Reads the list of CPUs of NUMA node 'node' from sysfs. */
+static int
+affinity_numa_node_cpus(int node, bool *map, int size)
+{
+    char path[sizeof NUMA_NODE_CPULIST + 16];
+    char buf[4096];
+    FILE *file;
+
+    snprintf(path, sizeof path, NUMA_NODE_CPULIST, node);
+    file = fopen(path, "r");
+    if (!file) {
+        return -1;
+    }
+    if (!fgets(buf, sizeof buf, file)) {
+        fclose(file);
+        errno = EIO;
+        return -1;
+    }
+    fclose(file);
+
+    return affinity_parse_list(buf, map, size);
+}
+
+int
+affinity_pin_thread(int id, const char *cpus, int numa_node)
+{
+    bool node_map[CPU_SETSIZE];
+    bool map[CPU_SETSIZE];
+    char node_str[32] = "";
+    int i, n_cpus = 0;
+    cpu_set_t set;
+    int error;
+
+    if (!cpus && numa_node < 0) {
+        return 0;
+    }
+
+    if (cpus && affinity_parse_list(cpus, map, CPU_SETSIZE)) {
+        log_error("[%02d] Invalid list of CPUs: '%s'.\n", id, cpus);
+        return -1;
+    }
+    if (numa_node >= 0) {
+        if (affinity_numa_node_cpus(numa_node, node_map, CPU_SETSIZE)) {
+            log_error("[%02d] Failed to get CPUs of NUMA node %d: %s.\n",
+                      id, numa_node, strerror(errno));
+            return -1;
+        }
+        for (i = 0; i < CPU_SETSIZE; i++) {
+            map[i] = node_map[i] && (!cpus || map[i]);
+        }
+    }
+
+    CPU_ZERO(&set);
+    for (i = 0; i < CPU_SETSIZE; i++) {
+        if (map[i]) {
+            CPU_SET(i, &set);
+            n_cpus++;
+        }
+    }
+    if (!n_cpus) {
+        log_error("[%02d] No CPUs to run on.\n", id);
+        errno = EINVAL;
+        return -1;
+    }
+
+    error = pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+    if (error) {
+        log_error("[%02d] Failed to set CPU affinity: %s.\n",
+                  id, strerror(error));
+        errno = error;
+        return -1;
+    }
+
+    if (numa_node >= 0) {
+        snprintf(node_str, sizeof node_str, " of NUMA node %d", numa_node);
+    }
+    log_info("[%02d] Pinned to %d CPU(s)%s.\n", id, n_cpus, node_str);
+    return 0;
+}
@@ -0,0 +1,35 @@
+/*
+ * Copyright (c) 2021 Ilya Maximets <i.maximets@ovn.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __ONE_SOCKET_AFFINITY_H
+#define __ONE_SOCKET_AFFINITY_H
+
+#include <stdbool.h>
+
+/* Parses list of non-negative integers and ranges, e.g. "0-3,8,10-11", and
+ * sets corresponding elements of 'map' of 'size' elements to 'true'.  Other
+ * elements are set to 'false'.  Returns 0 on success.  On failure, e.g. if
+ * the list is malformed or contains values not less than 'size', returns -1
+ * and sets errno to EINVAL. */
+int affinity_parse_list(const char *list, bool *map, int size);
+
+/* Pins the calling thread to CPUs from the list 'cpus' that also belong to
+ * the NUMA node 'numa_node'.  'cpus' could be NULL and 'numa_node' could be
+ * negative to not restrict CPUs by that criteria.  Returns 0 on success.
+ * On failure returns -1 and sets errno. */
+int affinity_pin_thread(int id, const char *cpus, int numa_node);
+
+#endif
@@ -0,0 +1,373 @@
+/*
+ * Copyright (c) 2021 Ilya Maximets <i.maximets@ovn.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <config.h>
+
+#include "balancer.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+
+/* Number of unreferenced instances to remember. */
+#define BALANCER_MAX_IDLE       1024
+
+#define BALANCER_MIN_BUCKETS    64
+
+/* Virtual time an instance of weight 1 waits for its next turn. */
+#define BALANCER_STRIDE         (UINT64_C(1) << 32)
+
+struct balancer_instance {
+    struct balancer *balancer;
+    struct balancer_instance *hash_next;
+    struct balancer_instance *idle_prev;    /* Unreferenced instances from */
+    struct balancer_instance *idle_next;    /* the least recently used. */
+
+    pid_t pid;
+    uint32_t weight;            /* Share under BALANCE_WEIGHTED. */
+    int n_refs;                 /* Clients that requested a pair. */
+    uint64_t n_pairs;           /* Number of pairings. */
+    uint64_t last_paired;       /* Sequence number of the last pairing. */
+    uint64_t pass;              /* Virtual time of the next turn. */
+};
+
+struct balancer {
+    int id;                     /* ID of the owning thread for logs. */
+    enum balance_policy policy;
+
+    struct balancer_instance **buckets;
+    uint32_t mask;              /* Number of buckets minus one. */
+    int n_instances;
+
+    struct balancer_instance *idle_head;
+    struct balancer_instance *idle_tail;
+    int n_idle;
+
+    uint64_t n_pairs;           /* Pairings of all instances. */
+    uint64_t pass;              /* Virtual time of the latest turn. */
+};
+
+static const char *const balance_policy_names[] = {
+    [BALANCE_FIFO]          = "fifo",
+    [BALANCE_ROUND_ROBIN]   = "round-robin",
+    [BALANCE_LEAST_RECENT]  = "least-recent",
+    [BALANCE_WEIGHTED]      = "weighted",
+};
+
+const char *
+balance_policy_str(enum balance_policy policy)
+{
+    if ((size_t) policy >= sizeof balance_policy_names
+                           / sizeof balance_policy_names[0]) {
+        return "<unknown>";
+    }
+    return balance_policy_names[policy];
+}
+
+int
+balance_policy_from_str(const char *name, enum balance_policy *policy)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof balance_policy_names
+                    / sizeof balance_policy_names[0]; i++) {
+        if (!strcmp(name, balance_policy_names[i])) {
+            *policy = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static void *
+balancer_xcalloc(int id, size_t n, size_t size)
+{
+    void *p = calloc(n, size);
+
+    if (!p) {
+        log_error("[%02d] Failed to allocate memory for a balancer: "
+                  "%s\n", id, strerror(errno));
+        abort();
+    }
+    return p;
+}
+
+struct balancer *
+balancer_create(int id, enum balance_policy policy)
+{
+    struct balancer *balancer = balancer_xcalloc(id, 1, sizeof *balancer);
+
+    balancer->id = id;
+    balancer->policy = policy;
+    balancer->mask = BALANCER_MIN_BUCKETS - 1;
+    balancer->buckets = balancer_xcalloc(id, BALANCER_MIN_BUCKETS,
+                                         sizeof *balancer->buckets);
+    log_info("[%02d] Balancing between instances: %s.\n",
+             id, balance_policy_str(policy));
+    return balancer;
+}
+
+void
+balancer_destroy(struct balancer *balancer)
+{
+    uint32_t i;
+
+    if (!balancer) {
+        return;
+    }
+    for (i = 0; i <= balancer->mask; i++) {
+        struct balancer_instance *inst, *next;
+
+        for (inst = balancer->buckets[i]; inst; inst = next) {
+            next = inst->hash_next;
+            free(inst);
+        }
+    }
+    free(balancer->buckets);
+    free(balancer);
+}
+
+enum balance_policy
+balancer_policy(const struct balancer *balancer)
+{
+    return balancer->policy;
+}
+
+static uint32_t
+balancer_hash(pid_t pid)
+{
+    return (uint32_t) pid * UINT32_C(2654435761);
+}
+
+static struct balancer_instance **
+balancer_bucket(const struct balancer *balancer, pid_t pid)
+{
+    return &balancer->buckets[balancer_hash(pid) & balancer->mask];
+}
+
+static void
+balancer_expand(struct balancer *balancer)
+{
+    struct balancer_instance **old = balancer->buckets;
+    uint32_t i, n_old = balancer->mask + 1;
+
+    balancer->buckets = balancer_xcalloc(balancer->id, n_old * 2,
+                                         sizeof *balancer->buckets);
+    balancer->mask = n_old * 2 - 1;
+    for (i = 0; i < n_old; i++) {
+        struct balancer_instance *inst, *next;
+
+        for (inst = old[i]; inst; inst = next) {
+            struct balancer_instance **bucket =
+                balancer_bucket(balancer, inst->pid);
+
+            next = inst->hash_next;
+            inst->hash_next = *bucket;
+            *bucket = inst;
+        }
+    }
+    free(old);
+}
+
+static void
+balancer_idle_remove(struct balancer_instance *inst)
+{
+    struct balancer *balancer = inst->balancer;
+
+    if (inst->idle_prev) {
+        inst->idle_prev->idle_next = inst->idle_next;
+    } else {
+        balancer->idle_head = inst->idle_next;
+    }
+    if (inst->idle_next) {
+        inst->idle_next->idle_prev = inst->idle_prev;
+    } else {
+        balancer->idle_tail = inst->idle_prev;
+    }
+    inst->idle_prev = inst->idle_next = NULL;
+    balancer->n_idle--;
+}
+
+static void
+balancer_idle_append(struct balancer_instance *inst)
+{
+    struct balancer *balancer = inst->balancer;
+
+    inst->idle_prev = balancer->idle_tail;
+    inst->idle_next = NULL;
+    if (balancer->idle_tail) {
+        balancer->idle_tail->idle_next = inst;
+    } else {
+        balancer->idle_head = inst;
+    }
+    balancer->idle_tail = inst;
+    balancer->n_idle++;
+}
+
+/* Forgets the least recently used unreferenced instance. */
+static void
+balancer_evict_idle(struct balancer *balancer)
+{
+    struct balancer_instance *inst = balancer->idle_head;
+    struct balancer_instance **p;
+
+    balancer_idle_remove(inst);
+    for (p = balancer_bucket(balancer, inst->pid); *p != inst;
+         p = &(*p)->hash_next) {
+        continue;
+    }
+    *p = inst->hash_next;
+    balancer->n_instances--;
+    free(inst);
+}
+
+struct balancer_instance *
+balancer_instance_ref(struct balancer *balancer, pid_t pid, uint32_t weight)
+{
+    struct balancer_instance **bucket = balancer_bucket(balancer, pid);
+    struct balancer_instance *inst;
+
+    for (inst = *bucket; inst; inst = inst->hash_next) {
+        if (inst->pid == pid) {
+            break;
+        }
+    }
+
+    if (!inst) {
+        inst = balancer_xcalloc(balancer->id, 1, sizeof *inst);
+        inst->balancer = balancer;
+        inst->pid = pid;
+        inst->weight = 1;
+        inst->hash_next = *bucket;
+        *bucket = inst;
+        if (++balancer->n_instances > (int) balancer->mask + 1) {
+            balancer_expand(balancer);
+        }
+    } else if (!inst->n_refs) {
+        balancer_idle_remove(inst);
+    }
+
+    /* Clients that didn't ask for a share don't reset the one requested by
+     * other clients of the instance. */
+    if (weight) {
+        inst->weight = weight;
+    }
+    inst->n_refs++;
+    return inst;
+}
+
+void
+balancer_instance_unref(struct balancer_instance *inst)
+{
+    struct balancer *balancer;
+
+    if (!inst || --inst->n_refs) {
+        return;
+    }
+    balancer = inst->balancer;
+    balancer_idle_append(inst);
+    if (balancer->n_idle > BALANCER_MAX_IDLE) {
+        balancer_evict_idle(balancer);
+    }
+}
+
+/* Instances that were not paired for a while are not getting all the turns
+ * they missed, they are joining the rotation at the current virtual time
+ * instead. */
+static uint64_t
+balancer_instance_pass(const struct balancer_instance *inst)
+{
+    uint64_t pass = inst->balancer->pass;
+
+    return inst->pass > pass ? inst->pass : pass;
+}
+
+bool
+balancer_prefer(const struct balancer_instance *a,
+                const struct balancer_instance *b)
+{
+    if (a == b || !a || !b) {
+        return false;
+    }
+
+    switch (a->balancer->policy) {
+    case BALANCE_ROUND_ROBIN:
+    case BALANCE_WEIGHTED:
+        return balancer_instance_pass(a) < balancer_instance_pass(b);
+    case BALANCE_LEAST_RECENT:
+        return a->last_paired < b->last_paired;
+    case BALANCE_FIFO:
+    default:
+        return false;
+    }
+}
+
+void
+balancer_paired(struct balancer_instance *inst, bool chosen)
+{
+    struct balancer *balancer;
+    uint64_t pass;
+
+    if (!inst) {
+        return;
+    }
+    balancer = inst->balancer;
+    pass = balancer_instance_pass(inst);
+
+    inst->n_pairs++;
+    balancer->n_pairs++;
+    if (!chosen) {
+        return;
+    }
+
+    inst->last_paired = balancer->n_pairs;
+
+    /* Stride scheduling: instance with a larger weight gets its next turn
+     * sooner. */
+    balancer->pass = pass;
+    inst->pass = pass + BALANCER_STRIDE
+                 / (balancer->policy == BALANCE_WEIGHTED ? inst->weight : 1);
+}
+
+void
+balancer_report(const struct balancer *balancer)
+{
+    uint32_t i;
+
+    log_info("[%02d] Balancing: %s, instances: %d (%d idle), "
+             "pairings: %"PRIu64".\n",
+             balancer->id, balance_policy_str(balancer->policy),
+             balancer->n_instances, balancer->n_idle, balancer->n_pairs);
+
+    for (i = 0; i <= balancer->mask; i++) {
+        const struct balancer_instance *inst;
+
+        for (inst = balancer->buckets[i]; inst; inst = inst->hash_next) {
+            if (!inst->n_refs) {
+                continue;
+            }
+            log_info("[%02d]   pid %ld: clients: %d, pairings: %"PRIu64", "
+                     "weight: %"PRIu32".\n", balancer->id, (long) inst->pid,
+                     inst->n_refs, inst->n_pairs, inst->weight);
+        }
+    }
+}
@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2021 Ilya Maximets <i.maximets@ovn.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __ONE_SOCKET_BALANCER_H
+#define __ONE_SOCKET_BALANCER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Policy of choosing between several waiting clients with the same key,
+ * e.g. between servers of different backend instances. */
+enum balance_policy {
+    BALANCE_FIFO,           /* In order of arrival. */
+    BALANCE_ROUND_ROBIN,    /* Instances take turns. */
+    BALANCE_LEAST_RECENT,   /* Instance that was paired least recently. */
+    BALANCE_WEIGHTED,       /* Shares of pairings proportional to weights. */
+};
+
+const char *balance_policy_str(enum balance_policy);
+
+/* Parses the name of a policy, as returned by balance_policy_str().
+ * Returns 0 on success, -1 if the name is unknown. */
+int balance_policy_from_str(const char *, enum balance_policy *);
+
+/* Pairing statistics of client instances, i.e. processes identified by
+ * their PIDs, so a backend that registered several servers is treated as
+ * one.  Clients with unknown PIDs have no instance, i.e. NULL, and are
+ * taken in order of arrival. */
+struct balancer;
+struct balancer_instance;
+
+struct balancer *balancer_create(int id, enum balance_policy);
+void balancer_destroy(struct balancer *);
+
+enum balance_policy balancer_policy(const struct balancer *);
+
+/* Returns the instance of the process 'pid' and takes a reference to it.
+ * 'weight' is the instance's share under BALANCE_WEIGHTED, zero keeps the
+ * current one, which is 1 for a new instance.
+ * Instance stays known while referenced, and for some time after that, so
+ * backends that register one server at a time keep their history. */
+struct balancer_instance *balancer_instance_ref(struct balancer *, pid_t pid,
+                                                uint32_t weight);
+void balancer_instance_unref(struct balancer_instance *);
+
+/* Returns 'true' if a client of instance 'a' should be paired before
+ * a client of instance 'b' according to the policy.  'false' if they are
+ * equally good, so the order of arrival could be used instead. */
+bool balancer_prefer(const struct balancer_instance *a,
+                     const struct balancer_instance *b);
+
+/* Accounts one more pairing of the instance.  'chosen' is 'true' if its
+ * waiting client was picked among others, only such pairings move the
+ * instance in the rotation. */
+void balancer_paired(struct balancer_instance *, bool chosen);
+
+void balancer_report(const struct balancer *);
+
+#endif
@@ -19,6 +19,7 @@
 #include "broker.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
 #include <limits.h>
 #include <pthread.h>
@@ -27,22 +28,77 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
 #include <unistd.h>
 
+#include "balancer.h"
+#include "capture.h"
+#include "key-index.h"
+#include "log.h"
+#include "pair-pool.h"
+#include "polling.h"
+#include "profiler.h"
 #include "socket-util.h"
+#include "timeval.h"
+#include "trace.h"
 
 #include <socketpair-broker/proto.h>
 #include <socketpair-broker/helper.h>
+#include <socketpair-broker/ring.h>
 
 #define CLIENT_NAME_MAX 1024
 
+/* Client that doesn't take its SET_PAIR for this long is disconnected, so
+ * its peer doesn't wait for it forever and could be paired again. */
+#define PAIRED_SEND_TIMEOUT_MS  2000
+
 struct client_info {
     int fd;                                 /* File descriptor. */
     enum client_state state;                /* Current state. */
     enum sp_broker_get_pair_mode mode;      /* NONE, CLIENT or SERVER. */
+    enum sp_broker_pair_type type;          /* Requested socket type. */
+    uint32_t version;                       /* Protocol version. */
+    uint32_t sndbuf;                        /* Requested SO_SNDBUF. */
+    uint32_t rcvbuf;                        /* Requested SO_RCVBUF. */
+    uint32_t sock_flags;                    /* SP_BROKER_SOCK_F_* flags. */
+    uint32_t ring_size;                     /* Requested SHM ring size. */
+    uint32_t weight;                        /* Share among same-key pairs. */
+    enum sp_broker_priority priority;       /* Priority class. */
+    int hello_len;                          /* -1 if no hello was sent. */
+    uint8_t hello[SP_BROKER_MAX_HELLO_SIZE];  /* Data for the peer. */
+    bool accept_fds;                        /* Takes the peer's 'fds'. */
+    int n_fds;                              /* Descriptors for the peer. */
+    int fds[SP_BROKER_MAX_PEER_FDS];
     int key_len;                            /* 'key' length. */
     uint8_t key[SP_BROKER_MAX_KEY_LENGTH];  /* Key to find a pair. */
+    bool prefix;                            /* 'key' is a prefix. */
+    struct key_index_entry index_entry;     /* In 'ctx->index' if waiting. */
     char name[CLIENT_NAME_MAX];             /* Client name for logs. */
+    uint32_t seq;                           /* Number of the client. */
+    struct capture *capture;                /* Trace of clients or NULL. */
+    pid_t pid;                              /* Process that connected. */
+    bool has_cred;                          /* 'pid', 'uid' and 'gid' are */
+    uid_t uid;                              /* known. */
+    gid_t gid;
+    int cgroup_len;                         /* 0 if 'cgroup' is unknown,
+                                             * negative if not read yet. */
+    char cgroup[SP_BROKER_MAX_CGROUP_SIZE]; /* Not null-terminated. */
+    bool want_peer_cred;                    /* Send credentials of the peer. */
+    struct balancer_instance *instance;     /* Set once GET_PAIR received. */
+    uint64_t pending_id;                    /* Position in the listing. */
+    uint64_t request_time;                  /* When connected or started
+                                             * waiting, ms. */
+
+    struct sp_broker_msg *in;               /* Partially received message. */
+    int in_len;                             /* Bytes received in 'in'. */
+    struct sp_broker_msg out;               /* Message being sent. */
+    int out_len;                            /* Size of 'out', 0 if none. */
+    int out_sent;                           /* Bytes sent from 'out'. */
+    bool want_write;                        /* Waiting for writability. */
+    struct client_info *peer;               /* Pair while SET_PAIR is sent. */
+    uint64_t paired_time;                   /* When the pair was found, ms. */
+    uint64_t pair_id;                       /* ID of the last pairing. */
 };
 
 enum client_state
@@ -69,14 +125,60 @@ client_name(struct client_info *info)
     return info->name;
 }
 
+uint64_t
+client_request_time(struct client_info *info)
+{
+    return info->request_time;
+}
+
+enum sp_broker_priority
+client_priority(struct client_info *info)
+{
+    return info->priority;
+}
+
+/* Reads the path of the process 'pid' in the unified cgroup hierarchy into
+ * 'buf'.  Returns the length of the path, or 0 if it is not known. */
+static int
+client_read_cgroup(pid_t pid, char *buf, int size)
+{
+    char path[64], line[SP_BROKER_MAX_CGROUP_SIZE + 8];
+    int len = 0;
+    FILE *file;
+
+    snprintf(path, sizeof path, "/proc/%ld/cgroup", (long) pid);
+    file = fopen(path, "re");
+    if (!file) {
+        return 0;
+    }
+    while (fgets(line, sizeof line, file)) {
+        if (strncmp(line, "0::", 3)) {
+            continue;
+        }
+        len = strcspn(line + 3, "\n");
+        if (len > size) {
+            len = 0;
+        }
+        memcpy(buf, line + 3, len);
+        break;
+    }
+    fclose(file);
+    return len;
+}
+
 int
-client_accept(int id, int listen_fd, struct client_info **info)
+client_accept(struct broker_ctx *ctx, int listen_fd,
+              struct client_info **info)
 {
     int client_fd = socket_accept(listen_fd);
     static __thread int seq_no = 0;
+    int id = ctx->id;
 
     if (client_fd < 0) {
-        fprintf(stderr, "[%02d] accept() failed: %s\n", id, strerror(errno));
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            log_error("[%02d] accept() failed: %s\n",
+                      id, strerror(errno));
+        }
         return -1;
     }
 
@@ -87,228 +189,1220 @@ client_accept(int id, int listen_fd, struct client_info **info)
 
     *info = calloc(1, sizeof **info);
     if (!*info) {
-        fprintf(stderr, "[%02d] Failed to allocate memory for a client: %s\n",
-                id, strerror(errno));
+        log_error("[%02d] Failed to allocate memory for a client: %s\n",
+                  id, strerror(errno));
         abort();
     }
     (*info)->fd = client_fd;
     (*info)->state = CLIENT_STATE_NEW;
     (*info)->mode = SP_BROKER_PAIR_MODE_MAX;
+    (*info)->request_time = time_msec();
+    (*info)->hello_len = -1;
+    /* Credentials are captured now, while the process that connected is
+     * known to exist, so they could be trusted by the peer later. */
+    if (socket_get_peer_cred(client_fd, &(*info)->pid,
+                             &(*info)->uid, &(*info)->gid)) {
+        log_info("[%02d] Failed to get credentials of a client: %s.\n",
+                 id, strerror(errno));
+        (*info)->pid = 0;
+    } else {
+        (*info)->has_cred = true;
+        (*info)->cgroup_len = -1;
+    }
+    (*info)->seq = seq_no++;
     snprintf((*info)->name, CLIENT_NAME_MAX, "client-%02d-%04d-%04d",
-             id, seq_no++, client_fd);
+             id, (*info)->seq, client_fd);
+    (*info)->capture = ctx->capture;
+    capture_event(ctx->capture, CAPTURE_CONNECT, (*info)->seq, NULL, 0, 0);
+    /* accept(name, fd, pid) */
+    TRACE(accept, (*info)->name, client_fd, (*info)->pid);
     return 0;
 }
 
+static void
+client_close_fds(struct sp_broker_msg *msg)
+{
+    int i;
+
+    for (i = 0; i < msg->n_fds; i++) {
+        close(msg->fds[i]);
+    }
+    msg->n_fds = 0;
+}
+
 void
-client_destroy(struct client_info *info)
+client_destroy(struct broker_ctx *ctx, struct client_info *info)
 {
+    int i;
+
     if (!info) {
         return;
     }
+    /* Descriptors of partially received or not yet sent messages. */
+    if (info->in) {
+        client_close_fds(info->in);
+        free(info->in);
+    }
+    /* disconnect(name, state, pair_id) */
+    TRACE(disconnect, info->name, info->state, info->pair_id);
+    capture_event(info->capture, CAPTURE_DISCONNECT, info->seq, NULL, 0,
+                  info->state);
+    client_close_fds(&info->out);
+    for (i = 0; i < info->n_fds; i++) {
+        close(info->fds[i]);
+    }
+    ctx->n_held_fds -= info->n_fds;
+    key_index_remove(&info->index_entry);
+    balancer_instance_unref(info->instance);
     close(info->fd);
     free(info);
 }
 
+static void
+client_want_write(struct broker_ctx *ctx, struct client_info *info,
+                  bool want_write)
+{
+    if (info->want_write == want_write) {
+        return;
+    }
+    if (poll_mod(ctx->id, ctx->poll_fd, info->fd, info, want_write,
+                 info->name)) {
+        info->state = CLIENT_STATE_DEAD;
+        return;
+    }
+    info->want_write = want_write;
+}
+
+/* Sends as much of the pending message as the socket accepts.  File
+ * descriptors are sent along with the first chunk.  The rest will be sent
+ * once the socket is writable again.  Returns 0 if the message is sent or
+ * the rest of it is pending.  On failure returns -1. */
+static int
+client_flush(struct broker_ctx *ctx, struct client_info *info)
+{
+    struct sp_broker_msg *out = &info->out;
+    struct client_info *peer = info->peer;
+    int ret;
+
+    while (info->out_sent < info->out_len) {
+        ret = socket_send_message(info->fd, (char *) out + info->out_sent,
+                                  info->out_len - info->out_sent,
+                                  out->fds, out->n_fds);
+        if (ret < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                client_want_write(ctx, info, true);
+                break;
+            }
+            log_info("[%02d] Failed to send message to %s: %s.\n",
+                     ctx->id, info->name, strerror(errno));
+            return -1;
+        }
+        /* Descriptors are in flight now, closing our copies. */
+        client_close_fds(out);
+        info->out_sent += ret;
+    }
+
+    if (info->out_len && info->out_sent == info->out_len) {
+        client_want_write(ctx, info, false);
+        if (info->state == CLIENT_STATE_PAIRED) {
+            /* set_pair_sent(pair_id, name) */
+            TRACE(set_pair_sent, info->pair_id, info->name);
+            info->state = CLIENT_STATE_COMPLETE;
+        }
+    }
+
+    /* This client has its end of the channel now.  Peer could receive
+     * the other one. */
+    if (info->out_sent && peer && peer->state == CLIENT_STATE_PAIRED
+        && peer->out_len && !peer->out_sent
+        && client_flush(ctx, peer)) {
+        peer->state = CLIENT_STATE_DEAD;
+    }
+    return 0;
+}
+
+/* Builds SP_BROKER_SET_PAIR with file descriptors 'fds' in the client's
+ * output buffer.  Only the header, the 'u64', the hello, descriptors and
+ * credentials of the 'peer' are written.  Takes the ownership of file
+ * descriptors.  Returns 0 on success, -1 on failure. */
 static int
-client_send_msg(int id, struct client_info *info, struct sp_broker_msg *msg)
+client_queue_set_pair(struct broker_ctx *ctx, struct client_info *info,
+                      struct client_info *peer, bool producer,
+                      const int *fds, int n_fds)
 {
-    if (socket_send_message(info->fd, (char *) msg, SP_BROKER_MESSAGE_SIZE,
-                            msg->fds, msg->n_fds) < 0) {
-        printf("[%02d] Failed to send SP_BROKER_SET_PAIR request to %s: %s.\n",
-               id, info->name, strerror(errno));
+    struct sp_broker_msg *out = &info->out;
+    int i;
+
+    if (info->out_len) {
+        /* Only one message per pairing client is ever sent. */
+        log_info("[%02d] Unexpected outgoing message for %s.\n",
+                 ctx->id, info->name);
+        for (i = 0; i < n_fds; i++) {
+            close(fds[i]);
+        }
         return -1;
     }
+
+    out->request = SP_BROKER_SET_PAIR;
+    out->flags = info->version | SP_BROKER_PAIR_TYPE_SET(info->type);
+    if (producer) {
+        out->flags |= SP_BROKER_SET_PAIR_F_PRODUCER;
+    }
+    out->size = sizeof out->payload.u64;
+    out->payload.u64 = info->pair_id;
+    memcpy(out->fds, fds, n_fds * sizeof fds[0]);
+    out->n_fds = n_fds;
+
+    /* Peer keeps its descriptors, so they could be sent again if this
+     * client fails to receive SET_PAIR and the peer is paired with somebody
+     * else. */
+    if (info->accept_fds) {
+        for (i = 0; i < peer->n_fds; i++) {
+            int fd = fcntl(peer->fds[i], F_DUPFD_CLOEXEC, 0);
+
+            if (fd < 0) {
+                log_info("[%02d] Failed to duplicate descriptors of %s "
+                         "for %s: %s.\n", ctx->id, peer->name, info->name,
+                         strerror(errno));
+                client_close_fds(out);
+                return -1;
+            }
+            out->fds[out->n_fds++] = fd;
+        }
+    } else if (peer->n_fds) {
+        log_info("[%02d] %s doesn't accept descriptors, not sending %d "
+                 "descriptors of %s.\n",
+                 ctx->id, info->name, peer->n_fds, peer->name);
+    }
+
+    if (info->want_peer_cred && peer->has_cred) {
+        struct sp_broker_peer_cred cred = {
+            .pid = peer->pid, .uid = peer->uid, .gid = peer->gid,
+        };
+
+        sp_broker_attr_put(out, SP_BROKER_ATTR_PEER_CRED, &cred, sizeof cred);
+        /* Few clients ask for it, so the cgroup is read only on demand,
+         * while the peer is still connected. */
+        if (peer->cgroup_len < 0) {
+            peer->cgroup_len = client_read_cgroup(peer->pid, peer->cgroup,
+                                                  sizeof peer->cgroup);
+        }
+        if (peer->cgroup_len) {
+            sp_broker_attr_put(out, SP_BROKER_ATTR_PEER_CGROUP,
+                               peer->cgroup, peer->cgroup_len);
+        }
+    }
+
+    /* Only clients that sent a hello themselves expect one, others may not
+     * know the attribute.  It always fits into the payload. */
+    if (info->hello_len >= 0 && peer->hello_len >= 0) {
+        sp_broker_attr_put(out, SP_BROKER_ATTR_HELLO,
+                           peer->hello, peer->hello_len);
+    }
+
+    /* Version 1 messages have a fixed size and carry only the 'u64'.  The
+     * buffer could hold an earlier reply, so clearing the rest of it. */
+    if (info->version == SP_BROKER_PROTOCOL_VERSION) {
+        memset((char *) out + SP_BROKER_HEADER_SIZE + sizeof out->payload.u64,
+               0, SP_BROKER_MESSAGE_SIZE - SP_BROKER_HEADER_SIZE
+                  - sizeof out->payload.u64);
+    }
+    info->out_len = sp_broker_message_length(out);
+    info->out_sent = 0;
     return 0;
 }
 
+void
+client_send_pending(struct broker_ctx *ctx, struct client_info *info)
+{
+    if (client_waits_disconnection(info->state)) {
+        return;
+    }
+    if (client_flush(ctx, info)) {
+        info->state = CLIENT_STATE_DEAD;
+    }
+}
+
+/* Receives the next portion of a message from the client.  Messages are
+ * received into the per-worker buffer.  Only if the message is not complete,
+ * it is moved to the client's own buffer to wait for the rest.  Returns 1 and
+ * stores the message in 'msgp' if the message is complete, 0 if more data is
+ * needed.  Returns -1 on failure or if connection was closed. */
 static int
-client_recv_msg(int id, struct client_info *info, struct sp_broker_msg *msg)
+client_recv_msg(struct broker_ctx *ctx, struct client_info *info,
+                struct sp_broker_msg **msgp)
 {
-    if (socket_read_message(info->fd, (char *) msg, SP_BROKER_MESSAGE_SIZE,
-                            msg->fds, sizeof msg->fds, &msg->n_fds) < 0) {
-        printf("[%02d] Failed to receive message from %s: %s.\n",
-               id, info->name, strerror(errno));
+    struct sp_broker_msg *msg = info->in_len ? info->in : &ctx->msg;
+    int ret, n_fds = 0, len;
+    int id = ctx->id;
+
+    if (!info->in_len) {
+        msg->n_fds = 0;
+    }
+
+    /* Not knowing the size until the header received, so reading as much
+     * as a message could take.  Clients are not allowed to send anything
+     * after the request, so this will not consume the next message. */
+    len = info->in_len < (int) SP_BROKER_HEADER_SIZE
+          ? (int) (SP_BROKER_HEADER_SIZE + SP_BROKER_MAX_PAYLOAD_SIZE)
+          : sp_broker_message_length(msg);
+
+    ret = socket_read_message(info->fd, (char *) msg + info->in_len,
+                              len - info->in_len, &msg->fds[msg->n_fds],
+                              SP_BROKER_PROTOCOL_MAX_FDS - msg->n_fds,
+                              &n_fds);
+    if (ret < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        }
+        log_info("[%02d] Failed to receive message from %s: %s.\n",
+                 id, info->name, strerror(errno));
+        return -1;
+    }
+    if (!ret) {
+        log_info("[%02d] Connection closed by %s.\n", id, info->name);
         return -1;
     }
+    msg->n_fds += n_fds;
+    ret += info->in_len;
+
+    if (ret >= (int) SP_BROKER_HEADER_SIZE) {
+        len = sp_broker_message_length(msg);
+        if (len < 0) {
+            log_info("[%02d] %s: Protocol error: Unsupported version 0x%"PRIx32
+                     " or payload size %"PRIu32".\n", id, info->name,
+                     msg->flags & SP_BROKER_PROTOCOL_VERSION_MASK, msg->size);
+            goto error;
+        }
+        if (ret > len) {
+            log_info("[%02d] %s: Protocol error: Unexpected message "
+                     "length %d. Expected: %d.\n", id, info->name, ret, len);
+            goto error;
+        }
+        if (ret == len) {
+            /* Message is complete.  Starting a new one next time. */
+            info->in_len = 0;
+            *msgp = msg;
+            return 1;
+        }
+    }
+
+    if (msg == &ctx->msg) {
+        /* Waiting for the rest of the message. */
+        if (!info->in) {
+            info->in = malloc(sizeof *info->in);
+            if (!info->in) {
+                log_error("[%02d] Failed to allocate memory for "
+                          "a message: %s\n", id, strerror(errno));
+                abort();
+            }
+        }
+        memcpy(info->in, msg, ret);
+        memcpy(info->in->fds, msg->fds, msg->n_fds * sizeof msg->fds[0]);
+        info->in->n_fds = msg->n_fds;
+    }
+    info->in_len = ret;
     return 0;
+
+error:
+    client_close_fds(msg);
+    return -1;
 }
 
+/* Checks if modes and types of clients allow to pair them.  Keys are not
+ * checked. */
 static bool
-client_match(const struct client_info *client,
-             const struct sp_broker_get_pair_request *get_pair)
+client_compatible(const struct client_info *client,
+                  const struct client_info *info)
 {
     if (client->mode >= SP_BROKER_PAIR_MODE_MAX) {
         return false;
     }
 
+    /* Both should request the same type of a socket. */
+    if (client->type != info->type) {
+        return false;
+    }
+
     /* Both modes should be NONE or they should be opposite. */
     if (client->mode == SP_BROKER_PAIR_MODE_NONE
-        || get_pair->mode == SP_BROKER_PAIR_MODE_NONE) {
-        if (client->mode != get_pair->mode) {
+        || info->mode == SP_BROKER_PAIR_MODE_NONE) {
+        if (client->mode != info->mode) {
             return false;
         }
-    } else if (client->mode == get_pair->mode) {
+    } else if (client->mode == info->mode) {
         return false;
     }
+    return true;
+}
 
-    return client->key_len == get_pair->key_len &&
-           !memcmp(client->key, get_pair->key, get_pair->key_len);
+/* Returns 'true' if 'key' of 'prefix_len' bytes is a prefix of 'info' key. */
+static bool
+client_key_starts_with(const struct client_info *info,
+                       const uint8_t *key, int prefix_len)
+{
+    return info->key_len >= prefix_len && !memcmp(info->key, key, prefix_len);
 }
 
+static bool
+client_match(const struct client_info *client, const struct client_info *info)
+{
+    if (!client_compatible(client, info)) {
+        return false;
+    }
+    if (client->prefix) {
+        return !info->prefix
+               && client_key_starts_with(info, client->key, client->key_len);
+    }
+    if (info->prefix) {
+        return client_key_starts_with(client, info->key, info->key_len);
+    }
+    return client->key_len == info->key_len &&
+           !memcmp(client->key, info->key, info->key_len);
+}
+
+_Static_assert(SP_BROKER_PAIR_TYPE_MAX * SP_BROKER_PAIR_MODE_MAX
+               <= KEY_INDEX_MAX_KINDS, "Not enough kinds in the key index");
+
+/* Kind of the client in the key index.  Clients of one kind are compatible
+ * with the same clients. */
+static int
+client_index_kind(enum sp_broker_pair_type type,
+                  enum sp_broker_get_pair_mode mode)
+{
+    return type * SP_BROKER_PAIR_MODE_MAX + mode;
+}
+
+/* Kind of clients in the key index that could be paired with 'info'. */
+static int
+client_index_peer_kind(const struct client_info *info)
+{
+    enum sp_broker_get_pair_mode mode = info->mode;
+
+    if (mode == SP_BROKER_PAIR_MODE_CLIENT) {
+        mode = SP_BROKER_PAIR_MODE_SERVER;
+    } else if (mode == SP_BROKER_PAIR_MODE_SERVER) {
+        mode = SP_BROKER_PAIR_MODE_CLIENT;
+    }
+    return client_index_kind(info->type, mode);
+}
+
+static bool
+client_index_match(const struct key_index_entry *entry, void *info_)
+{
+    const struct client_info *client =
+        KEY_INDEX_ENTRY_TO(entry, struct client_info, index_entry);
+    const struct client_info *info = info_;
+
+    /* Prefixes are not paired with each other. */
+    return client != info && client->state == CLIENT_STATE_PAIR_REQUESTED
+           && !(client->prefix && info->prefix)
+           && client_compatible(client, info);
+}
+
+static bool
+client_index_better(const struct key_index_entry *a_,
+                    const struct key_index_entry *b_, void *info_)
+{
+    const struct client_info *a =
+        KEY_INDEX_ENTRY_TO(a_, struct client_info, index_entry);
+    const struct client_info *b =
+        KEY_INDEX_ENTRY_TO(b_, struct client_info, index_entry);
+
+    (void) info_;
+    if (a->priority != b->priority) {
+        return a->priority > b->priority;
+    }
+    return balancer_prefer(a->instance, b->instance);
+}
+
+/* Looks for a waiting client that could be paired with 'info'.  Client with
+ * exactly the same key is preferred over the one that requested a prefix of
+ * the key.  Among clients with the same key the one with the highest
+ * priority is chosen, then the one preferred by the balancing policy, then
+ * the one that came first.  For a prefix all the keys that start with it are
+ * treated the same way, as if they were one key. */
 static struct client_info *
-client_lookup(struct client_info **clients, int n_clients,
-              const struct sp_broker_get_pair_request *get_pair)
+client_lookup(struct broker_ctx *ctx, struct client_info *info)
 {
-    int i;
+    enum profiler_phase phase;
+    struct key_index_entry *entry;
 
-    /* Might be slow.  TODO: Optimize with hashes or hash maps. */
-    for (i = 0; i < n_clients; i++) {
-        if (clients[i]->state == CLIENT_STATE_PAIR_REQUESTED
-            && client_match(clients[i], get_pair)) {
-            return clients[i];
+    phase = profiler_enter(ctx->profiler, PROFILER_PHASE_LOOKUP);
+    if (info->prefix) {
+        entry = key_index_find_prefixed(ctx->index, info->key, info->key_len,
+                                        client_index_peer_kind(info),
+                                        client_index_match,
+                                        client_index_better, info);
+    } else {
+        entry = key_index_find(ctx->index, info->key, info->key_len,
+                               client_index_peer_kind(info),
+                               client_index_match, client_index_better,
+                               info);
+    }
+    profiler_enter(ctx->profiler, phase);
+    return entry ? KEY_INDEX_ENTRY_TO(entry, struct client_info, index_entry)
+                 : NULL;
+}
+
+/* Makes the waiting client 'info' available for lookups. */
+static void
+client_wait_for_pair(struct broker_ctx *ctx, struct client_info *info)
+{
+    enum profiler_phase phase;
+
+    phase = profiler_enter(ctx->profiler, PROFILER_PHASE_LOOKUP);
+    info->state = CLIENT_STATE_PAIR_REQUESTED;
+    /* Under FIFO clients of the default priority are taken in order, so
+     * lookups don't compare them with each other. */
+    key_index_insert(ctx->index, &info->index_entry, info->key, info->key_len,
+                     info->prefix, client_index_kind(info->type, info->mode),
+                     balancer_policy(ctx->balancer) != BALANCE_FIFO
+                     || info->priority != SP_BROKER_PRIORITY_NORMAL);
+    profiler_enter(ctx->profiler, phase);
+}
+
+static const char *
+pair_mode_str(enum sp_broker_get_pair_mode mode)
+{
+    switch (mode) {
+        case SP_BROKER_PAIR_MODE_NONE:   return "none";
+        case SP_BROKER_PAIR_MODE_CLIENT: return "client";
+        case SP_BROKER_PAIR_MODE_SERVER: return "server";
+        default: return "<unknown>";
+    }
+}
+
+static const char *
+pair_type_str(enum sp_broker_pair_type type)
+{
+    switch (type) {
+        case SP_BROKER_PAIR_TYPE_STREAM:    return "stream";
+        case SP_BROKER_PAIR_TYPE_SEQPACKET: return "seqpacket";
+        case SP_BROKER_PAIR_TYPE_DGRAM:     return "dgram";
+        case SP_BROKER_PAIR_TYPE_SHM_RING:  return "shm-ring";
+        default: return "<unknown>";
+    }
+}
+
+static const char *
+priority_str(enum sp_broker_priority priority)
+{
+    switch (priority) {
+        case SP_BROKER_PRIORITY_NORMAL:   return "normal";
+        case SP_BROKER_PRIORITY_HIGH:     return "high";
+        case SP_BROKER_PRIORITY_CRITICAL: return "critical";
+        default: return "<unknown>";
+    }
+}
+
+static int
+pair_type_to_socket_type(enum sp_broker_pair_type type)
+{
+    switch (type) {
+        case SP_BROKER_PAIR_TYPE_SEQPACKET: return SOCK_SEQPACKET;
+        case SP_BROKER_PAIR_TYPE_DGRAM:     return SOCK_DGRAM;
+        case SP_BROKER_PAIR_TYPE_STREAM:
+        default: return SOCK_STREAM;
+    }
+}
+
+static int
+buffer_size_apply_policy(uint32_t requested, int default_size, int max_size)
+{
+    int size = requested ? (requested > INT_MAX ? INT_MAX : (int) requested)
+                         : default_size;
+
+    if (max_size && size > max_size) {
+        size = max_size;
+    }
+    return size;
+}
+
+/* Applies socket options requested by the client 'info' to the socket 'fd'
+ * that will be sent to this client. */
+static int
+client_apply_sockopts(struct broker_ctx *ctx, struct client_info *info,
+                      int fd)
+{
+    const struct pair_sockopts_policy *policy = &ctx->sockopts;
+    int sndbuf, rcvbuf;
+
+    sndbuf = buffer_size_apply_policy(info->sndbuf, policy->sndbuf,
+                                      policy->max_buf);
+    rcvbuf = buffer_size_apply_policy(info->rcvbuf, policy->rcvbuf,
+                                      policy->max_buf);
+    if (socket_set_buffers(fd, sndbuf, rcvbuf)) {
+        return -1;
+    }
+
+    if (info->sock_flags & SP_BROKER_SOCK_F_PASSCRED
+        && socket_set_flag(fd, SO_PASSCRED, true)) {
+        return -1;
+    }
+#ifdef SO_PASSSEC
+    if (info->sock_flags & SP_BROKER_SOCK_F_PASSSEC
+        && socket_set_flag(fd, SO_PASSSEC, true)) {
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+/* Creates a channel of the requested type for clients 'a' and 'b' and stores
+ * file descriptors that should be sent to each of them in 'fds_a' and
+ * 'fds_b'.  In case of a shared memory ring 'fds_b' are duplicates of
+ * 'fds_a', so every client owns its own set of descriptors.  Returns the
+ * number of descriptors for one client.  On failure returns -1 and sets
+ * errno. */
+static int
+client_create_channel(struct broker_ctx *ctx,
+                      struct client_info *a, struct client_info *b,
+                      int fds_a[], int fds_b[])
+{
+    int save_errno;
+    int i, j, sp[2];
+
+    if (a->type == SP_BROKER_PAIR_TYPE_SHM_RING) {
+        uint32_t size = a->ring_size > b->ring_size ? a->ring_size
+                                                    : b->ring_size;
+
+        if (sp_broker_ring_create(size ? size : SP_BROKER_RING_DEFAULT_SIZE,
+                                  fds_a)) {
+            return -1;
+        }
+        for (i = 0; i < SP_BROKER_RING_N_FDS; i++) {
+            fds_b[i] = fcntl(fds_a[i], F_DUPFD_CLOEXEC, 0);
+            if (fds_b[i] < 0) {
+                save_errno = errno;
+                for (j = 0; j < SP_BROKER_RING_N_FDS; j++) {
+                    close(fds_a[j]);
+                    if (j < i) {
+                        close(fds_b[j]);
+                    }
+                }
+                errno = save_errno;
+                return -1;
+            }
         }
+        return SP_BROKER_RING_N_FDS;
+    }
+
+    if (pair_pool_get(ctx->pool, pair_type_to_socket_type(a->type), sp)) {
+        return -1;
+    }
+
+    if (client_apply_sockopts(ctx, a, sp[0])
+        || client_apply_sockopts(ctx, b, sp[1])) {
+        save_errno = errno;
+        close(sp[0]);
+        close(sp[1]);
+        errno = save_errno;
+        return -1;
+    }
+
+    fds_a[0] = sp[0];
+    fds_b[0] = sp[1];
+    return 1;
+}
+
+static void
+client_account_pairing(struct broker_ctx *ctx, struct client_info *info)
+{
+    struct broker_class_stats *stats = &ctx->classes[info->priority];
+    uint64_t wait_ms = time_msec() - info->request_time;
+
+    stats->n_paired++;
+    stats->wait_ms += wait_ms;
+    if (wait_ms > stats->max_wait_ms) {
+        stats->max_wait_ms = wait_ms;
     }
-    return NULL;
 }
 
 static int
-client_create_and_send_socketpair(int id, struct client_info *a,
-                                          struct client_info *b)
+client_create_and_send_socketpair(struct broker_ctx *ctx,
+                                  struct client_info *a,
+                                  struct client_info *b)
 {
-    struct sp_broker_msg msg;
-    int ret = 0;
-    int sp[2];
+    int fds_a[SP_BROKER_RING_N_FDS], fds_b[SP_BROKER_RING_N_FDS];
+    struct client_info *producer = NULL;
+    enum profiler_phase phase;
+    int id = ctx->id;
+    int i, n_fds;
+    int ret = -1;
 
-    printf("[%02d] Creating socket pair for %s and %s.\n",
-                id, client_name(a), client_name(b));
+    phase = profiler_enter(ctx->profiler, PROFILER_PHASE_PAIR);
 
-    if (socket_pair_get(sp)) {
-        fprintf(stderr, "[%02d] Failed to create socketpair: %s.\n",
-                id, strerror(errno));
+    /* Upper bits are the worker ID, so IDs are unique for the process. */
+    a->pair_id = b->pair_id = (uint64_t) id << 48
+                              | (++*ctx->pair_seq & ((UINT64_C(1) << 48) - 1));
+
+    log_info("[%02d] Creating %s pair %#"PRIx64" for %s and %s.\n",
+             id, pair_type_str(a->type), a->pair_id,
+             client_name(a), client_name(b));
+    /* match(pair_id, name_a, name_b, wait_ms_a, wait_ms_b) */
+    TRACE(match, a->pair_id, a->name, b->name,
+          time_msec() - a->request_time, time_msec() - b->request_time);
+
+    n_fds = client_create_channel(ctx, a, b, fds_a, fds_b);
+    /* pair_create(pair_id, type, n_fds) */
+    TRACE(pair_create, a->pair_id, a->type, n_fds);
+    if (n_fds < 0) {
+        log_error("[%02d] Failed to create %s pair: %s.\n",
+                  id, pair_type_str(a->type), strerror(errno));
         /* We can't just leave both clients in PAIR_REQUESTED state because
          * we will never match them again.  Closing both to trigger re-connect.
          * Maybe they will be lucky net time.  */
         a->state = CLIENT_STATE_DEAD;
         b->state = CLIENT_STATE_DEAD;
-        return -1;
+        goto out;
     }
 
-    memset(&msg, 0, sizeof msg);
-    msg.request = SP_BROKER_SET_PAIR;
-    msg.flags |= SP_BROKER_PROTOCOL_VERSION;
-    msg.size = sizeof msg.payload.u64;
-    msg.n_fds = 1;
-    msg.fds[0] = sp[0];
+    if (a->type == SP_BROKER_PAIR_TYPE_SHM_RING) {
+        /* Client writes to the ring and server reads from it.  In
+         * nondirectional mode the client that came later is a producer. */
+        producer = a->mode == SP_BROKER_PAIR_MODE_CLIENT ? a : b;
+    }
 
-    if (client_send_msg(id, a, &msg) < 0) {
-        /* We have a chance to keep one of the clients.  Ony marking failed
-         * one as dead. */
-        a->state = CLIENT_STATE_DEAD;
-        ret = -1;
+    /* Clients are not available for matching anymore.  They will become
+     * COMPLETE once SET_PAIR is fully sent. */
+    a->state = CLIENT_STATE_PAIRED;
+    b->state = CLIENT_STATE_PAIRED;
+    a->paired_time = b->paired_time = time_msec();
+    if (!ctx->pairings_deadline) {
+        ctx->pairings_deadline = a->paired_time + PAIRED_SEND_TIMEOUT_MS;
     }
+    key_index_remove(&a->index_entry);
+    key_index_remove(&b->index_entry);
+    /* 'a' is the waiting client chosen by the lookup. */
+    balancer_paired(a->instance, true);
+    balancer_paired(b->instance, false);
+    client_account_pairing(ctx, a);
+    client_account_pairing(ctx, b);
 
-    msg.fds[0] = sp[1];
-    if (client_send_msg(id, b, &msg) < 0) {
-        /* We already sent reply to one of the clients, need to close them
-         * both so both will reconnect. */
+    if (client_queue_set_pair(ctx, a, b, producer == a, fds_a, n_fds) < 0) {
+        for (i = 0; i < n_fds; i++) {
+            close(fds_b[i]);
+        }
         a->state = CLIENT_STATE_DEAD;
         b->state = CLIENT_STATE_DEAD;
-        ret = -1;
+        goto out;
+    }
+    if (client_queue_set_pair(ctx, b, a, producer == b, fds_b, n_fds) < 0) {
+        a->state = CLIENT_STATE_DEAD;
+        b->state = CLIENT_STATE_DEAD;
+        goto out;
     }
 
-    /* Closing the socket pair from our side. */
-    close(sp[0]);
-    close(sp[1]);
-
-    if (!ret) {
-        a->state = CLIENT_STATE_COMPLETE;
-        b->state = CLIENT_STATE_COMPLETE;
+    /* SET_PAIR is sent to 'b' only after 'a' received its end of the
+     * channel.  If 'a' fails before that, 'b' is still untouched and goes
+     * back to pairing with somebody else, see client_unpair(). */
+    a->peer = b;
+    b->peer = a;
+    if (client_flush(ctx, a)) {
+        a->state = CLIENT_STATE_DEAD;
     }
+    ret = 0;
+
+out:
+    profiler_enter(ctx->profiler, phase);
     return ret;
 }
 
-static const char *
-pair_mode_str(enum sp_broker_get_pair_mode mode)
+static void
+client_parse_attrs(struct client_info *info, const struct sp_broker_msg *msg)
 {
-    switch (mode) {
-        case SP_BROKER_PAIR_MODE_NONE:   return "none";
-        case SP_BROKER_PAIR_MODE_CLIENT: return "client";
-        case SP_BROKER_PAIR_MODE_SERVER: return "server";
-        default: return "<unknown>";
+    const struct sp_broker_attr *attr;
+
+    SP_BROKER_ATTR_FOR_EACH (attr, msg) {
+        switch (attr->type) {
+        case SP_BROKER_ATTR_SNDBUF:
+            info->sndbuf = sp_broker_attr_get_u32(attr);
+            break;
+        case SP_BROKER_ATTR_RCVBUF:
+            info->rcvbuf = sp_broker_attr_get_u32(attr);
+            break;
+        case SP_BROKER_ATTR_SOCK_FLAGS:
+            info->sock_flags = sp_broker_attr_get_u32(attr);
+            break;
+        case SP_BROKER_ATTR_RING_SIZE:
+            info->ring_size = sp_broker_attr_get_u32(attr);
+            break;
+        case SP_BROKER_ATTR_WEIGHT:
+            info->weight = sp_broker_attr_get_u32(attr);
+            break;
+        case SP_BROKER_ATTR_PRIORITY:
+            info->priority = sp_broker_attr_get_u32(attr);
+            break;
+        case SP_BROKER_ATTR_HELLO:
+            info->hello_len = attr->len;
+            memcpy(info->hello, attr->value, attr->len);
+            break;
+        default:
+            break;
+        }
     }
 }
 
 static int
-client_handle_get_pair(int id, struct client_info *info,
+client_send_peer_status(struct broker_ctx *ctx, struct client_info *info,
+                        uint64_t status)
+{
+    struct sp_broker_msg *out = &info->out;
+
+    out->request = SP_BROKER_PEER_STATUS;
+    out->flags = SP_BROKER_PROTOCOL_VERSION_2;
+    out->size = sizeof out->payload.u64;
+    out->payload.u64 = status;
+    out->n_fds = 0;
+
+    info->out_len = sp_broker_message_length(out);
+    info->out_sent = 0;
+    return client_flush(ctx, info);
+}
+
+/* Tells clients that are waiting for a pair like 'info' to appear that it
+ * is here.  Watchers go back to the NEW state and could send more queries. */
+static void
+client_notify_watchers(struct broker_ctx *ctx, struct client_info *info,
+                       struct client_info **clients, int n_clients)
+{
+    int i, n_watchers = 0;
+
+    for (i = 0; i < n_clients; i++) {
+        struct client_info *client = clients[i];
+
+        if (client->state != CLIENT_STATE_WATCHING) {
+            continue;
+        }
+        if (!client_match(client, info)) {
+            n_watchers++;
+            continue;
+        }
+        log_info("[%02d] %s: notifying about %s.\n",
+                 ctx->id, client_name(client), client_name(info));
+        client->state = CLIENT_STATE_NEW;
+        if (client_send_peer_status(ctx, client, SP_BROKER_PEER_PRESENT)) {
+            client->state = CLIENT_STATE_DEAD;
+        }
+    }
+    ctx->n_watchers = n_watchers;
+}
+
+static int
+client_handle_get_pair(struct broker_ctx *ctx,
+                       struct client_info *info,
                        struct sp_broker_msg *msg,
                        struct client_info **clients, int n_clients)
 {
     struct client_info *pair;
+    int id = ctx->id;
 
     if (info->state != CLIENT_STATE_NEW) {
-        printf("[%02d] Unexpected request SP_BROKER_GET_PAIR from %s.  "
-               "Key is already set.\n", id, info->name);
+        log_info("[%02d] Unexpected request SP_BROKER_GET_PAIR from %s.  "
+                 "Key is already set.\n", id, info->name);
+        return -1;
+    }
+    if (info->out_len) {
+        log_info("[%02d] Unexpected request SP_BROKER_GET_PAIR from %s.  "
+                 "Connection is used for queries.\n", id, info->name);
+        return -1;
+    }
+    if (msg->n_fds > ctx->max_held_fds - ctx->n_held_fds) {
+        log_info("[%02d] %s: too many descriptors held for peers (%d + %d, "
+                 "limit: %d).  Rejecting.\n", id, info->name,
+                 ctx->n_held_fds, msg->n_fds, ctx->max_held_fds);
         return -1;
     }
-
-    /* Looking for pair before updating info for the current client to avoid
-     * finding it.  */
-    pair = client_lookup(clients, n_clients, &msg->payload.get_pair);
 
     /* Updating info for the current client.  */
     info->mode = msg->payload.get_pair.mode;
+    info->type = SP_BROKER_PAIR_TYPE_GET(msg->flags);
+    info->version = msg->flags & SP_BROKER_PROTOCOL_VERSION_MASK;
     info->key_len = msg->payload.get_pair.key_len;
     memcpy(info->key, msg->payload.get_pair.key, info->key_len);
+    info->prefix = !!(msg->flags & SP_BROKER_GET_PAIR_F_PREFIX);
+    info->accept_fds = !!(msg->flags & SP_BROKER_GET_PAIR_F_ACCEPT_FDS);
+    info->want_peer_cred = !!(msg->flags & SP_BROKER_GET_PAIR_F_PEER_CRED);
+    client_parse_attrs(info, msg);
+    /* Keeping descriptors for the peer, so they are not closed with the
+     * message. */
+    memcpy(info->fds, msg->fds, msg->n_fds * sizeof msg->fds[0]);
+    info->n_fds = msg->n_fds;
+    ctx->n_held_fds += msg->n_fds;
+    msg->n_fds = 0;
+    /* Clients of unknown processes are not merged into one instance. */
+    info->instance = info->has_cred
+                     ? balancer_instance_ref(ctx->balancer, info->pid,
+                                             info->weight)
+                     : NULL;
     info->state = CLIENT_STATE_PAIR_REQUESTED;
+    info->pending_id = ++*ctx->pending_seq;
+    info->request_time = time_msec();
+    ctx->classes[info->priority].n_requests++;
 
-    printf("[%02d] %s: key received, mode: %s.\n",
-           id, client_name(info), pair_mode_str(info->mode));
+    /* get_pair(name, key, key_len, mode, type, priority) */
+    TRACE(get_pair, info->name, info->key, info->key_len, info->mode,
+          info->type, info->priority);
+    capture_event(ctx->capture, CAPTURE_GET_PAIR, info->seq,
+                  info->key, info->key_len,
+                  info->mode | (info->prefix ? CAPTURE_F_PREFIX : 0));
+    log_info("[%02d] %s: %s received, mode: %s, type: %s, priority: %s.\n",
+             id, client_name(info), info->prefix ? "key prefix" : "key",
+             pair_mode_str(info->mode), pair_type_str(info->type),
+             priority_str(info->priority));
 
+    if (ctx->n_watchers) {
+        client_notify_watchers(ctx, info, clients, n_clients);
+    }
+
+    pair = client_lookup(ctx, info);
     if (pair) {
         /* Pair found! */
-        return client_create_and_send_socketpair(id, pair, info);
+        return client_create_and_send_socketpair(ctx, pair, info);
     }
+    client_wait_for_pair(ctx, info);
     return 0;
 }
 
+/* Queries are answered one by one on a connection that didn't request
+ * a pair. */
+static bool
+client_query_allowed(struct broker_ctx *ctx, struct client_info *info,
+                     const char *request)
+{
+    if (info->state != CLIENT_STATE_NEW) {
+        log_info("[%02d] Unexpected request %s from %s in state %s.\n",
+                 ctx->id, request, info->name, client_state_str(info->state));
+        return false;
+    }
+    if (info->out_sent < info->out_len) {
+        log_info("[%02d] Unexpected request %s from %s.  "
+                 "Previous reply is not sent yet.\n",
+                 ctx->id, request, info->name);
+        return false;
+    }
+    return true;
+}
+
+static int
+client_handle_query_peer(struct broker_ctx *ctx,
+                         struct client_info *info,
+                         struct sp_broker_msg *msg)
+{
+    bool present;
+
+    if (!client_query_allowed(ctx, info, "SP_BROKER_QUERY_PEER")) {
+        return -1;
+    }
+
+    /* Same fields as for pairing, so the lookup could be used. */
+    info->mode = msg->payload.get_pair.mode;
+    info->type = SP_BROKER_PAIR_TYPE_GET(msg->flags);
+    info->key_len = msg->payload.get_pair.key_len;
+    memcpy(info->key, msg->payload.get_pair.key, info->key_len);
+    info->prefix = !!(msg->flags & SP_BROKER_GET_PAIR_F_PREFIX);
+
+    present = client_lookup(ctx, info) != NULL;
+    if (!present && msg->flags & SP_BROKER_QUERY_PEER_F_WAIT) {
+        log_info("[%02d] %s: waiting for a pair to appear, mode: %s, "
+                 "type: %s.\n", ctx->id, client_name(info),
+                 pair_mode_str(info->mode), pair_type_str(info->type));
+        info->state = CLIENT_STATE_WATCHING;
+        info->request_time = time_msec();
+        ctx->n_watchers++;
+        return 0;
+    }
+    return client_send_peer_status(ctx, info, present ? SP_BROKER_PEER_PRESENT
+                                                      : SP_BROKER_PEER_ABSENT);
+}
+
+static void
+pending_page_swap(struct client_info **page, int i, int j)
+{
+    struct client_info *tmp = page[i];
+
+    page[i] = page[j];
+    page[j] = tmp;
+}
+
+/* Page is a max-heap by 'pending_id' while clients are collected. */
+static void
+pending_page_sift_up(struct client_info **page, int i)
+{
+    while (i && page[(i - 1) / 2]->pending_id < page[i]->pending_id) {
+        pending_page_swap(page, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void
+pending_page_sift_down(struct client_info **page, int n, int i)
+{
+    for (;;) {
+        int max = i, left = 2 * i + 1, right = 2 * i + 2;
+
+        if (left < n && page[left]->pending_id > page[max]->pending_id) {
+            max = left;
+        }
+        if (right < n && page[right]->pending_id > page[max]->pending_id) {
+            max = right;
+        }
+        if (max == i) {
+            return;
+        }
+        pending_page_swap(page, i, max);
+        i = max;
+    }
+}
+
+/* Replies with the page of waiting clients that follow the 'cursor' in order
+ * of their requests.  Clients are collected with a single pass over the
+ * worker's own table, so the cost of a page doesn't depend on the number of
+ * pages and nothing is held between requests.  Clients that started waiting
+ * after the listing began are added to the end. */
+static int
+client_handle_list_pending(struct broker_ctx *ctx,
+                           struct client_info *info,
+                           struct sp_broker_msg *msg,
+                           struct client_info **clients, int n_clients)
+{
+    uint64_t cursor = msg->payload.list_pending.cursor;
+    struct sp_broker_msg *out = &info->out;
+    struct sp_broker_pending_list list;
+    int limit = BROKER_LIST_MAX_ENTRIES;
+    struct client_info **page = ctx->page;
+    int i, n = 0, n_pending = 0;
+    uint64_t now = time_msec();
+    bool more = false;
+
+    if (!client_query_allowed(ctx, info, "SP_BROKER_LIST_PENDING")) {
+        return -1;
+    }
+
+    if (msg->payload.list_pending.max_entries
+        && msg->payload.list_pending.max_entries < (uint32_t) limit) {
+        limit = msg->payload.list_pending.max_entries;
+    }
+
+    for (i = 0; i < n_clients; i++) {
+        struct client_info *client = clients[i];
+
+        if (client->state != CLIENT_STATE_PAIR_REQUESTED) {
+            continue;
+        }
+        n_pending++;
+        if (client->pending_id <= cursor) {
+            continue;
+        }
+        if (n < limit) {
+            page[n] = client;
+            pending_page_sift_up(page, n++);
+        } else {
+            more = true;
+            if (client->pending_id < page[0]->pending_id) {
+                page[0] = client;
+                pending_page_sift_down(page, n, 0);
+            }
+        }
+    }
+
+    /* Sorting the page in order of requests. */
+    for (i = n - 1; i > 0; i--) {
+        pending_page_swap(page, 0, i);
+        pending_page_sift_down(page, i, 0);
+    }
+
+    out->request = SP_BROKER_PENDING_LIST;
+    out->flags = SP_BROKER_PROTOCOL_VERSION_2;
+    out->size = sizeof list;
+    out->n_fds = 0;
+    for (i = 0; i < n; i++) {
+        struct sp_broker_pending_entry entry;
+
+        if (out->size + sizeof entry + page[i]->key_len
+            > SP_BROKER_MAX_PAYLOAD_SIZE) {
+            /* Rest goes to the next page. */
+            more = true;
+            break;
+        }
+        entry.wait_ms = now - page[i]->request_time;
+        entry.mode = page[i]->mode;
+        entry.type = page[i]->type;
+        entry.key_len = page[i]->key_len;
+        memcpy(&out->payload.data[out->size], &entry, sizeof entry);
+        out->size += sizeof entry;
+        memcpy(&out->payload.data[out->size], page[i]->key, entry.key_len);
+        out->size += entry.key_len;
+    }
+
+    list.cursor = more ? page[i - 1]->pending_id : 0;
+    list.n_entries = i;
+    list.n_pending = n_pending;
+    memcpy(&out->payload.pending_list, &list, sizeof list);
+
+    info->out_len = sp_broker_message_length(out);
+    info->out_sent = 0;
+    return client_flush(ctx, info);
+}
+
+void
+client_unpair(struct broker_ctx *ctx, struct client_info *info)
+{
+    struct client_info *peer = info->peer, *pair;
+
+    if (!peer) {
+        return;
+    }
+    info->peer = NULL;
+    peer->peer = NULL;
+
+    if (info->out_sent || peer->state != CLIENT_STATE_PAIRED
+        || peer->out_sent) {
+        /* Pairing is already committed or the peer is going away too. */
+        return;
+    }
+
+    /* Peer never saw its SET_PAIR.  Taking it back and looking for
+     * somebody else. */
+    log_info("[%02d] %s: pair %s is gone, returning to pairing.\n",
+             ctx->id, client_name(peer), client_name(info));
+    client_close_fds(&peer->out);
+    peer->out_len = 0;
+    peer->out_sent = 0;
+    client_want_write(ctx, peer, false);
+    peer->state = CLIENT_STATE_PAIR_REQUESTED;
+
+    pair = client_lookup(ctx, peer);
+    if (pair) {
+        client_create_and_send_socketpair(ctx, pair, peer);
+    } else {
+        client_wait_for_pair(ctx, peer);
+    }
+}
+
 void
-client_recv_and_handle_request(int id, struct client_info *info,
+client_recv_and_handle_request(struct broker_ctx *ctx,
+                               struct client_info *info,
                                struct client_info **clients, int n_clients)
 {
-    enum sp_broker_request supported_requests[] = { SP_BROKER_GET_PAIR, };
-    struct sp_broker_msg msg;
-    int i, result = 0;
-    char *err;
+    enum sp_broker_request supported_requests[] = {
+        SP_BROKER_GET_PAIR, SP_BROKER_LIST_PENDING, SP_BROKER_QUERY_PEER,
+    };
+    struct sp_broker_msg *msg;
+    enum profiler_phase phase;
+    int id = ctx->id;
+    int ret;
 
-    memset(&msg, 0, sizeof msg);
-    if (client_recv_msg(id, info, &msg) < 0) {
-        info->state = CLIENT_STATE_DEAD;
-        goto exit;
+    phase = profiler_enter(ctx->profiler, PROFILER_PHASE_RECV);
+    ret = client_recv_msg(ctx, info, &msg);
+    if (ret <= 0) {
+        if (ret < 0) {
+            info->state = CLIENT_STATE_DEAD;
+        }
+        profiler_enter(ctx->profiler, phase);
+        return;
     }
 
-    result = sp_broker_message_validate(&msg, supported_requests,
-                                        sizeof supported_requests, &err);
-    if (result) {
-        printf("[%02d] %s: Protocol error: %s.\n",
-               id, info->name, err ? err : "Unknown error");
-        free(err);
+    profiler_enter(ctx->profiler, PROFILER_PHASE_VALIDATE);
+    ret = sp_broker_message_validate_buf(msg, supported_requests,
+                                         sizeof supported_requests
+                                         / sizeof supported_requests[0],
+                                         ctx->err);
+    profiler_enter(ctx->profiler, PROFILER_PHASE_HANDLE);
+    if (ret) {
+        log_info("[%02d] %s: Protocol error: %s.\n", id, info->name, ctx->err);
         info->state = CLIENT_STATE_DEAD;
         goto exit;
     }
 
-    if (msg.request != SP_BROKER_GET_PAIR) {
+    switch (msg->request) {
+    case SP_BROKER_GET_PAIR:
+        ret = client_handle_get_pair(ctx, info, msg, clients, n_clients);
+        break;
+    case SP_BROKER_LIST_PENDING:
+        ret = client_handle_list_pending(ctx, info, msg, clients, n_clients);
+        break;
+    case SP_BROKER_QUERY_PEER:
+        ret = client_handle_query_peer(ctx, info, msg);
+        break;
+    default:
         /* We're not supporting any other types of requsts and validation
          * went wrong. */
         abort();
     }
-
-    if (client_handle_get_pair(id, info, &msg, clients, n_clients)) {
+    if (ret) {
         info->state = CLIENT_STATE_DEAD;
     }
 
 exit:
     /* Closing all received file descriptors if any. */
-    for (i = 0; i < msg.n_fds; i++) {
-        close(msg.fds[i]);
+    client_close_fds(msg);
+    profiler_enter(ctx->profiler, phase);
+}
+
+void
+broker_expire_pairings(struct broker_ctx *ctx, struct client_info **clients,
+                       int n_clients)
+{
+    uint64_t now = time_msec();
+    int i;
+
+    if (!ctx->pairings_deadline || now < ctx->pairings_deadline) {
+        return;
+    }
+
+    ctx->pairings_deadline = 0;
+    for (i = 0; i < n_clients; i++) {
+        struct client_info *info = clients[i];
+        uint64_t deadline = info->paired_time + PAIRED_SEND_TIMEOUT_MS;
+
+        if (info->state != CLIENT_STATE_PAIRED) {
+            continue;
+        }
+        /* Only clients that don't take their own message.  The peer that
+         * waits for them is returned to pairing by client_unpair(). */
+        if (info->want_write && now >= deadline) {
+            log_info("[%02d] %s: SET_PAIR is not taken for %"PRIu64" ms.  "
+                     "Disconnecting.\n", ctx->id, info->name,
+                     now - info->paired_time);
+            info->state = CLIENT_STATE_DEAD;
+            continue;
+        }
+        if (deadline <= now) {
+            /* Waits for its peer, which is checked on its own. */
+            deadline = now + PAIRED_SEND_TIMEOUT_MS;
+        }
+        if (!ctx->pairings_deadline || deadline < ctx->pairings_deadline) {
+            ctx->pairings_deadline = deadline;
+        }
+    }
+}
+
+int
+broker_pairings_wait(const struct broker_ctx *ctx)
+{
+    uint64_t now = time_msec();
+
+    if (!ctx->pairings_deadline) {
+        return -1;
+    }
+    return ctx->pairings_deadline > now ? ctx->pairings_deadline - now : 0;
+}
+
+void
+broker_report_classes(const struct broker_ctx *ctx)
+{
+    int i;
+
+    for (i = 0; i < SP_BROKER_PRIORITY_MAX; i++) {
+        const struct broker_class_stats *stats = &ctx->classes[i];
+
+        log_info("[%02d] Priority %s: requests: %"PRIu64", paired: %"PRIu64", "
+                 "average wait: %"PRIu64" ms, max wait: %"PRIu64" ms, "
+                 "evicted: %"PRIu64".\n", ctx->id, priority_str(i),
+                 stats->n_requests, stats->n_paired,
+                 stats->n_paired ? stats->wait_ms / stats->n_paired : 0,
+                 stats->max_wait_ms, stats->n_evicted);
     }
 }
@@ -18,15 +18,90 @@
 #define __ONE_SOCKET_BROKER_H
 
 #include <stdbool.h>
+#include <stdint.h>
 
+#include <socketpair-broker/helper.h>
+#include <socketpair-broker/proto.h>
+
+struct balancer;
+struct capture;
 struct client_info;
+struct key_index;
+struct pair_pool;
+struct profiler;
+
+/* Maximum number of entries in one SP_BROKER_PENDING_LIST reply, i.e. how
+ * many entries with the shortest key fit into the payload. */
+#define BROKER_LIST_MAX_ENTRIES                         \
+    ((SP_BROKER_MAX_PAYLOAD_SIZE                        \
+      - sizeof (struct sp_broker_pending_list))         \
+     / (sizeof (struct sp_broker_pending_entry) + 1))
+
+/* Broker-side policy for options of created sockets. */
+struct pair_sockopts_policy {
+    int sndbuf;     /* Default SO_SNDBUF.  Zero - system default. */
+    int rcvbuf;     /* Default SO_RCVBUF.  Zero - system default. */
+    int max_buf;    /* Limit for requested buffer sizes.  Zero - no limit. */
+};
+
+/* Counters of one priority class. */
+struct broker_class_stats {
+    uint64_t n_requests;    /* SP_BROKER_GET_PAIR requests. */
+    uint64_t n_paired;      /* Clients that found a pair. */
+    uint64_t wait_ms;       /* Total time from the request to a pair. */
+    uint64_t max_wait_ms;   /* Longest time from the request to a pair. */
+    uint64_t n_evicted;     /* Disconnected to make room for others. */
+};
+
+/* State of a broker shared by all clients of one worker thread.  Objects it
+ * points to are not thread-safe, every worker has its own. */
+struct broker_ctx {
+    int id;                               /* ID of the worker for logs. */
+    int poll_fd;                          /* Polling of client sockets. */
+    struct pair_pool *pool;               /* Pre-created socket pairs. */
+    struct key_index *index;              /* Waiting clients by keys. */
+    struct balancer *balancer;            /* Pairings of client instances. */
+    struct pair_sockopts_policy sockopts; /* Socket options policy. */
+    struct profiler *profiler;            /* Phases of the loop or NULL. */
+    struct capture *capture;              /* Trace of clients or NULL. */
+
+    /* Preallocated buffers, so handling of a message doesn't need to
+     * allocate or clear any memory. */
+    struct sp_broker_msg msg;             /* Message being received. */
+    char err[SP_BROKER_MAX_ERROR_LEN];    /* Validation error. */
+
+    /* Listing of waiting clients. */
+    uint64_t *pending_seq;                /* Last assigned position. */
+    struct client_info *page[BROKER_LIST_MAX_ENTRIES];  /* Current page. */
+
+    uint64_t *pair_seq;                   /* Last assigned pair ID. */
+
+    /* Descriptors that waiting clients hold for their peers.  GET_PAIR
+     * with descriptors that don't fit into 'max_held_fds' is rejected. */
+    int n_held_fds;
+    int max_held_fds;
+
+    /* Number of clients in CLIENT_STATE_WATCHING.  Could be higher than
+     * the actual number if some of them are gone.  Corrected every time
+     * watchers are checked. */
+    int n_watchers;
+
+    /* When the oldest pairing of clients in CLIENT_STATE_PAIRED expires,
+     * ms.  0 if there are none. */
+    uint64_t pairings_deadline;
+
+    /* Statistics of priority classes. */
+    struct broker_class_stats classes[SP_BROKER_PRIORITY_MAX];
+};
 
 enum client_state {
     CLIENT_STATE_NEW,             /* Client just connected. */
     CLIENT_STATE_PAIR_REQUESTED,  /* GET_RAIR request received. */
+    CLIENT_STATE_PAIRED,          /* Pair found, sending SET_PAIR. */
     CLIENT_STATE_DEAD,            /* Some error appeared on connection. */
     CLIENT_STATE_COMPLETE,        /* SET_PAIR request sent. */
     CLIENT_STATE_VICTIM,          /* Client chosen to be disconnected. */
+    CLIENT_STATE_WATCHING,        /* Waiting for a pair to appear. */
 };
 
 static inline const char *
@@ -35,9 +110,11 @@ client_state_str(enum client_state state)
     switch (state) {
         case CLIENT_STATE_NEW: return "NEW";
         case CLIENT_STATE_PAIR_REQUESTED: return "PAIR_REQUESTED";
+        case CLIENT_STATE_PAIRED: return "PAIRED";
         case CLIENT_STATE_DEAD: return "DEAD";
         case CLIENT_STATE_COMPLETE: return "COMPLETE";
         case CLIENT_STATE_VICTIM: return "VICTIM";
+        case CLIENT_STATE_WATCHING: return "WATCHING";
     };
     return "<None>";
 }
@@ -50,8 +127,9 @@ client_waits_disconnection(enum client_state state)
            state == CLIENT_STATE_VICTIM;
 }
 
-int client_accept(int id, int listen_fd, struct client_info **client);
-void client_destroy(struct client_info *);
+int client_accept(struct broker_ctx *, int listen_fd,
+                  struct client_info **client);
+void client_destroy(struct broker_ctx *, struct client_info *);
 
 enum client_state client_state(struct client_info *);
 void client_state_set(struct client_info *, enum client_state);
@@ -59,8 +137,36 @@ void client_state_set(struct client_info *, enum client_state);
 int client_fd(struct client_info *);
 const char * client_name(struct client_info *);
 
-void client_recv_and_handle_request(int id, struct client_info *,
+/* Time when the client connected or started waiting for a pair or for
+ * a peer to appear, in milliseconds of CLOCK_MONOTONIC. */
+uint64_t client_request_time(struct client_info *);
+
+/* Priority class requested by the client.  SP_BROKER_PRIORITY_NORMAL until
+ * SP_BROKER_GET_PAIR is received. */
+enum sp_broker_priority client_priority(struct client_info *);
+
+void client_recv_and_handle_request(struct broker_ctx *,
+                                    struct client_info *,
                                     struct client_info **clients,
                                     int n_clients);
+void client_send_pending(struct broker_ctx *, struct client_info *);
+
+/* Breaks the link between the client that is going to be disconnected and
+ * its pair.  If the pair didn't receive SP_BROKER_SET_PAIR yet, it goes back
+ * to pairing and could be matched with another client right away. */
+void client_unpair(struct broker_ctx *, struct client_info *);
+
+/* Disconnects clients in CLIENT_STATE_PAIRED that don't take their
+ * SP_BROKER_SET_PAIR for too long, if it's time to check them.  Their
+ * peers are returned to pairing once they are cleaned up. */
+void broker_expire_pairings(struct broker_ctx *, struct client_info **clients,
+                            int n_clients);
+
+/* Returns how long, in milliseconds, broker_expire_pairings() could wait,
+ * negative if there is nothing to expire. */
+int broker_pairings_wait(const struct broker_ctx *);
+
+/* Prints counters of priority classes. */
+void broker_report_classes(const struct broker_ctx *);
 
 #endif
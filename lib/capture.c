@@ -0,0 +1,227 @@
+/*
+ * Copyright (c) 2021 Ilya Maximets <i.maximets@ovn.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <config.h>
+
+#include "capture.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "timeval.h"
+
+/* Records are written in batches of this size, or once the oldest of them
+ * waits for CAPTURE_FLUSH_MS, so the trace is not far behind if the broker
+ * is killed. */
+#define CAPTURE_BATCH       2048
+#define CAPTURE_FLUSH_MS    1000
+
+struct capture {
+    int id;                         /* ID of the worker. */
+    int fd;                         /* Not owned. */
+    bool failed;                    /* Write failed, not capturing. */
+    uint64_t first_ms;              /* When the oldest record was added. */
+    int n_records;
+    struct capture_record records[CAPTURE_BATCH];
+
+    /* Statistics. */
+    uint64_t n_written;
+    uint64_t n_lost;                /* Records not written due to errors. */
+};
+
+int
+capture_open(const char *path)
+{
+    struct capture_header header;
+    int fd;
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+              0600);
+    if (fd < 0) {
+        return -1;
+    }
+
+    memset(&header, 0, sizeof header);
+    memcpy(header.magic, CAPTURE_MAGIC, sizeof header.magic);
+    header.version = CAPTURE_VERSION;
+    header.record_size = sizeof (struct capture_record);
+    if (write(fd, &header, sizeof header) != sizeof header) {
+        int save_errno = errno ? errno : EIO;
+
+        close(fd);
+        errno = save_errno;
+        return -1;
+    }
+    return fd;
+}
+
+struct capture *
+capture_create(int id, int fd)
+{
+    struct capture *capture = calloc(1, sizeof *capture);
+
+    if (!capture) {
+        log_error("[%02d] Failed to allocate memory for a capture: "
+                  "%s\n", id, strerror(errno));
+        abort();
+    }
+    capture->id = id;
+    capture->fd = fd;
+    return capture;
+}
+
+void
+capture_destroy(struct capture *capture)
+{
+    if (!capture) {
+        return;
+    }
+    capture_flush(capture);
+    log_info("[%02d] Capture: %"PRIu64" records written, %"PRIu64" lost.\n",
+             capture->id, capture->n_written, capture->n_lost);
+    free(capture);
+}
+
+/* 64-bit FNV-1a. */
+static uint64_t
+capture_hash(const uint8_t *key, int key_len)
+{
+    uint64_t hash = UINT64_C(14695981039346656037);
+    int i;
+
+    for (i = 0; i < key_len; i++) {
+        hash ^= key[i];
+        hash *= UINT64_C(1099511628211);
+    }
+    return hash;
+}
+
+void
+capture_event(struct capture *capture, enum capture_event event,
+              uint32_t client, const uint8_t *key, int key_len, uint8_t arg)
+{
+    struct capture_record *record;
+
+    if (!capture) {
+        return;
+    }
+    if (capture->failed) {
+        capture->n_lost++;
+        return;
+    }
+    if (capture->n_records == CAPTURE_BATCH) {
+        capture_flush(capture);
+    }
+
+    record = &capture->records[capture->n_records++];
+    record->time_us = time_usec();
+    record->key_hash = key ? capture_hash(key, key_len) : 0;
+    record->client = client;
+    record->worker = capture->id;
+    record->event = event;
+    record->arg = arg;
+    if (capture->n_records == 1) {
+        capture->first_ms = record->time_us / 1000;
+    }
+}
+
+void
+capture_run(struct capture *capture)
+{
+    if (!capture_wait(capture)) {
+        capture_flush(capture);
+    }
+}
+
+int
+capture_wait(const struct capture *capture)
+{
+    uint64_t waited;
+
+    if (!capture || !capture->n_records) {
+        return -1;
+    }
+    waited = time_msec() - capture->first_ms;
+    return waited >= CAPTURE_FLUSH_MS ? 0 : CAPTURE_FLUSH_MS - waited;
+}
+
+/* Cuts the partial record left by a short write, so the rest of the file
+ * could still be read. */
+static void
+capture_truncate(struct capture *capture)
+{
+    size_t record_size = sizeof *capture->records;
+    struct stat st;
+    off_t size;
+
+    if (fstat(capture->fd, &st)
+        || st.st_size < (off_t) sizeof (struct capture_header)) {
+        return;
+    }
+    size = st.st_size - sizeof (struct capture_header);
+    if (size % record_size
+        && ftruncate(capture->fd, st.st_size - size % record_size)) {
+        log_error("[%02d] Failed to truncate the capture: %s.\n",
+                  capture->id, strerror(errno));
+    }
+}
+
+void
+capture_flush(struct capture *capture)
+{
+    size_t size;
+    ssize_t ret;
+
+    if (!capture || !capture->n_records) {
+        return;
+    }
+
+    /* Single write() of whole records, so batches of different workers
+     * are not mixed in the O_APPEND file. */
+    size = capture->n_records * sizeof *capture->records;
+    do {
+        ret = write(capture->fd, capture->records, size);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret != (ssize_t) size) {
+        int n_written = ret > 0 ? ret / sizeof *capture->records : 0;
+
+        /* Disk is likely full, so other records would be cut as well.
+         * Stopping with the file ending at a record boundary. */
+        log_error("[%02d] Failed to write %d capture records: %s.  "
+                  "Stopping the capture.\n", capture->id,
+                  capture->n_records - n_written,
+                  ret < 0 ? strerror(errno) : "short write");
+        if (ret > 0) {
+            capture_truncate(capture);
+        }
+        capture->n_written += n_written;
+        capture->n_lost += capture->n_records - n_written;
+        capture->failed = true;
+    } else {
+        capture->n_written += capture->n_records;
+    }
+    capture->n_records = 0;
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2021 Ilya Maximets <i.maximets@ovn.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __ONE_SOCKET_CAPTURE_H
+#define __ONE_SOCKET_CAPTURE_H
+
+#include <stdint.h>
+
+/* Compact binary trace of client arrivals, requests and departures, e.g.
+ * to replay real arrival patterns against a test broker later.  Keys are
+ * stored as hashes, so the trace doesn't expose them.
+ *
+ * File starts with 'struct capture_header' followed by records of all the
+ * workers.  Every worker appends its records in batches, so records are
+ * ordered by time only within a worker.  All values are in the byte order
+ * of the host that recorded the trace. */
+#define CAPTURE_MAGIC       "1SOCKCAP"
+#define CAPTURE_VERSION     1
+
+struct capture_header {
+    char magic[8];                  /* CAPTURE_MAGIC. */
+    uint32_t version;               /* CAPTURE_VERSION. */
+    uint32_t record_size;           /* sizeof (struct capture_record). */
+} __attribute__((__packed__));
+
+enum capture_event {
+    CAPTURE_CONNECT = 1,            /* Client accepted. */
+    CAPTURE_GET_PAIR,               /* SP_BROKER_GET_PAIR received. */
+    CAPTURE_DISCONNECT,             /* Client disconnected. */
+};
+
+/* Set in 'arg' of CAPTURE_GET_PAIR if the key is a prefix. */
+#define CAPTURE_F_PREFIX    0x80
+
+struct capture_record {
+    uint64_t time_us;               /* Monotonic time of the event. */
+    uint64_t key_hash;              /* Hash of the key for CAPTURE_GET_PAIR. */
+    uint32_t client;                /* Number of the client in its worker. */
+    uint16_t worker;                /* ID of the worker. */
+    uint8_t event;                  /* enum capture_event. */
+    uint8_t arg;                    /* Mode with CAPTURE_F_PREFIX for
+                                     * CAPTURE_GET_PAIR, enum client_state
+                                     * for CAPTURE_DISCONNECT. */
+} __attribute__((__packed__));
+
+/* Creates the file 'path' and writes the header.  Returns the descriptor
+ * to pass to capture_create() of every worker, or -1 and sets errno. */
+int capture_open(const char *path);
+
+/* Buffer of records of one worker.  Not thread-safe. */
+struct capture;
+
+struct capture *capture_create(int id, int fd);
+void capture_destroy(struct capture *);
+
+void capture_event(struct capture *, enum capture_event, uint32_t client,
+                   const uint8_t *key, int key_len, uint8_t arg);
+
+/* Writes out buffered records if they are waiting long enough. */
+void capture_run(struct capture *);
+
+/* Returns how long, in milliseconds, buffered records could wait before
+ * capture_run() should be called, negative if there are none. */
+int capture_wait(const struct capture *);
+
+void capture_flush(struct capture *);
+
+#endif
@@ -0,0 +1,229 @@
+/*
+ * Copyright (c) 2021 Ilya Maximets <i.maximets@ovn.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <config.h>
+
+#include "daemon.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* First file descriptor passed by systemd. */
+#define SD_LISTEN_FDS_START 3
+
+/* Write end of the pipe to the parent process.  -1 if not detached. */
+static int daemon_ready_fd = -1;
+
+int
+daemon_start(void)
+{
+    int fds[2];
+    char status;
+    pid_t pid;
+    int ret;
+
+    if (pipe(fds)) {
+        return -1;
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+
+    if (pid > 0) {
+        /* Parent.  Waiting for the child to become ready. */
+        close(fds[1]);
+        do {
+            ret = read(fds[0], &status, 1);
+        } while (ret < 0 && errno == EINTR);
+        if (ret != 1 || status != 'R') {
+            /* Pipe closed without a status.  Child is dead. */
+            waitpid(pid, NULL, 0);
+            exit(EXIT_FAILURE);
+        }
+        exit(EXIT_SUCCESS);
+    }
+
+    /* Child. */
+    close(fds[0]);
+    daemon_ready_fd = fds[1];
+    if (setsid() < 0) {
+        return -1;
+    }
+    if (chdir("/")) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Sends 'state' to systemd if the service is started with Type=notify. */
+static void
+daemon_notify_systemd(const char *state)
+{
+    const char *path = getenv("NOTIFY_SOCKET");
+    struct sockaddr_un un;
+    socklen_t len;
+    int fd;
+
+    if (!path || (path[0] != '/' && path[0] != '@')
+        || strlen(path) >= sizeof un.sun_path) {
+        return;
+    }
+
+    fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return;
+    }
+
+    memset(&un, 0, sizeof un);
+    un.sun_family = AF_UNIX;
+    memcpy(un.sun_path, path, strlen(path));
+    if (path[0] == '@') {
+        /* Abstract namespace. */
+        un.sun_path[0] = '\0';
+    }
+    len = offsetof(struct sockaddr_un, sun_path) + strlen(path);
+
+    if (sendto(fd, state, strlen(state), MSG_NOSIGNAL,
+               (struct sockaddr *) &un, len) < 0) {
+        fprintf(stderr, "Failed to notify systemd: %s.\n", strerror(errno));
+    }
+    close(fd);
+}
+
+void
+daemon_complete(const char *log_file)
+{
+    char status = 'R';
+    int fd;
+
+    daemon_notify_systemd("READY=1");
+
+    if (daemon_ready_fd < 0) {
+        return;
+    }
+
+    fd = open(log_file ? log_file : "/dev/null",
+              O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0640);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open log file '%s': %s.\n",
+                log_file, strerror(errno));
+        fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    }
+    fflush(stdout);
+    fflush(stderr);
+    if (fd >= 0) {
+        dup2(fd, STDOUT_FILENO);
+        dup2(fd, STDERR_FILENO);
+        close(fd);
+    }
+    /* Log file is not a terminal, keeping log lines intact. */
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        dup2(fd, STDIN_FILENO);
+        close(fd);
+    }
+
+    if (write(daemon_ready_fd, &status, 1) != 1) {
+        /* Parent is gone.  Nothing to do. */
+    }
+    close(daemon_ready_fd);
+    daemon_ready_fd = -1;
+}
+
+int
+daemon_write_pid_file(const char *pid_file)
+{
+    FILE *file = fopen(pid_file, "w");
+
+    if (!file) {
+        return -1;
+    }
+    fprintf(file, "%ld\n", (long) getpid());
+    if (fclose(file)) {
+        return -1;
+    }
+    return 0;
+}
+
+int
+daemon_get_listen_fds(int *fds, int max)
+{
+    const char *listen_pid = getenv("LISTEN_PID");
+    const char *listen_fds = getenv("LISTEN_FDS");
+    int i, n, n_fds = 0;
+    char *end;
+    long val;
+
+    if (!listen_pid || !listen_fds) {
+        return 0;
+    }
+
+    val = strtol(listen_pid, &end, 10);
+    if (*end || val != (long) getpid()) {
+        /* Sockets are for some other process. */
+        return 0;
+    }
+    n = strtol(listen_fds, &end, 10);
+    if (*end || n <= 0) {
+        return 0;
+    }
+
+    for (i = 0; i < n; i++) {
+        int fd = SD_LISTEN_FDS_START + i;
+        int accepting = 0;
+        socklen_t len = sizeof accepting;
+
+        if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &accepting, &len)
+            || !accepting) {
+            fprintf(stderr, "Inherited file descriptor %d is not a listening "
+                    "socket.  Ignoring.\n", fd);
+            continue;
+        }
+        if (n_fds >= max) {
+            /* Nobody would serve clients connected to it. */
+            fprintf(stderr, "Too many inherited sockets.  "
+                    "Closing file descriptor %d.\n", fd);
+            close(fd);
+            continue;
+        }
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        fds[n_fds++] = fd;
+    }
+
+    /* Not passing sockets to child processes, if any. */
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_FDNAMES");
+    return n_fds;
+}
@@ -0,0 +1,43 @@
+/*
+ * Copyright (c) 2021 Ilya Maximets <i.maximets@ovn.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __ONE_SOCKET_DAEMON_H
+#define __ONE_SOCKET_DAEMON_H
+
+/* Detaches the process from the terminal.  Should be called before starting
+ * any threads.  Parent process doesn't return from this function: it waits
+ * for the child to call daemon_complete() and exits with success, or exits
+ * with failure if the child died before that.  Returns 0 in the child.
+ * On failure returns -1 and sets errno. */
+int daemon_start(void);
+
+/* Tells the parent process and systemd (if NOTIFY_SOCKET is set) that the
+ * daemon is ready to serve clients.  If the process was detached by
+ * daemon_start(), also redirects standard output and error streams to the
+ * file 'log_file' or to /dev/null if 'log_file' is NULL. */
+void daemon_complete(const char *log_file);
+
+/* Writes PID of the current process to 'pid_file'.
+ * Returns 0 on success.  On failure returns -1 and sets errno. */
+int daemon_write_pid_file(const char *pid_file);
+
+/* Stores up to 'max' listening sockets passed by systemd socket activation
+ * (LISTEN_FDS/LISTEN_PID) in 'fds'.  Listening sockets beyond 'max' are
+ * closed.  Returns the number of stored sockets, zero if there are none for
+ * this process. */
+int daemon_get_listen_fds(int *fds, int max);
+
+#endif
@@ -0,0 +1,508 @@
+/*
+ * Copyright (c) 2021 Ilya Maximets <i.maximets@ovn.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <config.h>
+
+#include "key-index.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+
+struct key_index_list {
+    struct key_index_entry *head;
+    struct key_index_entry *tail;
+    int n_ranked;                       /* Entries with 'ranked' set. */
+};
+
+/* Node of a radix tree.  Key of the node is a concatenation of labels of
+ * all the nodes on the path from the root. */
+struct key_index_node {
+    struct key_index_node *parent;
+    uint8_t *label;                     /* Part of the key from the parent. */
+    int label_len;
+
+    struct key_index_node **children;   /* Sorted by the first label byte. */
+    int n_children;
+    int allocated;
+
+    struct key_index_list exact;        /* Entries with the node's key. */
+    struct key_index_list prefix;       /* Same, but added as prefixes. */
+    int n_exact[KEY_INDEX_MAX_KINDS];   /* Exact entries in the subtree. */
+};
+
+struct key_index {
+    struct key_index_node root;
+    uint64_t seq;                       /* Last 'seq' of an entry. */
+};
+
+/* Same as realloc(), but the new memory is zeroed if 'ptr' is NULL.
+ * Aborts on failure. */
+static void *
+key_index_xrealloc(void *ptr, size_t size)
+{
+    void *p = ptr ? realloc(ptr, size) : calloc(1, size);
+
+    if (!p) {
+        log_error("Failed to allocate memory for a key index: %s\n",
+                  strerror(errno));
+        abort();
+    }
+    return p;
+}
+
+struct key_index *
+key_index_create(void)
+{
+    return key_index_xrealloc(NULL, sizeof (struct key_index));
+}
+
+static void
+key_index_list_detach(struct key_index_list *list)
+{
+    struct key_index_entry *entry;
+
+    for (entry = list->head; entry; entry = entry->next) {
+        entry->node = NULL;
+    }
+}
+
+static void
+key_index_node_free(struct key_index_node *node, bool self)
+{
+    int i;
+
+    for (i = 0; i < node->n_children; i++) {
+        key_index_node_free(node->children[i], true);
+    }
+    key_index_list_detach(&node->exact);
+    key_index_list_detach(&node->prefix);
+    free(node->children);
+    free(node->label);
+    if (self) {
+        free(node);
+    }
+}
+
+void
+key_index_destroy(struct key_index *index)
+{
+    if (!index) {
+        return;
+    }
+    key_index_node_free(&index->root, false);
+    free(index);
+}
+
+/* Returns the position of a child that starts with 'byte' or the position
+ * where it should be inserted. */
+static int
+key_index_child_pos(const struct key_index_node *node, uint8_t byte,
+                    bool *found)
+{
+    int low = 0, high = node->n_children;
+
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        uint8_t first = node->children[mid]->label[0];
+
+        if (first == byte) {
+            *found = true;
+            return mid;
+        }
+        if (first < byte) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    *found = false;
+    return low;
+}
+
+static struct key_index_node *
+key_index_child(const struct key_index_node *node, uint8_t byte)
+{
+    bool found;
+    int pos = key_index_child_pos(node, byte, &found);
+
+    return found ? node->children[pos] : NULL;
+}
+
+static void
+key_index_child_add(struct key_index_node *node,
+                    struct key_index_node *child)
+{
+    bool found;
+    int pos = key_index_child_pos(node, child->label[0], &found);
+
+    if (node->n_children == node->allocated) {
+        node->allocated = node->allocated ? node->allocated * 2 : 2;
+        node->children = key_index_xrealloc(node->children,
+                                            node->allocated
+                                            * sizeof *node->children);
+    }
+    memmove(&node->children[pos + 1], &node->children[pos],
+            (node->n_children - pos) * sizeof *node->children);
+    node->children[pos] = child;
+    node->n_children++;
+    child->parent = node;
+}
+
+static void
+key_index_child_remove(struct key_index_node *node,
+                       struct key_index_node *child)
+{
+    bool found;
+    int pos = key_index_child_pos(node, child->label[0], &found);
+
+    node->n_children--;
+    memmove(&node->children[pos], &node->children[pos + 1],
+            (node->n_children - pos) * sizeof *node->children);
+    if (!node->n_children) {
+        free(node->children);
+        node->children = NULL;
+        node->allocated = 0;
+    }
+}
+
+static struct key_index_node *
+key_index_node_create(const uint8_t *label, int label_len)
+{
+    struct key_index_node *node;
+
+    node = key_index_xrealloc(NULL, sizeof *node);
+    node->label = key_index_xrealloc(NULL, label_len);
+    memcpy(node->label, label, label_len);
+    node->label_len = label_len;
+    return node;
+}
+
+/* Splits the 'child' after 'len' bytes of its label.  Returns the new node
+ * that takes the place of the 'child' and holds the first part of the
+ * label. */
+static struct key_index_node *
+key_index_node_split(struct key_index_node *child, int len)
+{
+    struct key_index_node *parent = child->parent;
+    struct key_index_node *mid;
+    bool found;
+    int pos;
+
+    mid = key_index_node_create(child->label, len);
+    memcpy(mid->n_exact, child->n_exact, sizeof mid->n_exact);
+
+    pos = key_index_child_pos(parent, child->label[0], &found);
+    parent->children[pos] = mid;
+    mid->parent = parent;
+
+    child->label_len -= len;
+    memmove(child->label, child->label + len, child->label_len);
+    key_index_child_add(mid, child);
+    return mid;
+}
+
+static int
+common_prefix_len(const uint8_t *a, int a_len, const uint8_t *b, int b_len)
+{
+    int i, len = a_len < b_len ? a_len : b_len;
+
+    for (i = 0; i < len && a[i] == b[i]; i++) {
+        continue;
+    }
+    return i;
+}
+
+static void
+key_index_list_append(struct key_index_list *list,
+                      struct key_index_entry *entry)
+{
+    entry->prev = list->tail;
+    entry->next = NULL;
+    list->n_ranked += entry->ranked;
+    if (list->tail) {
+        list->tail->next = entry;
+    } else {
+        list->head = entry;
+    }
+    list->tail = entry;
+}
+
+static void
+key_index_list_remove(struct key_index_list *list,
+                      struct key_index_entry *entry)
+{
+    if (entry->prev) {
+        entry->prev->next = entry->next;
+    } else {
+        list->head = entry->next;
+    }
+    if (entry->next) {
+        entry->next->prev = entry->prev;
+    } else {
+        list->tail = entry->prev;
+    }
+    entry->prev = entry->next = NULL;
+    list->n_ranked -= entry->ranked;
+}
+
+void
+key_index_insert(struct key_index *index, struct key_index_entry *entry,
+                 const uint8_t *key, int key_len, bool prefix, int kind,
+                 bool ranked)
+{
+    struct key_index_node *node = &index->root;
+    int pos = 0;
+
+    key_index_remove(entry);
+
+    while (pos < key_len) {
+        struct key_index_node *child = key_index_child(node, key[pos]);
+        int len;
+
+        if (!child) {
+            child = key_index_node_create(&key[pos], key_len - pos);
+            key_index_child_add(node, child);
+            node = child;
+            break;
+        }
+
+        len = common_prefix_len(child->label, child->label_len,
+                                &key[pos], key_len - pos);
+        if (len < child->label_len) {
+            child = key_index_node_split(child, len);
+        }
+        node = child;
+        pos += len;
+    }
+
+    entry->node = node;
+    entry->prefix = prefix;
+    entry->ranked = ranked;
+    entry->kind = kind;
+    entry->seq = ++index->seq;
+    if (prefix) {
+        key_index_list_append(&node->prefix, entry);
+        return;
+    }
+    key_index_list_append(&node->exact, entry);
+    for (; node; node = node->parent) {
+        node->n_exact[kind]++;
+    }
+}
+
+static bool
+key_index_node_unused(const struct key_index_node *node)
+{
+    return !node->exact.head && !node->prefix.head;
+}
+
+/* Removes nodes that are not needed anymore starting from 'node' and
+ * merges nodes with a single child, so the tree stays compressed. */
+static void
+key_index_node_compact(struct key_index_node *node)
+{
+    while (node->parent && key_index_node_unused(node)) {
+        struct key_index_node *parent = node->parent;
+
+        if (!node->n_children) {
+            key_index_child_remove(parent, node);
+            key_index_node_free(node, true);
+            node = parent;
+            continue;
+        }
+
+        if (node->n_children == 1) {
+            struct key_index_node *child = node->children[0];
+            bool found;
+            int pos;
+
+            child->label = key_index_xrealloc(child->label,
+                                              node->label_len
+                                              + child->label_len);
+            memmove(child->label + node->label_len, child->label,
+                    child->label_len);
+            memcpy(child->label, node->label, node->label_len);
+            child->label_len += node->label_len;
+
+            pos = key_index_child_pos(parent, node->label[0], &found);
+            parent->children[pos] = child;
+            child->parent = parent;
+
+            node->n_children = 0;
+            key_index_node_free(node, true);
+        }
+        break;
+    }
+}
+
+void
+key_index_remove(struct key_index_entry *entry)
+{
+    struct key_index_node *node = entry->node;
+
+    if (!node) {
+        return;
+    }
+
+    if (entry->prefix) {
+        key_index_list_remove(&node->prefix, entry);
+    } else {
+        struct key_index_node *n;
+
+        key_index_list_remove(&node->exact, entry);
+        for (n = node; n; n = n->parent) {
+            n->n_exact[entry->kind]--;
+        }
+    }
+    entry->node = NULL;
+    key_index_node_compact(node);
+}
+
+static struct key_index_entry *
+key_index_list_find(const struct key_index_list *list, int kind,
+                    key_index_match_cb match, key_index_better_cb better,
+                    void *aux)
+{
+    struct key_index_entry *entry, *best = NULL;
+
+    /* Order of insertion decides between unranked entries. */
+    if (!list->n_ranked) {
+        better = NULL;
+    }
+    for (entry = list->head; entry; entry = entry->next) {
+        if (entry->kind != kind || !match(entry, aux)) {
+            continue;
+        }
+        if (!better) {
+            return entry;
+        }
+        if (!best || better(entry, best, aux)) {
+            best = entry;
+        }
+    }
+    return best;
+}
+
+struct key_index_entry *
+key_index_find(const struct key_index *index,
+               const uint8_t *key, int key_len, int kind,
+               key_index_match_cb match, key_index_better_cb better,
+               void *aux)
+{
+    const struct key_index_node *node = &index->root;
+    struct key_index_entry *found, *longest = NULL;
+    int pos = 0;
+
+    for (;;) {
+        found = key_index_list_find(&node->prefix, kind, match, better, aux);
+        if (found) {
+            longest = found;
+        }
+        if (pos == key_len) {
+            found = node->n_exact[kind]
+                    ? key_index_list_find(&node->exact, kind, match, better,
+                                          aux)
+                    : NULL;
+            return found ? found : longest;
+        }
+
+        node = key_index_child(node, key[pos]);
+        if (!node || node->label_len > key_len - pos
+            || memcmp(node->label, &key[pos], node->label_len)) {
+            return longest;
+        }
+        pos += node->label_len;
+    }
+}
+
+/* Returns 'true' if entry 'a' should be chosen over entry 'b' that could be
+ * NULL. */
+static bool
+key_index_prefer(const struct key_index_entry *a,
+                 const struct key_index_entry *b,
+                 key_index_better_cb better, void *aux)
+{
+    if (!b) {
+        return true;
+    }
+    if (better) {
+        if (better(a, b, aux)) {
+            return true;
+        }
+        if (better(b, a, aux)) {
+            return false;
+        }
+    }
+    return a->seq < b->seq;
+}
+
+/* Updates '*best' with the best entry of 'kind' in the subtree of 'node'.
+ * Only subtrees that have entries of 'kind' are visited. */
+static void
+key_index_subtree_find(const struct key_index_node *node, int kind,
+                       key_index_match_cb match, key_index_better_cb better,
+                       void *aux, struct key_index_entry **best)
+{
+    struct key_index_entry *found;
+    int i;
+
+    if (!node->n_exact[kind]) {
+        return;
+    }
+    found = key_index_list_find(&node->exact, kind, match, better, aux);
+    if (found && key_index_prefer(found, *best, better, aux)) {
+        *best = found;
+    }
+    for (i = 0; i < node->n_children; i++) {
+        key_index_subtree_find(node->children[i], kind, match, better, aux,
+                               best);
+    }
+}
+
+struct key_index_entry *
+key_index_find_prefixed(const struct key_index *index,
+                        const uint8_t *prefix, int prefix_len, int kind,
+                        key_index_match_cb match, key_index_better_cb better,
+                        void *aux)
+{
+    const struct key_index_node *node = &index->root;
+    struct key_index_entry *best = NULL;
+    int pos = 0;
+
+    while (pos < prefix_len) {
+        int len;
+
+        node = key_index_child(node, prefix[pos]);
+        if (!node) {
+            return NULL;
+        }
+        len = common_prefix_len(node->label, node->label_len,
+                                &prefix[pos], prefix_len - pos);
+        if (len < node->label_len && pos + len < prefix_len) {
+            /* Diverged in the middle of the label. */
+            return NULL;
+        }
+        pos += len;
+    }
+    key_index_subtree_find(node, kind, match, better, aux, &best);
+    return best;
+}
@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2021 Ilya Maximets <i.maximets@ovn.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __ONE_SOCKET_KEY_INDEX_H
+#define __ONE_SOCKET_KEY_INDEX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Index of waiting clients by their keys.  Radix tree, so the cost of
+ * a lookup depends on the length of a key and not on the number of waiting
+ * clients, and entries with keys that start with a given prefix could be
+ * found without a full scan.
+ *
+ * Every entry has a kind, a number below KEY_INDEX_MAX_KINDS, and lookups
+ * are for entries of one kind.  Nodes count entries of every kind in their
+ * subtrees, so subtrees without entries of the kind are skipped. */
+#define KEY_INDEX_MAX_KINDS 16
+
+struct key_index;
+struct key_index_node;
+
+/* Entry of the index.  Supposed to be embedded into the indexed object.
+ * Fields are private to the index. */
+struct key_index_entry {
+    struct key_index_node *node;    /* NULL if not in the index. */
+    struct key_index_entry *prev;   /* Entries of the same node in order */
+    struct key_index_entry *next;   /* of insertion. */
+    bool prefix;                    /* Matches keys that start with it. */
+    bool ranked;                    /* Compared with others by 'better'. */
+    int kind;
+    uint64_t seq;                   /* Order of insertion into the index. */
+};
+
+#define KEY_INDEX_ENTRY_TO(ENTRY, TYPE, MEMBER) \
+    ((TYPE *) ((char *) (ENTRY) - offsetof(TYPE, MEMBER)))
+
+/* Returns 'true' if 'entry' is the one the caller is looking for. */
+typedef bool (*key_index_match_cb)(const struct key_index_entry *entry,
+                                   void *aux);
+
+/* Returns 'true' if entry 'a' should be chosen over entry 'b'. */
+typedef bool (*key_index_better_cb)(const struct key_index_entry *a,
+                                    const struct key_index_entry *b,
+                                    void *aux);
+
+struct key_index *key_index_create(void);
+void key_index_destroy(struct key_index *);
+
+/* Adds 'entry' of 'kind' with the key 'key' of 'key_len' bytes.  If
+ * 'prefix' is 'true', the entry will be found by keys that start with
+ * 'key'.  Entries that are not 'ranked' are all equally good for 'better'
+ * callbacks of lookups, so entries of a key are not compared with each
+ * other until one of them is ranked. */
+void key_index_insert(struct key_index *, struct key_index_entry *entry,
+                      const uint8_t *key, int key_len, bool prefix,
+                      int kind, bool ranked);
+
+/* Removes 'entry' from the index it belongs to, if any. */
+void key_index_remove(struct key_index_entry *entry);
+
+static inline bool
+key_index_contains(const struct key_index_entry *entry)
+{
+    return entry->node != NULL;
+}
+
+/* Looks for an entry of 'kind' accepted by 'match' that was added with
+ * exactly the same 'key' or as a prefix of 'key'.  Exact entries are
+ * preferred over prefixes and longer prefixes over shorter ones.  Among
+ * entries of the same key the first one in order of insertion is returned,
+ * or, if 'better' is not NULL and some of them are ranked, all of them are
+ * checked and the best one is returned. */
+struct key_index_entry *key_index_find(const struct key_index *,
+                                       const uint8_t *key, int key_len,
+                                       int kind, key_index_match_cb match,
+                                       key_index_better_cb better,
+                                       void *aux);
+
+/* Looks for an entry of 'kind' accepted by 'match' that was added not as
+ * a prefix and with a key that starts with 'prefix'.  All such keys are
+ * candidates: the best entry according to 'better' is returned, the one
+ * inserted first among equally good ones, so waiting entries of different
+ * keys are taken in turns and not the smallest key first. */
+struct key_index_entry *key_index_find_prefixed(const struct key_index *,
+                                                const uint8_t *prefix,
+                                                int prefix_len, int kind,
+                                                key_index_match_cb match,
+                                                key_index_better_cb better,
+                                                void *aux);
+
+#endif
@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2021 Ilya Maximets <i.maximets@ovn.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <config.h>
+
+#include "log.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Longer messages are truncated before passing to a handler. */
+#define LOG_MAX_LEN     1024
+
+static __thread const struct log_sink *thread_sink;
+
+const struct log_sink *
+log_set_thread_sink(const struct log_sink *sink)
+{
+    const struct log_sink *prev = thread_sink;
+
+    thread_sink = sink;
+    return prev;
+}
+
+void
+log_msg(enum log_level level, const char *format, ...)
+{
+    const struct log_sink *sink = thread_sink;
+    char msg[LOG_MAX_LEN];
+    va_list args;
+    size_t len;
+
+    if (sink && level > sink->max_level) {
+        return;
+    }
+
+    va_start(args, format);
+    if (!sink || !sink->handler) {
+        vfprintf(level == LOG_LEVEL_ERROR ? stderr : stdout, format, args);
+        va_end(args);
+        return;
+    }
+    vsnprintf(msg, sizeof msg, format, args);
+    va_end(args);
+
+    len = strlen(msg);
+    if (len && msg[len - 1] == '\n') {
+        msg[len - 1] = '\0';
+    }
+    sink->handler(level, msg, sink->aux);
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2021 Ilya Maximets <i.maximets@ovn.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __ONE_SOCKET_LOG_H
+#define __ONE_SOCKET_LOG_H
+
+/* Messages of the broker.  By default informational messages are printed
+ * to stdout and errors to stderr.  A thread could redirect messages logged
+ * by it to a handler, e.g. the embedded broker passes them to the
+ * application. */
+
+enum log_level {
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_INFO,
+};
+
+struct log_sink {
+    /* Receives one message at a time without the trailing new line.
+     * NULL - print it. */
+    void (*handler)(enum log_level, const char *msg, void *aux);
+    void *aux;
+    enum log_level max_level;   /* More verbose messages are dropped. */
+};
+
+/* Sets the sink for messages of the current thread.  NULL - print all the
+ * messages.  Returns the previous sink. */
+const struct log_sink *log_set_thread_sink(const struct log_sink *);
+
+void log_msg(enum log_level, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+#define log_error(...)  log_msg(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define log_info(...)   log_msg(LOG_LEVEL_INFO, __VA_ARGS__)
+
+#endif
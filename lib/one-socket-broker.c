@@ -0,0 +1,189 @@
+/*
+ * Copyright (c) 2021 Ilya Maximets <i.maximets@ovn.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <config.h>
+
+#include <one-socket/broker.h>
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "balancer.h"
+#include "log.h"
+#include "socket-util.h"
+#include "worker.h"
+
+_Static_assert((int) ONE_SOCKET_LOG_ERROR == (int) LOG_LEVEL_ERROR
+               && (int) ONE_SOCKET_LOG_INFO == (int) LOG_LEVEL_INFO,
+               "Log levels of the embedded broker don't match.");
+
+struct one_socket_broker {
+    int id;                         /* ID for logs, unique among workers. */
+    struct worker_config config;
+    struct worker_loop *loop;       /* NULL if the restart failed. */
+    uint64_t pair_seq;              /* Last assigned pair ID. */
+    uint64_t pending_seq;           /* Last assigned listing position. */
+
+    /* Messages logged inside functions of the broker go here. */
+    struct log_sink log;
+    void (*log_handler)(enum one_socket_log_level, const char *msg,
+                        void *aux);
+    void *log_aux;
+};
+
+void
+one_socket_broker_config_init(struct one_socket_broker_config *config)
+{
+    memset(config, 0, sizeof *config);
+    config->balance = balance_policy_str(BALANCE_ROUND_ROBIN);
+    config->log_level = ONE_SOCKET_LOG_INFO;
+}
+
+static void
+one_socket_broker_log(enum log_level level, const char *msg, void *aux)
+{
+    struct one_socket_broker *broker = aux;
+
+    broker->log_handler((enum one_socket_log_level) level, msg,
+                        broker->log_aux);
+}
+
+struct one_socket_broker *
+one_socket_broker_create(int listen_fd,
+                         const struct one_socket_broker_config *config_)
+{
+    struct one_socket_broker_config config;
+    struct one_socket_broker *broker;
+    const struct log_sink *prev_sink;
+    enum balance_policy balance;
+
+    if (config_) {
+        config = *config_;
+    } else {
+        one_socket_broker_config_init(&config);
+    }
+
+    if (listen_fd < 0 || config.pair_pool_size < 0
+        || config.sndbuf < 0 || config.rcvbuf < 0 || config.max_buf < 0
+        || (unsigned int) config.log_level > ONE_SOCKET_LOG_INFO) {
+        errno = EINVAL;
+        return NULL;
+    }
+    balance = BALANCE_ROUND_ROBIN;
+    if (config.balance && balance_policy_from_str(config.balance, &balance)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (socket_set_nonblock(listen_fd, "listening socket")) {
+        return NULL;
+    }
+
+    broker = calloc(1, sizeof *broker);
+    if (!broker) {
+        perror("one_socket_broker_create: Failed to allocate memory");
+        abort();
+    }
+    broker->id = worker_new_id();
+    broker->config.listen_fd = listen_fd;
+    broker->config.pair_pool_size = config.pair_pool_size;
+    broker->config.sockopts.sndbuf = config.sndbuf;
+    broker->config.sockopts.rcvbuf = config.rcvbuf;
+    broker->config.sockopts.max_buf = config.max_buf;
+    broker->config.balance = balance;
+    broker->config.profile = config.profile;
+    broker->config.capture_fd = -1;
+    broker->config.pair_seq = &broker->pair_seq;
+    broker->config.pending_seq = &broker->pending_seq;
+    broker->config.numa_node = -1;
+    broker->log.handler = config.log ? one_socket_broker_log : NULL;
+    broker->log.aux = broker;
+    broker->log.max_level = (enum log_level) config.log_level;
+    broker->log_handler = config.log;
+    broker->log_aux = config.log_aux;
+
+    prev_sink = log_set_thread_sink(&broker->log);
+    broker->loop = worker_loop_create(broker->id, &broker->config, -1);
+    if (broker->loop) {
+        log_info("[%02d] Embedded broker started.\n", broker->id);
+    }
+    log_set_thread_sink(prev_sink);
+
+    if (!broker->loop) {
+        free(broker);
+        return NULL;
+    }
+    return broker;
+}
+
+void
+one_socket_broker_destroy(struct one_socket_broker *broker)
+{
+    const struct log_sink *prev_sink;
+
+    if (!broker) {
+        return;
+    }
+    prev_sink = log_set_thread_sink(&broker->log);
+    worker_loop_destroy(broker->loop);
+    log_info("[%02d] Embedded broker stopped.\n", broker->id);
+    log_set_thread_sink(prev_sink);
+    free(broker);
+}
+
+int
+one_socket_broker_fd(const struct one_socket_broker *broker)
+{
+    return broker->loop ? worker_loop_fd(broker->loop) : -1;
+}
+
+int
+one_socket_broker_timeout(const struct one_socket_broker *broker)
+{
+    /* Not waiting for long if the loop needs to be created again. */
+    return broker->loop ? worker_loop_timeout(broker->loop) : 0;
+}
+
+int
+one_socket_broker_process(struct one_socket_broker *broker)
+{
+    const struct log_sink *prev_sink = log_set_thread_sink(&broker->log);
+    int ret = 0;
+
+    if (!broker->loop || worker_loop_run(broker->loop, 0)) {
+        /* Same as the worker thread, listening socket stays open, so
+         * clients are not refused while the loop is created again. */
+        worker_loop_destroy(broker->loop);
+        broker->loop = worker_loop_create(broker->id, &broker->config, -1);
+        ret = broker->loop ? 1 : -1;
+    }
+    log_set_thread_sink(prev_sink);
+    return ret;
+}
+
+void
+one_socket_broker_dump_stats(struct one_socket_broker *broker)
+{
+    const struct log_sink *prev_sink = log_set_thread_sink(&broker->log);
+
+    if (broker->loop) {
+        worker_loop_dump_stats(broker->loop);
+    }
+    log_set_thread_sink(prev_sink);
+}
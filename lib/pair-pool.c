@@ -0,0 +1,195 @@
+/*
+ * Copyright (c) 2021 Ilya Maximets <i.maximets@ovn.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <config.h>
+
+#include "pair-pool.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "socket-util.h"
+
+struct pair_pool {
+    int id;                 /* ID of the owning thread for logs. */
+    int size;               /* Maximum number of pairs in the pool. */
+    int n_pairs;            /* Current number of pairs in the pool. */
+    int (*pairs)[2];        /* Pre-created socket pairs. */
+
+    /* Statistics. */
+    uint64_t hits;          /* Pairs served from the pool. */
+    uint64_t misses;        /* Pairs created on demand. */
+    uint64_t created;       /* Pairs created by refill. */
+    uint64_t failures;      /* Failed refill attempts. */
+};
+
+/* Every pooled pair holds 2 file descriptors.  Pool is allowed to use not
+ * more than a half of descriptors that are not reserved for clients and
+ * other needs of a worker, so accepting of new clients is not affected. */
+static int
+pair_pool_size_limit(int reserved_fds)
+{
+    struct rlimit rlim;
+    int spare;
+
+    if (getrlimit(RLIMIT_NOFILE, &rlim) || rlim.rlim_cur == RLIM_INFINITY) {
+        return INT32_MAX;
+    }
+    if (rlim.rlim_cur <= (rlim_t) reserved_fds) {
+        return 0;
+    }
+    spare = rlim.rlim_cur - reserved_fds > INT32_MAX
+            ? INT32_MAX : (int) (rlim.rlim_cur - reserved_fds);
+    return spare / 4;
+}
+
+/* Creates a pool that will hold up to 'size' pre-created socket pairs.
+ * 'size' is limited by the RLIMIT_NOFILE, 'reserved_fds' is the number of
+ * file descriptors that should be left for other purposes.  Pool with zero
+ * size is valid, pair_pool_get() will create pairs on demand in this case. */
+struct pair_pool *
+pair_pool_create(int id, int size, int reserved_fds)
+{
+    struct pair_pool *pool = calloc(1, sizeof *pool);
+    int limit = pair_pool_size_limit(reserved_fds);
+
+    if (!pool) {
+        log_error("[%02d] Failed to allocate socketpair pool: %s\n",
+                  id, strerror(errno));
+        abort();
+    }
+
+    if (size < 0) {
+        size = 0;
+    }
+    if (size > limit) {
+        log_info("[%02d] Socketpair pool size %d exceeds file descriptor "
+                 "budget. Limiting to %d.\n", id, size, limit);
+        size = limit;
+    }
+
+    pool->id = id;
+    pool->size = size;
+    if (size) {
+        pool->pairs = calloc(size, sizeof *pool->pairs);
+        if (!pool->pairs) {
+            log_error("[%02d] Failed to allocate socketpair pool: %s\n",
+                      id, strerror(errno));
+            abort();
+        }
+    }
+    return pool;
+}
+
+void
+pair_pool_destroy(struct pair_pool *pool)
+{
+    if (!pool) {
+        return;
+    }
+    pair_pool_release(pool);
+    free(pool->pairs);
+    free(pool);
+}
+
+/* Stores a connected socket pair of type 'type' in 'sp'.  Takes one from
+ * the pool if available, otherwise creates a new one.  Pool holds only
+ * SOCK_STREAM pairs, pairs of other types are always created on demand.
+ *
+ * Returns 0 on success.  On failure returns -1 and sets errno. */
+int
+pair_pool_get(struct pair_pool *pool, int type, int sp[2])
+{
+    if (type != SOCK_STREAM) {
+        return socket_pair_get(type, sp);
+    }
+
+    if (pool->n_pairs) {
+        pool->n_pairs--;
+        sp[0] = pool->pairs[pool->n_pairs][0];
+        sp[1] = pool->pairs[pool->n_pairs][1];
+        pool->hits++;
+        return 0;
+    }
+
+    pool->misses++;
+    return socket_pair_get(SOCK_STREAM, sp);
+}
+
+bool
+pair_pool_is_empty(const struct pair_pool *pool)
+{
+    return !pool->n_pairs;
+}
+
+bool
+pair_pool_needs_refill(const struct pair_pool *pool)
+{
+    return pool->n_pairs < pool->size;
+}
+
+/* Creates up to 'max_pairs' new socket pairs, but not more than needed to
+ * fill the pool.  Returns the number of created pairs.  On failure returns
+ * -1 and sets errno. */
+int
+pair_pool_refill(struct pair_pool *pool, int max_pairs)
+{
+    int n = 0;
+
+    while (n < max_pairs && pool->n_pairs < pool->size) {
+        if (socket_pair_get(SOCK_STREAM, pool->pairs[pool->n_pairs])) {
+            pool->failures++;
+            return n ? n : -1;
+        }
+        pool->n_pairs++;
+        pool->created++;
+        n++;
+    }
+    return n;
+}
+
+/* Closes all the pooled socket pairs.  Useful to return file descriptors
+ * back to the process in case of descriptors exhaustion. */
+void
+pair_pool_release(struct pair_pool *pool)
+{
+    int i;
+
+    for (i = 0; i < pool->n_pairs; i++) {
+        close(pool->pairs[i][0]);
+        close(pool->pairs[i][1]);
+    }
+    pool->n_pairs = 0;
+}
+
+void
+pair_pool_report(const struct pair_pool *pool)
+{
+    log_info("[%02d] Socketpair pool: %d/%d pairs available, "
+             "hits: %"PRIu64", misses: %"PRIu64", created: %"PRIu64", "
+             "refill failures: %"PRIu64".\n",
+             pool->id, pool->n_pairs, pool->size,
+             pool->hits, pool->misses, pool->created, pool->failures);
+}
@@ -0,0 +1,37 @@
+/*
+ * Copyright (c) 2021 Ilya Maximets <i.maximets@ovn.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __ONE_SOCKET_PAIR_POOL_H
+#define __ONE_SOCKET_PAIR_POOL_H
+
+#include <stdbool.h>
+
+/* Pool of pre-created socket pairs.  Allows to take socketpair() syscall
+ * out of the pairing path. */
+struct pair_pool;
+
+struct pair_pool *pair_pool_create(int id, int size, int reserved_fds);
+void pair_pool_destroy(struct pair_pool *);
+
+int pair_pool_get(struct pair_pool *, int type, int sp[2]);
+bool pair_pool_is_empty(const struct pair_pool *);
+bool pair_pool_needs_refill(const struct pair_pool *);
+int pair_pool_refill(struct pair_pool *, int max_pairs);
+void pair_pool_release(struct pair_pool *);
+
+void pair_pool_report(const struct pair_pool *);
+
+#endif
@@ -28,6 +28,8 @@
 #include <sys/epoll.h>
 #include <unistd.h>
 
+#include "log.h"
+
 int
 poll_add(int id, int poll_fd, int fd, void *data, const char *name)
 {
@@ -38,9 +40,30 @@ poll_add(int id, int poll_fd, int fd, void *data, const char *name)
     event.data.ptr = data;
 
     if (epoll_ctl(poll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
-        fprintf(stderr, "[%02d] Failed to add fd %d %s%s%s to epoll: %s\n",
-                id, fd, name ? "(" : "", name ? name : "", name ? ")" : "",
-                strerror(errno));
+        log_error("[%02d] Failed to add fd %d %s%s%s to epoll: %s\n",
+                  id, fd, name ? "(" : "", name ? name : "", name ? ")" : "",
+                  strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* Changes the set of events for 'fd'.  Always waits for input, and also
+ * for the ability to write if 'writable' is 'true'. */
+int
+poll_mod(int id, int poll_fd, int fd, void *data, bool writable,
+         const char *name)
+{
+    struct epoll_event event;
+
+    memset(&event, 0, sizeof event);
+    event.events = EPOLLIN | EPOLLPRI | (writable ? EPOLLOUT : 0);
+    event.data.ptr = data;
+
+    if (epoll_ctl(poll_fd, EPOLL_CTL_MOD, fd, &event) < 0) {
+        log_error("[%02d] Failed to modify fd %d %s%s%s in epoll: %s\n",
+                  id, fd, name ? "(" : "", name ? name : "", name ? ")" : "",
+                  strerror(errno));
         return -1;
     }
     return 0;
@@ -50,42 +73,49 @@ int
 poll_del(int id, int poll_fd, int fd, const char *name)
 {
     if (epoll_ctl(poll_fd, EPOLL_CTL_DEL, fd, NULL) < 0) {
-        fprintf(stderr, "[%02d] Failed to del fd %d %s%s%s from epoll: %s\n",
-                id, fd, name ? "(" : "", name ? name : "", name ? ")" : "",
-                strerror(errno));
+        log_error("[%02d] Failed to del fd %d %s%s%s from epoll: %s\n",
+                  id, fd, name ? "(" : "", name ? name : "", name ? ")" : "",
+                  strerror(errno));
         return -1;
     }
     return 0;
 }
 
 static void
-poll_event_init(struct poll_event *event, bool error, void *data)
+poll_event_init(struct poll_event *event, uint32_t events, void *data)
 {
-    event->error = error;
+    event->error = events & (EPOLLERR | EPOLLHUP);
+    event->readable = events & (EPOLLIN | EPOLLPRI);
+    event->writable = events & EPOLLOUT;
     event->data = data;
 }
 
+/* Waits for events on 'poll_fd' for up to 'timeout_ms' milliseconds.
+ * Negative 'timeout_ms' means wait until at least one event.
+ * Returns the number of events stored in 'events', zero on timeout.
+ * On failure returns -1 and sets errno. */
 int
 poll_wait_for_events(int id, int poll_fd,
-                     struct poll_event *events, int max_events)
+                     struct poll_event *events, int max_events,
+                     int timeout_ms)
 {
     struct epoll_event epoll_events[max_events];
     int i, n_events;
 
     do {
-        n_events = epoll_wait(poll_fd, epoll_events, max_events, -1);
-    } while ((n_events < 0 && errno == EINTR) || n_events == 0);
+        n_events = epoll_wait(poll_fd, epoll_events, max_events, timeout_ms);
+    } while ((n_events < 0 && errno == EINTR)
+             || (n_events == 0 && timeout_ms < 0));
 
     if (n_events < 0) {
-        fprintf(stderr, "[%02d] epoll_wait failed: %s\n",
-                id, strerror(errno));
+        log_error("[%02d] epoll_wait failed: %s\n",
+                  id, strerror(errno));
         return n_events;
     }
 
     for (i = 0; i < n_events; i++) {
-        bool error = epoll_events[i].events & (EPOLLERR | EPOLLHUP);
-
-        poll_event_init(&events[i], error, epoll_events[i].data.ptr);
+        poll_event_init(&events[i], epoll_events[i].events,
+                        epoll_events[i].data.ptr);
     }
     return n_events;
 }
@@ -96,8 +126,8 @@ poll_create(int id)
     int epoll_fd = epoll_create(1);
 
     if (epoll_fd < 0) {
-        fprintf(stderr, "[%02d] Failed to create epoll: %s\n",
-                id, strerror(errno));
+        log_error("[%02d] Failed to create epoll: %s\n",
+                  id, strerror(errno));
     }
     return epoll_fd;
 }
@@ -21,13 +21,18 @@
 
 struct poll_event {
     bool error;
+    bool readable;
+    bool writable;
     void *data;
 };
 
 int poll_add(int id, int poll_fd, int fd, void *data, const char *name);
+int poll_mod(int id, int poll_fd, int fd, void *data, bool writable,
+             const char *name);
 int poll_del(int id, int poll_fd, int fd, const char *name);
 int poll_wait_for_events(int id, int poll_fd,
-                         struct poll_event *events, int max_events);
+                         struct poll_event *events, int max_events,
+                         int timeout_ms);
 int poll_create(int id);
 void poll_destroy(int poll_fd);
 
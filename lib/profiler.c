@@ -0,0 +1,218 @@
+/*
+ * Copyright (c) 2021 Ilya Maximets <i.maximets@ovn.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <config.h>
+
+#include "profiler.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+
+/* Histogram buckets are powers of two in microseconds: the first one is for
+ * less than 1 us, the last one is for everything longer than ~8 s. */
+#define PROFILER_N_BUCKETS      25
+
+struct profiler_hist {
+    uint64_t n;                 /* Iterations that spent time in the phase. */
+    uint64_t total_ns;
+    uint64_t max_ns;            /* Longest time within one iteration. */
+    uint64_t buckets[PROFILER_N_BUCKETS];
+};
+
+struct profiler {
+    int id;                     /* ID of the owning thread for logs. */
+    enum profiler_phase phase;  /* Current phase. */
+    uint64_t phase_start;       /* When the current phase was entered. */
+    uint64_t iteration_start;
+    uint64_t current[PROFILER_PHASE_MAX];   /* Time within this iteration. */
+
+    uint64_t n_iterations;
+    struct profiler_hist iterations;        /* Whole iterations. */
+    struct profiler_hist phases[PROFILER_PHASE_MAX];
+};
+
+static const char *const profiler_phase_names[] = {
+    [PROFILER_PHASE_OTHER]      = "other",
+    [PROFILER_PHASE_POLL]       = "poll",
+    [PROFILER_PHASE_CONTROL]    = "control",
+    [PROFILER_PHASE_ACCEPT]     = "accept",
+    [PROFILER_PHASE_RECV]       = "recv",
+    [PROFILER_PHASE_VALIDATE]   = "validate",
+    [PROFILER_PHASE_HANDLE]     = "handle",
+    [PROFILER_PHASE_LOOKUP]     = "lookup",
+    [PROFILER_PHASE_PAIR]       = "pair",
+    [PROFILER_PHASE_SEND]       = "send",
+    [PROFILER_PHASE_CLEANUP]    = "cleanup",
+    [PROFILER_PHASE_REFILL]     = "refill",
+};
+
+/* Raw monotonic time in nanoseconds.  Not affected by NTP adjustments and
+ * served from vDSO, so it is cheap enough to be read on every phase
+ * change. */
+static uint64_t
+profiler_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct profiler *
+profiler_create(int id)
+{
+    struct profiler *prof = calloc(1, sizeof *prof);
+
+    if (!prof) {
+        log_error("[%02d] Failed to allocate memory for a profiler: "
+                  "%s\n", id, strerror(errno));
+        abort();
+    }
+    prof->id = id;
+    prof->phase = PROFILER_PHASE_OTHER;
+    prof->phase_start = prof->iteration_start = profiler_now();
+    return prof;
+}
+
+void
+profiler_destroy(struct profiler *prof)
+{
+    free(prof);
+}
+
+enum profiler_phase
+profiler_enter(struct profiler *prof, enum profiler_phase phase)
+{
+    enum profiler_phase prev;
+    uint64_t now;
+
+    if (!prof) {
+        return PROFILER_PHASE_OTHER;
+    }
+    prev = prof->phase;
+    if (phase == prev) {
+        return prev;
+    }
+    now = profiler_now();
+    prof->current[prev] += now - prof->phase_start;
+    prof->phase_start = now;
+    prof->phase = phase;
+    return prev;
+}
+
+static void
+profiler_hist_add(struct profiler_hist *hist, uint64_t ns)
+{
+    uint64_t us = ns / 1000;
+    int bucket = 0;
+
+    while (us && bucket < PROFILER_N_BUCKETS - 1) {
+        us >>= 1;
+        bucket++;
+    }
+    hist->buckets[bucket]++;
+    hist->n++;
+    hist->total_ns += ns;
+    if (ns > hist->max_ns) {
+        hist->max_ns = ns;
+    }
+}
+
+void
+profiler_iteration(struct profiler *prof)
+{
+    uint64_t now;
+    int i;
+
+    if (!prof) {
+        return;
+    }
+    now = profiler_now();
+    prof->current[prof->phase] += now - prof->phase_start;
+    prof->phase_start = now;
+
+    for (i = 0; i < PROFILER_PHASE_MAX; i++) {
+        if (prof->current[i]) {
+            profiler_hist_add(&prof->phases[i], prof->current[i]);
+            prof->current[i] = 0;
+        }
+    }
+    profiler_hist_add(&prof->iterations, now - prof->iteration_start);
+    prof->iteration_start = now;
+    prof->n_iterations++;
+}
+
+/* Returns the upper bound of the bucket that holds the 'percent'th
+ * percentile, in microseconds. */
+static uint64_t
+profiler_hist_percentile(const struct profiler_hist *hist, int percent)
+{
+    uint64_t seen = 0, target = (hist->n * percent + 99) / 100;
+    int i;
+
+    for (i = 0; i < PROFILER_N_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen >= target) {
+            break;
+        }
+    }
+    return UINT64_C(1) << (i < PROFILER_N_BUCKETS ? i : i - 1);
+}
+
+static void
+profiler_hist_report(int id, const char *name,
+                     const struct profiler_hist *hist, uint64_t total_ns)
+{
+    log_info("[%02d]   %-8s: %5.1f%%, iterations: %"PRIu64", "
+             "average: %"PRIu64" us, p50: <%"PRIu64" us, "
+             "p99: <%"PRIu64" us, max: %"PRIu64" us.\n", id, name,
+             total_ns ? 100.0 * hist->total_ns / total_ns : 0.0, hist->n,
+             hist->total_ns / hist->n / 1000,
+             profiler_hist_percentile(hist, 50),
+             profiler_hist_percentile(hist, 99), hist->max_ns / 1000);
+}
+
+void
+profiler_report(const struct profiler *prof)
+{
+    uint64_t total_ns;
+    int i;
+
+    if (!prof) {
+        return;
+    }
+    total_ns = prof->iterations.total_ns;
+    log_info("[%02d] Profile: loop iterations: %"PRIu64", "
+             "total: %"PRIu64" ms.\n",
+             prof->id, prof->n_iterations, total_ns / 1000000);
+    if (!prof->n_iterations) {
+        return;
+    }
+    profiler_hist_report(prof->id, "loop", &prof->iterations, total_ns);
+    for (i = 0; i < PROFILER_PHASE_MAX; i++) {
+        if (prof->phases[i].n) {
+            profiler_hist_report(prof->id, profiler_phase_names[i],
+                                 &prof->phases[i], total_ns);
+        }
+    }
+}
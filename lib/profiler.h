@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2021 Ilya Maximets <i.maximets@ovn.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __ONE_SOCKET_PROFILER_H
+#define __ONE_SOCKET_PROFILER_H
+
+#include <stdint.h>
+
+/* Phases of the worker loop.  Time is accounted to the current phase until
+ * the next one is entered. */
+enum profiler_phase {
+    PROFILER_PHASE_OTHER,       /* Not covered by any of the below. */
+    PROFILER_PHASE_POLL,        /* Waiting for events. */
+    PROFILER_PHASE_CONTROL,     /* Commands from the main thread. */
+    PROFILER_PHASE_ACCEPT,      /* Accepting new clients. */
+    PROFILER_PHASE_RECV,        /* Receiving requests. */
+    PROFILER_PHASE_VALIDATE,    /* Validating received requests. */
+    PROFILER_PHASE_HANDLE,      /* Handling valid requests. */
+    PROFILER_PHASE_LOOKUP,      /* Looking up and indexing waiting clients. */
+    PROFILER_PHASE_PAIR,        /* Creating and sending socket pairs. */
+    PROFILER_PHASE_SEND,        /* Sending pending replies. */
+    PROFILER_PHASE_CLEANUP,     /* Disconnecting clients. */
+    PROFILER_PHASE_REFILL,      /* Refilling the socketpair pool. */
+    PROFILER_PHASE_MAX,
+};
+
+/* Per-phase timing of the worker loop iterations.  All functions accept
+ * NULL, i.e. disabled profiler, and do nothing in this case. */
+struct profiler;
+
+struct profiler *profiler_create(int id);
+void profiler_destroy(struct profiler *);
+
+/* Starts accounting time to 'phase'.  Returns the phase that was current,
+ * so it could be restored once the nested 'phase' is over. */
+enum profiler_phase profiler_enter(struct profiler *, enum profiler_phase);
+
+/* Completes the current loop iteration and starts the next one. */
+void profiler_iteration(struct profiler *);
+
+void profiler_report(const struct profiler *);
+
+#endif
@@ -14,6 +14,8 @@
  * limitations under the License.
  */
 
+#define _GNU_SOURCE
+
 #include <config.h>
 
 #include "socket-util.h"
@@ -58,11 +60,60 @@ socket_accept(int fd)
     return accept(fd, NULL, NULL);
 }
 
-/* Attempts to create a pair of connected unix domain sockets. */
+/* Attempts to create a pair of connected unix domain sockets of type 'type'
+ * (SOCK_STREAM, SOCK_SEQPACKET or SOCK_DGRAM). */
+int
+socket_pair_get(int type, int sp[2])
+{
+    return socketpair(AF_UNIX, type, 0, sp);
+}
+
+/* Sets SO_SNDBUF and SO_RCVBUF of the socket 'fd' to 'sndbuf' and 'rcvbuf'
+ * respectively.  Zero value means that the option should not be changed.
+ *
+ * Returns 0 on success.  On failure returns -1 and sets errno. */
+int
+socket_set_buffers(int fd, int sndbuf, int rcvbuf)
+{
+    if (sndbuf > 0 && setsockopt(fd, SOL_SOCKET, SO_SNDBUF,
+                                 &sndbuf, sizeof sndbuf)) {
+        return -1;
+    }
+    if (rcvbuf > 0 && setsockopt(fd, SOL_SOCKET, SO_RCVBUF,
+                                 &rcvbuf, sizeof rcvbuf)) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Sets boolean SOL_SOCKET level option 'option' of the socket 'fd'.
+ *
+ * Returns 0 on success.  On failure returns -1 and sets errno. */
 int
-socket_pair_get(int sp[2])
+socket_set_flag(int fd, int option, bool value)
 {
-    return socketpair(AF_UNIX, SOCK_STREAM, 0, sp);
+    int val = value;
+
+    return setsockopt(fd, SOL_SOCKET, option, &val, sizeof val);
+}
+
+/* Stores credentials of the process that connected the socket 'fd' in
+ * 'pid', 'uid' and 'gid'.
+ *
+ * Returns 0 on success.  On failure returns -1 and sets errno. */
+int
+socket_get_peer_cred(int fd, pid_t *pid, uid_t *uid, gid_t *gid)
+{
+    struct ucred cred;
+    socklen_t len = sizeof cred;
+
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len)) {
+        return -1;
+    }
+    *pid = cred.pid;
+    *uid = cred.uid;
+    *gid = cred.gid;
+    return 0;
 }
 
 /* Creates a socket using path 'path'.  If 'nonblock' equals 'true', sets
@@ -18,13 +18,17 @@
 #define __ONE_SOCKET_SOCKET_UTIL_H
 
 #include <stdbool.h>
+#include <sys/types.h>
 
 int socket_set_nonblock(int fd, const char *name);
 int socket_create_listening(const char *path, bool force, bool nonblock);
 
 int socket_accept(int fd);
 int socket_connect(const char *path, bool nonblock);
-int socket_pair_get(int sp[2]);
+int socket_pair_get(int type, int sp[2]);
+int socket_set_buffers(int fd, int sndbuf, int rcvbuf);
+int socket_set_flag(int fd, int option, bool value);
+int socket_get_peer_cred(int fd, pid_t *pid, uid_t *uid, gid_t *gid);
 
 int socket_read_message(int fd, char *buf, int buflen,
                         int *fds, int fds_len, int *n_fds);
@@ -19,21 +19,34 @@
 #include <errno.h>
 #include <inttypes.h>
 #include <limits.h>
+#include <poll.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <socketpair-broker/proto.h>
 #include <socketpair-broker/helper.h>
+#include <socketpair-broker/ring.h>
 
 #include "socket-util.h"
 
 static int sp_broker_get_pair_validate(const struct sp_broker_msg *,
-                                       char **err);
+                                       char *err);
+static int sp_broker_set_pair_validate(const struct sp_broker_msg *,
+                                       char *err);
+static int sp_broker_query_peer_validate(const struct sp_broker_msg *,
+                                         char *err);
+static int sp_broker_peer_status_validate(const struct sp_broker_msg *,
+                                          char *err);
+static int sp_broker_list_pending_validate(const struct sp_broker_msg *,
+                                           char *err);
+static int sp_broker_pending_list_validate(const struct sp_broker_msg *,
+                                           char *err);
 
 static void
 set_error(char **err, const char *fmt, ...)
@@ -62,83 +75,539 @@ set_error(char **err, const char *fmt, ...)
     memcpy(*err, res, len + 1);
 }
 
+/* Same as set_error(), but formats the message into the buffer 'err' of
+ * SP_BROKER_MAX_ERROR_LEN bytes, so no memory allocation is needed. */
+static void
+format_error(char *err, const char *fmt, ...)
+{
+    va_list ap;
+
+    if (!err) {
+        return;
+    }
+
+    va_start(ap, fmt);
+    vsnprintf(err, SP_BROKER_MAX_ERROR_LEN, fmt, ap);
+    va_end(ap);
+}
+
 struct sp_broker_messages {
     int len;
+    int min_len;       /* Minimal payload size for version 2. */
     int n_fds;
+    uint32_t flags;    /* Allowed flags in addition to the version. */
     const char *name;
-    int (*validate) (const struct sp_broker_msg *, char **);
+    int (*validate) (const struct sp_broker_msg *, char *);
 } sp_broker_msgs[] = {
     [SP_BROKER_NONE]     = { .len = 0, .n_fds = 0, .name = "SP_BROKER_NONE", },
     [SP_BROKER_GET_PAIR] = { .len = sizeof (struct sp_broker_get_pair_request),
-                             .n_fds = 0,
+                             .min_len = offsetof(
+                                 struct sp_broker_get_pair_request, key),
+                             .n_fds = -1, /* Depends on the version. */
+                             .flags = SP_BROKER_PAIR_TYPE_MASK
+                                      | SP_BROKER_GET_PAIR_F_PREFIX
+                                      | SP_BROKER_GET_PAIR_F_ACCEPT_FDS
+                                      | SP_BROKER_GET_PAIR_F_PEER_CRED,
                              .name = "SP_BROKER_GET_PAIR",
                              .validate = sp_broker_get_pair_validate, },
     [SP_BROKER_SET_PAIR] = { .len = sizeof (uint64_t),
-                             .n_fds = 1,
-                             .name = "SP_BROKER_SET_PAIR", },
+                             .min_len = sizeof (uint64_t),
+                             .n_fds = -1, /* Depends on the pair type. */
+                             .flags = SP_BROKER_PAIR_TYPE_MASK
+                                      | SP_BROKER_SET_PAIR_F_PRODUCER,
+                             .name = "SP_BROKER_SET_PAIR",
+                             .validate = sp_broker_set_pair_validate, },
+    [SP_BROKER_LIST_PENDING] = {
+        .len = sizeof (struct sp_broker_list_pending_request),
+        .min_len = sizeof (struct sp_broker_list_pending_request),
+        .n_fds = 0,
+        .name = "SP_BROKER_LIST_PENDING",
+        .validate = sp_broker_list_pending_validate, },
+    [SP_BROKER_PENDING_LIST] = {
+        .len = sizeof (struct sp_broker_pending_list),
+        .min_len = sizeof (struct sp_broker_pending_list),
+        .n_fds = 0,
+        .name = "SP_BROKER_PENDING_LIST",
+        .validate = sp_broker_pending_list_validate, },
+    [SP_BROKER_QUERY_PEER] = {
+        .len = sizeof (struct sp_broker_get_pair_request),
+        .min_len = offsetof(struct sp_broker_get_pair_request, key),
+        .n_fds = 0,
+        .flags = SP_BROKER_PAIR_TYPE_MASK | SP_BROKER_QUERY_PEER_F_WAIT
+                 | SP_BROKER_GET_PAIR_F_PREFIX,
+        .name = "SP_BROKER_QUERY_PEER",
+        .validate = sp_broker_query_peer_validate, },
+    [SP_BROKER_PEER_STATUS] = {
+        .len = sizeof (uint64_t),
+        .min_len = sizeof (uint64_t),
+        .n_fds = 0,
+        .name = "SP_BROKER_PEER_STATUS",
+        .validate = sp_broker_peer_status_validate, },
+};
+
+#define REQ_BIT(REQUEST) (1u << (REQUEST))
+
+struct sp_broker_attrs {
+    int len;           /* Size of the value, maximum size if 'variable'. */
+    bool variable;     /* Value could be shorter than 'len'. */
+    uint32_t requests; /* Bitmap of requests that may carry the attribute. */
+    const char *name;
+} sp_broker_attrs[] = {
+    [SP_BROKER_ATTR_NONE]       = { .name = "SP_BROKER_ATTR_NONE", },
+    [SP_BROKER_ATTR_SNDBUF]     = { .len = sizeof (uint32_t),
+                                    .requests = REQ_BIT(SP_BROKER_GET_PAIR),
+                                    .name = "SP_BROKER_ATTR_SNDBUF", },
+    [SP_BROKER_ATTR_RCVBUF]     = { .len = sizeof (uint32_t),
+                                    .requests = REQ_BIT(SP_BROKER_GET_PAIR),
+                                    .name = "SP_BROKER_ATTR_RCVBUF", },
+    [SP_BROKER_ATTR_SOCK_FLAGS] = { .len = sizeof (uint32_t),
+                                    .requests = REQ_BIT(SP_BROKER_GET_PAIR),
+                                    .name = "SP_BROKER_ATTR_SOCK_FLAGS", },
+    [SP_BROKER_ATTR_RING_SIZE]  = { .len = sizeof (uint32_t),
+                                    .requests = REQ_BIT(SP_BROKER_GET_PAIR),
+                                    .name = "SP_BROKER_ATTR_RING_SIZE", },
+    [SP_BROKER_ATTR_WEIGHT]     = { .len = sizeof (uint32_t),
+                                    .requests = REQ_BIT(SP_BROKER_GET_PAIR),
+                                    .name = "SP_BROKER_ATTR_WEIGHT", },
+    [SP_BROKER_ATTR_PRIORITY]   = { .len = sizeof (uint32_t),
+                                    .requests = REQ_BIT(SP_BROKER_GET_PAIR),
+                                    .name = "SP_BROKER_ATTR_PRIORITY", },
+    [SP_BROKER_ATTR_HELLO]      = { .len = SP_BROKER_MAX_HELLO_SIZE,
+                                    .variable = true,
+                                    .requests = REQ_BIT(SP_BROKER_GET_PAIR)
+                                                | REQ_BIT(SP_BROKER_SET_PAIR),
+                                    .name = "SP_BROKER_ATTR_HELLO", },
+    [SP_BROKER_ATTR_PEER_CRED]  = { .len = sizeof (struct sp_broker_peer_cred),
+                                    .requests = REQ_BIT(SP_BROKER_SET_PAIR),
+                                    .name = "SP_BROKER_ATTR_PEER_CRED", },
+    [SP_BROKER_ATTR_PEER_CGROUP] = { .len = SP_BROKER_MAX_CGROUP_SIZE,
+                                     .variable = true,
+                                     .requests = REQ_BIT(SP_BROKER_SET_PAIR),
+                                     .name = "SP_BROKER_ATTR_PEER_CGROUP", },
 };
 
+static uint32_t
+sp_broker_message_version(const struct sp_broker_msg *msg)
+{
+    return msg->flags & SP_BROKER_PROTOCOL_VERSION_MASK;
+}
+
+/* Returns offset of the first attribute in the payload. */
+static int
+sp_broker_attrs_offset(const struct sp_broker_msg *msg)
+{
+    switch (msg->request) {
+    case SP_BROKER_GET_PAIR:
+    case SP_BROKER_QUERY_PEER:
+        return offsetof(struct sp_broker_get_pair_request, key)
+               + msg->payload.get_pair.key_len;
+    case SP_BROKER_SET_PAIR:
+        return sizeof msg->payload.u64;
+    case SP_BROKER_LIST_PENDING:
+        return sizeof msg->payload.list_pending;
+    default:
+        return msg->size;
+    }
+}
+
+int
+sp_broker_message_length(const struct sp_broker_msg *msg)
+{
+    switch (sp_broker_message_version(msg)) {
+    case SP_BROKER_PROTOCOL_VERSION:
+        return SP_BROKER_MESSAGE_SIZE;
+    case SP_BROKER_PROTOCOL_VERSION_2:
+        if (msg->size > SP_BROKER_MAX_PAYLOAD_SIZE) {
+            return -1;
+        }
+        return SP_BROKER_HEADER_SIZE + msg->size;
+    default:
+        return -1;
+    }
+}
+
+const struct sp_broker_attr *
+sp_broker_attr_first(const struct sp_broker_msg *msg)
+{
+    int offset;
+
+    if (sp_broker_message_version(msg) != SP_BROKER_PROTOCOL_VERSION_2) {
+        return NULL;
+    }
+
+    offset = sp_broker_attrs_offset(msg);
+    if (offset + sizeof (struct sp_broker_attr) > msg->size) {
+        return NULL;
+    }
+    return (const struct sp_broker_attr *) &msg->payload.data[offset];
+}
+
+const struct sp_broker_attr *
+sp_broker_attr_next(const struct sp_broker_msg *msg,
+                    const struct sp_broker_attr *attr)
+{
+    size_t offset = attr->value + attr->len - msg->payload.data;
+
+    if (offset + sizeof (struct sp_broker_attr) > msg->size) {
+        return NULL;
+    }
+    return (const struct sp_broker_attr *) &msg->payload.data[offset];
+}
+
+uint32_t
+sp_broker_attr_get_u32(const struct sp_broker_attr *attr)
+{
+    uint32_t value;
+
+    memcpy(&value, attr->value, sizeof value);
+    return value;
+}
+
+int
+sp_broker_attr_put(struct sp_broker_msg *msg, uint16_t type,
+                   const void *value, uint16_t len)
+{
+    struct sp_broker_attr attr = { .type = type, .len = len };
+
+    if (msg->size + sizeof attr + len > SP_BROKER_MAX_PAYLOAD_SIZE) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    memcpy(&msg->payload.data[msg->size], &attr, sizeof attr);
+    msg->size += sizeof attr;
+    memcpy(&msg->payload.data[msg->size], value, len);
+    msg->size += len;
+    return 0;
+}
+
+int
+sp_broker_attr_put_u32(struct sp_broker_msg *msg, uint16_t type,
+                       uint32_t value)
+{
+    return sp_broker_attr_put(msg, type, &value, sizeof value);
+}
+
+static int
+sp_broker_attrs_validate(const struct sp_broker_msg *msg, char *err)
+{
+    const char *name = sp_broker_msgs[msg->request].name;
+    size_t offset = sp_broker_attrs_offset(msg);
+    uint64_t seen = 0;
+
+    while (offset < msg->size) {
+        struct sp_broker_attr attr;
+
+        if (offset + sizeof attr > msg->size) {
+            format_error(err, "%s: Truncated attribute header at offset %zu",
+                         name, offset);
+            return -1;
+        }
+        memcpy(&attr, &msg->payload.data[offset], sizeof attr);
+        offset += sizeof attr;
+
+        if (attr.type == SP_BROKER_ATTR_NONE
+            || attr.type >= SP_BROKER_ATTR_MAX) {
+            format_error(err, "%s: Unknown attribute (%"PRIu16")",
+                         name, attr.type);
+            return -1;
+        }
+        if (!(sp_broker_attrs[attr.type].requests & REQ_BIT(msg->request))) {
+            format_error(err, "%s: Unexpected attribute %s",
+                         name, sp_broker_attrs[attr.type].name);
+            return -1;
+        }
+        if (sp_broker_attrs[attr.type].variable
+            && attr.len > sp_broker_attrs[attr.type].len) {
+            format_error(err, "%s: Attribute %s: too big. "
+                              "Maximum: %d, Received: %"PRIu16,
+                         name, sp_broker_attrs[attr.type].name,
+                         sp_broker_attrs[attr.type].len, attr.len);
+            return -1;
+        }
+        if (!sp_broker_attrs[attr.type].variable
+            && attr.len != sp_broker_attrs[attr.type].len) {
+            format_error(err, "%s: Attribute %s: unexpected size. "
+                              "Expected: %d, Received: %"PRIu16,
+                         name, sp_broker_attrs[attr.type].name,
+                         sp_broker_attrs[attr.type].len, attr.len);
+            return -1;
+        }
+        if (offset + attr.len > msg->size) {
+            format_error(err, "%s: Attribute %s is truncated",
+                         name, sp_broker_attrs[attr.type].name);
+            return -1;
+        }
+        if (seen & (UINT64_C(1) << attr.type)) {
+            format_error(err, "%s: Duplicate attribute %s",
+                         name, sp_broker_attrs[attr.type].name);
+            return -1;
+        }
+        seen |= UINT64_C(1) << attr.type;
+
+        if (attr.type == SP_BROKER_ATTR_SOCK_FLAGS) {
+            uint32_t flags;
+
+            memcpy(&flags, &msg->payload.data[offset], sizeof flags);
+            if (flags & ~SP_BROKER_SOCK_F_MASK) {
+                format_error(err, "%s: Unsupported socket flags 0x%"PRIx32,
+                             name, flags & ~SP_BROKER_SOCK_F_MASK);
+                return -1;
+            }
+        }
+        if (attr.type == SP_BROKER_ATTR_PRIORITY) {
+            uint32_t priority;
+
+            memcpy(&priority, &msg->payload.data[offset], sizeof priority);
+            if (priority >= SP_BROKER_PRIORITY_MAX) {
+                format_error(err, "%s: Unsupported priority %"PRIu32,
+                             name, priority);
+                return -1;
+            }
+        }
+        offset += attr.len;
+    }
+    return 0;
+}
+
 static int
-sp_broker_get_pair_validate(const struct sp_broker_msg *msg, char **err)
+sp_broker_pair_type_validate(const struct sp_broker_msg *msg, char *err)
+{
+    uint32_t type = SP_BROKER_PAIR_TYPE_GET(msg->flags);
+
+    if (type >= SP_BROKER_PAIR_TYPE_MAX) {
+        format_error(err, "%s: Unexpected pair type (%"PRIu32")",
+                     sp_broker_msgs[msg->request].name, type);
+        return -1;
+    }
+    return 0;
+}
+
+static int
+sp_broker_get_pair_validate(const struct sp_broker_msg *msg, char *err)
 {
     const struct sp_broker_get_pair_request *request = &msg->payload.get_pair;
+    const char *name = sp_broker_msgs[msg->request].name;
 
     if (request->mode >= SP_BROKER_PAIR_MODE_MAX) {
-        set_error(err, "Unexpected pair mode (%d)", request->mode);
+        format_error(err, "Unexpected pair mode (%d)", request->mode);
         return -1;
     }
 
     if (!request->key_len || request->key_len > SP_BROKER_MAX_KEY_LENGTH) {
-        set_error(err, "SP_BROKER_GET_PAIR: Invalid key length %"PRIu16
-                       ". Valid range: [0-%d].",
-                  request->key_len, SP_BROKER_MAX_KEY_LENGTH);
+        format_error(err, "%s: Invalid key length %"PRIu16
+                          ". Valid range: [0-%d].",
+                     name, request->key_len, SP_BROKER_MAX_KEY_LENGTH);
+        return -1;
+    }
+
+    if (sp_broker_message_version(msg) == SP_BROKER_PROTOCOL_VERSION_2
+        && (uint32_t) sp_broker_attrs_offset(msg) > msg->size) {
+        format_error(err, "%s: Key length %"PRIu16" exceeds "
+                          "message size %"PRIu32".",
+                     name, request->key_len, msg->size);
+        return -1;
+    }
+
+    /* Descriptors for the peer. */
+    if (sp_broker_message_version(msg) == SP_BROKER_PROTOCOL_VERSION) {
+        if (msg->n_fds) {
+            format_error(err, "%s: unexpected number of file descriptors. "
+                              "Expected: 0, Received: %d", name, msg->n_fds);
+            return -1;
+        }
+        if (msg->flags & (SP_BROKER_GET_PAIR_F_ACCEPT_FDS
+                          | SP_BROKER_GET_PAIR_F_PEER_CRED)) {
+            format_error(err, "%s: Flags 0x%"PRIx32" require protocol "
+                              "version 0x%x", name,
+                         msg->flags & (SP_BROKER_GET_PAIR_F_ACCEPT_FDS
+                                       | SP_BROKER_GET_PAIR_F_PEER_CRED),
+                         SP_BROKER_PROTOCOL_VERSION_2);
+            return -1;
+        }
+    } else if (msg->n_fds > SP_BROKER_MAX_PEER_FDS) {
+        format_error(err, "%s: too many file descriptors. "
+                          "Maximum: %d, Received: %d",
+                     name, SP_BROKER_MAX_PEER_FDS, msg->n_fds);
+        return -1;
+    }
+    return sp_broker_pair_type_validate(msg, err);
+}
+
+static int
+sp_broker_set_pair_validate(const struct sp_broker_msg *msg, char *err)
+{
+    uint32_t type = SP_BROKER_PAIR_TYPE_GET(msg->flags);
+    int n_fds = type == SP_BROKER_PAIR_TYPE_SHM_RING ? SP_BROKER_RING_N_FDS : 1;
+
+    if (sp_broker_pair_type_validate(msg, err)) {
+        return -1;
+    }
+
+    /* Descriptors of the peer follow the ones of the channel. */
+    if (msg->n_fds < n_fds
+        || (sp_broker_message_version(msg) == SP_BROKER_PROTOCOL_VERSION
+            && msg->n_fds != n_fds)
+        || msg->n_fds > n_fds + SP_BROKER_MAX_PEER_FDS) {
+        format_error(err, "Request SP_BROKER_SET_PAIR: unexpected number of "
+                          "file descriptors. Expected: %d, Received: %d",
+                     n_fds, msg->n_fds);
+        return -1;
+    }
+
+    if (type != SP_BROKER_PAIR_TYPE_SHM_RING
+        && msg->flags & SP_BROKER_SET_PAIR_F_PRODUCER) {
+        format_error(err, "SP_BROKER_SET_PAIR: Producer flag is set for "
+                          "a pair of type %"PRIu32, type);
+        return -1;
+    }
+    return 0;
+}
+
+/* Requests that were added after version 2 have a variable size and do not
+ * exist in version 1. */
+static int
+sp_broker_version_2_validate(const struct sp_broker_msg *msg, char *err)
+{
+    if (sp_broker_message_version(msg) != SP_BROKER_PROTOCOL_VERSION_2) {
+        format_error(err, "%s: Requires protocol version 0x%x",
+                     sp_broker_msgs[msg->request].name,
+                     SP_BROKER_PROTOCOL_VERSION_2);
+        return -1;
+    }
+    return 0;
+}
+
+static int
+sp_broker_query_peer_validate(const struct sp_broker_msg *msg, char *err)
+{
+    if (sp_broker_version_2_validate(msg, err)) {
+        return -1;
+    }
+    return sp_broker_get_pair_validate(msg, err);
+}
+
+static int
+sp_broker_peer_status_validate(const struct sp_broker_msg *msg, char *err)
+{
+    if (sp_broker_version_2_validate(msg, err)) {
+        return -1;
+    }
+    if (msg->payload.u64 != SP_BROKER_PEER_ABSENT
+        && msg->payload.u64 != SP_BROKER_PEER_PRESENT) {
+        format_error(err, "SP_BROKER_PEER_STATUS: Unexpected status %"PRIu64,
+                     msg->payload.u64);
+        return -1;
+    }
+    return 0;
+}
+
+static int
+sp_broker_list_pending_validate(const struct sp_broker_msg *msg, char *err)
+{
+    return sp_broker_version_2_validate(msg, err);
+}
+
+static int
+sp_broker_pending_list_validate(const struct sp_broker_msg *msg, char *err)
+{
+    const struct sp_broker_pending_list *list = &msg->payload.pending_list;
+    size_t offset = sizeof *list;
+    uint32_t i;
+
+    if (sp_broker_version_2_validate(msg, err)) {
+        return -1;
+    }
+
+    for (i = 0; i < list->n_entries; i++) {
+        struct sp_broker_pending_entry entry;
+
+        if (offset + sizeof entry > msg->size) {
+            format_error(err, "SP_BROKER_PENDING_LIST: Entry %"PRIu32" of "
+                              "%"PRIu32" is truncated", i, list->n_entries);
+            return -1;
+        }
+        memcpy(&entry, &msg->payload.data[offset], sizeof entry);
+        offset += sizeof entry;
+
+        if (entry.mode >= SP_BROKER_PAIR_MODE_MAX
+            || entry.type >= SP_BROKER_PAIR_TYPE_MAX
+            || !entry.key_len || entry.key_len > SP_BROKER_MAX_KEY_LENGTH
+            || offset + entry.key_len > msg->size) {
+            format_error(err, "SP_BROKER_PENDING_LIST: Entry %"PRIu32" is "
+                              "invalid", i);
+            return -1;
+        }
+        offset += entry.key_len;
+    }
+
+    if (offset != msg->size) {
+        format_error(err, "SP_BROKER_PENDING_LIST: %zu unexpected bytes "
+                          "after %"PRIu32" entries",
+                     msg->size - offset, list->n_entries);
         return -1;
     }
     return 0;
 }
 
 int
-sp_broker_message_validate(const struct sp_broker_msg *msg,
-                           const enum sp_broker_request *expected,
-                           int n_expected, char **err)
+sp_broker_message_validate_buf(const struct sp_broker_msg *msg,
+                               const enum sp_broker_request *expected,
+                               int n_expected, char *err)
 {
+    uint32_t version = sp_broker_message_version(msg);
     uint32_t flags = msg->flags;
+    int ret;
 
-    if ((flags & SP_BROKER_PROTOCOL_VERSION_MASK)
-        != SP_BROKER_PROTOCOL_VERSION) {
-        set_error(err, "Request with unsupported protocol version 0x%"PRIx16
-                       ". Supported version: 0x%"PRIx16,
-                  flags & SP_BROKER_PROTOCOL_VERSION_MASK,
-                  SP_BROKER_PROTOCOL_VERSION);
+    if (version != SP_BROKER_PROTOCOL_VERSION
+        && version != SP_BROKER_PROTOCOL_VERSION_2) {
+        format_error(err, "Request with unsupported protocol version "
+                          "0x%"PRIx32". Supported versions: 0x%x, 0x%x",
+                     version, SP_BROKER_PROTOCOL_VERSION,
+                     SP_BROKER_PROTOCOL_VERSION_2);
         return -1;
     }
 
-    flags ^= msg->flags & SP_BROKER_PROTOCOL_VERSION_MASK;
-    if (flags) {
-        set_error(err,
-                  "Request with unsupported protocol flags 0x%"PRIx32".",
-                  flags);
+    if (msg->request == SP_BROKER_NONE || msg->request >= SP_BROKER_MAX) {
+        format_error(err, "Unexpected request (%d)", msg->request);
         return -1;
     }
 
-    if (msg->request == SP_BROKER_NONE || msg->request >= SP_BROKER_MAX) {
-        set_error(err, "Unexpected request (%d)", msg->request);
+    flags &= ~(SP_BROKER_PROTOCOL_VERSION_MASK
+               | sp_broker_msgs[msg->request].flags);
+    if (flags) {
+        format_error(err,
+                     "Request with unsupported protocol flags 0x%"PRIx32".",
+                     flags);
         return -1;
     }
 
-    if (msg->size != sp_broker_msgs[msg->request].len) {
-        set_error(err, "Request %s: unexpected message size. "
-                       "Expected: %d, Received: %d",
-                  sp_broker_msgs[msg->request].name,
-                  sp_broker_msgs[msg->request].len, msg->size);
+    if (version == SP_BROKER_PROTOCOL_VERSION
+        && msg->size != (uint32_t) sp_broker_msgs[msg->request].len) {
+        format_error(err, "Request %s: unexpected message size. "
+                          "Expected: %d, Received: %d",
+                     sp_broker_msgs[msg->request].name,
+                     sp_broker_msgs[msg->request].len, msg->size);
        return -1;
     }
 
-    if (msg->n_fds != sp_broker_msgs[msg->request].n_fds) {
-        set_error(err, "Request %s: unexpected number of file descriptors. "
-                       "Expected: %d, Received: %d",
-                  sp_broker_msgs[msg->request].name,
-                  sp_broker_msgs[msg->request].n_fds, msg->n_fds);
+    if (version == SP_BROKER_PROTOCOL_VERSION_2
+        && (msg->size < (uint32_t) sp_broker_msgs[msg->request].min_len
+            || msg->size > SP_BROKER_MAX_PAYLOAD_SIZE)) {
+        format_error(err, "Request %s: unexpected message size. "
+                          "Expected: [%d-%d], Received: %d",
+                     sp_broker_msgs[msg->request].name,
+                     sp_broker_msgs[msg->request].min_len,
+                     SP_BROKER_MAX_PAYLOAD_SIZE, msg->size);
+       return -1;
+    }
+
+    if (sp_broker_msgs[msg->request].n_fds >= 0
+        && msg->n_fds != sp_broker_msgs[msg->request].n_fds) {
+        format_error(err, "Request %s: unexpected number of file descriptors. "
+                          "Expected: %d, Received: %d",
+                     sp_broker_msgs[msg->request].name,
+                     sp_broker_msgs[msg->request].n_fds, msg->n_fds);
        return -1;
     }
 
@@ -153,19 +622,110 @@ sp_broker_message_validate(const struct sp_broker_msg *msg,
             }
         }
         if (!found) {
-            set_error(err, "Unexpected request (%s)",
-                      sp_broker_msgs[msg->request].name);
+            format_error(err, "Unexpected request (%s)",
+                         sp_broker_msgs[msg->request].name);
             return -1;
         }
     }
 
     if (sp_broker_msgs[msg->request].validate) {
-        return sp_broker_msgs[msg->request].validate(msg, err);
+        ret = sp_broker_msgs[msg->request].validate(msg, err);
+        if (ret) {
+            return ret;
+        }
     }
 
+    if (version == SP_BROKER_PROTOCOL_VERSION_2) {
+        return sp_broker_attrs_validate(msg, err);
+    }
     return 0;
 }
 
+int
+sp_broker_message_validate(const struct sp_broker_msg *msg,
+                           const enum sp_broker_request *expected,
+                           int n_expected, char **err)
+{
+    char buf[SP_BROKER_MAX_ERROR_LEN];
+
+    if (sp_broker_message_validate_buf(msg, expected, n_expected,
+                                       err ? buf : NULL)) {
+        set_error(err, "%s", buf);
+        return -1;
+    }
+    return 0;
+}
+
+/* Sends message 'msg' with all its file descriptors to a blocking socket
+ * 'fd'.  Returns 0 on success.  On failure returns -1 and sets errno. */
+static int
+sp_broker_send_msg(int fd, struct sp_broker_msg *msg)
+{
+    int len = sp_broker_message_length(msg);
+
+    if (len < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (socket_send_message(fd, (char *) msg, len,
+                            msg->fds, msg->n_fds) != len) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Receives one message from a blocking socket 'fd'.  Reads the header first
+ * to find out the size of the message and then reads the rest.
+ *
+ * Returns 0 on success.  On failure returns -1 and sets errno.  errno is set
+ * to zero if connection was closed by the other side. */
+static int
+sp_broker_recv_msg(int fd, struct sp_broker_msg *msg)
+{
+    int len = SP_BROKER_HEADER_SIZE;
+    bool header_received = false;
+    int save_errno, received = 0;
+    int i;
+
+    msg->n_fds = 0;
+    while (received < len) {
+        int n_fds = 0;
+        int ret;
+
+        ret = socket_read_message(fd, (char *) msg + received,
+                                  len - received, &msg->fds[msg->n_fds],
+                                  SP_BROKER_PROTOCOL_MAX_FDS - msg->n_fds,
+                                  &n_fds);
+        if (ret <= 0) {
+            if (!ret) {
+                errno = 0;
+            }
+            goto error;
+        }
+        msg->n_fds += n_fds;
+        received += ret;
+
+        if (!header_received && received == SP_BROKER_HEADER_SIZE) {
+            header_received = true;
+            len = sp_broker_message_length(msg);
+            if (len < 0) {
+                errno = EPROTO;
+                goto error;
+            }
+        }
+    }
+    return 0;
+
+error:
+    save_errno = errno;
+    for (i = 0; i < msg->n_fds; i++) {
+        close(msg->fds[i]);
+    }
+    msg->n_fds = 0;
+    errno = save_errno;
+    return -1;
+}
+
 int
 sp_broker_connect(const char *sock_path, bool nonblock, char **err)
 {
@@ -180,25 +740,108 @@ sp_broker_connect(const char *sock_path, bool nonblock, char **err)
     return broker_fd;
 }
 
-static int
-sp_broker_send_get_pair__(int broker_fd, const char *key,
-                          enum sp_broker_get_pair_mode mode, char **err)
+void
+sp_broker_pair_params_init(struct sp_broker_pair_params *params)
+{
+    memset(params, 0, sizeof *params);
+    params->mode = SP_BROKER_PAIR_MODE_NONE;
+    params->type = SP_BROKER_PAIR_TYPE_STREAM;
+}
+
+int
+sp_broker_send_get_pair_params(int broker_fd, const char *key,
+                               const struct sp_broker_pair_params *params,
+                               char **err)
 {
     struct sp_broker_msg msg;
     int key_len;
 
     key_len = strlen(key);
+    if (!key_len || key_len > SP_BROKER_MAX_KEY_LENGTH) {
+        set_error(err, "Invalid key length %d. Valid range: [1-%d]",
+                  key_len, SP_BROKER_MAX_KEY_LENGTH);
+        errno = EINVAL;
+        return -1;
+    }
 
-    memset(&msg, 0, sizeof msg);
+    /* Only the part of the message that goes to the wire is initialized. */
     msg.request = SP_BROKER_GET_PAIR;
-    msg.flags |= SP_BROKER_PROTOCOL_VERSION;
-    msg.size = sizeof msg.payload.get_pair;
-    msg.payload.get_pair.mode = mode;
+    msg.flags = SP_BROKER_PAIR_TYPE_SET(params->type);
+    if (params->prefix) {
+        msg.flags |= SP_BROKER_GET_PAIR_F_PREFIX;
+    }
+    if (params->accept_fds) {
+        msg.flags |= SP_BROKER_GET_PAIR_F_ACCEPT_FDS;
+    }
+    if (params->peer_cred) {
+        msg.flags |= SP_BROKER_GET_PAIR_F_PEER_CRED;
+    }
+    msg.payload.get_pair.mode = params->mode;
     msg.payload.get_pair.key_len = key_len;
     memcpy(msg.payload.get_pair.key, key, key_len);
 
-    if (socket_send_message(broker_fd, (char *) &msg, SP_BROKER_MESSAGE_SIZE,
-                            NULL, 0) != SP_BROKER_MESSAGE_SIZE) {
+    if (params->n_fds < 0 || params->n_fds > SP_BROKER_MAX_PEER_FDS) {
+        set_error(err, "Invalid number of descriptors %d. Valid range: "
+                  "[0-%d]", params->n_fds, SP_BROKER_MAX_PEER_FDS);
+        errno = EINVAL;
+        return -1;
+    }
+    msg.n_fds = params->n_fds;
+    if (params->n_fds) {
+        memcpy(msg.fds, params->fds, params->n_fds * sizeof msg.fds[0]);
+    }
+
+    if (params->hello
+        && (params->hello_len < 0
+            || params->hello_len > SP_BROKER_MAX_HELLO_SIZE)) {
+        set_error(err, "Hello is too big: %d bytes. Maximum: %d",
+                  params->hello_len, SP_BROKER_MAX_HELLO_SIZE);
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (!params->sndbuf && !params->rcvbuf && !params->sock_flags
+        && !params->ring_size && !params->weight && !params->priority
+        && !params->hello && !params->n_fds && !params->accept_fds
+        && !params->peer_cred) {
+        /* Nothing that requires attributes.  Using version 1 to stay
+         * compatible with older brokers. */
+        msg.flags |= SP_BROKER_PROTOCOL_VERSION;
+        msg.size = sizeof msg.payload.get_pair;
+        memset(&msg.payload.get_pair.key[key_len], 0,
+               SP_BROKER_MAX_KEY_LENGTH - key_len);
+    } else {
+        msg.flags |= SP_BROKER_PROTOCOL_VERSION_2;
+        msg.size = offsetof(struct sp_broker_get_pair_request, key) + key_len;
+
+        if ((params->sndbuf
+             && sp_broker_attr_put_u32(&msg, SP_BROKER_ATTR_SNDBUF,
+                                       params->sndbuf))
+            || (params->rcvbuf
+                && sp_broker_attr_put_u32(&msg, SP_BROKER_ATTR_RCVBUF,
+                                          params->rcvbuf))
+            || (params->sock_flags
+                && sp_broker_attr_put_u32(&msg, SP_BROKER_ATTR_SOCK_FLAGS,
+                                          params->sock_flags))
+            || (params->ring_size
+                && sp_broker_attr_put_u32(&msg, SP_BROKER_ATTR_RING_SIZE,
+                                          params->ring_size))
+            || (params->weight
+                && sp_broker_attr_put_u32(&msg, SP_BROKER_ATTR_WEIGHT,
+                                          params->weight))
+            || (params->priority
+                && sp_broker_attr_put_u32(&msg, SP_BROKER_ATTR_PRIORITY,
+                                          params->priority))
+            || (params->hello
+                && sp_broker_attr_put(&msg, SP_BROKER_ATTR_HELLO,
+                                      params->hello, params->hello_len))) {
+            set_error(err, "Failed to build SP_BROKER_GET_PAIR: %s",
+                      strerror(errno));
+            return -1;
+        }
+    }
+
+    if (sp_broker_send_msg(broker_fd, &msg)) {
         set_error(err, "Failed to send SP_BROKER_GET_PAIR: %s",
                   strerror(errno));
         return -1;
@@ -210,32 +853,41 @@ int
 sp_broker_send_get_pair(int broker_fd, const char *key,
                         bool server, char **err)
 {
-    return sp_broker_send_get_pair__(broker_fd, key,
-                                     server ? SP_BROKER_PAIR_MODE_SERVER
-                                            : SP_BROKER_PAIR_MODE_CLIENT,
-                                     err);
+    struct sp_broker_pair_params params;
+
+    sp_broker_pair_params_init(&params);
+    params.mode = server ? SP_BROKER_PAIR_MODE_SERVER
+                         : SP_BROKER_PAIR_MODE_CLIENT;
+    return sp_broker_send_get_pair_params(broker_fd, key, &params, err);
 }
 
 int
 sp_broker_send_get_pair_nondirectional(int broker_fd, const char *key,
                                        char **err)
 {
-    return sp_broker_send_get_pair__(broker_fd, key,
-                                     SP_BROKER_PAIR_MODE_NONE, err);
+    struct sp_broker_pair_params params;
+
+    sp_broker_pair_params_init(&params);
+    return sp_broker_send_get_pair_params(broker_fd, key, &params, err);
 }
 
 int
-sp_broker_receive_set_pair(int broker_fd, char **err)
+sp_broker_receive_pair(int broker_fd, struct sp_broker_pair *pair,
+                       char **err)
 {
     enum sp_broker_request expected = SP_BROKER_SET_PAIR;
+    char err2[SP_BROKER_MAX_ERROR_LEN];
+    const struct sp_broker_attr *attr;
     struct sp_broker_msg msg;
     int save_errno;
-    char *err2;
     int i;
 
-    if (socket_read_message(broker_fd, (char *) &msg, SP_BROKER_MESSAGE_SIZE,
-                            msg.fds, sizeof msg.fds, &msg.n_fds)
-        != SP_BROKER_MESSAGE_SIZE) {
+    pair->n_fds = 0;
+    pair->n_peer_fds = 0;
+    pair->hello_len = -1;
+    pair->has_peer_cred = false;
+    pair->peer_cgroup[0] = '\0';
+    if (sp_broker_recv_msg(broker_fd, &msg)) {
         save_errno = errno;
         set_error(err, "Failed to read message from broker: %s",
                   errno ? strerror(errno) : "EOF");
@@ -243,9 +895,8 @@ sp_broker_receive_set_pair(int broker_fd, char **err)
         return -1;
     }
 
-    if (sp_broker_message_validate(&msg, &expected, 1, &err2) < 0) {
-        set_error(err, "Validation failed: %s", err2 ? err2 : "Unknown error");
-        free(err2);
+    if (sp_broker_message_validate_buf(&msg, &expected, 1, err2) < 0) {
+        set_error(err, "Validation failed: %s", err2);
         for (i = 0; i < msg.n_fds; i++) {
             close(msg.fds[i]);
         }
@@ -253,26 +904,432 @@ sp_broker_receive_set_pair(int broker_fd, char **err)
         return -1;
     }
 
-    return msg.fds[0];
+    pair->id = msg.payload.u64;
+    pair->type = SP_BROKER_PAIR_TYPE_GET(msg.flags);
+    pair->producer = !!(msg.flags & SP_BROKER_SET_PAIR_F_PRODUCER);
+    pair->n_fds = pair->type == SP_BROKER_PAIR_TYPE_SHM_RING
+                  ? SP_BROKER_RING_N_FDS : 1;
+    memcpy(pair->fds, msg.fds, pair->n_fds * sizeof msg.fds[0]);
+    pair->n_peer_fds = msg.n_fds - pair->n_fds;
+    memcpy(pair->peer_fds, &msg.fds[pair->n_fds],
+           pair->n_peer_fds * sizeof msg.fds[0]);
+    if (sp_broker_message_version(&msg) == SP_BROKER_PROTOCOL_VERSION_2) {
+        SP_BROKER_ATTR_FOR_EACH (attr, &msg) {
+            switch (attr->type) {
+            case SP_BROKER_ATTR_HELLO:
+                pair->hello_len = attr->len;
+                memcpy(pair->hello, attr->value, attr->len);
+                break;
+            case SP_BROKER_ATTR_PEER_CRED:
+                pair->has_peer_cred = true;
+                memcpy(&pair->peer_cred, attr->value, attr->len);
+                break;
+            case SP_BROKER_ATTR_PEER_CGROUP:
+                memcpy(pair->peer_cgroup, attr->value, attr->len);
+                pair->peer_cgroup[attr->len] = '\0';
+                break;
+            default:
+                break;
+            }
+        }
+    }
+    return 0;
+}
+
+int
+sp_broker_query_peer(int broker_fd, const char *key,
+                     const struct sp_broker_pair_params *params,
+                     int timeout_ms, char **err)
+{
+    enum sp_broker_request expected = SP_BROKER_PEER_STATUS;
+    char err2[SP_BROKER_MAX_ERROR_LEN];
+    struct sp_broker_msg msg;
+    struct pollfd pfd;
+    int key_len, ret;
+    int save_errno;
+    int i;
+
+    key_len = strlen(key);
+    if (!key_len || key_len > SP_BROKER_MAX_KEY_LENGTH) {
+        set_error(err, "Invalid key length %d. Valid range: [1-%d]",
+                  key_len, SP_BROKER_MAX_KEY_LENGTH);
+        errno = EINVAL;
+        return -1;
+    }
+
+    msg.request = SP_BROKER_QUERY_PEER;
+    msg.flags = SP_BROKER_PROTOCOL_VERSION_2
+                | SP_BROKER_PAIR_TYPE_SET(params->type);
+    if (timeout_ms) {
+        msg.flags |= SP_BROKER_QUERY_PEER_F_WAIT;
+    }
+    if (params->prefix) {
+        msg.flags |= SP_BROKER_GET_PAIR_F_PREFIX;
+    }
+    msg.size = offsetof(struct sp_broker_get_pair_request, key) + key_len;
+    msg.payload.get_pair.mode = params->mode;
+    msg.payload.get_pair.key_len = key_len;
+    memcpy(msg.payload.get_pair.key, key, key_len);
+    msg.n_fds = 0;
+
+    if (sp_broker_send_msg(broker_fd, &msg)) {
+        set_error(err, "Failed to send SP_BROKER_QUERY_PEER: %s",
+                  strerror(errno));
+        return -1;
+    }
+
+    if (timeout_ms > 0) {
+        pfd.fd = broker_fd;
+        pfd.events = POLLIN;
+        do {
+            ret = poll(&pfd, 1, timeout_ms);
+        } while (ret < 0 && errno == EINTR);
+        if (ret < 0) {
+            set_error(err, "Failed to wait for SP_BROKER_PEER_STATUS: %s",
+                      strerror(errno));
+            return -1;
+        }
+        if (!ret) {
+            /* Broker still waits and will reply later, so this answer is
+             * not known. */
+            set_error(err, "Timed out waiting for SP_BROKER_PEER_STATUS");
+            errno = ETIMEDOUT;
+            return -1;
+        }
+    }
+
+    if (sp_broker_recv_msg(broker_fd, &msg)) {
+        save_errno = errno;
+        set_error(err, "Failed to read message from broker: %s",
+                  errno ? strerror(errno) : "EOF");
+        errno = save_errno;
+        return -1;
+    }
+
+    if (sp_broker_message_validate_buf(&msg, &expected, 1, err2) < 0) {
+        set_error(err, "Validation failed: %s", err2);
+        for (i = 0; i < msg.n_fds; i++) {
+            close(msg.fds[i]);
+        }
+        errno = EPROTO;
+        return -1;
+    }
+    return msg.payload.u64 == SP_BROKER_PEER_PRESENT;
 }
 
+int
+sp_broker_list_pending(int broker_fd, uint64_t *cursor,
+                       struct sp_broker_pending_info *entries,
+                       int max_entries, uint32_t *n_pending, char **err)
+{
+    enum sp_broker_request expected = SP_BROKER_PENDING_LIST;
+    char err2[SP_BROKER_MAX_ERROR_LEN];
+    struct sp_broker_msg msg;
+    size_t offset;
+    uint32_t i;
+
+    if (max_entries <= 0) {
+        set_error(err, "Invalid number of entries %d", max_entries);
+        errno = EINVAL;
+        return -1;
+    }
+
+    msg.request = SP_BROKER_LIST_PENDING;
+    msg.flags = SP_BROKER_PROTOCOL_VERSION_2;
+    msg.size = sizeof msg.payload.list_pending;
+    msg.payload.list_pending.cursor = *cursor;
+    msg.payload.list_pending.max_entries = max_entries;
+    msg.n_fds = 0;
+
+    if (sp_broker_send_msg(broker_fd, &msg)) {
+        set_error(err, "Failed to send SP_BROKER_LIST_PENDING: %s",
+                  strerror(errno));
+        return -1;
+    }
+
+    if (sp_broker_recv_msg(broker_fd, &msg)) {
+        int save_errno = errno;
 
+        set_error(err, "Failed to read message from broker: %s",
+                  errno ? strerror(errno) : "EOF");
+        errno = save_errno;
+        return -1;
+    }
+
+    if (sp_broker_message_validate_buf(&msg, &expected, 1, err2) < 0) {
+        set_error(err, "Validation failed: %s", err2);
+        for (i = 0; i < (uint32_t) msg.n_fds; i++) {
+            close(msg.fds[i]);
+        }
+        errno = EPROTO;
+        return -1;
+    }
+    if (msg.payload.pending_list.n_entries > (uint32_t) max_entries) {
+        set_error(err, "Received %"PRIu32" entries, requested: %d",
+                  msg.payload.pending_list.n_entries, max_entries);
+        errno = EPROTO;
+        return -1;
+    }
+
+    offset = sizeof msg.payload.pending_list;
+    for (i = 0; i < msg.payload.pending_list.n_entries; i++) {
+        struct sp_broker_pending_entry entry;
+
+        memcpy(&entry, &msg.payload.data[offset], sizeof entry);
+        offset += sizeof entry;
+
+        entries[i].wait_ms = entry.wait_ms;
+        entries[i].mode = entry.mode;
+        entries[i].type = entry.type;
+        entries[i].key_len = entry.key_len;
+        memcpy(entries[i].key, &msg.payload.data[offset], entry.key_len);
+        offset += entry.key_len;
+    }
+
+    *cursor = msg.payload.pending_list.cursor;
+    if (n_pending) {
+        *n_pending = msg.payload.pending_list.n_pending;
+    }
+    return msg.payload.pending_list.n_entries;
+}
+
+void
+sp_broker_pair_close(struct sp_broker_pair *pair)
+{
+    int i;
+
+    for (i = 0; i < pair->n_fds; i++) {
+        close(pair->fds[i]);
+    }
+    pair->n_fds = 0;
+    for (i = 0; i < pair->n_peer_fds; i++) {
+        close(pair->peer_fds[i]);
+    }
+    pair->n_peer_fds = 0;
+}
+
+int
+sp_broker_receive_set_pair(int broker_fd, char **err)
+{
+    struct sp_broker_pair pair;
+
+    if (sp_broker_receive_pair(broker_fd, &pair, err)) {
+        return -1;
+    }
+
+    if (pair.n_fds != 1) {
+        set_error(err, "Received pair of type %d is not a socket",
+                  pair.type);
+        sp_broker_pair_close(&pair);
+        errno = EPROTO;
+        return -1;
+    }
+    return pair.fds[0];
+}
+
+int
+sp_broker_request_pair(const char *sock_path, const char *key,
+                       const struct sp_broker_pair_params *params,
+                       struct sp_broker_pair *pair, char **err)
+{
+    int broker_fd;
+    int ret;
+
+    pair->n_fds = 0;
+    broker_fd = sp_broker_connect(sock_path, false, err);
+    if (broker_fd < 0) {
+        return -1;
+    }
+
+    ret = sp_broker_send_get_pair_params(broker_fd, key, params, err);
+    if (!ret) {
+        ret = sp_broker_receive_pair(broker_fd, pair, err);
+    }
+
+    close(broker_fd);
+    return ret;
+}
+
+void
+sp_broker_retry_policy_init(struct sp_broker_retry_policy *policy)
+{
+    memset(policy, 0, sizeof *policy);
+    policy->initial_delay_ms = 10;
+    policy->max_delay_ms = 1000;
+}
+
+static uint64_t
+sp_broker_time_msec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Returns a random delay before the retry number 'attempt'. */
+static uint32_t
+sp_broker_retry_delay(const struct sp_broker_retry_policy *policy,
+                      uint32_t attempt)
+{
+    static __thread unsigned int seed;
+    uint64_t max = policy->initial_delay_ms;
+
+    if (!seed) {
+        /* Clients started at the same time should not have the same
+         * sequence of delays. */
+        seed = (unsigned int) (getpid() ^ sp_broker_time_msec()
+                               ^ (uintptr_t) &seed) | 1;
+    }
+
+    while (attempt-- && max < policy->max_delay_ms) {
+        max *= 2;
+    }
+    if (max > policy->max_delay_ms) {
+        max = policy->max_delay_ms;
+    }
+    return max ? rand_r(&seed) % (max + 1) : 0;
+}
+
+/* Same as sp_broker_request_pair(), but waits for the pair not longer than
+ * 'timeout_ms' milliseconds (negative - infinitely).  'sent' is set to
+ * 'true' if the request reached the broker. */
 static int
-sp_broker_get_pair__(const char *sock_path, const char *key,
-                     bool directional, bool server, char **err)
+sp_broker_request_pair_timeout(const char *sock_path, const char *key,
+                               const struct sp_broker_pair_params *params,
+                               struct sp_broker_pair *pair, int timeout_ms,
+                               bool *sent, char **err)
+{
+    struct pollfd pfd;
+    int ret = -1;
+
+    pair->n_fds = 0;
+    pfd.fd = sp_broker_connect(sock_path, false, err);
+    if (pfd.fd < 0) {
+        return -1;
+    }
+
+    if (sp_broker_send_get_pair_params(pfd.fd, key, params, err)) {
+        goto exit;
+    }
+    *sent = true;
+
+    pfd.events = POLLIN;
+    do {
+        ret = poll(&pfd, 1, timeout_ms);
+    } while (ret < 0 && errno == EINTR);
+    if (ret <= 0) {
+        if (!ret) {
+            errno = ETIMEDOUT;
+        }
+        set_error(err, "Failed to wait for SP_BROKER_SET_PAIR: %s",
+                  strerror(errno));
+        ret = -1;
+        goto exit;
+    }
+
+    ret = sp_broker_receive_pair(pfd.fd, pair, err);
+exit:
+    close(pfd.fd);
+    return ret;
+}
+
+int
+sp_broker_request_pair_retry(const char *sock_path, const char *key,
+                             const struct sp_broker_pair_params *params,
+                             const struct sp_broker_retry_policy *policy,
+                             struct sp_broker_pair *pair, char **err)
+{
+    uint64_t deadline = 0, now;
+    uint32_t attempt = 0, backoff = 0;
+    char *last_err = NULL;
+    int save_errno;
+
+    if (policy->timeout_ms) {
+        deadline = sp_broker_time_msec() + policy->timeout_ms;
+    }
+
+    for (;;) {
+        int timeout_ms = -1;
+        bool sent = false;
+        uint32_t delay;
+
+        if (deadline) {
+            now = sp_broker_time_msec();
+            if (deadline <= now) {
+                timeout_ms = 0;
+            } else if (deadline - now > INT_MAX) {
+                /* Policy allows deadlines beyond what poll() can wait for.
+                 * Next attempt will wait for the rest. */
+                timeout_ms = INT_MAX;
+            } else {
+                timeout_ms = deadline - now;
+            }
+        }
+
+        free(last_err);
+        last_err = NULL;
+        if (!sp_broker_request_pair_timeout(sock_path, key, params, pair,
+                                            timeout_ms, &sent, &last_err)) {
+            free(last_err);
+            return 0;
+        }
+        attempt++;
+        if (errno == ETIMEDOUT && deadline
+            && sp_broker_time_msec() < deadline) {
+            /* Only the clamped wait expired. */
+            continue;
+        }
+        if (errno == EINVAL || errno == EMSGSIZE || errno == ETIMEDOUT
+            || (policy->max_attempts && attempt >= policy->max_attempts)) {
+            break;
+        }
+
+        /* Connection was fine, so starting the backoff over. */
+        if (sent) {
+            backoff = 0;
+        }
+        delay = sp_broker_retry_delay(policy, backoff++);
+        if (deadline) {
+            now = sp_broker_time_msec();
+            if (now + delay >= deadline) {
+                errno = ETIMEDOUT;
+                break;
+            }
+        }
+        poll(NULL, 0, delay);
+    }
+
+    save_errno = errno;
+    set_error(err, "Failed to get a pair after %"PRIu32" attempt(s): %s",
+              attempt, last_err ? last_err : strerror(errno));
+    free(last_err);
+    errno = save_errno;
+    return -1;
+}
+
+int
+sp_broker_get_pair_params(const char *sock_path, const char *key,
+                          const struct sp_broker_pair_params *params,
+                          char **err)
 {
     int peer_fd = -1;
     int broker_fd;
     int ret;
 
+    if (params->type == SP_BROKER_PAIR_TYPE_SHM_RING) {
+        set_error(err, "Shared memory ring is not a socket. "
+                       "Use sp_broker_request_pair() instead.");
+        errno = EINVAL;
+        return -1;
+    }
+
     broker_fd = sp_broker_connect(sock_path, false, err);
     if (broker_fd < 0) {
         return -1;
     }
 
-    ret = directional
-          ? sp_broker_send_get_pair(broker_fd, key, server, err)
-          : sp_broker_send_get_pair_nondirectional(broker_fd, key, err);
+    ret = sp_broker_send_get_pair_params(broker_fd, key, params, err);
     if (ret < 0) {
         goto exit_close;
     }
@@ -291,12 +1348,20 @@ int
 sp_broker_get_pair(const char *sock_path, const char *key,
                    bool server, char **err)
 {
-    return sp_broker_get_pair__(sock_path, key, true, server, err);
+    struct sp_broker_pair_params params;
+
+    sp_broker_pair_params_init(&params);
+    params.mode = server ? SP_BROKER_PAIR_MODE_SERVER
+                         : SP_BROKER_PAIR_MODE_CLIENT;
+    return sp_broker_get_pair_params(sock_path, key, &params, err);
 }
 
 int
 sp_broker_get_pair_nondirectional(const char *sock_path, const char *key,
                                   char **err)
 {
-    return sp_broker_get_pair__(sock_path, key, false, false, err);
+    struct sp_broker_pair_params params;
+
+    sp_broker_pair_params_init(&params);
+    return sp_broker_get_pair_params(sock_path, key, &params, err);
 }
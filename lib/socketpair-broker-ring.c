@@ -0,0 +1,482 @@
+/*
+ * Copyright (c) 2021 Ilya Maximets <i.maximets@ovn.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+#include <config.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <socketpair-broker/proto.h>
+#include <socketpair-broker/helper.h>
+#include <socketpair-broker/ring.h>
+
+_Static_assert(sizeof (struct sp_broker_ring_shared) == 192,
+               "Unexpected size of the shared ring header.");
+
+#define RING_DATA_OFFSET    4096
+
+/* Flags of memfd_create() for systems with the syscall, but without the
+ * libc wrapper. */
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC         0x0001U
+#endif
+#ifndef MFD_ALLOW_SEALING
+#define MFD_ALLOW_SEALING   0x0002U
+#endif
+#define RING_ALIGN(X)       (((X) + 7) & ~(uint64_t) 7)
+#define RING_RECORD_SIZE(LEN) \
+    (sizeof (struct sp_broker_ring_record) + RING_ALIGN(LEN))
+
+struct sp_broker_ring {
+    struct sp_broker_ring_shared *shared;
+    uint8_t *data;              /* Data area. */
+    uint64_t size;              /* Size of the data area. */
+    size_t map_size;            /* Size of the whole mapping. */
+    bool producer;              /* 'true' if this side is a producer. */
+    int fds[SP_BROKER_RING_N_FDS];
+
+    /* Local copies of the own position.  Producer owns 'head', consumer
+     * owns 'tail'. */
+    uint64_t pos;
+    uint64_t pending;           /* Size of the reserved/peeked record. */
+    uint64_t last_other;        /* Last seen position of the other side. */
+};
+
+static int
+ring_memfd_create(const char *name)
+{
+#ifdef HAVE_MEMFD_CREATE
+    return memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#elif defined(SYS_memfd_create)
+    return syscall(SYS_memfd_create, name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#else
+    (void) name;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static uint64_t
+ring_size_round(uint32_t size)
+{
+    uint64_t res = SP_BROKER_RING_MIN_SIZE;
+
+    while (res < size && res < SP_BROKER_RING_MAX_SIZE) {
+        res <<= 1;
+    }
+    return res;
+}
+
+int
+sp_broker_ring_create(uint32_t size, int fds[SP_BROKER_RING_N_FDS])
+{
+    struct sp_broker_ring_shared *shared;
+    uint64_t data_size = ring_size_round(size);
+    size_t map_size = RING_DATA_OFFSET + data_size;
+    int save_errno;
+    int i;
+
+    for (i = 0; i < SP_BROKER_RING_N_FDS; i++) {
+        fds[i] = -1;
+    }
+
+    fds[SP_BROKER_RING_FD_MEM] = ring_memfd_create("sp-broker-ring");
+    if (fds[SP_BROKER_RING_FD_MEM] < 0
+        || ftruncate(fds[SP_BROKER_RING_FD_MEM], map_size)) {
+        goto error;
+    }
+
+    shared = mmap(NULL, RING_DATA_OFFSET, PROT_READ | PROT_WRITE, MAP_SHARED,
+                  fds[SP_BROKER_RING_FD_MEM], 0);
+    if (shared == MAP_FAILED) {
+        goto error;
+    }
+    memset(shared, 0, sizeof *shared);
+    shared->magic = SP_BROKER_RING_MAGIC;
+    shared->version = SP_BROKER_RING_VERSION;
+    shared->size = data_size;
+    shared->data_offset = RING_DATA_OFFSET;
+    munmap(shared, RING_DATA_OFFSET);
+
+#ifdef F_ADD_SEALS
+    /* Peers should not be able to change the size of the memory and cause
+     * SIGBUS on the other side. */
+    fcntl(fds[SP_BROKER_RING_FD_MEM], F_ADD_SEALS,
+          F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+#endif
+
+    fds[SP_BROKER_RING_FD_DATA] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    fds[SP_BROKER_RING_FD_SPACE] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (fds[SP_BROKER_RING_FD_DATA] < 0 || fds[SP_BROKER_RING_FD_SPACE] < 0) {
+        goto error;
+    }
+    return 0;
+
+error:
+    save_errno = errno;
+    for (i = 0; i < SP_BROKER_RING_N_FDS; i++) {
+        if (fds[i] >= 0) {
+            close(fds[i]);
+            fds[i] = -1;
+        }
+    }
+    errno = save_errno;
+    return -1;
+}
+
+struct sp_broker_ring *
+sp_broker_ring_open(struct sp_broker_pair *pair)
+{
+    struct sp_broker_ring_shared *shared;
+    struct sp_broker_ring *ring;
+    struct stat st;
+    uint64_t size;
+    int i;
+
+    if (pair->type != SP_BROKER_PAIR_TYPE_SHM_RING
+        || pair->n_fds != SP_BROKER_RING_N_FDS) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (fstat(pair->fds[SP_BROKER_RING_FD_MEM], &st)) {
+        return NULL;
+    }
+    if (st.st_size <= RING_DATA_OFFSET) {
+        errno = EPROTO;
+        return NULL;
+    }
+
+    shared = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                  pair->fds[SP_BROKER_RING_FD_MEM], 0);
+    if (shared == MAP_FAILED) {
+        return NULL;
+    }
+
+    size = shared->size;
+    if (shared->magic != SP_BROKER_RING_MAGIC
+        || shared->version != SP_BROKER_RING_VERSION
+        || shared->data_offset != RING_DATA_OFFSET
+        || size < SP_BROKER_RING_MIN_SIZE || (size & (size - 1))
+        || RING_DATA_OFFSET + size > (uint64_t) st.st_size) {
+        munmap(shared, st.st_size);
+        errno = EPROTO;
+        return NULL;
+    }
+
+    ring = calloc(1, sizeof *ring);
+    if (!ring) {
+        munmap(shared, st.st_size);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    ring->shared = shared;
+    ring->data = (uint8_t *) shared + RING_DATA_OFFSET;
+    ring->size = size;
+    ring->map_size = st.st_size;
+    ring->producer = pair->producer;
+    for (i = 0; i < SP_BROKER_RING_N_FDS; i++) {
+        ring->fds[i] = pair->fds[i];
+    }
+    pair->n_fds = 0;
+
+    if (ring->producer) {
+        ring->pos = __atomic_load_n(&shared->head, __ATOMIC_ACQUIRE);
+        ring->last_other = __atomic_load_n(&shared->tail, __ATOMIC_ACQUIRE);
+    } else {
+        ring->pos = __atomic_load_n(&shared->tail, __ATOMIC_ACQUIRE);
+        ring->last_other = __atomic_load_n(&shared->head, __ATOMIC_ACQUIRE);
+    }
+    return ring;
+}
+
+void
+sp_broker_ring_close(struct sp_broker_ring *ring)
+{
+    int i;
+
+    if (!ring) {
+        return;
+    }
+    munmap(ring->shared, ring->map_size);
+    for (i = 0; i < SP_BROKER_RING_N_FDS; i++) {
+        close(ring->fds[i]);
+    }
+    free(ring);
+}
+
+bool
+sp_broker_ring_is_producer(const struct sp_broker_ring *ring)
+{
+    return ring->producer;
+}
+
+uint32_t
+sp_broker_ring_max_msg_size(const struct sp_broker_ring *ring)
+{
+    /* Half of the ring, so the message always fits after the padding
+     * record in an empty ring. */
+    return ring->size / 2 - sizeof (struct sp_broker_ring_record);
+}
+
+static void
+ring_notify(int fd, uint32_t *waiting)
+{
+    /* Pairs with the fence in sp_broker_ring_arm(). */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiting, __ATOMIC_RELAXED)) {
+        uint64_t one = 1;
+
+        if (write(fd, &one, sizeof one) < 0) {
+            /* Counter overflow.  The other side will wake up anyway. */
+        }
+    }
+}
+
+void *
+sp_broker_ring_reserve(struct sp_broker_ring *ring, uint32_t len)
+{
+    struct sp_broker_ring_record record;
+    uint64_t rec_size, offset, contiguous, need;
+
+    if (!ring->producer) {
+        errno = EPERM;
+        return NULL;
+    }
+    if (len > sp_broker_ring_max_msg_size(ring)) {
+        errno = EMSGSIZE;
+        return NULL;
+    }
+
+    rec_size = RING_RECORD_SIZE(len);
+    offset = ring->pos & (ring->size - 1);
+    contiguous = ring->size - offset;
+    need = rec_size + (contiguous < rec_size ? contiguous : 0);
+
+    ring->last_other = __atomic_load_n(&ring->shared->tail,
+                                       __ATOMIC_ACQUIRE);
+    if (ring->size - (ring->pos - ring->last_other) < need) {
+        errno = EAGAIN;
+        return NULL;
+    }
+
+    if (contiguous < rec_size) {
+        /* Not enough space till the end of the data area.  Filling it with
+         * padding and starting from the beginning. */
+        record.len = contiguous - sizeof record;
+        record.flags = SP_BROKER_RING_RECORD_PAD;
+        memcpy(&ring->data[offset], &record, sizeof record);
+        offset = 0;
+    }
+
+    record.len = len;
+    record.flags = 0;
+    memcpy(&ring->data[offset], &record, sizeof record);
+
+    ring->pending = need;
+    return &ring->data[offset + sizeof record];
+}
+
+void
+sp_broker_ring_commit(struct sp_broker_ring *ring)
+{
+    if (!ring->pending) {
+        return;
+    }
+    ring->pos += ring->pending;
+    ring->pending = 0;
+    __atomic_store_n(&ring->shared->head, ring->pos, __ATOMIC_RELEASE);
+    ring_notify(ring->fds[SP_BROKER_RING_FD_DATA],
+                &ring->shared->consumer_waiting);
+}
+
+int
+sp_broker_ring_send(struct sp_broker_ring *ring, const void *data,
+                    uint32_t len)
+{
+    void *dst = sp_broker_ring_reserve(ring, len);
+
+    if (!dst) {
+        return -1;
+    }
+    memcpy(dst, data, len);
+    sp_broker_ring_commit(ring);
+    return 0;
+}
+
+const void *
+sp_broker_ring_peek(struct sp_broker_ring *ring, uint32_t *len)
+{
+    struct sp_broker_ring_record record;
+    uint64_t offset, used, rec_size;
+
+    if (ring->producer) {
+        errno = EPERM;
+        return NULL;
+    }
+
+    ring->last_other = __atomic_load_n(&ring->shared->head,
+                                       __ATOMIC_ACQUIRE);
+    for (;;) {
+        used = ring->last_other - ring->pos;
+        if (!used) {
+            errno = EAGAIN;
+            return NULL;
+        }
+
+        offset = ring->pos & (ring->size - 1);
+        memcpy(&record, &ring->data[offset], sizeof record);
+
+        /* Memory is shared with other process, so checking everything. */
+        rec_size = RING_RECORD_SIZE(record.len);
+        if (used > ring->size || rec_size > used
+            || offset + rec_size > ring->size) {
+            errno = EPROTO;
+            return NULL;
+        }
+
+        if (record.flags & SP_BROKER_RING_RECORD_PAD) {
+            ring->pos += rec_size;
+            continue;
+        }
+
+        ring->pending = rec_size;
+        *len = record.len;
+        return &ring->data[offset + sizeof record];
+    }
+}
+
+void
+sp_broker_ring_release(struct sp_broker_ring *ring)
+{
+    ring->pos += ring->pending;
+    ring->pending = 0;
+    __atomic_store_n(&ring->shared->tail, ring->pos, __ATOMIC_RELEASE);
+    ring_notify(ring->fds[SP_BROKER_RING_FD_SPACE],
+                &ring->shared->producer_waiting);
+}
+
+int
+sp_broker_ring_recv(struct sp_broker_ring *ring, void *buf, uint32_t buflen)
+{
+    const void *src;
+    uint32_t len;
+
+    src = sp_broker_ring_peek(ring, &len);
+    if (!src) {
+        return -1;
+    }
+    if (len > buflen) {
+        ring->pending = 0;
+        errno = EMSGSIZE;
+        return -1;
+    }
+    memcpy(buf, src, len);
+    sp_broker_ring_release(ring);
+    return len;
+}
+
+static bool
+ring_is_ready(struct sp_broker_ring *ring)
+{
+    if (ring->producer) {
+        /* Consumer released something since the last failed reserve. */
+        return __atomic_load_n(&ring->shared->tail, __ATOMIC_ACQUIRE)
+               != ring->last_other;
+    }
+    return __atomic_load_n(&ring->shared->head, __ATOMIC_ACQUIRE)
+           != ring->pos;
+}
+
+static uint32_t *
+ring_waiting_flag(struct sp_broker_ring *ring)
+{
+    return ring->producer ? &ring->shared->producer_waiting
+                          : &ring->shared->consumer_waiting;
+}
+
+int
+sp_broker_ring_fd(const struct sp_broker_ring *ring)
+{
+    return ring->producer ? ring->fds[SP_BROKER_RING_FD_SPACE]
+                          : ring->fds[SP_BROKER_RING_FD_DATA];
+}
+
+bool
+sp_broker_ring_arm(struct sp_broker_ring *ring)
+{
+    __atomic_store_n(ring_waiting_flag(ring), 1, __ATOMIC_RELAXED);
+    /* Pairs with the fence in ring_notify(). */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (ring_is_ready(ring)) {
+        __atomic_store_n(ring_waiting_flag(ring), 0, __ATOMIC_RELAXED);
+        return true;
+    }
+    return false;
+}
+
+void
+sp_broker_ring_ack(struct sp_broker_ring *ring)
+{
+    uint64_t value;
+
+    __atomic_store_n(ring_waiting_flag(ring), 0, __ATOMIC_RELAXED);
+    if (read(sp_broker_ring_fd(ring), &value, sizeof value) < 0) {
+        /* Nothing to read.  Spurious wakeup or the ring was already
+         * ready at the time of arming. */
+    }
+}
+
+int
+sp_broker_ring_wait(struct sp_broker_ring *ring, int timeout_ms)
+{
+    struct pollfd pfd;
+    int ret;
+
+    if (ring_is_ready(ring) || sp_broker_ring_arm(ring)) {
+        return 0;
+    }
+
+    pfd.fd = sp_broker_ring_fd(ring);
+    pfd.events = POLLIN;
+    do {
+        ret = poll(&pfd, 1, timeout_ms);
+    } while (ret < 0 && errno == EINTR);
+
+    sp_broker_ring_ack(ring);
+    if (ret < 0) {
+        return -1;
+    }
+    if (!ret && !ring_is_ready(ring)) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    return 0;
+}
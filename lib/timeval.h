@@ -0,0 +1,28 @@
+/*
+ * Copyright (c) 2021 Ilya Maximets <i.maximets@ovn.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __ONE_SOCKET_TIMEVAL_H
+#define __ONE_SOCKET_TIMEVAL_H
+
+#include <stdint.h>
+
+/* Monotonic time of the broker.  Simulator replaces these with a virtual
+ * clock, so all the time-dependent logic of the broker should use them
+ * instead of clock_gettime(). */
+uint64_t time_msec(void);
+uint64_t time_usec(void);
+
+#endif
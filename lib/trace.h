@@ -0,0 +1,35 @@
+/*
+ * Copyright (c) 2021 Ilya Maximets <i.maximets@ovn.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __ONE_SOCKET_TRACE_H
+#define __ONE_SOCKET_TRACE_H
+
+/* Static user-space tracepoints (USDT) of the 'one_socket' provider, e.g.:
+ *
+ *   bpftrace -e 'usdt:/usr/bin/one-socket:one_socket:match
+ *                { printf("%x %s %s\n", arg0, str(arg1), str(arg2)); }'
+ *
+ * Probes are compiled in if <sys/sdt.h> is available and cost a single
+ * 'nop' while nothing is attached.  Arguments of every probe are listed
+ * where it is used. */
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define TRACE(NAME, ...) STAP_PROBEV(one_socket, NAME, __VA_ARGS__)
+#else
+#define TRACE(NAME, ...) do { } while (0)
+#endif
+
+#endif
@@ -27,55 +27,130 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <unistd.h>
 
 #include <socketpair-broker/proto.h>
 #include <socketpair-broker/helper.h>
 
+#include "affinity.h"
+#include "balancer.h"
+#include "capture.h"
 #include "broker.h"
+#include "key-index.h"
+#include "log.h"
+#include "pair-pool.h"
 #include "polling.h"
+#include "profiler.h"
 #include "socket-util.h"
+#include "timeval.h"
 
 #define DEFAULT_MAX_CLIENTS     1000
 
+/* Number of file descriptors that worker needs in addition to clients:
+ * listening socket, control pipe, epoll and some spare ones. */
+#define WORKER_RESERVED_FDS     16
+
+/* Maximum number of socket pairs to create in one idle iteration. */
+#define POOL_REFILL_BATCH       8
+
+/* Maximum number of clients to accept in one iteration. */
+#define ACCEPT_BATCH            16
+
+/* Worker is overloaded if the average time to handle one iteration of the
+ * loop, i.e. how long a ready client may wait to be served, or the number
+ * of client events in one iteration is above the high mark.  Accepting is
+ * resumed once both are below the low marks. */
+#define OVERLOAD_LAG_HIGH_US    20000
+#define OVERLOAD_LAG_LOW_US     5000
+#define OVERLOAD_EVENTS_HIGH    (DEFAULT_MAX_CLIENTS / 2)
+#define OVERLOAD_EVENTS_LOW     (DEFAULT_MAX_CLIENTS / 8)
+
+/* How often to re-check the load while accepting is paused. */
+#define OVERLOAD_RECHECK_MS     10
+
 #define CONTROL_FD_DATA         0
 #define LISTEN_FD_DATA          1
 
+/* Commands sent over the control pipe. */
+enum worker_cmd {
+    WORKER_CMD_DUMP_STATS = 'S',
+};
+
+/* Load of the worker.  New clients are taken from the listen backlog only
+ * when connected ones are served, so they are not starved by a storm of
+ * new connections. */
+struct worker_load {
+    uint64_t busy_start;          /* When the current iteration started. */
+    uint64_t lag_us;              /* Average duration of an iteration. */
+    int n_events;                 /* Client events in the last iteration. */
+    bool accept_paused;           /* Listening socket is not polled. */
+
+    /* Statistics. */
+    uint64_t n_pauses;            /* Times accepting was paused. */
+    uint64_t n_evictions;         /* Clients disconnected to make room. */
+};
+
 struct worker_thread_info {
     const int id;                 /* ID of the thread. */
     const pthread_t thread;       /* pthread handle. */
     int control_pipe[2];          /* pipe with the main thread. */
     char sock_path[PATH_MAX + 1]; /* Path of the listening socket. */
+    int listen_fd;                /* Listening socket. */
+    int pair_pool_size;           /* Size of the socketpair pool. */
+    struct pair_sockopts_policy sockopts; /* Options of created sockets. */
+    enum balance_policy balance;  /* Choosing between same-key clients. */
+    bool profile;                 /* Measure time spent in loop phases. */
+    int capture_fd;               /* Trace of clients.  Negative - none. */
+    char *cpus;                   /* CPUs to run on.  NULL - any. */
+    int numa_node;                /* NUMA node to run on.  Negative - any. */
     pthread_mutex_t mutex;        /* Protects members of this structure. */
 };
 
+struct worker_loop {
+    int id;                       /* ID of the worker for logs. */
+    int listen_fd;                /* Listening socket.  Not owned. */
+    int control_fd;               /* Control pipe.  Not owned, optional. */
+    int poll_fd;                  /* Polling instance. */
+    int max_events;
+    struct poll_event *events;
+    struct poll_event *sorted;    /* Space for sorting of 'events'. */
+    struct client_info **clients;
+    int n_clients;
+    struct worker_load load;
+    struct broker_ctx ctx;
+    bool refill_blocked;          /* Pool refill failed, not retrying. */
+    uint64_t pair_seq;            /* Pair IDs if the config has none. */
+    uint64_t pending_seq;         /* Positions if the config has none. */
+};
+
 /* Tries to disconnect one client.  Returns 'true' on success.
  * On failure returns 'false'.  Caller will likely need to re-create polling
  * instance. */
 static bool
-disconnect_one_client(int id, int poll_fd,
+disconnect_one_client(struct broker_ctx *ctx,
                       struct client_info **clients, int *n_clients,
                       int index, const char *reason)
 {
     int n = *n_clients;
+    int id = ctx->id;
 
     if (index >= n) {
-        fprintf(stderr,
-                "[%02d] client_disconnect: index (%d) >= n_clients (%d).\n",
-                id, index, n);
+        log_error("[%02d] client_disconnect: index (%d) >= n_clients (%d).\n",
+                  id, index, n);
         abort();
     }
 
-    printf("[%02d] Disconnecting %s. Reason: %s.\n",
-           id, client_name(clients[index]), reason);
-    if (poll_del(id, poll_fd,
+    log_info("[%02d] Disconnecting %s. Reason: %s.\n",
+             id, client_name(clients[index]), reason);
+    if (poll_del(id, ctx->poll_fd,
                  client_fd(clients[index]), client_name(clients[index]))) {
-        fprintf(stderr, "[%02d] Failed to remove fd %d from polling.\n",
-                id, client_fd(clients[index]));
+        log_error("[%02d] Failed to remove fd %d from polling.\n",
+                  id, client_fd(clients[index]));
         return false;
     }
 
-    client_destroy(clients[index]);
+    client_destroy(ctx, clients[index]);
     clients[index] = NULL;
     n--;
     if (index < n) {
@@ -95,8 +170,9 @@ get_new_poll(int id, int control_fd, int listen_fd, int *poll_fd)
     }
 
     /* Adding control pipe to receive commands from the main thread. */
-    if (poll_add(id, *poll_fd, control_fd,
-                 (void *) CONTROL_FD_DATA, "control pipe")) {
+    if (control_fd >= 0
+        && poll_add(id, *poll_fd, control_fd,
+                    (void *) CONTROL_FD_DATA, "control pipe")) {
         goto err_close;
     }
 
@@ -114,179 +190,563 @@ err:
     return -1;
 }
 
-static void *
-worker_thread_main(void *aux_)
+/* Accounts the end of the current iteration and pauses or resumes
+ * accepting of new clients depending on the load.  Returns 0 on success,
+ * -1 if polling of the listening socket could not be changed. */
+static int
+worker_update_load(int id, int poll_fd, int listen_fd,
+                   struct worker_load *load)
 {
-    struct worker_thread_info *worker = aux_;
-    struct client_info **clients;
-    struct poll_event *events;
-    int max_events = DEFAULT_MAX_CLIENTS + 2;
-    int listen_fd, control_fd, poll_fd;
-    int n_clients;
-    bool restart;
-    int id;
-    int i;
+    uint64_t now = time_usec();
+    bool overloaded;
 
-restart:
-    restart = false;
+    if (load->busy_start) {
+        /* Exponential moving average with weight 1/8. */
+        load->lag_us = load->lag_us - load->lag_us / 8
+                       + (now - load->busy_start) / 8;
+    }
+    load->busy_start = 0;
+
+    if (load->accept_paused) {
+        overloaded = load->lag_us >= OVERLOAD_LAG_LOW_US
+                     || load->n_events >= OVERLOAD_EVENTS_LOW;
+    } else {
+        overloaded = load->lag_us >= OVERLOAD_LAG_HIGH_US
+                     || load->n_events >= OVERLOAD_EVENTS_HIGH;
+    }
+    if (overloaded == load->accept_paused) {
+        return 0;
+    }
 
-    pthread_mutex_lock(&worker->mutex);
-    id = worker->id;
-    control_fd = worker->control_pipe[1];
+    if (overloaded) {
+        log_info("[%02d] Overloaded (loop lag: %"PRIu64" us, events: %d).  "
+                 "Pausing accepting of new clients.\n",
+                 id, load->lag_us, load->n_events);
+        if (poll_del(id, poll_fd, listen_fd, "listening socket")) {
+            return -1;
+        }
+        load->n_pauses++;
+    } else {
+        log_info("[%02d] Resuming accepting of new clients.\n", id);
+        if (poll_add(id, poll_fd, listen_fd,
+                     (void *) LISTEN_FD_DATA, "listening socket")) {
+            return -1;
+        }
+    }
+    load->accept_paused = overloaded;
+    return 0;
+}
 
-    printf("[%02d] Worker thread %02d started.\n", id, id);
+/* Chooses a client to disconnect when there is no room for new ones: the
+ * one with the lowest priority that waits the longest.  Clients that are
+ * being paired or already going away are not touched.  Returns the index of
+ * the client or -1. */
+static int
+worker_choose_victim(struct client_info **clients, int n_clients)
+{
+    enum sp_broker_priority lowest = SP_BROKER_PRIORITY_MAX;
+    uint64_t oldest = UINT64_MAX;
+    int i, victim = -1;
 
-    listen_fd = socket_create_listening(worker->sock_path, true, true);
-    if (listen_fd < 0) {
-        fprintf(stderr, "[%02d] Failed to create socket (%s): %s\n",
-                id, worker->sock_path, strerror(errno));
-        pthread_mutex_unlock(&worker->mutex);
-        goto exit_listen;
+    for (i = 0; i < n_clients; i++) {
+        enum client_state state = client_state(clients[i]);
+        enum sp_broker_priority priority = client_priority(clients[i]);
+
+        if (state != CLIENT_STATE_NEW
+            && state != CLIENT_STATE_PAIR_REQUESTED
+            && state != CLIENT_STATE_WATCHING) {
+            continue;
+        }
+        if (priority < lowest
+            || (priority == lowest
+                && client_request_time(clients[i]) < oldest)) {
+            lowest = priority;
+            oldest = client_request_time(clients[i]);
+            victim = i;
+        }
     }
+    return victim;
+}
 
-    printf("[%02d] Serving on socket '%s'.\n", id, worker->sock_path);
-    pthread_mutex_unlock(&worker->mutex);
+/* Rank of the event for worker_sort_events().  Control pipe and listening
+ * socket are ranked above all clients. */
+static int
+worker_event_rank(const struct poll_event *event)
+{
+    if (event->data == (void *) CONTROL_FD_DATA
+        || event->data == (void *) LISTEN_FD_DATA) {
+        return SP_BROKER_PRIORITY_MAX;
+    }
+    return client_priority(event->data);
+}
+
+/* Stable sort of 'n_events' of 'events' by priorities of their clients,
+ * so clients of higher priority classes are served first.  'tmp' should
+ * have space for 'n_events'. */
+static void
+worker_sort_events(struct poll_event *events, struct poll_event *tmp,
+                   int n_events)
+{
+    int pos[SP_BROKER_PRIORITY_MAX + 1] = { 0 };
+    int i, rank, n = 0;
 
-    if (get_new_poll(id, control_fd, listen_fd, &poll_fd)) {
-        goto exit_epoll_failure;
+    for (i = 0; i < n_events; i++) {
+        pos[worker_event_rank(&events[i])]++;
+    }
+    if (pos[SP_BROKER_PRIORITY_NORMAL] + pos[SP_BROKER_PRIORITY_MAX]
+        == n_events) {
+        /* Nothing to reorder. */
+        return;
     }
 
-    events = calloc(max_events, sizeof *events);
-    clients = calloc(max_events, sizeof *clients);
-    if (!events || !clients) {
-        fprintf(stderr, "[%02d] Failed to allocate memory for clients: %s\n",
-                id, strerror(errno));
-        abort();
+    /* Starting positions of ranks, from the highest one. */
+    for (rank = SP_BROKER_PRIORITY_MAX; rank >= 0; rank--) {
+        int count = pos[rank];
+
+        pos[rank] = n;
+        n += count;
+    }
+    for (i = 0; i < n_events; i++) {
+        tmp[pos[worker_event_rank(&events[i])]++] = events[i];
     }
+    memcpy(events, tmp, n_events * sizeof *events);
+}
 
-    n_clients = 0;
-    for (;;) {
-        bool too_many_fds = false;
-        int n_events;
-
-        n_events = poll_wait_for_events(id, poll_fd, events, max_events);
-        if (n_events < 0) {
-            fprintf(stderr,
-                    "[%02d] Polling failed. "
-                    "Disconnecting all clients and restarting.\n",
-                    id);
-            restart = true;
-            goto exit;
+static void
+worker_dump_stats(struct broker_ctx *ctx, const struct worker_load *load,
+                  int n_clients)
+{
+    log_info("[%02d] Number of clients: %d, descriptors held for peers: "
+             "%d (limit: %d).\n", ctx->id, n_clients, ctx->n_held_fds,
+             ctx->max_held_fds);
+    log_info("[%02d] Load: loop lag: %"PRIu64" us, accepting: %s, "
+             "pauses: %"PRIu64", evictions: %"PRIu64".\n", ctx->id,
+             load->lag_us, load->accept_paused ? "paused" : "yes",
+             load->n_pauses, load->n_evictions);
+    pair_pool_report(ctx->pool);
+    balancer_report(ctx->balancer);
+    broker_report_classes(ctx);
+    profiler_report(ctx->profiler);
+    capture_flush(ctx->capture);
+}
+
+static void
+worker_handle_control(struct broker_ctx *ctx, const struct worker_load *load,
+                      int control_fd, int n_clients)
+{
+    char cmds[16];
+    int i, n;
+
+    do {
+        n = read(control_fd, cmds, sizeof cmds);
+    } while (n < 0 && errno == EINTR);
+
+    for (i = 0; i < n; i++) {
+        switch (cmds[i]) {
+        case WORKER_CMD_DUMP_STATS:
+            worker_dump_stats(ctx, load, n_clients);
+            break;
+        default:
+            log_error("[%02d] Unknown control command '%c'.\n",
+                      ctx->id, cmds[i]);
+            break;
         }
+    }
+}
+
+/* Waiting clients may hold descriptors for their peers.  They are allowed
+ * to hold not more than a half of descriptors that are not reserved for
+ * clients and other needs of a worker, the rest is left for the socketpair
+ * pool. */
+static int
+worker_held_fds_limit(int reserved_fds)
+{
+    struct rlimit rlim;
+    rlim_t spare;
+
+    if (getrlimit(RLIMIT_NOFILE, &rlim) || rlim.rlim_cur == RLIM_INFINITY) {
+        return INT_MAX;
+    }
+    if (rlim.rlim_cur <= (rlim_t) reserved_fds) {
+        return 0;
+    }
+    spare = (rlim.rlim_cur - reserved_fds) / 2;
+    return spare > INT_MAX ? INT_MAX : (int) spare;
+}
+
+int
+worker_new_id(void)
+{
+    static int counter = 1;
+
+    return __atomic_fetch_add(&counter, 1, __ATOMIC_RELAXED);
+}
+
+struct worker_loop *
+worker_loop_create(int id, const struct worker_config *config,
+                   int control_fd)
+{
+    struct worker_loop *loop = calloc(1, sizeof *loop);
+    int reserved_fds;
+
+    if (!loop) {
+        log_error("[%02d] Failed to allocate memory for a loop: %s\n",
+                  id, strerror(errno));
+        abort();
+    }
+
+    loop->id = id;
+    loop->listen_fd = config->listen_fd;
+    loop->control_fd = control_fd;
+    loop->max_events = DEFAULT_MAX_CLIENTS + 2;
+
+    loop->ctx.id = id;
+    reserved_fds = loop->max_events + WORKER_RESERVED_FDS;
+    loop->ctx.max_held_fds = worker_held_fds_limit(reserved_fds);
+    reserved_fds = loop->ctx.max_held_fds > INT_MAX - reserved_fds
+                   ? INT_MAX : reserved_fds + loop->ctx.max_held_fds;
+    loop->ctx.pool = pair_pool_create(id, config->pair_pool_size,
+                                      reserved_fds);
+    loop->ctx.index = key_index_create();
+    loop->ctx.balancer = balancer_create(id, config->balance);
+    loop->ctx.profiler = config->profile ? profiler_create(id) : NULL;
+    loop->ctx.sockopts = config->sockopts;
+    loop->ctx.pair_seq = config->pair_seq ? config->pair_seq
+                                          : &loop->pair_seq;
+    loop->ctx.pending_seq = config->pending_seq ? config->pending_seq
+                                                : &loop->pending_seq;
+    loop->ctx.capture = config->capture_fd >= 0
+                        ? capture_create(id, config->capture_fd) : NULL;
+
+    if (get_new_poll(id, control_fd, loop->listen_fd, &loop->poll_fd)) {
+        loop->poll_fd = -1;
+        worker_loop_destroy(loop);
+        return NULL;
+    }
+    loop->ctx.poll_fd = loop->poll_fd;
+
+    loop->events = calloc(loop->max_events, sizeof *loop->events);
+    loop->sorted = calloc(loop->max_events, sizeof *loop->sorted);
+    loop->clients = calloc(loop->max_events, sizeof *loop->clients);
+    if (!loop->events || !loop->sorted || !loop->clients) {
+        log_error("[%02d] Failed to allocate memory for clients: %s\n",
+                  id, strerror(errno));
+        abort();
+    }
+    return loop;
+}
+
+void
+worker_loop_destroy(struct worker_loop *loop)
+{
+    int i;
+
+    if (!loop) {
+        return;
+    }
+    for (i = 0; i < loop->n_clients; i++) {
+        client_destroy(&loop->ctx, loop->clients[i]);
+    }
+    free(loop->clients);
+    free(loop->sorted);
+    free(loop->events);
+    if (loop->poll_fd >= 0) {
+        poll_destroy(loop->poll_fd);
+    }
+    pair_pool_destroy(loop->ctx.pool);
+    key_index_destroy(loop->ctx.index);
+    balancer_destroy(loop->ctx.balancer);
+    profiler_destroy(loop->ctx.profiler);
+    capture_destroy(loop->ctx.capture);
+    free(loop);
+}
+
+int
+worker_loop_fd(const struct worker_loop *loop)
+{
+    return loop->poll_fd;
+}
+
+int
+worker_loop_timeout(const struct worker_loop *loop)
+{
+    int timeout = -1, capture, pairings;
+
+    /* Not blocking if there is some work to do while idle. */
+    if (!loop->refill_blocked && pair_pool_needs_refill(loop->ctx.pool)) {
+        return 0;
+    }
+    /* Listening socket is not polled, so nothing will wake us up to
+     * resume accepting. */
+    if (loop->load.accept_paused) {
+        timeout = OVERLOAD_RECHECK_MS;
+    }
+    capture = capture_wait(loop->ctx.capture);
+    if (capture >= 0 && (timeout < 0 || capture < timeout)) {
+        timeout = capture;
+    }
+    pairings = broker_pairings_wait(&loop->ctx);
+    if (pairings >= 0 && (timeout < 0 || pairings < timeout)) {
+        timeout = pairings;
+    }
+    return timeout;
+}
+
+void
+worker_loop_dump_stats(struct worker_loop *loop)
+{
+    worker_dump_stats(&loop->ctx, &loop->load, loop->n_clients);
+}
+
+int
+worker_loop_run(struct worker_loop *loop, int timeout)
+{
+    struct client_info **clients = loop->clients;
+    struct worker_load *load = &loop->load;
+    struct broker_ctx *ctx = &loop->ctx;
+    struct poll_event *events = loop->events;
+    int listen_fd = loop->listen_fd;
+    int poll_fd = loop->poll_fd;
+    bool too_many_fds = false;
+    bool listen_ready = false;
+    int id = loop->id;
+    int n_events;
+    bool cleaned;
+    int i;
+
+    profiler_iteration(ctx->profiler);
+    profiler_enter(ctx->profiler, PROFILER_PHASE_POLL);
+    n_events = poll_wait_for_events(id, poll_fd, events, loop->max_events,
+                                    timeout);
+    profiler_enter(ctx->profiler, PROFILER_PHASE_OTHER);
+    load->busy_start = time_usec();
+    load->n_events = 0;
+    if (n_events < 0) {
+        log_error("[%02d] Polling failed. "
+                  "Disconnecting all clients and restarting.\n", id);
+        return -1;
+    }
 #if DEBUG
-        printf("--- Got %d polling events.\n", n_events);
+    log_info("--- Got %d polling events.\n", n_events);
 #endif
-        for (i = 0; i < n_events; i++) {
-            struct poll_event *event = &events[i];
-            struct client_info *client;
+    if (!n_events) {
+        /* Nothing to do.  Using this time to refill the pool. */
+        profiler_enter(ctx->profiler, PROFILER_PHASE_REFILL);
+        if (pair_pool_refill(ctx->pool, POOL_REFILL_BATCH) < 0) {
+            log_error("[%02d] Failed to refill socketpair pool: "
+                      "%s.\n", id, strerror(errno));
+            /* Not trying again until some descriptors released. */
+            loop->refill_blocked = true;
+        }
+        if (broker_pairings_wait(ctx)) {
+            goto out;
+        }
+        /* Some pairings expired, cleaning up. */
+    }
+    worker_sort_events(events, loop->sorted, n_events);
+    for (i = 0; i < n_events; i++) {
+        struct poll_event *event = &events[i];
+        struct client_info *client;
 
-            if (event->data == (void *) CONTROL_FD_DATA) {
+        if (event->data == (void *) CONTROL_FD_DATA) {
 #if DEBUG
-                printf("--- Control pipe event.\n");
+            log_info("--- Control pipe event.\n");
 #endif
-                if (event->error) {
-                    fprintf(stderr,
-                            "[%02d] Control pipe failed. Aborting.\n", id);
-                    abort();
-                }
-                /* TODO: read and handle control messages. */
-                continue;
-            } else if (event->data == (void *) LISTEN_FD_DATA) {
+            if (event->error) {
+                log_error("[%02d] Control pipe failed. Aborting.\n", id);
+                abort();
+            }
+            profiler_enter(ctx->profiler, PROFILER_PHASE_CONTROL);
+            worker_handle_control(ctx, load, loop->control_fd,
+                                  loop->n_clients);
+            profiler_enter(ctx->profiler, PROFILER_PHASE_OTHER);
+            continue;
+        } else if (event->data == (void *) LISTEN_FD_DATA) {
 #if DEBUG
-                printf("--- Listen event.\n");
+            log_info("--- Listen event.\n");
 #endif
-                if (event->error) {
-                    fprintf(stderr,
-                            "[%02d] listening socket failed. "
-                            "Disconnecting all clients and restarting.\n",
-                            id);
-                    restart = true;
-                    goto exit;
-                }
-                /* Event on a listening socket.  Trying to accept clients. */
-                if (client_accept(id, listen_fd, &clients[n_clients])) {
-                    if (errno == EMFILE || errno == ENFILE) {
-                        /* Maximum nuber of file descriptors reached.
-                         * We will not be able to accept any new client but
-                         * the process will wake up instantly from poll since
-                         * there is an incoming connection.  Disconnecting
-                         * one clinet to be able to accept the new one. */
-                        too_many_fds = true;
-                    }
-                    continue;
-                }
-
-                if (!poll_add(id, poll_fd,
-                              client_fd(clients[n_clients]),
-                              clients[n_clients],
-                              client_name(clients[n_clients]))) {
-                    printf("[%02d] Accepted: %s.\n",
-                           id, client_name(clients[n_clients]));
-                    n_clients++;
-                } else {
-                    client_destroy(clients[n_clients]);
-                    clients[n_clients] = NULL;
-                }
-                continue;
+            if (event->error) {
+                log_error("[%02d] listening socket failed. "
+                          "Disconnecting all clients and restarting.\n",
+                          id);
+                return -1;
             }
+            /* Accepting once connected clients are served. */
+            listen_ready = true;
+            continue;
+        }
 
-            /* We have an event on client socket. */
-            client = (struct client_info *) event->data;
+        /* We have an event on client socket. */
+        client = (struct client_info *) event->data;
+        load->n_events++;
 #if DEBUG
-            printf("--- New event from %s.\n", client_name(client));
+        log_info("--- New event from %s.\n", client_name(client));
 #endif
-            if (event->error) {
-                printf("[%02d] Connection with %s is broken.\n",
-                       id, client_name(client));
-                client_state_set(client, CLIENT_STATE_DEAD);
-                continue;
+        if (event->error) {
+            log_info("[%02d] Connection with %s is broken.\n",
+                     id, client_name(client));
+            client_state_set(client, CLIENT_STATE_DEAD);
+            continue;
+        }
+        if (event->writable) {
+            profiler_enter(ctx->profiler, PROFILER_PHASE_SEND);
+            client_send_pending(ctx, client);
+            profiler_enter(ctx->profiler, PROFILER_PHASE_OTHER);
+        }
+        if (event->readable) {
+            client_recv_and_handle_request(ctx, client,
+                                           clients, loop->n_clients);
+        }
+    }
+
+    if (listen_ready) {
+        profiler_enter(ctx->profiler, PROFILER_PHASE_ACCEPT);
+    }
+    for (i = 0; listen_ready && i < ACCEPT_BATCH
+                && loop->n_clients < loop->max_events - 2; i++) {
+        struct client_info **new = &clients[loop->n_clients];
+
+        /* Event on a listening socket.  Trying to accept clients. */
+        if (client_accept(ctx, listen_fd, new)) {
+            if (errno == EMFILE || errno == ENFILE) {
+                /* Maximum nuber of file descriptors reached.
+                 * We will not be able to accept any new client but
+                 * the process will wake up instantly from poll since
+                 * there is an incoming connection.  Disconnecting
+                 * one clinet to be able to accept the new one. */
+                too_many_fds = true;
             }
-            client_recv_and_handle_request(id, client, clients, n_clients);
+            break;
         }
 
-        if (too_many_fds || n_clients == max_events - 2) {
-            /* Too many clients.  Randomly choosing a victim. */
-            int victim = rand() % (n_clients ? n_clients : 1);
+        if (!poll_add(id, poll_fd, client_fd(*new), *new,
+                      client_name(*new))) {
+            log_info("[%02d] Accepted: %s.\n", id, client_name(*new));
+            loop->n_clients++;
+        } else {
+            client_destroy(ctx, *new);
+            *new = NULL;
+        }
+    }
 
+    profiler_enter(ctx->profiler, PROFILER_PHASE_CLEANUP);
+    if (too_many_fds && !pair_pool_is_empty(ctx->pool)) {
+        /* Pool is not empty.  Releasing pooled descriptors instead of
+         * disconnecting one of the clients. */
+        log_info("[%02d] Too many open files. "
+                 "Releasing socketpair pool.\n", id);
+        pair_pool_release(ctx->pool);
+        loop->refill_blocked = true;
+    } else if (too_many_fds
+               || (listen_ready
+                   && loop->n_clients == loop->max_events - 2)) {
+        /* Too many clients and somebody else wants to connect.  Making
+         * room by disconnecting the one that waits the longest. */
+        int victim = worker_choose_victim(clients, loop->n_clients);
+
+        if (victim >= 0) {
             client_state_set(clients[victim], CLIENT_STATE_VICTIM);
+            ctx->classes[client_priority(clients[victim])].n_evicted++;
+            load->n_evictions++;
         }
+    }
 
-        /* Cleanup completed and dead clients. */
-        for (i = n_clients - 1; i >= 0; i--) {
+    broker_expire_pairings(ctx, clients, loop->n_clients);
+
+    /* Cleanup completed and dead clients.  Unpairing could move
+     * other clients to a final state, so repeating until nothing left. */
+    do {
+        cleaned = false;
+        for (i = loop->n_clients - 1; i >= 0; i--) {
             struct client_info *client = clients[i];
             enum client_state state = client_state(client);
 
             if (!client_waits_disconnection(state)) {
                 continue;
             }
-            if (!disconnect_one_client(id, poll_fd, clients, &n_clients, i,
-                                       client_state_str(state))) {
-                fprintf(stderr,
-                        "[%02d] Disconnecting all clients and restarting.\n",
-                        id);
-                restart = true;
-                goto exit;
+            client_unpair(ctx, client);
+            if (!disconnect_one_client(ctx, clients, &loop->n_clients,
+                                       i, client_state_str(state))) {
+                log_error("[%02d] Disconnecting all clients and "
+                          "restarting.\n", id);
+                return -1;
             }
+            /* Some file descriptors released, pool could be refilled. */
+            loop->refill_blocked = false;
+            cleaned = true;
         }
+    } while (cleaned);
 #if DEBUG
-        printf("--- Number of clients: %d.\n", n_clients);
+    log_info("--- Number of clients: %d.\n", loop->n_clients);
 #endif
+
+out:
+    profiler_enter(ctx->profiler, PROFILER_PHASE_OTHER);
+    capture_run(ctx->capture);
+    if (worker_update_load(id, poll_fd, listen_fd, load)) {
+        log_error("[%02d] Failed to change polling of the listening "
+                  "socket. Disconnecting all clients and restarting.\n", id);
+        return -1;
     }
+    return 0;
+}
 
-exit:
-    for (i = 0; i < n_clients; i++) {
-        client_destroy(clients[i]);
+static void *
+worker_thread_main(void *aux_)
+{
+    struct worker_thread_info *worker = aux_;
+    struct worker_config config;
+    struct worker_loop *loop;
+    int listen_fd, control_fd;
+    uint64_t pair_seq = 0;
+    uint64_t pending_seq = 0;
+    int id;
+
+    /* Pinning before allocating anything, so the memory of the worker is
+     * allocated on the local NUMA node. */
+    pthread_mutex_lock(&worker->mutex);
+    id = worker->id;
+    if (affinity_pin_thread(id, worker->cpus, worker->numa_node)) {
+        /* Not leaving the socket that nobody serves. */
+        close(worker->listen_fd);
+        pthread_mutex_unlock(&worker->mutex);
+        goto exit;
     }
-    free(clients);
-    free(events);
-    poll_destroy(poll_fd);
-exit_epoll_failure:
-    close(listen_fd);
-    if (restart) {
-        goto restart;
+    pthread_mutex_unlock(&worker->mutex);
+
+    for (;;) {
+        pthread_mutex_lock(&worker->mutex);
+        control_fd = worker->control_pipe[0];
+        listen_fd = worker->listen_fd;
+
+        log_info("[%02d] Worker thread %02d started.\n", id, id);
+        log_info("[%02d] Serving on socket '%s'.\n", id, worker->sock_path);
+
+        memset(&config, 0, sizeof config);
+        config.listen_fd = listen_fd;
+        config.pair_pool_size = worker->pair_pool_size;
+        config.sockopts = worker->sockopts;
+        config.balance = worker->balance;
+        config.profile = worker->profile;
+        config.capture_fd = worker->capture_fd;
+        config.pair_seq = &pair_seq;
+        config.pending_seq = &pending_seq;
+        pthread_mutex_unlock(&worker->mutex);
+
+        loop = worker_loop_create(id, &config, control_fd);
+        if (!loop) {
+            break;
+        }
+        while (!worker_loop_run(loop, worker_loop_timeout(loop))) {
+            continue;
+        }
+        /* Listening socket stays open, so clients are not refused while
+         * the worker is restarting. */
+        worker_loop_destroy(loop);
     }
-exit_listen:
-    printf("[%02d] Worker thread stopped.\n", id);
+    close(listen_fd);
+exit:
+    log_info("[%02d] Worker thread stopped.\n", id);
     return NULL;
 }
 
@@ -298,11 +758,25 @@ worker_thread_join(worker_handle_t aux)
     return pthread_join(info->thread, NULL);
 }
 
+void
+worker_thread_dump_stats(worker_handle_t aux)
+{
+    struct worker_thread_info *info = aux;
+    char cmd = WORKER_CMD_DUMP_STATS;
+    int save_errno = errno;
+
+    /* Not taking the mutex, since this could be called from a signal
+     * handler.  Control pipe doesn't change during the thread lifetime. */
+    if (write(info->control_pipe[1], &cmd, 1) < 0) {
+        /* Pipe is full.  Worker will dump stats anyway. */
+    }
+    errno = save_errno;
+}
+
 worker_handle_t
-worker_thread_start(const char *sock_path)
+worker_thread_start(const struct worker_config *config)
 {
     struct worker_thread_info *aux = calloc(1, sizeof *aux);
-    static int counter = 1;
     pthread_t thread;
     int len;
 
@@ -316,30 +790,71 @@ worker_thread_start(const char *sock_path)
         goto err;
     }
     pthread_mutex_lock(&aux->mutex);
-    *((int *) &aux->id) = counter++;
+    *((int *) &aux->id) = worker_new_id();
 
-    len = strnlen(sock_path, PATH_MAX);
-    memcpy(aux->sock_path, sock_path, len);
+    len = strnlen(config->sock_path, PATH_MAX);
+    memcpy(aux->sock_path, config->sock_path, len);
     aux->sock_path[len] = '\0';
+    aux->pair_pool_size = config->pair_pool_size;
+    aux->sockopts = config->sockopts;
+    aux->balance = config->balance;
+    aux->profile = config->profile;
+    aux->capture_fd = config->capture_fd;
+    aux->numa_node = config->numa_node;
+    if (config->cpus) {
+        aux->cpus = strdup(config->cpus);
+        if (!aux->cpus) {
+            perror("start_worker_thread: Failed to allocate memory");
+            abort();
+        }
+    }
+
+    if (config->listen_fd >= 0) {
+        aux->listen_fd = config->listen_fd;
+        if (socket_set_nonblock(aux->listen_fd, aux->sock_path)) {
+            goto err_unlock;
+        }
+    } else {
+        /* Creating the socket here, so clients could connect as soon as
+         * this function returns. */
+        aux->listen_fd = socket_create_listening(aux->sock_path, true, true);
+        if (aux->listen_fd < 0) {
+            log_error("Failed to create socket (%s): %s\n",
+                      aux->sock_path, strerror(errno));
+            goto err_unlock;
+        }
+    }
 
     if (pipe(aux->control_pipe)) {
         perror("start_worker_thread: Failed to create control pipe");
-        goto err_unlock;
+        goto err_close_listen;
+    }
+    if (socket_set_nonblock(aux->control_pipe[0], "control pipe")
+        || socket_set_nonblock(aux->control_pipe[1], "control pipe")) {
+        goto err_close_pipe;
     }
 
     if (pthread_create(&thread, NULL, worker_thread_main, (void *) aux)) {
         perror("Can't start worker thread, pthread_create() failed");
-        goto err_unlock;
+        goto err_close_pipe;
     }
 
     *((pthread_t *) &aux->thread) = thread;
     pthread_mutex_unlock(&aux->mutex);
     return (worker_handle_t) aux;
 
+err_close_pipe:
+    close(aux->control_pipe[0]);
+    close(aux->control_pipe[1]);
+err_close_listen:
+    if (config->listen_fd < 0) {
+        close(aux->listen_fd);
+    }
 err_unlock:
     pthread_mutex_unlock(&aux->mutex);
     pthread_mutex_destroy(&aux->mutex);
 err:
+    free(aux->cpus);
     free(aux);
     return NULL;
 }
@@ -17,9 +17,68 @@
 #ifndef __ONE_SOCKET_WORKER_H
 #define __ONE_SOCKET_WORKER_H
 
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "balancer.h"
+#include "broker.h"
+
 typedef void * worker_handle_t;
 
-worker_handle_t worker_thread_start(const char *sock_path);
+struct worker_config {
+    const char *sock_path;      /* Path of the listening socket. */
+    int listen_fd;              /* Already listening socket to use instead
+                                 * of 'sock_path'.  Negative - none. */
+    int pair_pool_size;         /* Number of pre-created socket pairs. */
+    struct pair_sockopts_policy sockopts; /* Options of created sockets. */
+    enum balance_policy balance;  /* Choosing between same-key clients. */
+    bool profile;               /* Measure time spent in phases of the loop. */
+    int capture_fd;             /* From capture_open().  Negative - none. */
+    uint64_t *pair_seq;         /* Last assigned pair ID.  Kept outside of
+                                 * the loop, so IDs are not reused after
+                                 * restarts.  NULL - reset every time. */
+    uint64_t *pending_seq;      /* Last assigned position in listings of
+                                 * waiting clients, kept the same way, so
+                                 * cursors don't point back in time. */
+    const char *cpus;           /* CPUs to run on, e.g. "0-3,8".  NULL - any. */
+    int numa_node;              /* NUMA node to run on.  Negative - any. */
+};
+
+worker_handle_t worker_thread_start(const struct worker_config *);
 int worker_thread_join(worker_handle_t);
 
+/* Asks worker thread to print its statistics.  Async-signal-safe. */
+void worker_thread_dump_stats(worker_handle_t);
+
+/* Returns a new unique ID for a worker.  Thread-safe. */
+int worker_new_id(void);
+
+/* Event loop of a worker without a thread, so it could be driven by an
+ * external event loop.  Serves clients of 'config->listen_fd', which must
+ * be a non-blocking listening socket.  'control_fd' is the read end of the
+ * control pipe, negative if none.  Only 'listen_fd', 'pair_pool_size',
+ * 'sockopts', 'balance', 'profile', 'capture_fd', 'pair_seq' and
+ * 'pending_seq' of the 'config' are used.  Returns NULL if polling could
+ * not be created. */
+struct worker_loop;
+
+struct worker_loop *worker_loop_create(int id, const struct worker_config *,
+                                       int control_fd);
+/* Disconnects all clients.  Listening socket and control pipe stay open. */
+void worker_loop_destroy(struct worker_loop *);
+
+/* File descriptor that becomes readable once the loop has some events. */
+int worker_loop_fd(const struct worker_loop *);
+
+/* Returns how long, in milliseconds, the caller may wait for the loop's
+ * file descriptor before running the loop again.  Negative - forever. */
+int worker_loop_timeout(const struct worker_loop *);
+
+/* Runs one iteration of the loop waiting at most 'timeout' milliseconds for
+ * events.  Returns 0 on success.  Returns -1 if the loop is broken and
+ * should be destroyed and created again. */
+int worker_loop_run(struct worker_loop *, int timeout);
+
+void worker_loop_dump_stats(struct worker_loop *);
+
 #endif
@@ -19,6 +19,7 @@
 #include <errno.h>
 #include <inttypes.h>
 #include <limits.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -26,18 +27,164 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "affinity.h"
+#include "balancer.h"
+#include "capture.h"
+#include "daemon.h"
 #include "socket-util.h"
 #include "worker.h"
 
 #define DEFAULT_SOCK_NAME       "one.socket"
 #define DEFAULT_RUNDIR          "/var/run"
 
+#define MAX_PAIR_POOL_SIZE      65536
+#define MAX_SOCKET_BUFFER_SIZE  (INT_MAX / 2)
+#define MAX_NUMA_NODES          64
+
+static worker_handle_t workers[MAX_NUMA_NODES];
+static int n_workers;
+
+static void
+dump_stats_signal_handler(int signum)
+{
+    int i;
+
+    (void) signum;
+    for (i = 0; i < n_workers; i++) {
+        worker_thread_dump_stats(workers[i]);
+    }
+}
+
+/* Reads non-negative integer not larger than 'max' from the environment
+ * variable 'name'.  Returns 'default_value' if variable is not set or
+ * contains invalid value. */
+static int
+get_env_int(const char *name, int default_value, int max)
+{
+    const char *value = getenv(name);
+    char *end;
+    long res;
+
+    if (!value || !*value) {
+        return default_value;
+    }
+
+    errno = 0;
+    res = strtol(value, &end, 10);
+    if (errno || *end || res < 0 || res > max) {
+        fprintf(stderr, "Invalid value of %s (%s). "
+                        "Expected integer in range [0-%d]. "
+                        "Falling back to default (%d).\n",
+                        name, value, max, default_value);
+        return default_value;
+    }
+    return res;
+}
+
+/* Reads the name of a balancing policy from the environment variable
+ * 'name'.  Returns 'default_policy' if variable is not set or contains
+ * unknown policy. */
+static enum balance_policy
+get_env_balance_policy(const char *name, enum balance_policy default_policy)
+{
+    const char *value = getenv(name);
+    enum balance_policy policy;
+
+    if (!value || !*value) {
+        return default_policy;
+    }
+    if (balance_policy_from_str(value, &policy)) {
+        fprintf(stderr, "Invalid value of %s (%s). "
+                        "Expected one of: fifo, round-robin, least-recent, "
+                        "weighted. Falling back to default (%s).\n",
+                        name, value, balance_policy_str(default_policy));
+        return default_policy;
+    }
+    return policy;
+}
+
+/* Starts a worker that listens on 'sock_path' or on 'listen_fd' if it is
+ * not negative.  Returns 0 on success, -1 on failure. */
+static int
+start_worker(struct worker_config *config, const char *sock_path,
+             int listen_fd, int numa_node)
+{
+    char name[64];
+
+    config->sock_path = sock_path;
+    config->listen_fd = listen_fd;
+    config->numa_node = numa_node;
+    if (listen_fd >= 0) {
+        snprintf(name, sizeof name, "inherited socket %d", listen_fd);
+        config->sock_path = name;
+    }
+
+    workers[n_workers] = worker_thread_start(config);
+    if (!workers[n_workers]) {
+        return -1;
+    }
+    n_workers++;
+    return 0;
+}
+
+/* Starts a worker for every NUMA node listed in ONE_SOCKET_NUMA_NODES or
+ * a single worker if not set.  Workers of NUMA nodes are listening on
+ * separate sockets, so each one pairs clients of its own node.  Workers
+ * take sockets from 'listen_fds' in order, if any.
+ * Returns the number of started workers. */
+static int
+start_workers(struct worker_config *config, const char *sock_path,
+              const int *listen_fds, int n_listen_fds)
+{
+    const char *numa_nodes = getenv("ONE_SOCKET_NUMA_NODES");
+    char node_sock_path[PATH_MAX];
+    bool nodes[MAX_NUMA_NODES];
+    int node;
+
+    if (numa_nodes && *numa_nodes
+        && affinity_parse_list(numa_nodes, nodes, MAX_NUMA_NODES)) {
+        fprintf(stderr, "Invalid value of ONE_SOCKET_NUMA_NODES (%s). "
+                        "Expected list of NUMA nodes, e.g. '0,1'. "
+                        "Falling back to a single worker.\n", numa_nodes);
+        numa_nodes = NULL;
+    }
+
+    if (!numa_nodes || !*numa_nodes) {
+        start_worker(config, sock_path,
+                     n_listen_fds ? listen_fds[0] : -1, -1);
+        return n_workers;
+    }
+
+    for (node = 0; node < MAX_NUMA_NODES; node++) {
+        int listen_fd = n_workers < n_listen_fds ? listen_fds[n_workers] : -1;
+
+        if (!nodes[node]) {
+            continue;
+        }
+        if (snprintf(node_sock_path, sizeof node_sock_path, "%s.node%d",
+                     sock_path, node) >= (int) sizeof node_sock_path) {
+            fprintf(stderr, "Socket path for NUMA node %d is too long.\n",
+                    node);
+            continue;
+        }
+        if (start_worker(config, node_sock_path, listen_fd, node)) {
+            fprintf(stderr, "Failed to start worker for NUMA node %d.\n",
+                    node);
+        }
+    }
+    return n_workers;
+}
+
 int
 main(void)
 {
     const char *sock_path = getenv("ONE_SOCKET_PATH");
-    worker_handle_t worker;
-    int ret;
+    const char *pid_file = getenv("ONE_SOCKET_PID_FILE");
+    const char *capture_path = getenv("ONE_SOCKET_CAPTURE");
+    int listen_fds[MAX_NUMA_NODES], n_listen_fds;
+    struct worker_config config;
+    struct sigaction sa;
+    int i, ret;
 
     printf("One Socket v" VERSION_STR ".\n");
 
@@ -51,19 +198,83 @@ main(void)
         sock_path = DEFAULT_RUNDIR"/"DEFAULT_SOCK_NAME;
     }
 
-    worker = worker_thread_start(sock_path);
-    if (!worker) {
-        fprintf(stderr, "Failed to start worker thread.\n");
+    /* Sockets are passed to this process, so taking them before fork(). */
+    n_listen_fds = daemon_get_listen_fds(listen_fds, MAX_NUMA_NODES);
+    if (n_listen_fds) {
+        printf("Using %d listening socket(s) passed by the service "
+               "manager.\n", n_listen_fds);
+    }
+
+    /* Threads do not survive fork(), so detaching before starting them. */
+    if (get_env_int("ONE_SOCKET_DAEMON", 0, 1) && daemon_start()) {
+        fprintf(stderr, "Failed to daemonize: %s.\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (pid_file && *pid_file && daemon_write_pid_file(pid_file)) {
+        fprintf(stderr, "Failed to write pid file '%s': %s.\n",
+                pid_file, strerror(errno));
         exit(EXIT_FAILURE);
     }
 
-    /* TODO: daemonize. */
+    memset(&config, 0, sizeof config);
+    config.pair_pool_size = get_env_int("ONE_SOCKET_PAIR_POOL_SIZE", 0,
+                                        MAX_PAIR_POOL_SIZE);
+    config.sockopts.sndbuf = get_env_int("ONE_SOCKET_PAIR_SNDBUF", 0,
+                                         MAX_SOCKET_BUFFER_SIZE);
+    config.sockopts.rcvbuf = get_env_int("ONE_SOCKET_PAIR_RCVBUF", 0,
+                                         MAX_SOCKET_BUFFER_SIZE);
+    config.sockopts.max_buf = get_env_int("ONE_SOCKET_PAIR_MAX_BUF", 0,
+                                          MAX_SOCKET_BUFFER_SIZE);
+    config.balance = get_env_balance_policy("ONE_SOCKET_BALANCE",
+                                            BALANCE_ROUND_ROBIN);
+    config.profile = get_env_int("ONE_SOCKET_PROFILE", 0, 1);
+    config.capture_fd = -1;
+    if (capture_path && *capture_path) {
+        config.capture_fd = capture_open(capture_path);
+        if (config.capture_fd < 0) {
+            fprintf(stderr, "Failed to open capture file '%s': %s.\n",
+                    capture_path, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+    config.cpus = getenv("ONE_SOCKET_CPUS");
+    if (config.cpus && !*config.cpus) {
+        config.cpus = NULL;
+    }
 
-    ret = worker_thread_join(worker);
-    if (ret) {
-        fprintf(stderr, "Failed to join worker thread: %s.\n", strerror(ret));
+    if (!start_workers(&config, sock_path, listen_fds, n_listen_fds)) {
+        fprintf(stderr, "Failed to start worker thread.\n");
         exit(EXIT_FAILURE);
     }
+    /* Workers took inherited sockets in order.  Clients of the rest would
+     * wait forever, closing them instead. */
+    for (i = n_workers; i < n_listen_fds; i++) {
+        fprintf(stderr, "No worker for inherited socket %d.  Closing.\n",
+                listen_fds[i]);
+        close(listen_fds[i]);
+    }
+
+    /* SIGUSR1 requests statistics from the worker. */
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = dump_stats_signal_handler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGUSR1, &sa, NULL)) {
+        fprintf(stderr, "Failed to set SIGUSR1 handler: %s.\n",
+                strerror(errno));
+    }
+
+    /* Listening sockets are ready, clients could connect now. */
+    daemon_complete(getenv("ONE_SOCKET_LOG_FILE"));
+
+    for (i = 0; i < n_workers; i++) {
+        ret = worker_thread_join(workers[i]);
+        if (ret) {
+            fprintf(stderr, "Failed to join worker thread: %s.\n",
+                    strerror(ret));
+            exit(EXIT_FAILURE);
+        }
+    }
 
     return 0;
 }
@@ -0,0 +1,160 @@
+/*
+ * Copyright (c) 2021 Ilya Maximets <i.maximets@ovn.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Fuzzing harness for the SocketPair Broker Protocol validator.
+ *
+ * Input format: first byte is the number of file descriptors that came
+ * with the message, the rest is the message as received from the socket.
+ *
+ * Build with '-Dfuzzing=true' and clang to get a libFuzzer binary.
+ * Otherwise, the binary reads inputs from files given on the command line
+ * or from stdin, which is suitable for AFL:
+ *
+ *   $ CC=afl-clang-fast meson build && ninja -C build
+ *   $ afl-fuzz -i seeds -o findings -- build/test/fuzz-validator @@
+ */
+
+#include <config.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <socketpair-broker/proto.h>
+#include <socketpair-broker/helper.h>
+
+#define FUZZ_MAX_INPUT (1 + SP_BROKER_HEADER_SIZE + SP_BROKER_MAX_PAYLOAD_SIZE)
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+static void
+fuzz_check(bool condition, const char *what)
+{
+    if (!condition) {
+        fprintf(stderr, "fuzz-validator: check failed: %s\n", what);
+        abort();
+    }
+}
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    static const enum sp_broker_request all[] = {
+        SP_BROKER_GET_PAIR, SP_BROKER_SET_PAIR,
+        SP_BROKER_LIST_PENDING, SP_BROKER_PENDING_LIST,
+        SP_BROKER_QUERY_PEER, SP_BROKER_PEER_STATUS,
+    };
+    const struct sp_broker_attr *attr;
+    struct sp_broker_msg msg;
+    int received, len, n_attrs;
+    char *err = NULL;
+    size_t end;
+
+    if (size < 1 || size > FUZZ_MAX_INPUT) {
+        return 0;
+    }
+
+    /* Broker reuses the receive buffer, so anything after the received
+     * bytes is a leftover of previous messages. */
+    memset(&msg, 0xa5, sizeof msg);
+    received = size - 1;
+    memcpy(&msg, data + 1, received);
+    msg.n_fds = data[0] % (SP_BROKER_PROTOCOL_MAX_FDS + 1);
+
+    if (sp_broker_message_validate(&msg, all, sizeof all / sizeof all[0],
+                                   &err)) {
+        /* Every failure should be explained. */
+        fuzz_check(err != NULL, "error message on validation failure");
+        free(err);
+        return 0;
+    }
+    fuzz_check(err == NULL, "no error message on success");
+
+    len = sp_broker_message_length(&msg);
+    fuzz_check(len >= (int) SP_BROKER_HEADER_SIZE, "valid message length");
+    fuzz_check(len <= (int) (SP_BROKER_HEADER_SIZE
+                             + SP_BROKER_MAX_PAYLOAD_SIZE),
+               "message length within limits");
+    if (received != len) {
+        /* Broker drops messages with unexpected length. */
+        return 0;
+    }
+
+    /* Attributes of a valid message should never point outside of it. */
+    n_attrs = 0;
+    SP_BROKER_ATTR_FOR_EACH (attr, &msg) {
+        end = attr->value + attr->len - msg.payload.data;
+        fuzz_check(end <= msg.size, "attribute within the payload");
+        fuzz_check(attr->type > SP_BROKER_ATTR_NONE
+                   && attr->type < SP_BROKER_ATTR_MAX, "known attribute");
+        fuzz_check(++n_attrs < SP_BROKER_ATTR_MAX, "no duplicate attributes");
+    }
+
+    if (msg.request == SP_BROKER_GET_PAIR
+        || msg.request == SP_BROKER_QUERY_PEER) {
+        fuzz_check(msg.payload.get_pair.key_len >= 1
+                   && msg.payload.get_pair.key_len
+                      <= SP_BROKER_MAX_KEY_LENGTH, "valid key length");
+        fuzz_check(msg.n_fds == 0
+                   || (msg.request == SP_BROKER_GET_PAIR
+                       && (msg.flags & SP_BROKER_PROTOCOL_VERSION_MASK)
+                          == SP_BROKER_PROTOCOL_VERSION_2
+                       && msg.n_fds <= SP_BROKER_MAX_PEER_FDS),
+                   "descriptors for the peer only in GET_PAIR version 2");
+    }
+    return 0;
+}
+
+#ifndef FUZZ_NO_MAIN
+static int
+fuzz_one_file(FILE *file)
+{
+    static uint8_t data[FUZZ_MAX_INPUT + 1];
+    size_t size = fread(data, 1, sizeof data, file);
+
+    if (ferror(file)) {
+        return -1;
+    }
+    LLVMFuzzerTestOneInput(data, size);
+    return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+    int i;
+
+    if (argc < 2) {
+        return fuzz_one_file(stdin) ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    for (i = 1; i < argc; i++) {
+        FILE *file = fopen(argv[i], "rb");
+
+        if (!file || fuzz_one_file(file)) {
+            perror(argv[i]);
+            if (file) {
+                fclose(file);
+            }
+            return EXIT_FAILURE;
+        }
+        fclose(file);
+    }
+    return EXIT_SUCCESS;
+}
+#endif
@@ -0,0 +1,491 @@
+/*
+ * Copyright (c) 2021 Ilya Maximets <i.maximets@ovn.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Replays a capture recorded by the broker with ONE_SOCKET_CAPTURE against
+ * a running broker: connects, requests pairs and disconnects at the same
+ * relative times as the captured clients did, optionally faster, and
+ * reports how long clients waited for their pairs.
+ *
+ * Usage: replay-capture SP_BROKER_SOCKET CAPTURE_FILE [SPEED]
+ *
+ * Keys are replaced with their hashes, so clients are paired the same way
+ * as the captured ones.  Prefix keys could not be restored from hashes and
+ * are requested as exact keys.  Clients that the broker paired in the
+ * capture are waiting for a pair until the end of the replay, others give
+ * up at the time they disconnected. */
+
+#include <config.h>
+
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "broker.h"
+#include "capture.h"
+
+#include <socketpair-broker/helper.h>
+
+/* How long to wait for pairs after the last captured event. */
+#define DRAIN_TIMEOUT_MS    5000
+
+enum replay_state {
+    REPLAY_IDLE,                    /* Not connected yet. */
+    REPLAY_CONNECTED,
+    REPLAY_CLOSED,                  /* Disconnected without a request. */
+    REPLAY_WAITING,                 /* GET_PAIR sent. */
+    REPLAY_PAIRED,
+    REPLAY_GAVE_UP,
+    REPLAY_DROPPED,                 /* Disconnected by the broker. */
+    REPLAY_FAILED,                  /* Could not connect or send. */
+};
+
+struct replay_client {
+    uint32_t worker;                /* Identity in the capture. */
+    uint32_t client;
+    uint64_t key_hash;
+    uint8_t mode;
+    bool prefix;
+    bool completed;                 /* Was paired in the capture. */
+
+    enum replay_state state;
+    int fd;
+    uint64_t request_us;            /* When GET_PAIR was sent. */
+    uint64_t paired_us;             /* When SET_PAIR was received. */
+    uint64_t pair_id;
+};
+
+struct replay_action {
+    uint64_t time_us;               /* Captured time. */
+    int client;                     /* Index in 'clients'. */
+    enum capture_event event;
+};
+
+static struct replay_client *clients;
+static int n_clients;
+static struct replay_action *actions;
+static int n_actions;
+static int n_prefix;
+
+static uint64_t
+time_now_usec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int
+record_cmp(const void *a_, const void *b_)
+{
+    const struct capture_record *a = a_, *b = b_;
+
+    if (a->time_us != b->time_us) {
+        return a->time_us < b->time_us ? -1 : 1;
+    }
+    /* Events of the same client at the same time keep their order. */
+    return a->event < b->event ? -1 : a->event > b->event;
+}
+
+static int
+identity_cmp(const void *a_, const void *b_)
+{
+    const struct replay_client *a = &clients[*(const int *) a_];
+    const struct replay_client *b = &clients[*(const int *) b_];
+
+    if (a->worker != b->worker) {
+        return a->worker < b->worker ? -1 : 1;
+    }
+    return a->client < b->client ? -1 : a->client > b->client;
+}
+
+/* Returns the index of the client with the captured identity or -1.
+ * 'sorted' are indexes of all the clients sorted by identity_cmp(). */
+static int
+replay_client_find(const int *sorted, uint32_t worker, uint32_t client)
+{
+    int low = 0, high = n_clients;
+
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        const struct replay_client *c = &clients[sorted[mid]];
+
+        if (c->worker == worker && c->client == client) {
+            return sorted[mid];
+        }
+        if (c->worker < worker
+            || (c->worker == worker && c->client < client)) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return -1;
+}
+
+static int
+capture_load(const char *path)
+{
+    struct capture_record *records = NULL;
+    struct capture_header header;
+    size_t n_records = 0, allocated = 0;
+    int *sorted;
+    FILE *file;
+    size_t i;
+
+    file = fopen(path, "rb");
+    if (!file) {
+        fprintf(stderr, "Failed to open '%s': %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (fread(&header, sizeof header, 1, file) != 1
+        || memcmp(header.magic, CAPTURE_MAGIC, sizeof header.magic)
+        || header.version != CAPTURE_VERSION
+        || header.record_size != sizeof *records) {
+        fprintf(stderr, "'%s' is not a capture of a supported version.\n",
+                path);
+        fclose(file);
+        return -1;
+    }
+    for (;;) {
+        if (n_records == allocated) {
+            allocated = allocated ? allocated * 2 : 4096;
+            records = realloc(records, allocated * sizeof *records);
+            if (!records) {
+                perror("Failed to allocate memory for records");
+                abort();
+            }
+        }
+        /* Partially written last record is ignored. */
+        if (fread(&records[n_records], sizeof *records, 1, file) != 1) {
+            break;
+        }
+        n_records++;
+    }
+    fclose(file);
+
+    /* Workers write their records in batches, so the file is ordered only
+     * within a worker. */
+    qsort(records, n_records, sizeof *records, record_cmp);
+
+    clients = calloc(n_records ? n_records : 1, sizeof *clients);
+    actions = calloc(n_records ? n_records : 1, sizeof *actions);
+    sorted = calloc(n_records ? n_records : 1, sizeof *sorted);
+    if (!clients || !actions || !sorted) {
+        perror("Failed to allocate memory for clients");
+        abort();
+    }
+    for (i = 0; i < n_records; i++) {
+        if (records[i].event == CAPTURE_CONNECT) {
+            clients[n_clients].worker = records[i].worker;
+            clients[n_clients].client = records[i].client;
+            clients[n_clients].fd = -1;
+            sorted[n_clients] = n_clients;
+            n_clients++;
+        }
+    }
+    qsort(sorted, n_clients, sizeof *sorted, identity_cmp);
+
+    for (i = 0; i < n_records; i++) {
+        const struct capture_record *record = &records[i];
+        struct replay_client *client;
+        int idx;
+
+        /* Clients that connected before the capture started are not
+         * replayed. */
+        idx = replay_client_find(sorted, record->worker, record->client);
+        if (idx < 0) {
+            continue;
+        }
+        client = &clients[idx];
+
+        if (record->event == CAPTURE_GET_PAIR) {
+            client->key_hash = record->key_hash;
+            client->mode = record->arg & ~CAPTURE_F_PREFIX;
+            client->prefix = record->arg & CAPTURE_F_PREFIX;
+            n_prefix += client->prefix;
+        } else if (record->event == CAPTURE_DISCONNECT) {
+            client->completed = record->arg == CLIENT_STATE_COMPLETE;
+        } else if (record->event != CAPTURE_CONNECT) {
+            continue;
+        }
+        actions[n_actions].time_us = record->time_us;
+        actions[n_actions].client = idx;
+        actions[n_actions].event = record->event;
+        n_actions++;
+    }
+    free(sorted);
+    free(records);
+    return 0;
+}
+
+static void
+replay_close(struct replay_client *client, enum replay_state state)
+{
+    if (client->fd >= 0) {
+        close(client->fd);
+        client->fd = -1;
+    }
+    client->state = state;
+}
+
+static void
+replay_action(const char *sock_path, const struct replay_action *action)
+{
+    struct replay_client *client = &clients[action->client];
+    struct sp_broker_pair_params params;
+    char key[32];
+    char *err;
+
+    switch (action->event) {
+    case CAPTURE_CONNECT:
+        client->fd = sp_broker_connect(sock_path, false, &err);
+        if (client->fd < 0) {
+            fprintf(stderr, "%s.\n", err);
+            free(err);
+            client->state = REPLAY_FAILED;
+            return;
+        }
+        client->state = REPLAY_CONNECTED;
+        break;
+    case CAPTURE_GET_PAIR:
+        if (client->state != REPLAY_CONNECTED) {
+            return;
+        }
+        sp_broker_pair_params_init(&params);
+        params.mode = client->mode;
+        snprintf(key, sizeof key, "capture-%016"PRIx64, client->key_hash);
+        if (sp_broker_send_get_pair_params(client->fd, key, &params, &err)) {
+            fprintf(stderr, "%s.\n", err);
+            free(err);
+            replay_close(client, REPLAY_FAILED);
+            return;
+        }
+        client->request_us = time_now_usec();
+        client->state = REPLAY_WAITING;
+        break;
+    case CAPTURE_DISCONNECT:
+        /* Paired clients are disconnected once they receive the pair. */
+        if (client->state == REPLAY_CONNECTED) {
+            replay_close(client, REPLAY_CLOSED);
+        } else if (client->state == REPLAY_WAITING && !client->completed) {
+            replay_close(client, REPLAY_GAVE_UP);
+        }
+        break;
+    }
+}
+
+static void
+replay_receive(struct replay_client *client)
+{
+    struct sp_broker_pair pair;
+
+    if (sp_broker_receive_pair(client->fd, &pair, NULL)) {
+        replay_close(client, REPLAY_DROPPED);
+        return;
+    }
+    client->paired_us = time_now_usec();
+    client->pair_id = pair.id;
+    sp_broker_pair_close(&pair);
+    replay_close(client, REPLAY_PAIRED);
+}
+
+/* Waits for pairs of waiting clients until 'deadline_us'. */
+static void
+replay_poll(uint64_t deadline_us)
+{
+    static struct pollfd *pfds;
+    static int *idx;
+    int i, n = 0, timeout;
+    uint64_t now;
+
+    if (!pfds) {
+        pfds = calloc(n_clients ? n_clients : 1, sizeof *pfds);
+        idx = calloc(n_clients ? n_clients : 1, sizeof *idx);
+        if (!pfds || !idx) {
+            perror("Failed to allocate memory for polling");
+            abort();
+        }
+    }
+    for (i = 0; i < n_clients; i++) {
+        if (clients[i].state == REPLAY_WAITING) {
+            pfds[n].fd = clients[i].fd;
+            pfds[n].events = POLLIN;
+            idx[n++] = i;
+        }
+    }
+
+    now = time_now_usec();
+    timeout = deadline_us > now ? (deadline_us - now + 999) / 1000 : 0;
+    if (poll(pfds, n, timeout) <= 0) {
+        return;
+    }
+    for (i = 0; i < n; i++) {
+        if (pfds[i].revents) {
+            replay_receive(&clients[idx[i]]);
+        }
+    }
+}
+
+static int
+u64_cmp(const void *a_, const void *b_)
+{
+    const uint64_t *a = a_, *b = b_;
+
+    return *a < *b ? -1 : *a > *b;
+}
+
+static void
+print_latency(const char *name, uint64_t *values, int n)
+{
+    uint64_t sum = 0;
+    int i;
+
+    if (!n) {
+        printf("%s: none.\n", name);
+        return;
+    }
+    qsort(values, n, sizeof *values, u64_cmp);
+    for (i = 0; i < n; i++) {
+        sum += values[i];
+    }
+    printf("%s: average: %"PRIu64" us, p50: %"PRIu64" us, "
+           "p90: %"PRIu64" us, p99: %"PRIu64" us, max: %"PRIu64" us.\n",
+           name, sum / n, values[n / 2], values[n * 9 / 10],
+           values[n * 99 / 100], values[n - 1]);
+}
+
+static int
+pair_id_cmp(const void *a_, const void *b_)
+{
+    const struct replay_client *a = a_, *b = b_;
+
+    return a->pair_id < b->pair_id ? -1 : a->pair_id > b->pair_id;
+}
+
+static void
+replay_report(void)
+{
+    int n_states[REPLAY_FAILED + 1] = { 0 };
+    int i, n_waits = 0, n_pairs = 0;
+    uint64_t *waits, *pairs;
+
+    waits = calloc(n_clients ? n_clients : 1, sizeof *waits);
+    pairs = calloc(n_clients ? n_clients : 1, sizeof *pairs);
+    if (!waits || !pairs) {
+        perror("Failed to allocate memory for the report");
+        abort();
+    }
+
+    for (i = 0; i < n_clients; i++) {
+        n_states[clients[i].state]++;
+        if (clients[i].state == REPLAY_PAIRED && clients[i].pair_id) {
+            waits[n_waits++] = clients[i].paired_us - clients[i].request_us;
+        }
+    }
+
+    /* Latency of the broker is the time from the later request of the two
+     * clients to the later SET_PAIR. */
+    qsort(clients, n_clients, sizeof *clients, pair_id_cmp);
+    for (i = 0; i + 1 < n_clients; i++) {
+        const struct replay_client *a = &clients[i], *b = &clients[i + 1];
+
+        if (!a->pair_id || a->pair_id != b->pair_id) {
+            continue;
+        }
+        pairs[n_pairs++] = (a->paired_us > b->paired_us ? a->paired_us
+                                                          : b->paired_us)
+                           - (a->request_us > b->request_us ? a->request_us
+                                                            : b->request_us);
+        i++;
+    }
+
+    printf("Clients: %d, paired: %d, gave up: %d, dropped by broker: %d, "
+           "failed: %d, not paired: %d, without requests: %d.\n", n_clients,
+           n_states[REPLAY_PAIRED], n_states[REPLAY_GAVE_UP],
+           n_states[REPLAY_DROPPED], n_states[REPLAY_FAILED],
+           n_states[REPLAY_WAITING], n_states[REPLAY_CONNECTED]
+           + n_states[REPLAY_CLOSED] + n_states[REPLAY_IDLE]);
+    if (n_prefix) {
+        printf("Prefix requests replayed as exact keys: %d.\n", n_prefix);
+    }
+    print_latency("Wait for a pair", waits, n_waits);
+    print_latency("Pairing latency", pairs, n_pairs);
+    free(waits);
+    free(pairs);
+}
+
+int
+main(int argc, char **argv)
+{
+    double speed = argc > 3 ? atof(argv[3]) : 1.0;
+    uint64_t start_us, deadline_us;
+    struct rlimit rlim;
+    int i;
+
+    if (argc < 3 || speed <= 0) {
+        printf("Usage: %s SP_BROKER_SOCKET CAPTURE_FILE [SPEED]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (capture_load(argv[2])) {
+        return EXIT_FAILURE;
+    }
+    printf("Replaying %d events of %d clients at %gx speed.\n",
+           n_actions, n_clients, speed);
+
+    /* All the clients of a burst are connected at once. */
+    if (!getrlimit(RLIMIT_NOFILE, &rlim) && rlim.rlim_cur < rlim.rlim_max) {
+        rlim.rlim_cur = rlim.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rlim);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    start_us = time_now_usec();
+    for (i = 0; i < n_actions; ) {
+        deadline_us = start_us + (actions[i].time_us - actions[0].time_us)
+                                 / speed;
+        if (time_now_usec() < deadline_us) {
+            replay_poll(deadline_us);
+            continue;
+        }
+        replay_action(argv[1], &actions[i++]);
+    }
+
+    deadline_us = time_now_usec() + DRAIN_TIMEOUT_MS * 1000;
+    for (;;) {
+        bool waiting = false;
+
+        for (i = 0; i < n_clients && !waiting; i++) {
+            waiting = clients[i].state == REPLAY_WAITING;
+        }
+        if (!waiting || time_now_usec() >= deadline_us) {
+            break;
+        }
+        replay_poll(deadline_us);
+    }
+
+    replay_report();
+    return EXIT_SUCCESS;
+}
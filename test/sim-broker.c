@@ -0,0 +1,834 @@
+/*
+ * Copyright (c) 2021 Ilya Maximets <i.maximets@ovn.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Deterministic simulator of the broker.  Runs the real worker loop and
+ * request handling of the broker on top of virtual implementations of
+ * polling.h, socket-util.h and timeval.h: clients are plain structures,
+ * their connections are virtual descriptors and the time only moves when
+ * the broker waits for events.  Results depend only on the workload and
+ * the seed, not on the kernel or the machine load, so changes in matching,
+ * balancing and eviction could be compared reproducibly.
+ *
+ * Usage: sim-broker [WORKLOAD [CLIENTS [SEED [PATIENCE_MS]]]]
+ *
+ * Workloads:
+ *   random          - pairs of a server and a client arrive at random times.
+ *   ovs-start       - all servers arrive at once, clients trickle in.
+ *   reconnect       - all nondirectional clients reconnect at once.
+ *   same-key        - servers of few instances share few keys.
+ *   stuck           - first server of every key never reads its SET_PAIR.
+ *
+ * Clients that are not paired in PATIENCE_MS (0 - never) disconnect.
+ * Set TEST_VERBOSE environment variable to see the broker output. */
+
+#include <config.h>
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "balancer.h"
+#include "polling.h"
+#include "socket-util.h"
+#include "timeval.h"
+#include "worker.h"
+
+#include <socketpair-broker/helper.h>
+#include <socketpair-broker/proto.h>
+
+/* Virtual descriptors are far above any real one, so close() could tell
+ * them apart. */
+#define SIM_FD_BASE         (1 << 24)
+#define SIM_LISTEN_FD       SIM_FD_BASE
+#define SIM_POLL_FD         (SIM_FD_BASE + 1)
+#define SIM_CLIENT_FD_BASE  (SIM_FD_BASE + 2)
+
+/* PIDs above the kernel's maximum, so the broker will not find processes
+ * of virtual clients in /proc. */
+#define SIM_PID_BASE        (1 << 22)
+
+/* Clients arrive at the rate of 10000 per second. */
+#define SIM_ARRIVAL_US      100
+
+/* Second client of a pair arrives within 20 ms after the first one. */
+#define SIM_PARTNER_DELAY_US    20000
+
+struct sim_client {
+    uint64_t arrival_us;
+    uint64_t paired_us;         /* When SET_PAIR was received. */
+    int key;
+    enum sp_broker_get_pair_mode mode;
+    pid_t pid;
+
+    /* Connection.  Client end is the even descriptor, broker end is the
+     * odd one. */
+    char *in;                   /* Data sent by the client. */
+    int in_len;
+    int in_pos;                 /* Data read by the broker. */
+    bool paired;
+    bool client_closed;
+    bool broker_closed;
+    bool registered;            /* Broker end is polled. */
+    bool want_write;
+    bool stuck;                 /* Never reads, so the broker can't send. */
+    bool queued;                /* In the ready queue. */
+    void *data;                 /* Polling data of the broker end. */
+};
+
+static struct sim {
+    uint64_t now_us;            /* Virtual clock. */
+    bool done;                  /* No more actions, nothing to serve. */
+
+    struct sim_client *clients; /* In order of arrival. */
+    int n_clients;
+    int next_arrival;           /* First client that didn't connect yet. */
+    int next_accept;            /* First client that wasn't accepted. */
+    int next_expiry;            /* First client that may run out of patience. */
+    uint64_t patience_us;
+
+    bool listen_registered;
+    void *listen_data;
+
+    int *ready;                 /* Clients that may have events. */
+    int n_ready;
+
+    unsigned int pair_fd_seq;   /* Descriptors of created pairs. */
+
+    /* Statistics. */
+    uint64_t n_events;
+    uint64_t n_iterations;
+    int n_paired;
+    int n_gave_up;
+    int n_dropped;              /* Disconnected by the broker before SET_PAIR. */
+} sim;
+
+static uint64_t
+sim_random(uint64_t *state)
+{
+    /* xorshift64* */
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * UINT64_C(2685821657736338717);
+}
+
+/* Virtual clock. */
+
+uint64_t
+time_msec(void)
+{
+    return sim.now_us / 1000;
+}
+
+uint64_t
+time_usec(void)
+{
+    return sim.now_us;
+}
+
+/* Virtual descriptors. */
+
+static struct sim_client *
+sim_client_by_fd(int fd, bool *broker_end)
+{
+    int idx = fd - SIM_CLIENT_FD_BASE;
+
+    if (idx < 0 || idx / 2 >= sim.n_clients) {
+        return NULL;
+    }
+    *broker_end = idx & 1;
+    return &sim.clients[idx / 2];
+}
+
+static int
+sim_client_fd(const struct sim_client *client, bool broker_end)
+{
+    return SIM_CLIENT_FD_BASE + (client - sim.clients) * 2 + broker_end;
+}
+
+static void
+sim_client_wake(struct sim_client *client)
+{
+    if (!client->queued && client->registered) {
+        client->queued = true;
+        sim.ready[sim.n_ready++] = client - sim.clients;
+    }
+}
+
+int __real_close(int fd);
+int __wrap_close(int fd);
+
+int
+__wrap_close(int fd)
+{
+    struct sim_client *client;
+    bool broker_end;
+
+    if (fd < SIM_FD_BASE) {
+        return __real_close(fd);
+    }
+    client = sim_client_by_fd(fd, &broker_end);
+    if (client && broker_end) {
+        client->broker_closed = true;
+        client->registered = false;
+        /* Clients that are still waiting when the simulation is over are
+         * not dropped, they are never paired. */
+        if (!client->paired && !client->client_closed && !sim.done) {
+            sim.n_dropped++;
+        }
+        free(client->in);
+        client->in = NULL;
+    }
+    /* Listening socket, polling and created pairs have no state. */
+    return 0;
+}
+
+int
+socket_set_nonblock(int fd, const char *name)
+{
+    return 0;
+}
+
+int
+socket_create_listening(const char *path, bool force, bool nonblock)
+{
+    errno = ENOTSUP;
+    return -1;
+}
+
+int
+socket_connect(const char *path, bool nonblock)
+{
+    errno = ENOTSUP;
+    return -1;
+}
+
+int
+socket_accept(int fd)
+{
+    struct sim_client *client;
+
+    if (fd != SIM_LISTEN_FD) {
+        errno = EBADF;
+        return -1;
+    }
+    if (sim.next_accept == sim.next_arrival) {
+        errno = EAGAIN;
+        return -1;
+    }
+    client = &sim.clients[sim.next_accept++];
+    return sim_client_fd(client, true);
+}
+
+int
+socket_pair_get(int type, int sp[2])
+{
+    /* Nobody uses them, so they don't need any state. */
+    sp[0] = SIM_CLIENT_FD_BASE + 2 * sim.n_clients + sim.pair_fd_seq++;
+    sp[1] = SIM_CLIENT_FD_BASE + 2 * sim.n_clients + sim.pair_fd_seq++;
+    sim.pair_fd_seq %= 1 << 20;
+    return 0;
+}
+
+int
+socket_set_buffers(int fd, int sndbuf, int rcvbuf)
+{
+    return 0;
+}
+
+int
+socket_set_flag(int fd, int option, bool value)
+{
+    return 0;
+}
+
+int
+socket_get_peer_cred(int fd, pid_t *pid, uid_t *uid, gid_t *gid)
+{
+    struct sim_client *client;
+    bool broker_end;
+
+    client = sim_client_by_fd(fd, &broker_end);
+    if (!client) {
+        errno = EBADF;
+        return -1;
+    }
+    *pid = client->pid;
+    *uid = 0;
+    *gid = 0;
+    return 0;
+}
+
+int
+socket_read_message(int fd, char *buf, int buflen,
+                    int *fds, int fds_len, int *n_fds)
+{
+    struct sim_client *client;
+    bool broker_end;
+    int len;
+
+    client = sim_client_by_fd(fd, &broker_end);
+    if (!client || !broker_end || client->broker_closed) {
+        errno = EBADF;
+        return -1;
+    }
+    if (n_fds) {
+        *n_fds = 0;
+    }
+    if (client->in_pos == client->in_len) {
+        if (client->client_closed) {
+            return 0;
+        }
+        errno = EAGAIN;
+        return -1;
+    }
+
+    len = client->in_len - client->in_pos;
+    if (len > buflen) {
+        len = buflen;
+    }
+    memcpy(buf, client->in + client->in_pos, len);
+    client->in_pos += len;
+    return len;
+}
+
+int
+socket_send_message(int fd, char *buf, int buflen, int *fds, int n_fds)
+{
+    const struct sp_broker_msg *msg = (const void *) buf;
+    struct sim_client *client;
+    bool broker_end;
+
+    client = sim_client_by_fd(fd, &broker_end);
+    if (!client || client->broker_closed) {
+        errno = EBADF;
+        return -1;
+    }
+
+    if (!broker_end) {
+        /* Request of the client.  Clients send only one. */
+        client->in = malloc(buflen);
+        if (!client->in) {
+            perror("Failed to allocate memory for a message");
+            abort();
+        }
+        memcpy(client->in, buf, buflen);
+        client->in_len = buflen;
+        client->in_pos = 0;
+        sim_client_wake(client);
+        return buflen;
+    }
+
+    if (client->client_closed) {
+        errno = EPIPE;
+        return -1;
+    }
+    if (client->stuck) {
+        errno = EAGAIN;
+        return -1;
+    }
+    /* Broker sends the whole SET_PAIR at once, since nothing limits the
+     * virtual socket buffer. */
+    if (buflen == (int) sp_broker_message_length(msg)
+        && msg->request == SP_BROKER_SET_PAIR && !client->paired) {
+        client->paired = true;
+        client->paired_us = sim.now_us;
+        sim.n_paired++;
+    }
+    return buflen;
+}
+
+/* Virtual polling. */
+
+int
+poll_create(int id)
+{
+    return SIM_POLL_FD;
+}
+
+void
+poll_destroy(int poll_fd)
+{
+    int i;
+
+    sim.listen_registered = false;
+    for (i = 0; i < sim.n_clients; i++) {
+        sim.clients[i].registered = false;
+    }
+}
+
+int
+poll_add(int id, int poll_fd, int fd, void *data, const char *name)
+{
+    struct sim_client *client;
+    bool broker_end;
+
+    if (fd == SIM_LISTEN_FD) {
+        sim.listen_registered = true;
+        sim.listen_data = data;
+        return 0;
+    }
+    client = sim_client_by_fd(fd, &broker_end);
+    if (!client || !broker_end || client->broker_closed) {
+        errno = EBADF;
+        return -1;
+    }
+    client->registered = true;
+    client->want_write = false;
+    client->data = data;
+    sim_client_wake(client);
+    return 0;
+}
+
+int
+poll_mod(int id, int poll_fd, int fd, void *data, bool writable,
+         const char *name)
+{
+    struct sim_client *client;
+    bool broker_end;
+
+    client = sim_client_by_fd(fd, &broker_end);
+    if (!client || !broker_end || !client->registered) {
+        errno = ENOENT;
+        return -1;
+    }
+    client->want_write = writable;
+    client->data = data;
+    sim_client_wake(client);
+    return 0;
+}
+
+int
+poll_del(int id, int poll_fd, int fd, const char *name)
+{
+    struct sim_client *client;
+    bool broker_end;
+
+    if (fd == SIM_LISTEN_FD) {
+        sim.listen_registered = false;
+        return 0;
+    }
+    client = sim_client_by_fd(fd, &broker_end);
+    if (!client || !broker_end || !client->registered) {
+        errno = ENOENT;
+        return -1;
+    }
+    client->registered = false;
+    return 0;
+}
+
+/* Collects level-triggered events of the ready clients.  Clients that still
+ * have events stay in the queue. */
+static int
+sim_collect_events(struct poll_event *events, int max_events)
+{
+    int i, n = 0, n_ready = 0;
+
+    if (sim.listen_registered && sim.next_accept < sim.next_arrival) {
+        events[n].error = false;
+        events[n].readable = true;
+        events[n].writable = false;
+        events[n].data = sim.listen_data;
+        n++;
+    }
+
+    for (i = 0; i < sim.n_ready; i++) {
+        struct sim_client *client = &sim.clients[sim.ready[i]];
+        bool readable = client->in_pos < client->in_len
+                        || client->client_closed;
+        bool writable = client->want_write && !client->stuck;
+
+        if (!client->registered || (!readable && !writable)) {
+            client->queued = false;
+            continue;
+        }
+        sim.ready[n_ready++] = sim.ready[i];
+        if (n < max_events) {
+            events[n].error = client->client_closed;
+            events[n].readable = readable;
+            events[n].writable = writable;
+            events[n].data = client->data;
+            n++;
+        }
+    }
+    sim.n_ready = n_ready;
+    return n;
+}
+
+/* Time of the next action of clients, UINT64_MAX if none. */
+static uint64_t
+sim_next_action(void)
+{
+    uint64_t next = UINT64_MAX;
+
+    if (sim.next_arrival < sim.n_clients) {
+        next = sim.clients[sim.next_arrival].arrival_us;
+    }
+    /* Clients run out of patience in order of arrival. */
+    while (sim.patience_us && sim.next_expiry < sim.next_arrival) {
+        struct sim_client *client = &sim.clients[sim.next_expiry];
+
+        if (client->paired || client->broker_closed) {
+            sim.next_expiry++;
+            continue;
+        }
+        if (client->arrival_us + sim.patience_us < next) {
+            next = client->arrival_us + sim.patience_us;
+        }
+        break;
+    }
+    return next;
+}
+
+static void
+sim_client_connect(struct sim_client *client)
+{
+    struct sp_broker_pair_params params;
+    char key[32];
+
+    sp_broker_pair_params_init(&params);
+    params.mode = client->mode;
+    snprintf(key, sizeof key, "sim-key-%d", client->key);
+    if (sp_broker_send_get_pair_params(sim_client_fd(client, false), key,
+                                       &params, NULL)) {
+        fprintf(stderr, "Failed to send a request: %s\n", strerror(errno));
+        abort();
+    }
+}
+
+/* Performs all the actions of clients that are due. */
+static void
+sim_run_actions(void)
+{
+    while (sim.next_arrival < sim.n_clients
+           && sim.clients[sim.next_arrival].arrival_us <= sim.now_us) {
+        sim_client_connect(&sim.clients[sim.next_arrival++]);
+    }
+    while (sim.patience_us && sim.next_expiry < sim.next_arrival) {
+        struct sim_client *client = &sim.clients[sim.next_expiry];
+
+        if (client->arrival_us + sim.patience_us > sim.now_us) {
+            break;
+        }
+        if (!client->paired && !client->broker_closed) {
+            client->client_closed = true;
+            sim.n_gave_up++;
+            sim_client_wake(client);
+        }
+        sim.next_expiry++;
+    }
+}
+
+int
+poll_wait_for_events(int id, int poll_fd,
+                     struct poll_event *events, int max_events,
+                     int timeout_ms)
+{
+    uint64_t deadline = timeout_ms < 0 ? UINT64_MAX
+                        : sim.now_us + (uint64_t) timeout_ms * 1000;
+
+    sim.n_iterations++;
+    for (;;) {
+        uint64_t next;
+        int n;
+
+        n = sim_collect_events(events, max_events);
+        if (n || !timeout_ms) {
+            sim.n_events += n;
+            return n;
+        }
+
+        /* Nothing to do.  Moving the clock to the next action. */
+        next = sim_next_action();
+        if (next > deadline) {
+            sim.now_us = deadline;
+            return 0;
+        }
+        if (next == UINT64_MAX) {
+            sim.done = true;
+            return 0;
+        }
+        if (next > sim.now_us) {
+            sim.now_us = next;
+        }
+        sim_run_actions();
+    }
+}
+
+/* Workloads. */
+
+static void
+sim_client_init(struct sim_client *client, int key,
+                enum sp_broker_get_pair_mode mode, uint64_t arrival_us,
+                int instance)
+{
+    memset(client, 0, sizeof *client);
+    client->key = key;
+    client->mode = mode;
+    client->arrival_us = arrival_us;
+    client->pid = SIM_PID_BASE + instance;
+}
+
+static uint64_t
+sim_duration_us(void)
+{
+    return (uint64_t) sim.n_clients * SIM_ARRIVAL_US;
+}
+
+static void
+workload_random(uint64_t *seed)
+{
+    uint64_t start = 0;
+    int i;
+
+    /* Either side of a pair could come first. */
+    for (i = 0; i < sim.n_clients; i++) {
+        if (i % 2 == 0) {
+            start = sim_random(seed) % sim_duration_us();
+        }
+        sim_client_init(&sim.clients[i], i / 2,
+                        i % 2 ? SP_BROKER_PAIR_MODE_CLIENT
+                              : SP_BROKER_PAIR_MODE_SERVER,
+                        start + sim_random(seed) % SIM_PARTNER_DELAY_US, i);
+    }
+}
+
+static void
+workload_ovs_start(uint64_t *seed)
+{
+    int i;
+
+    /* One switch registers servers for all its ports within a millisecond,
+     * virtual machines boot one by one. */
+    for (i = 0; i < sim.n_clients; i++) {
+        bool server = i % 2 == 0;
+
+        sim_client_init(&sim.clients[i], i / 2,
+                        server ? SP_BROKER_PAIR_MODE_SERVER
+                               : SP_BROKER_PAIR_MODE_CLIENT,
+                        server ? sim_random(seed) % 1000
+                               : sim_random(seed) % sim_duration_us(),
+                        server ? 0 : i);
+    }
+}
+
+static void
+workload_reconnect(uint64_t *seed)
+{
+    int i;
+
+    /* Both sides of every pair came back after the broker restart within
+     * a few milliseconds. */
+    for (i = 0; i < sim.n_clients; i++) {
+        sim_client_init(&sim.clients[i], i / 2, SP_BROKER_PAIR_MODE_NONE,
+                        sim_random(seed) % 5000, i);
+    }
+}
+
+static void
+workload_same_key(uint64_t *seed)
+{
+    int n_keys = sim.n_clients / 200 + 1;
+    int i;
+
+    /* A few backends with 4 instances each serve many clients. */
+    for (i = 0; i < sim.n_clients; i++) {
+        int key = sim_random(seed) % n_keys;
+
+        sim_client_init(&sim.clients[i], key,
+                        i % 2 ? SP_BROKER_PAIR_MODE_CLIENT
+                              : SP_BROKER_PAIR_MODE_SERVER,
+                        sim_random(seed) % sim_duration_us(),
+                        i % 2 ? i : (int) (key * 4 + sim_random(seed) % 4));
+    }
+}
+
+static void
+workload_stuck(uint64_t *seed)
+{
+    uint64_t start = 0;
+    int i;
+
+    /* Every key has a server that stopped reading, a client that comes
+     * after it and another server that comes after the client.  Clients
+     * should not wait for stuck servers forever. */
+    for (i = 0; i < sim.n_clients; i++) {
+        if (i % 3 == 0) {
+            start = sim_random(seed) % sim_duration_us();
+        }
+        sim_client_init(&sim.clients[i], i / 3,
+                        i % 3 == 1 ? SP_BROKER_PAIR_MODE_CLIENT
+                                   : SP_BROKER_PAIR_MODE_SERVER,
+                        start + (i % 3) * SIM_PARTNER_DELAY_US, i);
+        sim.clients[i].stuck = i % 3 == 0;
+    }
+}
+
+/* Partners of evicted clients are never paired, unless the workload is
+ * 'strict', i.e. it doesn't overflow the broker.  Simulation of a strict
+ * workload fails if some client is left without a pair. */
+static const struct {
+    const char *name;
+    void (*init)(uint64_t *seed);
+    bool strict;
+} workloads[] = {
+    { "random",     workload_random,    false },
+    { "ovs-start",  workload_ovs_start, false },
+    { "reconnect",  workload_reconnect, false },
+    { "same-key",   workload_same_key,  false },
+    { "stuck",      workload_stuck,     true },
+};
+
+static int
+sim_client_cmp(const void *a_, const void *b_)
+{
+    const struct sim_client *a = a_, *b = b_;
+
+    if (a->arrival_us != b->arrival_us) {
+        return a->arrival_us < b->arrival_us ? -1 : 1;
+    }
+    return a->pid < b->pid ? -1 : a->pid > b->pid;
+}
+
+static uint64_t
+wall_usec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+sim_report(FILE *out, const char *workload, uint64_t wall_us)
+{
+    uint64_t wait_sum = 0, wait_max = 0;
+    int i;
+
+    for (i = 0; i < sim.n_clients; i++) {
+        const struct sim_client *client = &sim.clients[i];
+        uint64_t wait = client->paired_us - client->arrival_us;
+
+        if (!client->paired) {
+            continue;
+        }
+        wait_sum += wait;
+        if (wait > wait_max) {
+            wait_max = wait;
+        }
+    }
+
+    fprintf(out, "Workload '%s': %d clients, virtual time: %"PRIu64" ms.\n",
+            workload, sim.n_clients, sim.now_us / 1000);
+    fprintf(out, "Paired: %d, gave up: %d, dropped by broker: %d, "
+            "never paired: %d.\n", sim.n_paired, sim.n_gave_up,
+            sim.n_dropped,
+            sim.n_clients - sim.n_paired - sim.n_gave_up - sim.n_dropped);
+    fprintf(out, "Wait for a pair: average: %"PRIu64" us, max: %"PRIu64
+            " us.\n", sim.n_paired ? wait_sum / sim.n_paired : 0, wait_max);
+    fprintf(out, "Loop iterations: %"PRIu64", events: %"PRIu64", "
+            "wall time: %"PRIu64" ms, %.0f events/s.\n",
+            sim.n_iterations, sim.n_events, wall_us / 1000,
+            wall_us ? sim.n_events * 1e6 / wall_us : 0.0);
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *workload = argc > 1 ? argv[1] : "random";
+    int n_clients = argc > 2 ? atoi(argv[2]) : 100000;
+    uint64_t seed = argc > 3 ? strtoull(argv[3], NULL, 0) : 1;
+    int patience_ms = argc > 4 ? atoi(argv[4]) : 0;
+    struct worker_config config;
+    struct worker_loop *loop;
+    uint64_t wall_us;
+    FILE *report;
+    size_t i;
+
+    for (i = 0; i < sizeof workloads / sizeof workloads[0]; i++) {
+        if (!strcmp(workload, workloads[i].name)) {
+            break;
+        }
+    }
+    if (i == sizeof workloads / sizeof workloads[0] || n_clients < 2
+        || patience_ms < 0) {
+        printf("Usage: %s [WORKLOAD [CLIENTS [SEED [PATIENCE_MS]]]]\n",
+               argv[0]);
+        printf("Workloads: random, ovs-start, reconnect, same-key, "
+               "stuck.\n");
+        return EXIT_FAILURE;
+    }
+
+    /* Broker logs every client.  Keeping the report visible. */
+    report = fdopen(dup(STDOUT_FILENO), "w");
+    if (!report || (!getenv("TEST_VERBOSE")
+                    && !freopen("/dev/null", "w", stdout))) {
+        perror("Failed to redirect the broker output");
+        return EXIT_FAILURE;
+    }
+    setvbuf(stdout, NULL, _IOFBF, 1 << 20);
+
+    sim.n_clients = n_clients;
+    sim.patience_us = (uint64_t) patience_ms * 1000;
+    sim.clients = calloc(n_clients, sizeof *sim.clients);
+    sim.ready = calloc(n_clients, sizeof *sim.ready);
+    if (!sim.clients || !sim.ready) {
+        perror("Failed to allocate memory for clients");
+        return EXIT_FAILURE;
+    }
+    seed = seed ? seed : 1;
+    workloads[i].init(&seed);
+    qsort(sim.clients, n_clients, sizeof *sim.clients, sim_client_cmp);
+
+    memset(&config, 0, sizeof config);
+    config.listen_fd = SIM_LISTEN_FD;
+    config.balance = BALANCE_ROUND_ROBIN;
+    config.capture_fd = -1;
+    config.numa_node = -1;
+
+    wall_us = wall_usec();
+    loop = worker_loop_create(worker_new_id(), &config, -1);
+    if (!loop) {
+        fprintf(report, "Failed to create the worker loop.\n");
+        return EXIT_FAILURE;
+    }
+    while (!sim.done) {
+        if (worker_loop_run(loop, worker_loop_timeout(loop))) {
+            fprintf(report, "Worker loop failed.\n");
+            return EXIT_FAILURE;
+        }
+    }
+    worker_loop_dump_stats(loop);
+    worker_loop_destroy(loop);
+    wall_us = wall_usec() - wall_us;
+
+    fflush(stdout);
+    sim_report(report, workload, wall_us);
+    fclose(report);
+
+    if (workloads[i].strict
+        && sim.n_paired + sim.n_gave_up + sim.n_dropped != sim.n_clients) {
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,240 @@
+/*
+ * Copyright (c) 2021 Ilya Maximets <i.maximets@ovn.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Test of the embedded broker.  Drives libonesocket from a poll() loop of
+ * the test itself, the same way an application would do, pairs real
+ * clients, forces a restart of the broker and checks that log messages go
+ * to the configured handler.
+ *
+ * Usage: test-embedded
+ *
+ * Set TEST_VERBOSE environment variable to see the broker output. */
+
+#include <config.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "socket-util.h"
+
+#include <one-socket/broker.h>
+#include <socketpair-broker/helper.h>
+
+#define TIMEOUT_MS          10000
+
+#define CHECK(COND)                                                 \
+    do {                                                            \
+        if (!(COND)) {                                              \
+            fprintf(stderr, "FAIL:%s:%d: %s (errno: %s)\n",         \
+                    __FILE__, __LINE__, #COND, strerror(errno));    \
+            return -1;                                              \
+        }                                                           \
+    } while (0)
+
+static char tmp_dir[] = "/tmp/one-socket-test-XXXXXX";
+static char sock_path[sizeof tmp_dir + 32];
+
+/* ID of the last pair created by test_pairing(). */
+static uint64_t last_pair_id;
+
+/* Number of messages received by test_log() per level. */
+static int n_logged[ONE_SOCKET_LOG_INFO + 1];
+
+static void
+test_log(enum one_socket_log_level level, const char *msg, void *aux)
+{
+    int *n = aux;
+
+    n[level]++;
+    if (getenv("TEST_VERBOSE")) {
+        printf("%s: %s\n", level == ONE_SOCKET_LOG_ERROR ? "ERR" : "INFO",
+               msg);
+    }
+}
+
+/* Runs the broker until both 'a' and 'b' have something to read. */
+static int
+serve(struct one_socket_broker *broker, int a, int b)
+{
+    int i;
+
+    for (i = 0; i < TIMEOUT_MS / 10; i++) {
+        struct pollfd pfds[3] = {
+            { .fd = one_socket_broker_fd(broker), .events = POLLIN },
+            { .fd = a, .events = POLLIN },
+            { .fd = b, .events = POLLIN },
+        };
+        int timeout = one_socket_broker_timeout(broker);
+
+        if (timeout < 0 || timeout > 10) {
+            timeout = 10;
+        }
+        CHECK(poll(pfds, 3, timeout) >= 0);
+        if (pfds[1].revents && pfds[2].revents) {
+            return 0;
+        }
+        CHECK(one_socket_broker_process(broker) == 0);
+    }
+    CHECK(!"Clients were not served");
+    return -1;
+}
+
+static int
+send_get_pair(int fd, const char *key, enum sp_broker_get_pair_mode mode)
+{
+    struct sp_broker_pair_params params;
+
+    sp_broker_pair_params_init(&params);
+    params.mode = mode;
+    return sp_broker_send_get_pair_params(fd, key, &params, NULL);
+}
+
+/* Pairs two new clients through the broker and checks that they are
+ * connected. */
+static int
+test_pairing(struct one_socket_broker *broker, const char *key)
+{
+    struct sp_broker_pair a, b;
+    int server, client;
+    char c = 0;
+
+    server = sp_broker_connect(sock_path, false, NULL);
+    client = sp_broker_connect(sock_path, false, NULL);
+    CHECK(server >= 0 && client >= 0);
+    CHECK(!send_get_pair(server, key, SP_BROKER_PAIR_MODE_SERVER));
+    CHECK(!send_get_pair(client, key, SP_BROKER_PAIR_MODE_CLIENT));
+    CHECK(!serve(broker, server, client));
+    CHECK(!sp_broker_receive_pair(server, &a, NULL));
+    CHECK(!sp_broker_receive_pair(client, &b, NULL));
+    CHECK(a.id && a.id == b.id && a.n_fds == 1 && b.n_fds == 1);
+    last_pair_id = a.id;
+    CHECK(write(a.fds[0], "x", 1) == 1);
+    CHECK(read(b.fds[0], &c, 1) == 1 && c == 'x');
+    sp_broker_pair_close(&a);
+    sp_broker_pair_close(&b);
+    close(server);
+    close(client);
+    return 0;
+}
+
+/* Failure of the broker's descriptor makes the broker restart.  Clients
+ * are disconnected, but new ones are served through the new descriptor.
+ * IDs of pairs created before the restart are not reused. */
+static int
+test_restart(struct one_socket_broker *broker)
+{
+    uint64_t pair_id = last_pair_id;
+    char buf[SP_BROKER_HEADER_SIZE];
+    int i, waiting;
+
+    waiting = sp_broker_connect(sock_path, false, NULL);
+    CHECK(waiting >= 0);
+    CHECK(!send_get_pair(waiting, "restart", SP_BROKER_PAIR_MODE_SERVER));
+    for (i = 0; i < 10; i++) {
+        struct pollfd pfd = {
+            .fd = one_socket_broker_fd(broker), .events = POLLIN,
+        };
+
+        CHECK(poll(&pfd, 1, 10) >= 0);
+        CHECK(one_socket_broker_process(broker) == 0);
+    }
+
+    close(one_socket_broker_fd(broker));
+    CHECK(one_socket_broker_process(broker) == 1);
+    CHECK(one_socket_broker_fd(broker) >= 0);
+    CHECK(n_logged[ONE_SOCKET_LOG_ERROR] > 0);
+
+    /* Waiting client is gone with the old state. */
+    CHECK(recv(waiting, buf, sizeof buf, 0) == 0);
+    close(waiting);
+
+    CHECK(!test_pairing(broker, "restart"));
+    CHECK(last_pair_id > pair_id);
+    return 0;
+}
+
+static int
+run(int listen_fd)
+{
+    struct one_socket_broker_config config;
+    struct one_socket_broker *broker;
+    int n_info;
+
+    one_socket_broker_config_init(&config);
+    config.pair_pool_size = 4;
+    config.log = test_log;
+    config.log_aux = n_logged;
+    broker = one_socket_broker_create(listen_fd, &config);
+    CHECK(broker);
+    CHECK(one_socket_broker_fd(broker) >= 0);
+    CHECK(n_logged[ONE_SOCKET_LOG_INFO] > 0);
+
+    CHECK(!test_pairing(broker, "embedded"));
+    printf("Pairing: OK.\n");
+
+    CHECK(!test_restart(broker));
+    printf("Restart: OK.\n");
+
+    n_info = n_logged[ONE_SOCKET_LOG_INFO];
+    one_socket_broker_dump_stats(broker);
+    CHECK(n_logged[ONE_SOCKET_LOG_INFO] > n_info);
+    one_socket_broker_destroy(broker);
+
+    /* Only errors are passed to the handler. */
+    config.log_level = ONE_SOCKET_LOG_ERROR;
+    broker = one_socket_broker_create(listen_fd, &config);
+    CHECK(broker);
+    n_info = n_logged[ONE_SOCKET_LOG_INFO];
+    CHECK(!test_pairing(broker, "quiet"));
+    one_socket_broker_dump_stats(broker);
+    one_socket_broker_destroy(broker);
+    CHECK(n_logged[ONE_SOCKET_LOG_INFO] == n_info);
+    printf("Log level: OK.\n");
+
+    /* Invalid configuration. */
+    config.log_level = ONE_SOCKET_LOG_INFO + 1;
+    CHECK(!one_socket_broker_create(listen_fd, &config) && errno == EINVAL);
+    return 0;
+}
+
+int
+main(void)
+{
+    int listen_fd, ret;
+
+    if (!mkdtemp(tmp_dir)) {
+        perror("mkdtemp");
+        return EXIT_FAILURE;
+    }
+    snprintf(sock_path, sizeof sock_path, "%s/one.socket", tmp_dir);
+
+    listen_fd = socket_create_listening(sock_path, true, false);
+    ret = listen_fd < 0 || run(listen_fd) ? EXIT_FAILURE : EXIT_SUCCESS;
+
+    if (listen_fd >= 0) {
+        close(listen_fd);
+    }
+    unlink(sock_path);
+    rmdir(tmp_dir);
+    return ret;
+}
@@ -0,0 +1,411 @@
+/*
+ * Copyright (c) 2021 Ilya Maximets <i.maximets@ovn.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Unit tests for the shared memory ring: reserving and committing, peeking
+ * and releasing, padding at the end of the data area, full ring, wakeups
+ * and a producer exchanging messages with a consumer in another process.
+ *
+ * Usage: test-ring [MESSAGES [SEED]] */
+
+#include <config.h>
+
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <socketpair-broker/proto.h>
+#include <socketpair-broker/helper.h>
+#include <socketpair-broker/ring.h>
+
+#define TIMEOUT_MS          10000
+
+#define CHECK(COND)                                                 \
+    do {                                                            \
+        if (!(COND)) {                                              \
+            fprintf(stderr, "FAIL:%s:%d: %s (errno: %s)\n",         \
+                    __FILE__, __LINE__, #COND, strerror(errno));    \
+            return -1;                                              \
+        }                                                           \
+    } while (0)
+
+/* Creates a ring of 'size' bytes and opens both sides of it. */
+static int
+ring_open_pair(uint32_t size, struct sp_broker_ring **producer,
+               struct sp_broker_ring **consumer)
+{
+    int fds[SP_BROKER_RING_N_FDS];
+    struct sp_broker_pair a, b;
+    int i;
+
+    CHECK(!sp_broker_ring_create(size, fds));
+    memset(&a, 0, sizeof a);
+    memset(&b, 0, sizeof b);
+    a.type = b.type = SP_BROKER_PAIR_TYPE_SHM_RING;
+    a.n_fds = b.n_fds = SP_BROKER_RING_N_FDS;
+    for (i = 0; i < SP_BROKER_RING_N_FDS; i++) {
+        a.fds[i] = fds[i];
+        b.fds[i] = dup(fds[i]);
+        CHECK(b.fds[i] >= 0);
+    }
+    a.producer = true;
+
+    *producer = sp_broker_ring_open(&a);
+    *consumer = sp_broker_ring_open(&b);
+    CHECK(*producer && *consumer);
+    CHECK(!a.n_fds && !b.n_fds);
+    CHECK(sp_broker_ring_is_producer(*producer));
+    CHECK(!sp_broker_ring_is_producer(*consumer));
+    return 0;
+}
+
+static bool
+readable(int fd, int timeout_ms)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+    return poll(&pfd, 1, timeout_ms) == 1;
+}
+
+/* Fills 'len' bytes of 'data' with a pattern of the message 'n'. */
+static void
+fill(uint8_t *data, uint32_t len, uint32_t n)
+{
+    uint32_t i;
+
+    for (i = 0; i < len; i++) {
+        data[i] = n * 31 + i;
+    }
+}
+
+static bool
+check_fill(const uint8_t *data, uint32_t len, uint32_t n)
+{
+    uint32_t i;
+
+    for (i = 0; i < len; i++) {
+        if (data[i] != (uint8_t) (n * 31 + i)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Messages are visible only after commit and stay in the ring until
+ * release. */
+static int
+test_reserve_commit(void)
+{
+    struct sp_broker_ring *producer, *consumer;
+    uint8_t buf[SP_BROKER_RING_MIN_SIZE];
+    const uint8_t *msg;
+    uint8_t *dst;
+    uint32_t len;
+
+    CHECK(!ring_open_pair(SP_BROKER_RING_MIN_SIZE, &producer, &consumer));
+    CHECK(sp_broker_ring_max_msg_size(producer)
+          == SP_BROKER_RING_MIN_SIZE / 2
+             - sizeof (struct sp_broker_ring_record));
+
+    CHECK(!sp_broker_ring_peek(consumer, &len) && errno == EAGAIN);
+    CHECK(!sp_broker_ring_peek(producer, &len) && errno == EPERM);
+    CHECK(!sp_broker_ring_reserve(consumer, 1) && errno == EPERM);
+    CHECK(!sp_broker_ring_reserve(producer,
+                                  sp_broker_ring_max_msg_size(producer) + 1)
+          && errno == EMSGSIZE);
+
+    dst = sp_broker_ring_reserve(producer, 100);
+    CHECK(dst);
+    fill(dst, 100, 1);
+    CHECK(!sp_broker_ring_peek(consumer, &len) && errno == EAGAIN);
+    sp_broker_ring_commit(producer);
+
+    /* Peeking twice returns the same message. */
+    msg = sp_broker_ring_peek(consumer, &len);
+    CHECK(msg && len == 100 && check_fill(msg, len, 1));
+    CHECK(sp_broker_ring_peek(consumer, &len) == msg && len == 100);
+    sp_broker_ring_release(consumer);
+    CHECK(!sp_broker_ring_peek(consumer, &len) && errno == EAGAIN);
+
+    /* Empty messages and copies. */
+    fill(buf, 7, 2);
+    CHECK(!sp_broker_ring_send(producer, buf, 0));
+    CHECK(!sp_broker_ring_send(producer, buf, 7));
+    CHECK(sp_broker_ring_recv(consumer, buf, sizeof buf) == 0);
+    memset(buf, 0, sizeof buf);
+    CHECK(sp_broker_ring_recv(consumer, buf, 6) < 0 && errno == EMSGSIZE);
+    CHECK(sp_broker_ring_recv(consumer, buf, sizeof buf) == 7);
+    CHECK(check_fill(buf, 7, 2));
+    CHECK(sp_broker_ring_recv(consumer, buf, sizeof buf) < 0
+          && errno == EAGAIN);
+
+    sp_broker_ring_close(producer);
+    sp_broker_ring_close(consumer);
+    return 0;
+}
+
+/* Message that doesn't fit till the end of the data area starts from the
+ * beginning, the rest is skipped by the consumer. */
+static int
+test_wrap_around(void)
+{
+    uint32_t max_len = SP_BROKER_RING_MIN_SIZE / 2
+                       - sizeof (struct sp_broker_ring_record);
+    struct sp_broker_ring *producer, *consumer;
+    uint8_t buf[SP_BROKER_RING_MIN_SIZE];
+    const uint8_t *msg, *first_msg = NULL;
+    uint8_t *dst, *first;
+    uint32_t len;
+    int i;
+
+    CHECK(!ring_open_pair(SP_BROKER_RING_MIN_SIZE, &producer, &consumer));
+    memset(buf, 0, sizeof buf);
+
+    /* Moving close to the end of the data area. */
+    for (i = 0; i < 2; i++) {
+        dst = sp_broker_ring_reserve(producer, max_len - 64);
+        CHECK(dst);
+        if (!i) {
+            first = dst;
+        }
+        fill(dst, max_len - 64, i);
+        sp_broker_ring_commit(producer);
+        msg = sp_broker_ring_peek(consumer, &len);
+        CHECK(msg && len == max_len - 64 && check_fill(msg, len, i));
+        if (!i) {
+            first_msg = msg;
+        }
+        sp_broker_ring_release(consumer);
+    }
+
+    /* 128 bytes are left till the end, so the next one wraps. */
+    dst = sp_broker_ring_reserve(producer, 200);
+    CHECK(dst == first);
+    fill(dst, 200, 3);
+    sp_broker_ring_commit(producer);
+    msg = sp_broker_ring_peek(consumer, &len);
+    CHECK(msg == first_msg && len == 200 && check_fill(msg, len, 3));
+    sp_broker_ring_release(consumer);
+
+    /* Padding needs space too.  Leaving 1000 bytes till the end with
+     * a message of 1600 bytes not yet released.  'max_len' would fit into
+     * the free space, but not together with the padding. */
+    CHECK(!sp_broker_ring_send(producer, buf, 1280));
+    CHECK(sp_broker_ring_recv(consumer, buf, sizeof buf) == 1280);
+    CHECK(!sp_broker_ring_send(producer, buf, 1592));
+    CHECK(sp_broker_ring_peek(consumer, &len) && len == 1592);
+    CHECK(!sp_broker_ring_reserve(producer, max_len) && errno == EAGAIN);
+    sp_broker_ring_release(consumer);
+    dst = sp_broker_ring_reserve(producer, max_len);
+    CHECK(dst == first);
+    fill(dst, max_len, 4);
+    sp_broker_ring_commit(producer);
+    msg = sp_broker_ring_peek(consumer, &len);
+    CHECK(msg == first_msg && len == max_len && check_fill(msg, len, 4));
+    sp_broker_ring_release(consumer);
+    CHECK(!sp_broker_ring_peek(consumer, &len) && errno == EAGAIN);
+
+    sp_broker_ring_close(producer);
+    sp_broker_ring_close(consumer);
+    return 0;
+}
+
+/* Producer can't overwrite messages that are not released yet. */
+static int
+test_full(void)
+{
+    struct sp_broker_ring *producer, *consumer;
+    uint32_t i, n, len;
+    const uint8_t *msg;
+    uint8_t buf[56];
+
+    CHECK(!ring_open_pair(SP_BROKER_RING_MIN_SIZE, &producer, &consumer));
+
+    /* Every record takes 64 bytes with the header. */
+    for (n = 0; n < SP_BROKER_RING_MIN_SIZE; n++) {
+        fill(buf, sizeof buf, n);
+        if (sp_broker_ring_send(producer, buf, sizeof buf)) {
+            CHECK(errno == EAGAIN);
+            break;
+        }
+    }
+    CHECK(n == SP_BROKER_RING_MIN_SIZE / 64);
+
+    /* Peeked, but not released message still takes space. */
+    msg = sp_broker_ring_peek(consumer, &len);
+    CHECK(msg && len == sizeof buf && check_fill(msg, len, 0));
+    CHECK(sp_broker_ring_send(producer, buf, sizeof buf) && errno == EAGAIN);
+    sp_broker_ring_release(consumer);
+    fill(buf, sizeof buf, n);
+    CHECK(!sp_broker_ring_send(producer, buf, sizeof buf));
+    CHECK(sp_broker_ring_send(producer, buf, sizeof buf) && errno == EAGAIN);
+
+    /* All messages are delivered in order. */
+    for (i = 1; i <= n; i++) {
+        CHECK(sp_broker_ring_recv(consumer, buf, sizeof buf) == sizeof buf);
+        CHECK(check_fill(buf, sizeof buf, i));
+    }
+    CHECK(sp_broker_ring_recv(consumer, buf, sizeof buf) < 0
+          && errno == EAGAIN);
+
+    sp_broker_ring_close(producer);
+    sp_broker_ring_close(consumer);
+    return 0;
+}
+
+/* Eventfds are signaled only if the other side armed itself. */
+static int
+test_wakeups(void)
+{
+    struct sp_broker_ring *producer, *consumer;
+    int consumer_fd, producer_fd;
+    uint8_t buf[56] = { 0 };
+
+    CHECK(!ring_open_pair(SP_BROKER_RING_MIN_SIZE, &producer, &consumer));
+    consumer_fd = sp_broker_ring_fd(consumer);
+    producer_fd = sp_broker_ring_fd(producer);
+    CHECK(consumer_fd >= 0 && producer_fd >= 0 && consumer_fd != producer_fd);
+
+    /* Nobody waits, no wakeup. */
+    CHECK(!sp_broker_ring_send(producer, buf, sizeof buf));
+    CHECK(!readable(consumer_fd, 0));
+
+    /* Ring is not empty, arming reports that. */
+    CHECK(sp_broker_ring_arm(consumer));
+    CHECK(sp_broker_ring_recv(consumer, buf, sizeof buf) == sizeof buf);
+    CHECK(sp_broker_ring_wait(consumer, 0) && errno == ETIMEDOUT);
+
+    /* Armed consumer is woken up by the commit. */
+    CHECK(!sp_broker_ring_arm(consumer));
+    CHECK(!readable(consumer_fd, 0));
+    CHECK(!sp_broker_ring_send(producer, buf, sizeof buf));
+    CHECK(readable(consumer_fd, 0));
+    sp_broker_ring_ack(consumer);
+    CHECK(!readable(consumer_fd, 0));
+    CHECK(!sp_broker_ring_wait(consumer, 0));
+    CHECK(sp_broker_ring_recv(consumer, buf, sizeof buf) == sizeof buf);
+
+    /* Armed producer is woken up by the release once the ring is full. */
+    while (!sp_broker_ring_send(producer, buf, sizeof buf)) {
+        continue;
+    }
+    CHECK(errno == EAGAIN);
+    CHECK(!sp_broker_ring_arm(producer));
+    CHECK(sp_broker_ring_wait(producer, 10) && errno == ETIMEDOUT);
+    CHECK(!sp_broker_ring_arm(producer));
+    CHECK(!readable(producer_fd, 0));
+    CHECK(sp_broker_ring_recv(consumer, buf, sizeof buf) == sizeof buf);
+    CHECK(readable(producer_fd, 0));
+    sp_broker_ring_ack(producer);
+    CHECK(!readable(producer_fd, 0));
+    CHECK(!sp_broker_ring_wait(producer, 0));
+    CHECK(!sp_broker_ring_send(producer, buf, sizeof buf));
+
+    sp_broker_ring_close(producer);
+    sp_broker_ring_close(consumer);
+    return 0;
+}
+
+static uint32_t
+test_random(uint32_t *state)
+{
+    *state = *state * 1103515245 + 12345;
+    return *state >> 8;
+}
+
+/* Consumer side of test_exchange().  Runs in a child process. */
+static int
+exchange_consume(struct sp_broker_ring *consumer, uint32_t n_msgs,
+                 uint32_t seed)
+{
+    uint32_t max_len = sp_broker_ring_max_msg_size(consumer);
+    const uint8_t *msg;
+    uint32_t i, len;
+
+    for (i = 0; i < n_msgs; i++) {
+        while (!(msg = sp_broker_ring_peek(consumer, &len))) {
+            CHECK(errno == EAGAIN);
+            CHECK(!sp_broker_ring_wait(consumer, TIMEOUT_MS));
+        }
+        CHECK(len == test_random(&seed) % (max_len + 1));
+        CHECK(check_fill(msg, len, i));
+        sp_broker_ring_release(consumer);
+    }
+    CHECK(!sp_broker_ring_peek(consumer, &len) && errno == EAGAIN);
+    return 0;
+}
+
+/* Producer and consumer in different processes exchange messages of
+ * random sizes, waiting for each other when the ring is full or empty. */
+static int
+test_exchange(uint32_t n_msgs, uint32_t seed)
+{
+    struct sp_broker_ring *producer, *consumer;
+    uint32_t i, len, max_len, state = seed;
+    int status;
+    uint8_t *dst;
+    pid_t pid;
+
+    CHECK(!ring_open_pair(2 * SP_BROKER_RING_MIN_SIZE, &producer, &consumer));
+    max_len = sp_broker_ring_max_msg_size(producer);
+
+    pid = fork();
+    CHECK(pid >= 0);
+    if (!pid) {
+        sp_broker_ring_close(producer);
+        _exit(exchange_consume(consumer, n_msgs, seed)
+              ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+    sp_broker_ring_close(consumer);
+
+    for (i = 0; i < n_msgs; i++) {
+        len = test_random(&state) % (max_len + 1);
+        while (!(dst = sp_broker_ring_reserve(producer, len))) {
+            CHECK(errno == EAGAIN);
+            CHECK(!sp_broker_ring_wait(producer, TIMEOUT_MS));
+        }
+        fill(dst, len, i);
+        sp_broker_ring_commit(producer);
+    }
+
+    CHECK(waitpid(pid, &status, 0) == pid);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+    sp_broker_ring_close(producer);
+    printf("Exchanged %"PRIu32" messages, seed %"PRIu32".\n", n_msgs, seed);
+    return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+    uint32_t n_msgs = argc > 1 ? strtoul(argv[1], NULL, 0) : 100000;
+    uint32_t seed = argc > 2 ? strtoul(argv[2], NULL, 0) : 42;
+
+    if (test_reserve_commit()
+        || test_wrap_around()
+        || test_full()
+        || test_wakeups()
+        || test_exchange(n_msgs, seed)) {
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,1498 @@
+/*
+ * Copyright (c) 2021 Ilya Maximets <i.maximets@ovn.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Pairing stress test.  Spawns a broker on a temporary socket and drives
+ * it with many concurrent clients, including clients that should never be
+ * paired and clients that send malformed requests.  Checks that all the
+ * correct clients are paired with each other and that broker survives and
+ * doesn't leak file descriptors.
+ *
+ * Usage: test-stress ONE_SOCKET_BINARY [ROUNDS [PAIRS]]
+ *
+ * Set TEST_VERBOSE environment variable to see the broker output. */
+
+#include <config.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "socket-util.h"
+
+#include <socketpair-broker/helper.h>
+#include <socketpair-broker/ring.h>
+
+/* Broker serves up to 1000 clients per worker.  Keeping some space for
+ * clients of other tests. */
+#define MAX_PAIRS_PER_ROUND 400
+
+#define TIMEOUT_MS          10000
+
+/* Descriptors sent for the peer by every client in test_held_fds(). */
+#define HELD_FDS_PER_CLIENT 16
+#define HELD_FDS_MAX_CLIENTS 16
+
+static char tmp_dir[] = "/tmp/one-socket-test-XXXXXX";
+static char sock_path[sizeof tmp_dir + 32];
+static pid_t broker_pid;
+
+#define CHECK(COND)                                                 \
+    do {                                                            \
+        if (!(COND)) {                                              \
+            fprintf(stderr, "FAIL:%s:%d: %s (errno: %s)\n",         \
+                    __FILE__, __LINE__, #COND, strerror(errno));    \
+            return -1;                                              \
+        }                                                           \
+    } while (0)
+
+static void
+broker_kill(void)
+{
+    if (broker_pid > 0) {
+        kill(broker_pid, SIGKILL);
+        waitpid(broker_pid, NULL, 0);
+        broker_pid = 0;
+    }
+}
+
+static void
+broker_stop(void)
+{
+    broker_kill();
+    unlink(sock_path);
+    rmdir(tmp_dir);
+}
+
+/* Starts the broker.  'listen_fds' are passed to it the same way systemd
+ * passes sockets for socket activation. */
+static int
+broker_start_with_fds(const char *binary, const int *listen_fds,
+                      int n_listen_fds)
+{
+    int i;
+
+    if (!sock_path[0]) {
+        CHECK(mkdtemp(tmp_dir));
+        snprintf(sock_path, sizeof sock_path, "%s/one.socket", tmp_dir);
+    }
+
+    /* Child would flush the pending output otherwise. */
+    fflush(stdout);
+    broker_pid = fork();
+    CHECK(broker_pid >= 0);
+    if (!broker_pid) {
+        if (!getenv("TEST_VERBOSE")) {
+            freopen("/dev/null", "w", stdout);
+            freopen("/dev/null", "w", stderr);
+        }
+        setenv("ONE_SOCKET_PATH", sock_path, 1);
+        if (n_listen_fds) {
+            char value[32];
+            int fds[8];
+
+            /* Moving out of the way first, so sockets are not overwritten
+             * while placed at their numbers. */
+            for (i = 0; i < n_listen_fds && i < 8; i++) {
+                fds[i] = fcntl(listen_fds[i], F_DUPFD, 3 + n_listen_fds);
+            }
+            for (i = 0; i < n_listen_fds && i < 8; i++) {
+                dup2(fds[i], 3 + i);
+                close(fds[i]);
+            }
+            snprintf(value, sizeof value, "%d", n_listen_fds);
+            setenv("LISTEN_FDS", value, 1);
+            snprintf(value, sizeof value, "%ld", (long) getpid());
+            setenv("LISTEN_PID", value, 1);
+        }
+        execl(binary, binary, (char *) NULL);
+        _exit(127);
+    }
+
+    /* Waiting for the broker to start listening. */
+    for (i = 0; i < TIMEOUT_MS / 10; i++) {
+        int fd = sp_broker_connect(sock_path, false, NULL);
+
+        if (fd >= 0) {
+            close(fd);
+            return 0;
+        }
+        CHECK(waitpid(broker_pid, NULL, WNOHANG) == 0);
+        usleep(10 * 1000);
+    }
+    CHECK(!"Broker didn't start");
+    return -1;
+}
+
+static int
+broker_start(const char *binary)
+{
+    return broker_start_with_fds(binary, NULL, 0);
+}
+
+static bool
+broker_alive(void)
+{
+    return waitpid(broker_pid, NULL, WNOHANG) == 0;
+}
+
+static int
+broker_n_fds(void)
+{
+    char path[64];
+    struct dirent *de;
+    int n = 0;
+    DIR *dir;
+
+    snprintf(path, sizeof path, "/proc/%d/fd", (int) broker_pid);
+    dir = opendir(path);
+    if (!dir) {
+        return -1;
+    }
+    while ((de = readdir(dir))) {
+        n += de->d_name[0] != '.';
+    }
+    closedir(dir);
+    return n;
+}
+
+static int
+connect_client(void)
+{
+    struct timeval tv = { .tv_sec = TIMEOUT_MS / 1000 };
+    int fd = sp_broker_connect(sock_path, false, NULL);
+
+    if (fd >= 0) {
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+    }
+    return fd;
+}
+
+/* Returns 'true' if there is something to read on 'fd' (data or EOF)
+ * within 'timeout_ms'. */
+static bool
+readable(int fd, int timeout_ms)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+    return poll(&pfd, 1, timeout_ms) == 1;
+}
+
+/* Returns 'true' if broker closed connection 'fd'. */
+static bool
+closed_by_broker(int fd)
+{
+    char buf[SP_BROKER_HEADER_SIZE + SP_BROKER_MAX_PAYLOAD_SIZE];
+    ssize_t ret;
+
+    do {
+        ret = recv(fd, buf, sizeof buf, 0);
+    } while (ret < 0 && errno == EINTR);
+    return !ret || (ret < 0 && errno == ECONNRESET);
+}
+
+static int
+check_connected(const struct sp_broker_pair *a, const struct sp_broker_pair *b,
+                uint32_t token)
+{
+    uint32_t received = 0;
+
+    CHECK(a->type == b->type);
+    CHECK(a->id && a->id == b->id);
+    if (a->type == SP_BROKER_PAIR_TYPE_SHM_RING) {
+        struct stat st_a, st_b;
+
+        /* Both should have the same ring, one of them is a producer. */
+        CHECK(a->n_fds == SP_BROKER_RING_N_FDS);
+        CHECK(b->n_fds == SP_BROKER_RING_N_FDS);
+        CHECK(a->producer != b->producer);
+        CHECK(!fstat(a->fds[SP_BROKER_RING_FD_MEM], &st_a));
+        CHECK(!fstat(b->fds[SP_BROKER_RING_FD_MEM], &st_b));
+        CHECK(st_a.st_ino == st_b.st_ino);
+        return 0;
+    }
+
+    CHECK(a->n_fds == 1 && b->n_fds == 1);
+    CHECK(write(a->fds[0], &token, sizeof token) == sizeof token);
+    CHECK(readable(b->fds[0], TIMEOUT_MS));
+    CHECK(read(b->fds[0], &received, sizeof received) == sizeof received);
+    CHECK(received == token);
+    return 0;
+}
+
+/* Connects 2 * 'n_pairs' clients at once and requests pairs for all of them
+ * with a variety of modes, types and protocol versions.  Second halves of
+ * pairs are requested in reverse order. */
+static int
+test_pairing(int round, int n_pairs)
+{
+    struct sp_broker_pair_params params;
+    struct sp_broker_pair *pairs;
+    int *fds;
+    int i, ret = -1;
+
+    fds = calloc(2 * n_pairs, sizeof *fds);
+    pairs = calloc(2 * n_pairs, sizeof *pairs);
+    CHECK(fds && pairs);
+
+    for (i = 0; i < 2 * n_pairs; i++) {
+        fds[i] = -1;
+    }
+    for (i = 0; i < 2 * n_pairs; i++) {
+        fds[i] = connect_client();
+        if (fds[i] < 0) {
+            fprintf(stderr, "FAIL: Failed to connect client %d\n", i);
+            goto exit;
+        }
+    }
+
+    for (i = 0; i < 2 * n_pairs; i++) {
+        int idx = i < n_pairs ? i : 2 * n_pairs - 1 - i;
+        bool first = i < n_pairs;
+        char key[64];
+
+        snprintf(key, sizeof key, "stress-%d-%d", round, idx);
+        sp_broker_pair_params_init(&params);
+        params.type = idx % SP_BROKER_PAIR_TYPE_MAX;
+        if (idx % 3) {
+            params.mode = first == (idx % 3 == 1)
+                          ? SP_BROKER_PAIR_MODE_CLIENT
+                          : SP_BROKER_PAIR_MODE_SERVER;
+        }
+        if (idx % 5 == 0) {
+            /* Version 2 of the protocol. */
+            params.sndbuf = 64 * 1024;
+            params.ring_size = 8192;
+        }
+        if (sp_broker_send_get_pair_params(fds[first ? idx : n_pairs + idx],
+                                           key, &params, NULL)) {
+            fprintf(stderr, "FAIL: Failed to send request %d\n", i);
+            goto exit;
+        }
+    }
+
+    for (i = 0; i < 2 * n_pairs; i++) {
+        if (sp_broker_receive_pair(fds[i], &pairs[i], NULL)) {
+            fprintf(stderr, "FAIL: Client %d is not paired: %s\n",
+                    i, strerror(errno));
+            goto exit;
+        }
+    }
+
+    for (i = 0; i < n_pairs; i++) {
+        if (check_connected(&pairs[i], &pairs[n_pairs + i], i)) {
+            goto exit;
+        }
+    }
+    ret = 0;
+
+exit:
+    for (i = 0; i < 2 * n_pairs; i++) {
+        if (fds[i] >= 0) {
+            close(fds[i]);
+        }
+        sp_broker_pair_close(&pairs[i]);
+    }
+    free(pairs);
+    free(fds);
+    return ret;
+}
+
+static int
+send_get_pair(int fd, const char *key, enum sp_broker_get_pair_mode mode,
+              enum sp_broker_pair_type type)
+{
+    struct sp_broker_pair_params params;
+
+    sp_broker_pair_params_init(&params);
+    params.mode = mode;
+    params.type = type;
+    return sp_broker_send_get_pair_params(fd, key, &params, NULL);
+}
+
+/* Clients with the same key, but incompatible modes or types should not be
+ * paired.  They should still be paired with a correct client later. */
+static int
+test_mode_mismatch(int n_keys)
+{
+    int fds[MAX_PAIRS_PER_ROUND][4];
+    struct sp_broker_pair a, b;
+    int i, j;
+
+    if (n_keys > MAX_PAIRS_PER_ROUND / 2) {
+        n_keys = MAX_PAIRS_PER_ROUND / 2;
+    }
+
+    for (i = 0; i < n_keys; i++) {
+        char key[64];
+
+        snprintf(key, sizeof key, "mismatch-%d", i);
+        for (j = 0; j < 4; j++) {
+            fds[i][j] = connect_client();
+            CHECK(fds[i][j] >= 0);
+        }
+        CHECK(!send_get_pair(fds[i][0], key, SP_BROKER_PAIR_MODE_CLIENT,
+                             SP_BROKER_PAIR_TYPE_STREAM));
+        CHECK(!send_get_pair(fds[i][1], key, SP_BROKER_PAIR_MODE_CLIENT,
+                             SP_BROKER_PAIR_TYPE_STREAM));
+        CHECK(!send_get_pair(fds[i][2], key, SP_BROKER_PAIR_MODE_NONE,
+                             SP_BROKER_PAIR_TYPE_STREAM));
+        CHECK(!send_get_pair(fds[i][3], key, SP_BROKER_PAIR_MODE_SERVER,
+                             SP_BROKER_PAIR_TYPE_SEQPACKET));
+    }
+
+    for (i = 0; i < n_keys; i++) {
+        for (j = 0; j < 4; j++) {
+            CHECK(!readable(fds[i][j], i ? 0 : 200));
+        }
+    }
+
+    /* Now the correct server for every key.  It should be paired with one
+     * of the clients. */
+    for (i = 0; i < n_keys; i++) {
+        char key[64];
+        int fd = connect_client();
+
+        snprintf(key, sizeof key, "mismatch-%d", i);
+        CHECK(fd >= 0);
+        CHECK(!send_get_pair(fd, key, SP_BROKER_PAIR_MODE_SERVER,
+                             SP_BROKER_PAIR_TYPE_STREAM));
+        CHECK(!sp_broker_receive_pair(fd, &a, NULL));
+        close(fd);
+
+        /* Broker replies to the waiting client first. */
+        j = readable(fds[i][0], 0) ? 0 : 1;
+        CHECK(readable(fds[i][j], 0));
+        CHECK(!sp_broker_receive_pair(fds[i][j], &b, NULL));
+        CHECK(!check_connected(&a, &b, i));
+        sp_broker_pair_close(&a);
+        sp_broker_pair_close(&b);
+
+        CHECK(!readable(fds[i][!j], 0));
+        CHECK(!readable(fds[i][2], 0));
+        CHECK(!readable(fds[i][3], 0));
+        for (j = 0; j < 4; j++) {
+            close(fds[i][j]);
+        }
+    }
+    return 0;
+}
+
+/* Listing of waiting clients page by page should report every one of them
+ * exactly once. */
+static int
+test_list_pending(int n_keys)
+{
+    struct sp_broker_pending_info entries[3];
+    int fds[MAX_PAIRS_PER_ROUND];
+    bool seen[MAX_PAIRS_PER_ROUND];
+    int i, n, fd, n_seen = 0;
+    uint64_t cursor = 0;
+    uint32_t n_pending;
+
+    for (i = 0; i < n_keys; i++) {
+        char key[64];
+
+        snprintf(key, sizeof key, "pending-%d", i);
+        fds[i] = connect_client();
+        CHECK(fds[i] >= 0);
+        CHECK(!send_get_pair(fds[i], key, SP_BROKER_PAIR_MODE_SERVER,
+                             SP_BROKER_PAIR_TYPE_SEQPACKET));
+        seen[i] = false;
+    }
+    usleep(100 * 1000);
+
+    fd = connect_client();
+    CHECK(fd >= 0);
+    do {
+        n = sp_broker_list_pending(fd, &cursor, entries, 3, &n_pending, NULL);
+        CHECK(n >= 0 && n <= 3);
+        CHECK(n_pending >= (uint32_t) n_keys);
+        CHECK(n == 3 || !cursor);
+        for (i = 0; i < n; i++) {
+            char key[64];
+            int idx;
+
+            if (entries[i].key_len >= (int) sizeof key) {
+                continue;
+            }
+            memcpy(key, entries[i].key, entries[i].key_len);
+            key[entries[i].key_len] = '\0';
+            if (sscanf(key, "pending-%d", &idx) != 1) {
+                continue;
+            }
+            CHECK(idx >= 0 && idx < n_keys && !seen[idx]);
+            CHECK(entries[i].mode == SP_BROKER_PAIR_MODE_SERVER);
+            CHECK(entries[i].type == SP_BROKER_PAIR_TYPE_SEQPACKET);
+            CHECK(entries[i].wait_ms >= 50);
+            seen[idx] = true;
+            n_seen++;
+        }
+    } while (cursor);
+    CHECK(n_seen == n_keys);
+
+    /* Listing connection can't be used for pairing. */
+    CHECK(!send_get_pair(fd, "pending-0", SP_BROKER_PAIR_MODE_CLIENT,
+                         SP_BROKER_PAIR_TYPE_SEQPACKET));
+    CHECK(closed_by_broker(fd));
+    close(fd);
+
+    for (i = 0; i < n_keys; i++) {
+        CHECK(!readable(fds[i], 0));
+        close(fds[i]);
+    }
+    return 0;
+}
+
+static int
+query_peer(int fd, const char *key, enum sp_broker_get_pair_mode mode,
+           int timeout_ms)
+{
+    struct sp_broker_pair_params params;
+
+    sp_broker_pair_params_init(&params);
+    params.mode = mode;
+    return sp_broker_query_peer(fd, key, &params, timeout_ms, NULL);
+}
+
+/* Presence queries should not consume the waiting client, and watchers
+ * should be notified once the client appears. */
+static int
+test_query_peer(void)
+{
+    struct sp_broker_pair a, b;
+    struct sp_broker_msg msg;
+    int query, watcher, server, client;
+
+    query = connect_client();
+    watcher = connect_client();
+    CHECK(query >= 0 && watcher >= 0);
+    CHECK(query_peer(query, "presence", SP_BROKER_PAIR_MODE_CLIENT, 0) == 0);
+
+    /* Waiting with a timeout for something that never appears is not an
+     * answer. */
+    errno = 0;
+    CHECK(query_peer(watcher, "presence", SP_BROKER_PAIR_MODE_CLIENT,
+                     100) == -1);
+    CHECK(errno == ETIMEDOUT);
+
+    /* Watcher is still subscribed and receives the late reply once the
+     * server appears, so the connection can't be used for other queries. */
+    server = connect_client();
+    CHECK(server >= 0);
+    CHECK(!send_get_pair(server, "presence", SP_BROKER_PAIR_MODE_SERVER,
+                         SP_BROKER_PAIR_TYPE_STREAM));
+    CHECK(readable(watcher, TIMEOUT_MS));
+    memset(&msg, 0, sizeof msg);
+    CHECK(socket_read_message(watcher, (char *) &msg, sizeof msg, NULL, 0,
+                              NULL)
+          == (int) (SP_BROKER_HEADER_SIZE + sizeof msg.payload.u64));
+    CHECK(msg.request == SP_BROKER_PEER_STATUS);
+    CHECK(msg.payload.u64 == SP_BROKER_PEER_PRESENT);
+    close(watcher);
+
+    CHECK(query_peer(query, "presence", SP_BROKER_PAIR_MODE_CLIENT, 0) == 1);
+    CHECK(query_peer(query, "presence", SP_BROKER_PAIR_MODE_SERVER, 0) == 0);
+    CHECK(query_peer(query, "presence", SP_BROKER_PAIR_MODE_CLIENT,
+                     TIMEOUT_MS) == 1);
+
+    /* Server is still there and could be paired. */
+    client = connect_client();
+    CHECK(client >= 0);
+    CHECK(!send_get_pair(client, "presence", SP_BROKER_PAIR_MODE_CLIENT,
+                         SP_BROKER_PAIR_TYPE_STREAM));
+    CHECK(!sp_broker_receive_pair(server, &a, NULL));
+    CHECK(!sp_broker_receive_pair(client, &b, NULL));
+    CHECK(!check_connected(&a, &b, 7));
+    sp_broker_pair_close(&a);
+    sp_broker_pair_close(&b);
+    close(server);
+    close(client);
+    close(query);
+    return 0;
+}
+
+static int
+send_get_pair_prefix(int fd, const char *prefix)
+{
+    struct sp_broker_pair_params params;
+
+    sp_broker_pair_params_init(&params);
+    params.mode = SP_BROKER_PAIR_MODE_CLIENT;
+    params.prefix = true;
+    return sp_broker_send_get_pair_params(fd, prefix, &params, NULL);
+}
+
+/* Receives pairs on 'a' and 'b' and checks that they are connected. */
+static int
+check_paired(int a, int b, int n)
+{
+    struct sp_broker_pair pa, pb;
+
+    CHECK(!sp_broker_receive_pair(a, &pa, NULL));
+    CHECK(!sp_broker_receive_pair(b, &pb, NULL));
+    CHECK(!check_connected(&pa, &pb, n));
+    sp_broker_pair_close(&pa);
+    sp_broker_pair_close(&pb);
+    return 0;
+}
+
+/* Client that requested a prefix should be paired with a server whose key
+ * starts with it, regardless of who came first.  Exact keys are preferred.
+ * Among different keys with the prefix the one that waits longer wins. */
+static int
+test_prefix(void)
+{
+    int prefix, exact, server, other, servers[2];
+    int i;
+
+    prefix = connect_client();
+    server = connect_client();
+    CHECK(prefix >= 0 && server >= 0);
+    CHECK(!send_get_pair(server, "storage/node3/disk1",
+                         SP_BROKER_PAIR_MODE_SERVER,
+                         SP_BROKER_PAIR_TYPE_STREAM));
+    CHECK(!send_get_pair_prefix(prefix, "storage/node3/"));
+    CHECK(!check_paired(prefix, server, 1));
+    close(prefix);
+    close(server);
+
+    prefix = connect_client();
+    exact = connect_client();
+    other = connect_client();
+    CHECK(prefix >= 0 && exact >= 0 && other >= 0);
+    CHECK(!send_get_pair_prefix(prefix, "storage/node4/"));
+    CHECK(!send_get_pair(exact, "storage/node4/disk1",
+                         SP_BROKER_PAIR_MODE_CLIENT,
+                         SP_BROKER_PAIR_TYPE_STREAM));
+    /* Not a match for the prefix. */
+    CHECK(!send_get_pair(other, "storage/node40",
+                         SP_BROKER_PAIR_MODE_SERVER,
+                         SP_BROKER_PAIR_TYPE_STREAM));
+    CHECK(!readable(prefix, 100));
+
+    server = connect_client();
+    CHECK(server >= 0);
+    CHECK(!send_get_pair(server, "storage/node4/disk1",
+                         SP_BROKER_PAIR_MODE_SERVER,
+                         SP_BROKER_PAIR_TYPE_STREAM));
+    CHECK(!check_paired(exact, server, 2));
+    CHECK(!readable(prefix, 0));
+    close(exact);
+    close(server);
+
+    server = connect_client();
+    CHECK(server >= 0);
+    CHECK(!send_get_pair(server, "storage/node4/disk2",
+                         SP_BROKER_PAIR_MODE_SERVER,
+                         SP_BROKER_PAIR_TYPE_STREAM));
+    CHECK(!check_paired(prefix, server, 3));
+    CHECK(!readable(other, 0));
+    close(prefix);
+    close(server);
+    close(other);
+
+    /* Key that sorts first is not taken first. */
+    servers[0] = connect_client();
+    servers[1] = connect_client();
+    CHECK(servers[0] >= 0 && servers[1] >= 0);
+    CHECK(!send_get_pair(servers[0], "storage/node5/b",
+                         SP_BROKER_PAIR_MODE_SERVER,
+                         SP_BROKER_PAIR_TYPE_STREAM));
+    CHECK(!send_get_pair(servers[1], "storage/node5/a",
+                         SP_BROKER_PAIR_MODE_SERVER,
+                         SP_BROKER_PAIR_TYPE_STREAM));
+    for (i = 0; i < 2; i++) {
+        prefix = connect_client();
+        CHECK(prefix >= 0);
+        CHECK(!send_get_pair_prefix(prefix, "storage/node5/"));
+        CHECK(!check_paired(prefix, servers[i], 4 + i));
+        close(prefix);
+        close(servers[i]);
+    }
+    return 0;
+}
+
+/* Connects 'n' clients from a child process, so the broker sees them as
+ * clients of another instance.  Connections are passed back to this
+ * process in 'fds'. */
+static int
+connect_instance(int *fds, int n)
+{
+    int i, sp[2], n_fds = 0, status;
+    char c = 'C';
+    pid_t pid;
+
+    CHECK(!socket_pair_get(SOCK_STREAM, sp));
+    pid = fork();
+    CHECK(pid >= 0);
+    if (!pid) {
+        for (i = 0; i < n; i++) {
+            fds[i] = connect_client();
+            if (fds[i] < 0) {
+                _exit(EXIT_FAILURE);
+            }
+        }
+        _exit(socket_send_message(sp[1], &c, 1, fds, n) == 1
+              ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    close(sp[1]);
+    CHECK(socket_read_message(sp[0], &c, 1, fds, n, &n_fds) == 1);
+    close(sp[0]);
+    CHECK(waitpid(pid, &status, 0) == pid);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+    CHECK(n_fds == n);
+    return 0;
+}
+
+/* Servers of two instances are registered for the same key, all servers of
+ * one instance first.  Clients should still be spread between instances. */
+static int
+test_balance(void)
+{
+    int a[3], b[3], n_a = 0, n_b = 0;
+    struct sp_broker_pair pair;
+    int i, client;
+
+    CHECK(!connect_instance(a, 3));
+    CHECK(!connect_instance(b, 3));
+    for (i = 0; i < 3; i++) {
+        CHECK(!send_get_pair(a[i], "balance", SP_BROKER_PAIR_MODE_SERVER,
+                             SP_BROKER_PAIR_TYPE_STREAM));
+    }
+    usleep(20 * 1000);
+    for (i = 0; i < 3; i++) {
+        CHECK(!send_get_pair(b[i], "balance", SP_BROKER_PAIR_MODE_SERVER,
+                             SP_BROKER_PAIR_TYPE_STREAM));
+    }
+    usleep(20 * 1000);
+
+    for (i = 0; i < 2; i++) {
+        client = connect_client();
+        CHECK(client >= 0);
+        CHECK(!send_get_pair(client, "balance", SP_BROKER_PAIR_MODE_CLIENT,
+                             SP_BROKER_PAIR_TYPE_STREAM));
+        CHECK(!sp_broker_receive_pair(client, &pair, NULL));
+        sp_broker_pair_close(&pair);
+        close(client);
+    }
+
+    /* Servers receive SET_PAIR before their clients. */
+    for (i = 0; i < 3; i++) {
+        n_a += readable(a[i], 0);
+        n_b += readable(b[i], 0);
+    }
+    CHECK(n_a == 1 && n_b == 1);
+
+    for (i = 0; i < 3; i++) {
+        close(a[i]);
+        close(b[i]);
+    }
+    return 0;
+}
+
+/* Waiting client of a higher priority class should be paired first, even
+ * if it came later. */
+static int
+test_priority(void)
+{
+    struct sp_broker_pair_params params;
+    int normal, critical, server;
+
+    normal = connect_client();
+    critical = connect_client();
+    CHECK(normal >= 0 && critical >= 0);
+    CHECK(!send_get_pair(normal, "priority", SP_BROKER_PAIR_MODE_CLIENT,
+                         SP_BROKER_PAIR_TYPE_STREAM));
+    usleep(20 * 1000);
+    sp_broker_pair_params_init(&params);
+    params.mode = SP_BROKER_PAIR_MODE_CLIENT;
+    params.priority = SP_BROKER_PRIORITY_CRITICAL;
+    CHECK(!sp_broker_send_get_pair_params(critical, "priority", &params,
+                                          NULL));
+    usleep(20 * 1000);
+
+    server = connect_client();
+    CHECK(server >= 0);
+    CHECK(!send_get_pair(server, "priority", SP_BROKER_PAIR_MODE_SERVER,
+                         SP_BROKER_PAIR_TYPE_STREAM));
+    CHECK(!check_paired(critical, server, 1));
+    CHECK(!readable(normal, 0));
+    close(server);
+    close(critical);
+    close(normal);
+    return 0;
+}
+
+/* Hello is delivered to the peer only if the peer sent one too. */
+static int
+test_hello(void)
+{
+    struct sp_broker_pair_params params;
+    static const char hello[] = "features: 0x1f";
+    struct sp_broker_pair a, b;
+    int server, client, old;
+
+    server = connect_client();
+    client = connect_client();
+    CHECK(server >= 0 && client >= 0);
+    sp_broker_pair_params_init(&params);
+    params.mode = SP_BROKER_PAIR_MODE_SERVER;
+    params.hello = hello;
+    params.hello_len = sizeof hello;
+    CHECK(!sp_broker_send_get_pair_params(server, "hello", &params, NULL));
+    /* Only asks for the server's hello. */
+    params.mode = SP_BROKER_PAIR_MODE_CLIENT;
+    params.hello_len = 0;
+    CHECK(!sp_broker_send_get_pair_params(client, "hello", &params, NULL));
+    CHECK(!sp_broker_receive_pair(server, &a, NULL));
+    CHECK(!sp_broker_receive_pair(client, &b, NULL));
+    CHECK(a.hello_len == 0);
+    CHECK(b.hello_len == sizeof hello && !memcmp(b.hello, hello, sizeof hello));
+    CHECK(!check_connected(&a, &b, 1));
+    sp_broker_pair_close(&a);
+    sp_broker_pair_close(&b);
+    close(server);
+    close(client);
+
+    /* Client that didn't send a hello doesn't receive one. */
+    server = connect_client();
+    old = connect_client();
+    CHECK(server >= 0 && old >= 0);
+    params.mode = SP_BROKER_PAIR_MODE_SERVER;
+    params.hello_len = sizeof hello;
+    CHECK(!sp_broker_send_get_pair_params(server, "hello", &params, NULL));
+    CHECK(!send_get_pair(old, "hello", SP_BROKER_PAIR_MODE_CLIENT,
+                         SP_BROKER_PAIR_TYPE_STREAM));
+    CHECK(!sp_broker_receive_pair(server, &a, NULL));
+    CHECK(!sp_broker_receive_pair(old, &b, NULL));
+    CHECK(a.hello_len == -1 && b.hello_len == -1);
+    CHECK(!check_connected(&a, &b, 2));
+    sp_broker_pair_close(&a);
+    sp_broker_pair_close(&b);
+    close(server);
+    close(old);
+    return 0;
+}
+
+/* Descriptors sent with the request are delivered to the peer that accepts
+ * them and refer to the same files. */
+static int
+test_peer_fds(void)
+{
+    struct sp_broker_pair_params params;
+    int server, client, old, fds[2];
+    struct sp_broker_pair a, b;
+    char c = 0;
+
+    CHECK(!pipe(fds));
+    server = connect_client();
+    client = connect_client();
+    CHECK(server >= 0 && client >= 0);
+    sp_broker_pair_params_init(&params);
+    params.mode = SP_BROKER_PAIR_MODE_SERVER;
+    params.fds = fds;
+    params.n_fds = 2;
+    CHECK(!sp_broker_send_get_pair_params(server, "peer-fds", &params, NULL));
+    sp_broker_pair_params_init(&params);
+    params.mode = SP_BROKER_PAIR_MODE_CLIENT;
+    params.accept_fds = true;
+    CHECK(!sp_broker_send_get_pair_params(client, "peer-fds", &params, NULL));
+    CHECK(!sp_broker_receive_pair(server, &a, NULL));
+    CHECK(!sp_broker_receive_pair(client, &b, NULL));
+    CHECK(a.n_peer_fds == 0 && b.n_peer_fds == 2);
+    CHECK(!check_connected(&a, &b, 1));
+    CHECK(write(b.peer_fds[1], "x", 1) == 1);
+    CHECK(read(fds[0], &c, 1) == 1 && c == 'x');
+    sp_broker_pair_close(&a);
+    sp_broker_pair_close(&b);
+    close(server);
+    close(client);
+
+    /* Not sent to a client that doesn't accept them. */
+    server = connect_client();
+    old = connect_client();
+    CHECK(server >= 0 && old >= 0);
+    sp_broker_pair_params_init(&params);
+    params.mode = SP_BROKER_PAIR_MODE_SERVER;
+    params.fds = fds;
+    params.n_fds = 2;
+    CHECK(!sp_broker_send_get_pair_params(server, "peer-fds", &params, NULL));
+    CHECK(!send_get_pair(old, "peer-fds", SP_BROKER_PAIR_MODE_CLIENT,
+                         SP_BROKER_PAIR_TYPE_STREAM));
+    CHECK(!sp_broker_receive_pair(server, &a, NULL));
+    CHECK(!sp_broker_receive_pair(old, &b, NULL));
+    CHECK(b.n_peer_fds == 0);
+    CHECK(!check_connected(&a, &b, 2));
+    sp_broker_pair_close(&a);
+    sp_broker_pair_close(&b);
+    close(server);
+    close(old);
+    close(fds[0]);
+    close(fds[1]);
+    return 0;
+}
+
+/* Stores the path of this process in the unified cgroup hierarchy in 'buf'.
+ * Empty if not known. */
+static void
+self_cgroup(char *buf, int size)
+{
+    char line[SP_BROKER_MAX_CGROUP_SIZE + 8];
+    FILE *file = fopen("/proc/self/cgroup", "r");
+
+    buf[0] = '\0';
+    if (!file) {
+        return;
+    }
+    while (fgets(line, sizeof line, file)) {
+        if (!strncmp(line, "0::", 3)) {
+            size_t len = strcspn(line + 3, "\n");
+
+            if (len >= (size_t) size) {
+                len = size - 1;
+            }
+            memcpy(buf, line + 3, len);
+            buf[len] = '\0';
+            break;
+        }
+    }
+    fclose(file);
+}
+
+/* Credentials of the peer are the ones of the process that connected, not
+ * of the broker. */
+static int
+test_peer_cred(void)
+{
+    char cgroup[SP_BROKER_MAX_CGROUP_SIZE + 1];
+    struct sp_broker_pair_params params;
+    struct sp_broker_pair a, b;
+    int server, client;
+
+    server = connect_client();
+    client = connect_client();
+    CHECK(server >= 0 && client >= 0);
+    sp_broker_pair_params_init(&params);
+    params.mode = SP_BROKER_PAIR_MODE_SERVER;
+    params.peer_cred = true;
+    CHECK(!sp_broker_send_get_pair_params(server, "peer-cred", &params,
+                                          NULL));
+    CHECK(!send_get_pair(client, "peer-cred", SP_BROKER_PAIR_MODE_CLIENT,
+                         SP_BROKER_PAIR_TYPE_STREAM));
+    CHECK(!sp_broker_receive_pair(server, &a, NULL));
+    CHECK(!sp_broker_receive_pair(client, &b, NULL));
+    CHECK(a.has_peer_cred && !b.has_peer_cred);
+    CHECK(a.peer_cred.pid == (uint32_t) getpid()
+          && a.peer_cred.uid == (uint32_t) getuid()
+          && a.peer_cred.gid == (uint32_t) getgid());
+    self_cgroup(cgroup, sizeof cgroup);
+    CHECK(!strcmp(a.peer_cgroup, cgroup) && !b.peer_cgroup[0]);
+    CHECK(!check_connected(&a, &b, 1));
+    sp_broker_pair_close(&a);
+    sp_broker_pair_close(&b);
+    close(server);
+    close(client);
+    return 0;
+}
+
+/* Client that can't receive SP_BROKER_SET_PAIR should not take its pair
+ * down.  The pair should be matched with another waiting client instead. */
+static int
+test_repairing(int n_keys)
+{
+    static const enum sp_broker_pair_type types[] = {
+        SP_BROKER_PAIR_TYPE_STREAM, SP_BROKER_PAIR_TYPE_SHM_RING,
+    };
+    struct sp_broker_pair a, b;
+    int broken, server, client;
+    char key[32];
+    int i;
+
+    for (i = 0; i < n_keys; i++) {
+        enum sp_broker_pair_type type = types[i % 2];
+
+        snprintf(key, sizeof key, "repair-%d", i);
+        broken = connect_client();
+        server = connect_client();
+        CHECK(broken >= 0 && server >= 0);
+        CHECK(!send_get_pair(broken, key, SP_BROKER_PAIR_MODE_SERVER, type));
+        /* Broker will fail to send anything to this one. */
+        CHECK(!shutdown(broken, SHUT_RD));
+        CHECK(!send_get_pair(server, key, SP_BROKER_PAIR_MODE_SERVER, type));
+        usleep(20 * 1000);
+
+        client = connect_client();
+        CHECK(client >= 0);
+        CHECK(!send_get_pair(client, key, SP_BROKER_PAIR_MODE_CLIENT, type));
+        CHECK(!sp_broker_receive_pair(client, &a, NULL));
+        CHECK(!sp_broker_receive_pair(server, &b, NULL));
+        CHECK(!check_connected(&a, &b, i));
+        sp_broker_pair_close(&a);
+        sp_broker_pair_close(&b);
+        close(client);
+        close(server);
+        close(broken);
+    }
+    return 0;
+}
+
+/* Sends 'len' bytes of 'msg' with 'n_fds' descriptors attached and checks
+ * that broker drops the connection. */
+static int
+check_rejected(const char *name, struct sp_broker_msg *msg, int len,
+               int n_fds)
+{
+    int fds[2] = { -1, -1 };
+    int fd = connect_client();
+
+    CHECK(fd >= 0);
+    if (n_fds) {
+        CHECK(!socket_pair_get(SOCK_STREAM, fds));
+    }
+    CHECK(socket_send_message(fd, (char *) msg, len, fds, n_fds) == len);
+    if (!closed_by_broker(fd)) {
+        fprintf(stderr, "FAIL: Broker accepted malformed request: %s\n",
+                name);
+        return -1;
+    }
+    close(fd);
+    if (n_fds) {
+        close(fds[0]);
+        close(fds[1]);
+    }
+    return 0;
+}
+
+static void
+build_get_pair(struct sp_broker_msg *msg, uint32_t version)
+{
+    memset(msg, 0, sizeof *msg);
+    msg->request = SP_BROKER_GET_PAIR;
+    msg->flags = version;
+    msg->payload.get_pair.mode = SP_BROKER_PAIR_MODE_CLIENT;
+    msg->payload.get_pair.key_len = 9;
+    memcpy(msg->payload.get_pair.key, "malformed", 9);
+    if (version == SP_BROKER_PROTOCOL_VERSION) {
+        msg->size = sizeof msg->payload.get_pair;
+    } else {
+        msg->size = offsetof(struct sp_broker_get_pair_request, key) + 9;
+    }
+}
+
+#define V1_LEN ((int) SP_BROKER_MESSAGE_SIZE)
+#define V2_LEN(MSG) ((int) (SP_BROKER_HEADER_SIZE + (MSG)->size))
+
+/* Sends requests of all the clients in small pieces, one piece of each
+ * client at a time, so broker has to assemble messages across multiple
+ * reads. */
+static int
+test_split_requests(int n_pairs)
+{
+    static const int splits[] = { 1, 5, SP_BROKER_HEADER_SIZE + 3, 600 };
+    struct sp_broker_pair a, b;
+    struct sp_broker_msg msg;
+    int fds[MAX_PAIRS_PER_ROUND * 2];
+    int i, j, len;
+
+    for (i = 0; i < 2 * n_pairs; i++) {
+        fds[i] = connect_client();
+        CHECK(fds[i] >= 0);
+    }
+
+    for (j = 0; j <= (int) (sizeof splits / sizeof splits[0]); j++) {
+        for (i = 0; i < 2 * n_pairs; i++) {
+            int from = j ? splits[j - 1] : 0;
+            int to;
+
+            build_get_pair(&msg, i % 4 < 2 ? SP_BROKER_PROTOCOL_VERSION
+                                           : SP_BROKER_PROTOCOL_VERSION_2);
+            snprintf((char *) msg.payload.get_pair.key, 10, "split-%03d",
+                     (i / 2) % 1000);
+            msg.payload.get_pair.mode = i % 2 ? SP_BROKER_PAIR_MODE_SERVER
+                                              : SP_BROKER_PAIR_MODE_CLIENT;
+            len = i % 4 < 2 ? V1_LEN : V2_LEN(&msg);
+            to = j < (int) (sizeof splits / sizeof splits[0])
+                 ? splits[j] : len;
+            if (to > len) {
+                to = len;
+            }
+            if (from < to) {
+                CHECK(socket_send_message(fds[i], (char *) &msg + from,
+                                          to - from, NULL, 0) == to - from);
+            }
+        }
+    }
+
+    for (i = 0; i < 2 * n_pairs; i += 2) {
+        CHECK(!sp_broker_receive_pair(fds[i], &a, NULL));
+        CHECK(!sp_broker_receive_pair(fds[i + 1], &b, NULL));
+        CHECK(!check_connected(&a, &b, i));
+        sp_broker_pair_close(&a);
+        sp_broker_pair_close(&b);
+        close(fds[i]);
+        close(fds[i + 1]);
+    }
+    return 0;
+}
+
+static int
+test_malformed(void)
+{
+    struct sp_broker_msg msg;
+    uint32_t state = 42;
+    int i;
+
+    build_get_pair(&msg, SP_BROKER_PROTOCOL_VERSION);
+    msg.size = 8;
+    CHECK(!check_rejected("v1 wrong size", &msg, V1_LEN, 0));
+
+    build_get_pair(&msg, 0x3);
+    CHECK(!check_rejected("bad version", &msg, V1_LEN, 0));
+
+    build_get_pair(&msg, SP_BROKER_PROTOCOL_VERSION);
+    msg.request = 7;
+    CHECK(!check_rejected("unknown request", &msg, V1_LEN, 0));
+
+    build_get_pair(&msg, SP_BROKER_PROTOCOL_VERSION);
+    msg.flags |= SP_BROKER_PAIR_TYPE_MASK;
+    CHECK(!check_rejected("bad type", &msg, V1_LEN, 0));
+
+    build_get_pair(&msg, SP_BROKER_PROTOCOL_VERSION);
+    msg.payload.get_pair.mode = SP_BROKER_PAIR_MODE_MAX;
+    CHECK(!check_rejected("bad mode", &msg, V1_LEN, 0));
+
+    build_get_pair(&msg, SP_BROKER_PROTOCOL_VERSION);
+    msg.payload.get_pair.key_len = 0;
+    CHECK(!check_rejected("empty key", &msg, V1_LEN, 0));
+
+    build_get_pair(&msg, SP_BROKER_PROTOCOL_VERSION);
+    CHECK(!check_rejected("GET_PAIR with fd", &msg, V1_LEN, 1));
+
+    memset(&msg, 0, sizeof msg);
+    msg.request = SP_BROKER_SET_PAIR;
+    msg.flags = SP_BROKER_PROTOCOL_VERSION;
+    msg.size = sizeof msg.payload.u64;
+    CHECK(!check_rejected("SET_PAIR from client", &msg, V1_LEN, 1));
+
+    build_get_pair(&msg, SP_BROKER_PROTOCOL_VERSION_2);
+    msg.size = SP_BROKER_MAX_PAYLOAD_SIZE + 1;
+    CHECK(!check_rejected("v2 too big", &msg, SP_BROKER_HEADER_SIZE, 0));
+
+    build_get_pair(&msg, SP_BROKER_PROTOCOL_VERSION_2);
+    msg.payload.get_pair.key_len = 100;
+    CHECK(!check_rejected("v2 key overflow", &msg, V2_LEN(&msg), 0));
+
+    build_get_pair(&msg, SP_BROKER_PROTOCOL_VERSION_2);
+    sp_broker_attr_put_u32(&msg, SP_BROKER_ATTR_SNDBUF, 4096);
+    msg.size -= 1;
+    CHECK(!check_rejected("v2 truncated attribute", &msg, V2_LEN(&msg), 0));
+
+    build_get_pair(&msg, SP_BROKER_PROTOCOL_VERSION_2);
+    sp_broker_attr_put_u32(&msg, SP_BROKER_ATTR_SNDBUF, 4096);
+    sp_broker_attr_put_u32(&msg, SP_BROKER_ATTR_SNDBUF, 4096);
+    CHECK(!check_rejected("v2 duplicate attribute", &msg, V2_LEN(&msg), 0));
+
+    build_get_pair(&msg, SP_BROKER_PROTOCOL_VERSION_2);
+    sp_broker_attr_put_u32(&msg, 0x7fff, 0);
+    CHECK(!check_rejected("v2 unknown attribute", &msg, V2_LEN(&msg), 0));
+
+    /* Truncated messages and random garbage.  Connection is closed by the
+     * client, broker should just survive. */
+    for (i = 0; i < 1000; i++) {
+        int fd = connect_client();
+        int len;
+
+        CHECK(fd >= 0);
+        build_get_pair(&msg, i % 2 ? SP_BROKER_PROTOCOL_VERSION
+                                   : SP_BROKER_PROTOCOL_VERSION_2);
+        len = i % 2 ? V1_LEN : V2_LEN(&msg);
+        state = state * 1103515245 + 12345;
+        if (i % 4 < 2) {
+            len = state % len;
+        } else {
+            int j;
+
+            for (j = 0; j < 4; j++) {
+                state = state * 1103515245 + 12345;
+                ((uint8_t *) &msg)[state % len] = state >> 24;
+            }
+        }
+        if (len) {
+            socket_send_message(fd, (char *) &msg, len, NULL, 0);
+        }
+        close(fd);
+    }
+    return 0;
+}
+
+/* Descriptors held by waiting clients for their peers are limited by the
+ * RLIMIT_NOFILE of the broker.  Requests above the limit should be rejected
+ * and the budget should be freed once the holders are gone. */
+static int
+test_held_fds(const char *binary)
+{
+    int fds[HELD_FDS_MAX_CLIENTS], peer_fds[HELD_FDS_PER_CLIENT];
+    struct sp_broker_pair_params params;
+    int i, n, ret, client, pipe_fds[2];
+    struct rlimit rlim, saved;
+    struct sp_broker_pair a, b;
+    char key[64];
+
+    /* Broker keeps about a thousand descriptors for clients, holding is
+     * allowed for a half of the rest. */
+    CHECK(!getrlimit(RLIMIT_NOFILE, &saved));
+    rlim = saved;
+    rlim.rlim_cur = 1024 + 8 * HELD_FDS_PER_CLIENT;
+    CHECK(rlim.rlim_max == RLIM_INFINITY || rlim.rlim_max >= rlim.rlim_cur);
+    broker_kill();
+    CHECK(!setrlimit(RLIMIT_NOFILE, &rlim));
+    ret = broker_start(binary);
+    setrlimit(RLIMIT_NOFILE, &saved);
+    CHECK(!ret);
+
+    CHECK(!pipe(pipe_fds));
+    for (i = 0; i < HELD_FDS_PER_CLIENT; i++) {
+        peer_fds[i] = pipe_fds[i % 2];
+    }
+    sp_broker_pair_params_init(&params);
+    params.mode = SP_BROKER_PAIR_MODE_SERVER;
+    params.fds = peer_fds;
+    params.n_fds = HELD_FDS_PER_CLIENT;
+
+    /* Filling the budget until the broker refuses. */
+    for (n = 0; n < HELD_FDS_MAX_CLIENTS; n++) {
+        snprintf(key, sizeof key, "held-fds-%d", n);
+        fds[n] = connect_client();
+        CHECK(fds[n] >= 0);
+        CHECK(!sp_broker_send_get_pair_params(fds[n], key, &params, NULL));
+        if (readable(fds[n], 200)) {
+            CHECK(closed_by_broker(fds[n]));
+            close(fds[n]);
+            break;
+        }
+    }
+    CHECK(n > 0 && n < HELD_FDS_MAX_CLIENTS);
+
+    /* Clients without descriptors are still served and receive the held
+     * ones. */
+    client = connect_client();
+    CHECK(client >= 0);
+    sp_broker_pair_params_init(&params);
+    params.mode = SP_BROKER_PAIR_MODE_CLIENT;
+    params.accept_fds = true;
+    CHECK(!sp_broker_send_get_pair_params(client, "held-fds-0", &params,
+                                          NULL));
+    CHECK(!sp_broker_receive_pair(fds[0], &a, NULL));
+    CHECK(!sp_broker_receive_pair(client, &b, NULL));
+    CHECK(b.n_peer_fds == HELD_FDS_PER_CLIENT);
+    CHECK(!check_connected(&a, &b, 1));
+    sp_broker_pair_close(&a);
+    sp_broker_pair_close(&b);
+    close(client);
+    close(fds[0]);
+
+    /* Paired client is gone, there is room for one more. */
+    sp_broker_pair_params_init(&params);
+    params.mode = SP_BROKER_PAIR_MODE_SERVER;
+    params.fds = peer_fds;
+    params.n_fds = HELD_FDS_PER_CLIENT;
+    fds[0] = connect_client();
+    CHECK(fds[0] >= 0);
+    CHECK(!sp_broker_send_get_pair_params(fds[0], "held-fds-0", &params,
+                                          NULL));
+    CHECK(!readable(fds[0], 200));
+
+    for (i = 0; i < n; i++) {
+        close(fds[i]);
+    }
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+
+    /* Back to the default limit. */
+    broker_kill();
+    CHECK(!broker_start(binary));
+    return 0;
+}
+
+/* Broker started with sockets from the service manager should serve clients
+ * on them without touching the socket file.  Broker runs one worker here, so
+ * the second socket has nobody to serve it and should be closed. */
+static int
+test_socket_activation(const char *binary)
+{
+    char extra_path[sizeof tmp_dir + 32];
+    struct stat before, after;
+    int i, fd, ret, fds[2];
+
+    snprintf(extra_path, sizeof extra_path, "%s/extra.socket", tmp_dir);
+    broker_kill();
+    fds[0] = socket_create_listening(sock_path, true, false);
+    CHECK(fds[0] >= 0);
+    fds[1] = socket_create_listening(extra_path, true, false);
+    CHECK(fds[1] >= 0);
+    CHECK(!stat(sock_path, &before));
+
+    ret = broker_start_with_fds(binary, fds, 2);
+    close(fds[0]);
+    close(fds[1]);
+    CHECK(!ret);
+
+    CHECK(!test_pairing(0, 1));
+    CHECK(!stat(sock_path, &after));
+    CHECK(before.st_ino == after.st_ino);
+
+    /* Unused sockets are closed after workers are started, i.e. possibly
+     * after the broker started to serve. */
+    for (i = 0; i < TIMEOUT_MS / 10; i++) {
+        fd = sp_broker_connect(extra_path, true, NULL);
+        if (fd < 0) {
+            break;
+        }
+        close(fd);
+        usleep(10 * 1000);
+    }
+    CHECK(fd < 0 && errno == ECONNREFUSED);
+    unlink(extra_path);
+
+    broker_kill();
+    CHECK(!broker_start(binary));
+    return 0;
+}
+
+/* Client with a retry policy should survive the broker restart while
+ * waiting for a pair. */
+static int
+test_restart(const char *binary)
+{
+    struct sp_broker_retry_policy policy;
+    struct sp_broker_pair_params params;
+    struct sp_broker_pair a, b;
+    int status, sp[2];
+    char c;
+    pid_t pid;
+
+    CHECK(!socketpair(AF_UNIX, SOCK_STREAM, 0, sp));
+    pid = fork();
+    CHECK(pid >= 0);
+    if (!pid) {
+        close(sp[0]);
+        sp_broker_pair_params_init(&params);
+        params.mode = SP_BROKER_PAIR_MODE_SERVER;
+        sp_broker_retry_policy_init(&policy);
+        policy.timeout_ms = TIMEOUT_MS;
+        if (sp_broker_request_pair_retry(sock_path, "restart", &params,
+                                         &policy, &a, NULL)) {
+            _exit(EXIT_FAILURE);
+        }
+        /* Passing the result to the parent for a check. */
+        if (socket_send_message(sp[1], "P", 1, a.fds, a.n_fds) != 1) {
+            _exit(EXIT_FAILURE);
+        }
+        _exit(EXIT_SUCCESS);
+    }
+    close(sp[1]);
+
+    /* Restarting while the child waits for a pair and restarting again
+     * to make it face a refused connection. */
+    usleep(100 * 1000);
+    broker_kill();
+    CHECK(!broker_start(binary));
+    broker_kill();
+    usleep(20 * 1000);
+    CHECK(!broker_start(binary));
+
+    sp_broker_pair_params_init(&params);
+    params.mode = SP_BROKER_PAIR_MODE_CLIENT;
+    sp_broker_retry_policy_init(&policy);
+    policy.timeout_ms = TIMEOUT_MS;
+    CHECK(!sp_broker_request_pair_retry(sock_path, "restart", &params,
+                                        &policy, &b, NULL));
+
+    /* Only descriptors are passed from the child. */
+    a.id = b.id;
+    a.type = b.type;
+    a.n_fds = 0;
+    a.n_peer_fds = 0;
+    CHECK(readable(sp[0], TIMEOUT_MS));
+    CHECK(socket_read_message(sp[0], &c, 1, a.fds,
+                              SP_BROKER_PROTOCOL_MAX_FDS, &a.n_fds) == 1);
+    CHECK(waitpid(pid, &status, 0) == pid);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+    CHECK(!check_connected(&b, &a, 42));
+    sp_broker_pair_close(&a);
+    sp_broker_pair_close(&b);
+    close(sp[0]);
+    return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+    int rounds = argc > 2 ? atoi(argv[2]) : 5;
+    int n_pairs = argc > 3 ? atoi(argv[3]) : MAX_PAIRS_PER_ROUND;
+    int i, n_fds, ret = EXIT_FAILURE;
+    struct rlimit rlim;
+
+    if (argc < 2) {
+        printf("Usage: %s ONE_SOCKET_BINARY [ROUNDS [PAIRS]]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (n_pairs < 1 || n_pairs > MAX_PAIRS_PER_ROUND) {
+        n_pairs = MAX_PAIRS_PER_ROUND;
+    }
+
+    /* Test process holds all the clients at once. */
+    if (!getrlimit(RLIMIT_NOFILE, &rlim) && rlim.rlim_cur < rlim.rlim_max) {
+        rlim.rlim_cur = rlim.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rlim);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    if (broker_start(argv[1])) {
+        goto exit;
+    }
+    /* Broker accepts connections before the worker is fully initialized,
+     * so taking the baseline once one pair is served and its clients are
+     * gone. */
+    if (test_pairing(rounds + 1, 1)) {
+        goto exit;
+    }
+    n_fds = broker_n_fds();
+    for (i = 0; i < 10; i++) {
+        usleep(10 * 1000);
+        if (broker_n_fds() < n_fds) {
+            n_fds = broker_n_fds();
+        }
+    }
+
+    for (i = 0; i < rounds; i++) {
+        if (test_pairing(i, n_pairs)) {
+            goto exit;
+        }
+    }
+    printf("Paired %d clients.\n", 2 * rounds * n_pairs);
+
+    if (test_mode_mismatch(n_pairs / 2)) {
+        goto exit;
+    }
+    printf("Mode mismatch: OK.\n");
+
+    if (test_repairing(n_pairs / 2)) {
+        goto exit;
+    }
+    printf("Re-pairing: OK.\n");
+
+    if (test_list_pending(n_pairs)) {
+        goto exit;
+    }
+    printf("Listing of waiting clients: OK.\n");
+
+    if (test_query_peer()) {
+        goto exit;
+    }
+    printf("Presence queries: OK.\n");
+
+    if (test_prefix()) {
+        goto exit;
+    }
+    printf("Prefix matching: OK.\n");
+
+    if (test_balance()) {
+        goto exit;
+    }
+    printf("Balancing between instances: OK.\n");
+
+    if (test_priority()) {
+        goto exit;
+    }
+    printf("Priority classes: OK.\n");
+
+    if (test_hello()) {
+        goto exit;
+    }
+    printf("Hello exchange: OK.\n");
+
+    if (test_peer_fds()) {
+        goto exit;
+    }
+    printf("Descriptors of the peer: OK.\n");
+
+    if (test_peer_cred()) {
+        goto exit;
+    }
+    printf("Credentials of the peer: OK.\n");
+
+    if (test_split_requests(n_pairs)) {
+        goto exit;
+    }
+    printf("Split requests: OK.\n");
+
+    if (test_malformed()) {
+        goto exit;
+    }
+    printf("Malformed requests: OK.\n");
+
+    /* Broker should still work. */
+    if (!broker_alive() || test_pairing(rounds, 1)) {
+        fprintf(stderr, "FAIL: Broker doesn't work after the test.\n");
+        goto exit;
+    }
+
+    /* All the clients are gone, broker should not have more open file
+     * descriptors than in the beginning. */
+    for (i = 0; i < 100 && broker_n_fds() > n_fds; i++) {
+        usleep(10 * 1000);
+    }
+    if (broker_n_fds() > n_fds) {
+        fprintf(stderr, "FAIL: Broker leaks file descriptors: %d -> %d\n",
+                n_fds, broker_n_fds());
+        goto exit;
+    }
+
+    if (test_held_fds(argv[1])) {
+        goto exit;
+    }
+    printf("Limit of held descriptors: OK.\n");
+
+    if (test_socket_activation(argv[1])) {
+        goto exit;
+    }
+    printf("Socket activation: OK.\n");
+
+    if (test_restart(argv[1])) {
+        goto exit;
+    }
+    printf("Broker restart: OK.\n");
+    ret = EXIT_SUCCESS;
+
+exit:
+    broker_stop();
+    return ret;
+}
@@ -0,0 +1,534 @@
+/*
+ * Copyright (c) 2021 Ilya Maximets <i.maximets@ovn.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Unit tests for sp_broker_message_validate() followed by a quick
+ * deterministic fuzzing of the same harness that fuzz-validator uses.
+ *
+ * Usage: test-validator [ITERATIONS [SEED]] */
+
+#include <config.h>
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <socketpair-broker/proto.h>
+#include <socketpair-broker/helper.h>
+#include <socketpair-broker/ring.h>
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+static int n_failures;
+
+#define CHECK_VALID(MSG, EXPECTED) \
+    check_valid(MSG, EXPECTED, #MSG " is " #EXPECTED, __LINE__)
+
+static void
+check_valid(const struct sp_broker_msg *msg, bool expected,
+            const char *what, int line)
+{
+    char *err = NULL;
+    bool valid;
+
+    valid = !sp_broker_message_validate(msg, NULL, 0, &err);
+    if (valid != expected) {
+        printf("FAIL:%d: %s (%s)\n", line, what, err ? err : "no error");
+        n_failures++;
+    }
+    free(err);
+}
+
+static void
+get_pair_v1(struct sp_broker_msg *msg, const char *key, uint16_t mode)
+{
+    memset(msg, 0, sizeof *msg);
+    msg->request = SP_BROKER_GET_PAIR;
+    msg->flags = SP_BROKER_PROTOCOL_VERSION;
+    msg->size = sizeof msg->payload.get_pair;
+    msg->payload.get_pair.mode = mode;
+    msg->payload.get_pair.key_len = strlen(key);
+    memcpy(msg->payload.get_pair.key, key, strlen(key));
+}
+
+static void
+get_pair_v2(struct sp_broker_msg *msg, const char *key, uint16_t mode)
+{
+    get_pair_v1(msg, key, mode);
+    msg->flags = SP_BROKER_PROTOCOL_VERSION_2;
+    msg->size = offsetof(struct sp_broker_get_pair_request, key) + strlen(key);
+}
+
+static void
+set_pair(struct sp_broker_msg *msg, uint32_t version,
+         enum sp_broker_pair_type type, int n_fds)
+{
+    memset(msg, 0, sizeof *msg);
+    msg->request = SP_BROKER_SET_PAIR;
+    msg->flags = version | SP_BROKER_PAIR_TYPE_SET(type);
+    msg->size = sizeof msg->payload.u64;
+    msg->n_fds = n_fds;
+}
+
+/* Appends an entry to SP_BROKER_PENDING_LIST. */
+static void
+pending_list_add(struct sp_broker_msg *msg, const char *key, uint16_t mode)
+{
+    struct sp_broker_pending_entry entry = {
+        .wait_ms = 42,
+        .mode = mode,
+        .type = SP_BROKER_PAIR_TYPE_STREAM,
+        .key_len = strlen(key),
+    };
+
+    if (!msg->size) {
+        msg->request = SP_BROKER_PENDING_LIST;
+        msg->flags = SP_BROKER_PROTOCOL_VERSION_2;
+        msg->size = sizeof msg->payload.pending_list;
+    }
+    memcpy(&msg->payload.data[msg->size], &entry, sizeof entry);
+    msg->size += sizeof entry;
+    memcpy(&msg->payload.data[msg->size], key, entry.key_len);
+    msg->size += entry.key_len;
+    msg->payload.pending_list.n_entries++;
+}
+
+static void
+test_get_pair(void)
+{
+    struct sp_broker_msg msg;
+
+    get_pair_v1(&msg, "key", SP_BROKER_PAIR_MODE_CLIENT);
+    CHECK_VALID(&msg, true);
+
+    msg.flags |= SP_BROKER_PAIR_TYPE_SET(SP_BROKER_PAIR_TYPE_SHM_RING);
+    CHECK_VALID(&msg, true);
+
+    msg.flags |= SP_BROKER_PAIR_TYPE_SET(SP_BROKER_PAIR_TYPE_MAX);
+    CHECK_VALID(&msg, false);
+
+    get_pair_v1(&msg, "key", SP_BROKER_PAIR_MODE_MAX);
+    CHECK_VALID(&msg, false);
+
+    get_pair_v1(&msg, "key", SP_BROKER_PAIR_MODE_NONE);
+    msg.payload.get_pair.key_len = 0;
+    CHECK_VALID(&msg, false);
+
+    get_pair_v1(&msg, "key", SP_BROKER_PAIR_MODE_NONE);
+    msg.payload.get_pair.key_len = SP_BROKER_MAX_KEY_LENGTH + 1;
+    CHECK_VALID(&msg, false);
+
+    get_pair_v1(&msg, "key", SP_BROKER_PAIR_MODE_NONE);
+    msg.size--;
+    CHECK_VALID(&msg, false);
+
+    get_pair_v1(&msg, "key", SP_BROKER_PAIR_MODE_NONE);
+    msg.n_fds = 1;
+    CHECK_VALID(&msg, false);
+
+    get_pair_v1(&msg, "key", SP_BROKER_PAIR_MODE_NONE);
+    msg.flags |= SP_BROKER_SET_PAIR_F_PRODUCER;
+    CHECK_VALID(&msg, false);
+
+    get_pair_v1(&msg, "key", SP_BROKER_PAIR_MODE_NONE);
+    msg.flags |= SP_BROKER_GET_PAIR_F_PREFIX;
+    CHECK_VALID(&msg, true);
+
+    get_pair_v1(&msg, "key", SP_BROKER_PAIR_MODE_NONE);
+    msg.flags = 0x3;
+    CHECK_VALID(&msg, false);
+
+    get_pair_v1(&msg, "key", SP_BROKER_PAIR_MODE_NONE);
+    msg.request = SP_BROKER_MAX;
+    CHECK_VALID(&msg, false);
+}
+
+static void
+test_get_pair_v2(void)
+{
+    uint8_t big[SP_BROKER_MAX_HELLO_SIZE + 1];
+    struct sp_broker_msg msg;
+    uint8_t raw[8];
+
+    get_pair_v2(&msg, "key", SP_BROKER_PAIR_MODE_SERVER);
+    CHECK_VALID(&msg, true);
+
+    sp_broker_attr_put_u32(&msg, SP_BROKER_ATTR_SNDBUF, 65536);
+    sp_broker_attr_put_u32(&msg, SP_BROKER_ATTR_RING_SIZE, 8192);
+    sp_broker_attr_put_u32(&msg, SP_BROKER_ATTR_WEIGHT, 3);
+    CHECK_VALID(&msg, true);
+
+    /* Duplicate. */
+    sp_broker_attr_put_u32(&msg, SP_BROKER_ATTR_SNDBUF, 65536);
+    CHECK_VALID(&msg, false);
+
+    /* Key doesn't fit. */
+    get_pair_v2(&msg, "key", SP_BROKER_PAIR_MODE_SERVER);
+    msg.size--;
+    CHECK_VALID(&msg, false);
+
+    /* Too big. */
+    get_pair_v2(&msg, "key", SP_BROKER_PAIR_MODE_SERVER);
+    msg.size = SP_BROKER_MAX_PAYLOAD_SIZE + 1;
+    CHECK_VALID(&msg, false);
+
+    /* Unknown attribute. */
+    get_pair_v2(&msg, "key", SP_BROKER_PAIR_MODE_SERVER);
+    sp_broker_attr_put_u32(&msg, SP_BROKER_ATTR_MAX, 0);
+    CHECK_VALID(&msg, false);
+
+    /* Wrong size of the attribute value. */
+    get_pair_v2(&msg, "key", SP_BROKER_PAIR_MODE_SERVER);
+    memset(raw, 0, sizeof raw);
+    sp_broker_attr_put(&msg, SP_BROKER_ATTR_RCVBUF, raw, sizeof raw);
+    CHECK_VALID(&msg, false);
+
+    /* Truncated attribute. */
+    get_pair_v2(&msg, "key", SP_BROKER_PAIR_MODE_SERVER);
+    sp_broker_attr_put_u32(&msg, SP_BROKER_ATTR_RCVBUF, 4096);
+    msg.size -= 2;
+    CHECK_VALID(&msg, false);
+
+    /* Truncated attribute header. */
+    get_pair_v2(&msg, "key", SP_BROKER_PAIR_MODE_SERVER);
+    msg.size += 2;
+    CHECK_VALID(&msg, false);
+
+    /* Unsupported socket flags. */
+    get_pair_v2(&msg, "key", SP_BROKER_PAIR_MODE_SERVER);
+    sp_broker_attr_put_u32(&msg, SP_BROKER_ATTR_SOCK_FLAGS,
+                           ~SP_BROKER_SOCK_F_MASK);
+    CHECK_VALID(&msg, false);
+
+    /* Priority classes. */
+    get_pair_v2(&msg, "key", SP_BROKER_PAIR_MODE_SERVER);
+    sp_broker_attr_put_u32(&msg, SP_BROKER_ATTR_PRIORITY,
+                           SP_BROKER_PRIORITY_CRITICAL);
+    CHECK_VALID(&msg, true);
+    get_pair_v2(&msg, "key", SP_BROKER_PAIR_MODE_SERVER);
+    sp_broker_attr_put_u32(&msg, SP_BROKER_ATTR_PRIORITY,
+                           SP_BROKER_PRIORITY_MAX);
+    CHECK_VALID(&msg, false);
+
+    /* Descriptors for the peer. */
+    get_pair_v2(&msg, "key", SP_BROKER_PAIR_MODE_SERVER);
+    msg.flags |= SP_BROKER_GET_PAIR_F_ACCEPT_FDS;
+    msg.n_fds = SP_BROKER_MAX_PEER_FDS;
+    CHECK_VALID(&msg, true);
+    msg.n_fds++;
+    CHECK_VALID(&msg, false);
+    get_pair_v1(&msg, "key", SP_BROKER_PAIR_MODE_SERVER);
+    msg.flags |= SP_BROKER_GET_PAIR_F_ACCEPT_FDS;
+    CHECK_VALID(&msg, false);
+
+    /* Credentials are requested with a flag and only sent by the broker. */
+    get_pair_v2(&msg, "key", SP_BROKER_PAIR_MODE_SERVER);
+    msg.flags |= SP_BROKER_GET_PAIR_F_PEER_CRED;
+    CHECK_VALID(&msg, true);
+    sp_broker_attr_put(&msg, SP_BROKER_ATTR_PEER_CGROUP, "/", 1);
+    CHECK_VALID(&msg, false);
+    get_pair_v1(&msg, "key", SP_BROKER_PAIR_MODE_SERVER);
+    msg.flags |= SP_BROKER_GET_PAIR_F_PEER_CRED;
+    CHECK_VALID(&msg, false);
+
+    /* Hello of any size up to the limit. */
+    get_pair_v2(&msg, "key", SP_BROKER_PAIR_MODE_SERVER);
+    sp_broker_attr_put(&msg, SP_BROKER_ATTR_HELLO, "", 0);
+    CHECK_VALID(&msg, true);
+    get_pair_v2(&msg, "key", SP_BROKER_PAIR_MODE_SERVER);
+    memset(big, 0, sizeof big);
+    sp_broker_attr_put(&msg, SP_BROKER_ATTR_HELLO, big,
+                       SP_BROKER_MAX_HELLO_SIZE);
+    CHECK_VALID(&msg, true);
+    get_pair_v2(&msg, "key", SP_BROKER_PAIR_MODE_SERVER);
+    sp_broker_attr_put(&msg, SP_BROKER_ATTR_HELLO, big, sizeof big);
+    CHECK_VALID(&msg, false);
+}
+
+static void
+test_set_pair(void)
+{
+    struct sp_broker_peer_cred cred = { .pid = 1, };
+    struct sp_broker_msg msg;
+
+    set_pair(&msg, SP_BROKER_PROTOCOL_VERSION, SP_BROKER_PAIR_TYPE_STREAM, 1);
+    CHECK_VALID(&msg, true);
+
+    set_pair(&msg, SP_BROKER_PROTOCOL_VERSION_2,
+             SP_BROKER_PAIR_TYPE_DGRAM, 1);
+    CHECK_VALID(&msg, true);
+
+    set_pair(&msg, SP_BROKER_PROTOCOL_VERSION, SP_BROKER_PAIR_TYPE_STREAM, 0);
+    CHECK_VALID(&msg, false);
+
+    set_pair(&msg, SP_BROKER_PROTOCOL_VERSION, SP_BROKER_PAIR_TYPE_STREAM, 2);
+    CHECK_VALID(&msg, false);
+
+    set_pair(&msg, SP_BROKER_PROTOCOL_VERSION, SP_BROKER_PAIR_TYPE_STREAM, 1);
+    msg.flags |= SP_BROKER_SET_PAIR_F_PRODUCER;
+    CHECK_VALID(&msg, false);
+
+    set_pair(&msg, SP_BROKER_PROTOCOL_VERSION, SP_BROKER_PAIR_TYPE_SHM_RING,
+             SP_BROKER_RING_N_FDS);
+    CHECK_VALID(&msg, true);
+    msg.flags |= SP_BROKER_SET_PAIR_F_PRODUCER;
+    CHECK_VALID(&msg, true);
+
+    set_pair(&msg, SP_BROKER_PROTOCOL_VERSION, SP_BROKER_PAIR_TYPE_SHM_RING, 1);
+    CHECK_VALID(&msg, false);
+
+    /* Descriptors of the peer follow the channel in version 2 only. */
+    set_pair(&msg, SP_BROKER_PROTOCOL_VERSION_2,
+             SP_BROKER_PAIR_TYPE_STREAM, 3);
+    CHECK_VALID(&msg, true);
+    set_pair(&msg, SP_BROKER_PROTOCOL_VERSION_2, SP_BROKER_PAIR_TYPE_STREAM,
+             1 + SP_BROKER_MAX_PEER_FDS + 1);
+    CHECK_VALID(&msg, false);
+
+    /* Credentials of the peer. */
+    set_pair(&msg, SP_BROKER_PROTOCOL_VERSION_2,
+             SP_BROKER_PAIR_TYPE_STREAM, 1);
+    sp_broker_attr_put(&msg, SP_BROKER_ATTR_PEER_CRED, &cred, sizeof cred);
+    sp_broker_attr_put(&msg, SP_BROKER_ATTR_PEER_CGROUP, "/user.slice", 11);
+    CHECK_VALID(&msg, true);
+
+    /* Hello of the peer. */
+    set_pair(&msg, SP_BROKER_PROTOCOL_VERSION_2,
+             SP_BROKER_PAIR_TYPE_STREAM, 1);
+    sp_broker_attr_put(&msg, SP_BROKER_ATTR_HELLO, "hello", 5);
+    CHECK_VALID(&msg, true);
+
+    /* GET_PAIR attributes are not allowed in SET_PAIR. */
+    set_pair(&msg, SP_BROKER_PROTOCOL_VERSION_2,
+             SP_BROKER_PAIR_TYPE_STREAM, 1);
+    sp_broker_attr_put_u32(&msg, SP_BROKER_ATTR_SNDBUF, 4096);
+    CHECK_VALID(&msg, false);
+}
+
+static void
+test_list_pending(void)
+{
+    struct sp_broker_msg msg;
+
+    memset(&msg, 0, sizeof msg);
+    msg.request = SP_BROKER_LIST_PENDING;
+    msg.flags = SP_BROKER_PROTOCOL_VERSION_2;
+    msg.size = sizeof msg.payload.list_pending;
+    CHECK_VALID(&msg, true);
+
+    /* Not available in version 1. */
+    msg.flags = SP_BROKER_PROTOCOL_VERSION;
+    CHECK_VALID(&msg, false);
+
+    msg.flags = SP_BROKER_PROTOCOL_VERSION_2;
+    msg.size--;
+    CHECK_VALID(&msg, false);
+
+    memset(&msg, 0, sizeof msg);
+    pending_list_add(&msg, "a", SP_BROKER_PAIR_MODE_CLIENT);
+    pending_list_add(&msg, "key", SP_BROKER_PAIR_MODE_NONE);
+    CHECK_VALID(&msg, true);
+
+    /* Entries don't match the size. */
+    msg.payload.pending_list.n_entries++;
+    CHECK_VALID(&msg, false);
+    msg.payload.pending_list.n_entries -= 2;
+    CHECK_VALID(&msg, false);
+
+    memset(&msg, 0, sizeof msg);
+    pending_list_add(&msg, "key", SP_BROKER_PAIR_MODE_MAX);
+    CHECK_VALID(&msg, false);
+
+    /* Empty list is fine. */
+    memset(&msg, 0, sizeof msg);
+    msg.request = SP_BROKER_PENDING_LIST;
+    msg.flags = SP_BROKER_PROTOCOL_VERSION_2;
+    msg.size = sizeof msg.payload.pending_list;
+    CHECK_VALID(&msg, true);
+}
+
+static void
+test_query_peer(void)
+{
+    struct sp_broker_msg msg;
+
+    get_pair_v2(&msg, "key", SP_BROKER_PAIR_MODE_SERVER);
+    msg.request = SP_BROKER_QUERY_PEER;
+    CHECK_VALID(&msg, true);
+    msg.flags |= SP_BROKER_QUERY_PEER_F_WAIT;
+    CHECK_VALID(&msg, true);
+
+    /* Not available in version 1 and doesn't take attributes. */
+    get_pair_v1(&msg, "key", SP_BROKER_PAIR_MODE_SERVER);
+    msg.request = SP_BROKER_QUERY_PEER;
+    CHECK_VALID(&msg, false);
+    get_pair_v2(&msg, "key", SP_BROKER_PAIR_MODE_SERVER);
+    msg.request = SP_BROKER_QUERY_PEER;
+    sp_broker_attr_put_u32(&msg, SP_BROKER_ATTR_SNDBUF, 4096);
+    CHECK_VALID(&msg, false);
+
+    set_pair(&msg, SP_BROKER_PROTOCOL_VERSION_2,
+             SP_BROKER_PAIR_TYPE_STREAM, 0);
+    msg.request = SP_BROKER_PEER_STATUS;
+    msg.flags = SP_BROKER_PROTOCOL_VERSION_2;
+    msg.payload.u64 = SP_BROKER_PEER_PRESENT;
+    CHECK_VALID(&msg, true);
+    msg.payload.u64 = 2;
+    CHECK_VALID(&msg, false);
+}
+
+static void
+test_expected(void)
+{
+    enum sp_broker_request expected = SP_BROKER_GET_PAIR;
+    struct sp_broker_msg msg;
+    char *err = NULL;
+
+    set_pair(&msg, SP_BROKER_PROTOCOL_VERSION, SP_BROKER_PAIR_TYPE_STREAM, 1);
+    if (!sp_broker_message_validate(&msg, &expected, 1, &err)) {
+        printf("FAIL:%d: SET_PAIR accepted while GET_PAIR expected\n",
+               __LINE__);
+        n_failures++;
+    }
+    free(err);
+}
+
+/* Allocation-free validation should report the same errors. */
+static void
+test_error_buf(void)
+{
+    enum sp_broker_request expected = SP_BROKER_GET_PAIR;
+    char buf[SP_BROKER_MAX_ERROR_LEN];
+    struct sp_broker_msg msg;
+    char *err = NULL;
+
+    set_pair(&msg, SP_BROKER_PROTOCOL_VERSION, SP_BROKER_PAIR_TYPE_STREAM, 1);
+    if (!sp_broker_message_validate_buf(&msg, &expected, 1, buf)
+        || sp_broker_message_validate(&msg, &expected, 1, &err)
+           != -1 || !err || strcmp(err, buf)) {
+        printf("FAIL:%d: different errors: '%s' vs '%s'\n",
+               __LINE__, buf, err ? err : "none");
+        n_failures++;
+    }
+    free(err);
+
+    /* Without a buffer only the result is reported. */
+    get_pair_v1(&msg, "key", SP_BROKER_PAIR_MODE_MAX);
+    if (!sp_broker_message_validate_buf(&msg, NULL, 0, NULL)) {
+        printf("FAIL:%d: invalid mode accepted\n", __LINE__);
+        n_failures++;
+    }
+}
+
+/* Simple xorshift, so the sequence is the same on every platform. */
+static uint32_t
+test_random(uint32_t *state)
+{
+    uint32_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+/* Feeds the fuzzing harness with random mutations of valid messages.  The
+ * harness aborts if it finds a problem. */
+static void
+test_fuzz(unsigned long iterations, uint32_t seed)
+{
+    static uint8_t data[1 + SP_BROKER_HEADER_SIZE
+                        + SP_BROKER_MAX_PAYLOAD_SIZE];
+    struct sp_broker_msg seeds[5];
+    uint32_t state = seed ? seed : 1;
+    unsigned long i;
+
+    get_pair_v1(&seeds[0], "fuzz", SP_BROKER_PAIR_MODE_CLIENT);
+    get_pair_v2(&seeds[1], "fuzz", SP_BROKER_PAIR_MODE_NONE);
+    sp_broker_attr_put_u32(&seeds[1], SP_BROKER_ATTR_SNDBUF, 4096);
+    sp_broker_attr_put_u32(&seeds[1], SP_BROKER_ATTR_SOCK_FLAGS,
+                           SP_BROKER_SOCK_F_PASSCRED);
+    set_pair(&seeds[2], SP_BROKER_PROTOCOL_VERSION,
+             SP_BROKER_PAIR_TYPE_SEQPACKET, 1);
+    set_pair(&seeds[3], SP_BROKER_PROTOCOL_VERSION_2,
+             SP_BROKER_PAIR_TYPE_SHM_RING, SP_BROKER_RING_N_FDS);
+    memset(&seeds[4], 0, sizeof seeds[4]);
+    pending_list_add(&seeds[4], "fuzz", SP_BROKER_PAIR_MODE_SERVER);
+    pending_list_add(&seeds[4], "fuzz-2", SP_BROKER_PAIR_MODE_NONE);
+
+    for (i = 0; i < iterations; i++) {
+        const struct sp_broker_msg *msg = &seeds[test_random(&state) % 5];
+        int size = sp_broker_message_length(msg);
+        int n_mutations = 1 + test_random(&state) % 8;
+        int j;
+
+        data[0] = msg->n_fds;
+        memcpy(&data[1], msg, size);
+
+        for (j = 0; j < n_mutations; j++) {
+            uint32_t r = test_random(&state);
+            int pos = r % (size + 1);
+
+            switch ((r >> 16) % 4) {
+            case 0:
+                /* Flip a bit. */
+                data[pos] ^= 1 << ((r >> 8) % 8);
+                break;
+            case 1:
+                /* Random byte. */
+                data[pos] = r >> 24;
+                break;
+            case 2:
+                /* Truncate. */
+                size = pos;
+                break;
+            case 3:
+                /* Extend with random bytes. */
+                if (size < (int) sizeof data - 5) {
+                    memcpy(&data[size + 1], &r, 4);
+                    size += 4;
+                }
+                break;
+            }
+        }
+        LLVMFuzzerTestOneInput(data, size + 1);
+    }
+    printf("Fuzzed %lu messages, seed %"PRIu32".\n", iterations, seed);
+}
+
+int
+main(int argc, char **argv)
+{
+    unsigned long iterations = argc > 1 ? strtoul(argv[1], NULL, 0) : 100000;
+    uint32_t seed = argc > 2 ? strtoul(argv[2], NULL, 0) : 42;
+
+    test_get_pair();
+    test_get_pair_v2();
+    test_set_pair();
+    test_list_pending();
+    test_query_peer();
+    test_expected();
+    test_error_buf();
+    test_fuzz(iterations, seed);
+
+    if (n_failures) {
+        printf("%d checks failed.\n", n_failures);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}